@@ -1,18 +1,29 @@
 #include <WiFi.h>
 #include <ESP32Servo.h>
 #include <SPIFFS.h>
+#include "feeder_core.h"
+
+// The feeding logic lives in feeder_core.c, which also builds on the host
+// (see -simulate); this sketch only connects it to the ESP32 hardware.
 
 Servo myservo;
 const char *ssid = "qazwsx";        // WiFi network name
 const char *password = "qazwsxedc";   // WiFi network password
 const int servoPin = 2;
-int pos = 0;           // Variable to store servo position
 int delayTime = 1000;  // Default delay time in milliseconds
 WiFiServer server(80);
-unsigned long onStartTime = 0; // Variable to store start time of opening
 
+// Device link: 1 sends events to the host as binary frames (see
+// serial/packet.h on the host), 0 prints "Duration:[n]" lines for debugging
+#define LINK_BINARY 1
+const uint8_t deviceId = 1;    // Device id carried by every frame
+
+feeder_core core;
+WiFiClient clients[FEEDER_MAX_CLIENTS];
+bool clientOpen[FEEDER_MAX_CLIENTS];
 
-// Read delay time from file
+
+// Read delay time from file, once at boot
 void readDelayTime() {
   if (SPIFFS.begin(true)) {
     if (SPIFFS.exists("/time.txt")) {
@@ -27,10 +38,49 @@ void readDelayTime() {
   }
 }
 
+// HAL: hardware access used by the core
+
+uint32_t halMillis(void *ctx) {
+  return millis();
+}
+
+void halServoWrite(void *ctx, int angle) {
+  myservo.write(angle);
+}
+
+void halSerialWrite(void *ctx, const uint8_t *data, size_t len) {
+  Serial.write(data, len);
+}
+
+void halClientWrite(void *ctx, int client, const char *data, size_t len) {
+  clients[client].write((const uint8_t *)data, len);
+}
+
+void halClientClose(void *ctx, int client) {
+  clients[client].stop();
+  clientOpen[client] = false;
+}
+
+// Write delay time to file so it survives a restart
+int halSaveDelay(void *ctx, long delayMs) {
+  int result = -1;
+  if (SPIFFS.begin(true)) {
+    File file = SPIFFS.open("/time.txt", "w");
+    if (file) {
+      result = file.print(delayMs) > 0 ? 0 : -1;
+      file.close();
+    }
+    SPIFFS.end();
+  }
+  return result;
+}
+
 void setup() {
   Serial.begin(115200);  // Initialize Serial communication
   delay(10);
 
+  readDelayTime();
+
   // Servo setup
   myservo.attach(servoPin);
   myservo.write(0);
@@ -54,70 +104,53 @@ void setup() {
   Serial.println(WiFi.localIP());
 
   server.begin();
+
+  feeder_hal hal = { halMillis, halServoWrite, halSerialWrite, halClientWrite, halClientClose, halSaveDelay, NULL };
+  feeder_init(&core, &hal, delayTime, deviceId, LINK_BINARY);
 }
 
+// Nothing here waits: input is handed to the core and its timers run
 void loop() {
-  readDelayTime();
+  char buffer[64];
 
-  // Handle WiFi client requests
+  // Settings commands from the host
+  int n = Serial.available();
+  if (n > 0) {
+    n = Serial.readBytes(buffer, n < (int)sizeof(buffer) ? n : sizeof(buffer));
+    feeder_serial_input(&core, buffer, n);
+  }
+
+  // New HTTP clients
   WiFiClient client = server.available();
   if (client) {
-    Serial.println("New Client.");
-    String currentLine = "";
-    while (client.connected()) {
-      if (client.available()) {
-        char c = client.read();
-        Serial.write(c);
-        if (c == '\n') {
-          if (currentLine.length() == 0) {
-            client.println("HTTP/1.1 200 OK");
-            client.println("Content-type:text/html");
-            client.println();
-
-            client.print("Click <a href=\"/H\">here</a> to feed the cat.<br>");
-            client.print("Click <a href=\"/L\">here</a> to turn the servo motor slowly.<br>");
-            
-            client.println();
-            break;
-          } else {
-            currentLine = "";
-          }
-        } else if (c != '\r') {
-          currentLine += c;
-        }
-
-        // Handle Wi-Fi commands
-        if (currentLine.endsWith("GET /H")) {
-          onStartTime = millis();
-
-          for (pos = 0; pos <= 55; pos++) {
-            myservo.write(pos);
-            delay(1);
-          }
-          delay(delayTime);
-          for (pos = 55; pos >= 0; pos--) {
-            myservo.write(pos);
-            delay(1);
-          }
-        }
-        if (currentLine.endsWith("GET /L")) {
-          for (pos = 0; pos <= 70; pos++) {
-            myservo.write(pos);
-            delay(15);
-          }
-          for (pos = 70; pos >= 0; pos--) {
-            myservo.write(pos);
-            delay(15);
-          }
-        }
-        unsigned long duration = (millis() - onStartTime) / 1000;
-
-          Serial.print("Duration:[");
-          Serial.print(duration);
-          Serial.println("]");
+    int slot = feeder_client_open(&core);
+    if (slot < 0) {
+      client.stop();  // Every slot is busy
+    } else {
+      clients[slot] = client;
+      clientOpen[slot] = true;
+    }
+  }
+
+  // Requests of connected clients
+  for (int i = 0; i < FEEDER_MAX_CLIENTS; i++) {
+    if (!clientOpen[i]) {
+      continue;
+    }
+    if (!clients[i].connected() && !clients[i].available()) {
+      clientOpen[i] = false;
+      clients[i].stop();
+      feeder_client_gone(&core, i);
+      continue;
+    }
+    n = clients[i].available();
+    if (n > 0) {
+      n = clients[i].read((uint8_t *)buffer, n < (int)sizeof(buffer) ? n : sizeof(buffer));
+      if (n > 0) {
+        feeder_client_input(&core, i, buffer, n);
       }
     }
-    client.stop();
-    Serial.println("Client Disconnected.");
   }
+
+  feeder_poll(&core);
 }
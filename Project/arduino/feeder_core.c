@@ -0,0 +1,540 @@
+/**
+ * @file feeder_core.c
+ * @brief Portable feeder logic: servo moves, HTTP clients, settings and link events
+ *
+ * The sketch used to run a feeding inside loop() with delay() calls, so
+ * while the servo moved (for the whole feeding delay) no other client was
+ * served and nothing was reported. Here every wait is a timer instead:
+ *
+ * - a move takes one timer tick per degree and one for the hold, and moves
+ *   requested while the servo runs wait in a small queue
+ * - an HTTP request is answered as soon as its header is complete, and the
+ *   move it asked for runs in the background
+ * - link events are batched and sent when a frame is full or when the
+ *   oldest one has waited FEEDER_LINK_FLUSH_MS
+ *
+ * Timers live in a binary heap ordered by due time. Times are 32-bit
+ * millisecond counters compared by signed difference, so the wrap of
+ * millis() after 49 days is harmless. Only hardware access goes through
+ * the HAL, so this file builds with the host compiler as well as for the
+ * ESP32.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "feeder_core.h"
+
+enum {
+    TIMER_SERVO,
+    TIMER_FLUSH,
+    TIMER_SWEEP
+};
+
+enum {
+    PHASE_IDLE,
+    PHASE_OPEN,
+    PHASE_HOLD,
+    PHASE_CLOSE,
+    PHASE_DONE
+};
+
+// Moves asked for by "GET /H" (feed) and "GET /L" (turn the servo slowly)
+static const feeder_move FEED_MOVE = { 55, 1, 1 };
+static const feeder_move SLOW_MOVE = { 70, 0, 15 };
+
+static const char PAGE[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-type:text/html\r\n"
+    "\r\n"
+    "Click <a href=\"/H\">here</a> to feed the cat.<br>"
+    "Click <a href=\"/L\">here</a> to turn the servo motor slowly.<br>"
+    "\r\n";
+
+/**
+ * Whether time a is before time b.
+ */
+static int before(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b) < 0;
+}
+
+/**
+ * Adds a timer due in delay_ms. The heap is sized for every timer kind
+ * to be pending at once, so it cannot overflow.
+ */
+static void timer_add(feeder_core *core, uint8_t kind, uint32_t delay_ms)
+{
+    if (core->timer_count == FEEDER_MAX_TIMERS)
+    {
+        return;
+    }
+    feeder_timer timer = { core->hal.millis(core->hal.ctx) + delay_ms, kind };
+    size_t i = core->timer_count++;
+    while (i > 0 && before(timer.due, core->timers[(i - 1) / 2].due))
+    {
+        core->timers[i] = core->timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    core->timers[i] = timer;
+}
+
+/**
+ * Removes the first timer of the heap.
+ */
+static feeder_timer timer_pop(feeder_core *core)
+{
+    feeder_timer first = core->timers[0];
+    feeder_timer last = core->timers[--core->timer_count];
+    size_t n = core->timer_count;
+    size_t i = 0;
+    while (2 * i + 1 < n)
+    {
+        size_t child = 2 * i + 1;
+        if (child + 1 < n && before(core->timers[child + 1].due, core->timers[child].due))
+        {
+            child++;
+        }
+        if (!before(core->timers[child].due, last.due))
+        {
+            break;
+        }
+        core->timers[i] = core->timers[child];
+        i = child;
+    }
+    if (n > 0)
+    {
+        core->timers[i] = last;
+    }
+    return first;
+}
+
+/**
+ * Sends the batched events as one frame.
+ */
+static void flush_events(feeder_core *core)
+{
+    if (core->event_count == 0)
+    {
+        return;
+    }
+
+    uint8_t *f = core->frame;
+    size_t payload = core->event_count * FEEDER_LINK_EVENT;
+    f[0] = 0xA5;
+    f[1] = 0x5A;
+    f[2] = (uint8_t)payload;
+    f[3] = 1;    // Events frame
+    f[4] = core->device;
+    f[5] = (uint8_t)core->seq;
+    f[6] = (uint8_t)(core->seq >> 8);
+
+    // CRC-16/CCITT-FALSE, the same as packet_crc16() on the host
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 2; i < FEEDER_LINK_HEADER + payload; i++)
+    {
+        crc ^= (uint16_t)(f[i] << 8);
+        for (int b = 0; b < 8; b++)
+        {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    f[FEEDER_LINK_HEADER + payload] = (uint8_t)crc;
+    f[FEEDER_LINK_HEADER + payload + 1] = (uint8_t)(crc >> 8);
+    core->hal.serial_write(core->hal.ctx, f, FEEDER_LINK_HEADER + payload + 2);
+
+    core->seq = (uint16_t)(core->seq + core->event_count);
+    core->event_count = 0;
+}
+
+/**
+ * Reports an event to the host, as a batched frame or as a text line.
+ */
+static void send_event(feeder_core *core, uint8_t kind, uint32_t value)
+{
+    if (!core->binary)
+    {
+        char text[40];
+        int len = 0;
+        if (kind == FEEDER_LINK_DURATION)
+        {
+            len = snprintf(text, sizeof(text), "Duration:[%lu]\r\n", (unsigned long)(value / 1000));
+        }
+        else if (kind == FEEDER_LINK_CONNECT)
+        {
+            len = snprintf(text, sizeof(text), "New Client.\r\n");
+        }
+        else if (kind == FEEDER_LINK_DISCONNECT)
+        {
+            len = snprintf(text, sizeof(text), "Client Disconnected.\r\n");
+        }
+        core->hal.serial_write(core->hal.ctx, (const uint8_t *)text, (size_t)len);
+        return;
+    }
+
+    uint8_t *e = core->frame + FEEDER_LINK_HEADER + core->event_count * FEEDER_LINK_EVENT;
+    e[0] = kind;
+    e[1] = (uint8_t)value;
+    e[2] = (uint8_t)(value >> 8);
+    e[3] = (uint8_t)(value >> 16);
+    e[4] = (uint8_t)(value >> 24);
+    if (++core->event_count == FEEDER_LINK_MAX_EVENTS)
+    {
+        flush_events(core);
+    }
+    else if (!core->flush_pending)
+    {
+        core->flush_pending = 1;
+        timer_add(core, TIMER_FLUSH, FEEDER_LINK_FLUSH_MS);
+    }
+}
+
+/**
+ * Starts the next queued move if the servo is free.
+ */
+static void start_move(feeder_core *core)
+{
+    if (core->phase != PHASE_IDLE || core->move_count == 0)
+    {
+        return;
+    }
+    const feeder_move *move = &core->moves[core->move_head];
+    core->phase = PHASE_OPEN;
+    core->angle = 0;
+    core->move_start = core->hal.millis(core->hal.ctx);
+    core->move_hold = move->report ? (uint32_t)core->delay_ms : 0;
+    timer_add(core, TIMER_SERVO, 0);
+}
+
+/**
+ * Queues a move; it is dropped if the queue is full.
+ */
+static void queue_move(feeder_core *core, const feeder_move *move)
+{
+    if (core->move_count == FEEDER_MAX_MOVES)
+    {
+        core->stats.dropped_moves++;
+        return;
+    }
+    core->moves[(core->move_head + core->move_count) % FEEDER_MAX_MOVES] = *move;
+    core->move_count++;
+    start_move(core);
+}
+
+/**
+ * Advances the servo by one step of the current move.
+ */
+static void servo_tick(feeder_core *core)
+{
+    const feeder_move *move = &core->moves[core->move_head];
+    switch (core->phase)
+    {
+    case PHASE_OPEN:
+        core->hal.servo_write(core->hal.ctx, core->angle);
+        if (core->angle < move->top)
+        {
+            core->angle++;
+            timer_add(core, TIMER_SERVO, move->step_ms);
+        }
+        else
+        {
+            core->phase = PHASE_HOLD;
+            timer_add(core, TIMER_SERVO, move->step_ms + core->move_hold);
+        }
+        break;
+
+    case PHASE_HOLD:
+        core->phase = PHASE_CLOSE;
+        core->angle = move->top;
+        // fall through
+    case PHASE_CLOSE:
+        core->hal.servo_write(core->hal.ctx, core->angle);
+        if (core->angle > 0)
+        {
+            core->angle--;
+        }
+        else
+        {
+            core->phase = PHASE_DONE;
+        }
+        timer_add(core, TIMER_SERVO, move->step_ms);
+        break;
+
+    case PHASE_DONE:
+        if (move->report)
+        {
+            core->stats.feedings++;
+            send_event(core, FEEDER_LINK_DURATION, core->hal.millis(core->hal.ctx) - core->move_start);
+        }
+        core->phase = PHASE_IDLE;
+        core->move_head = (core->move_head + 1) % FEEDER_MAX_MOVES;
+        core->move_count--;
+        start_move(core);
+        break;
+    }
+}
+
+/**
+ * Closes a client slot and reports the disconnect.
+ */
+static void close_client(feeder_core *core, int client, int by_core)
+{
+    core->clients[client].used = 0;
+    if (by_core)
+    {
+        core->hal.client_close(core->hal.ctx, client);
+    }
+    send_event(core, FEEDER_LINK_DISCONNECT, 0);
+}
+
+/**
+ * Disconnects clients that stopped sending; runs once a second while any
+ * client is connected.
+ */
+static void sweep_clients(feeder_core *core)
+{
+    uint32_t now = core->hal.millis(core->hal.ctx);
+    int active = 0;
+    for (int i = 0; i < FEEDER_MAX_CLIENTS; i++)
+    {
+        feeder_client *c = &core->clients[i];
+        if (c->used && now - c->last_seen >= FEEDER_CLIENT_TIMEOUT_MS)
+        {
+            close_client(core, i, 1);
+        }
+        active |= c->used;
+    }
+    core->sweep_pending = (uint8_t)active;
+    if (active)
+    {
+        timer_add(core, TIMER_SWEEP, 1000);
+    }
+}
+
+/**
+ * Whether a request line asks for a path, e.g. "GET /H HTTP/1.1" for "/H".
+ */
+static int requests(const char *line, const char *path)
+{
+    size_t len = strlen(path);
+    if (strncmp(line, "GET ", 4) != 0 || strncmp(line + 4, path, len) != 0)
+    {
+        return 0;
+    }
+    char next = line[4 + len];
+    return next == '\0' || next == ' ' || next == '?';
+}
+
+/**
+ * Handles one line of an HTTP request header.
+ */
+static void client_line(feeder_core *core, int client)
+{
+    feeder_client *c = &core->clients[client];
+    if (c->len == 0)
+    {
+        // End of the header: answer at once, whatever the servo is doing
+        core->stats.requests++;
+        core->hal.client_write(core->hal.ctx, client, PAGE, sizeof(PAGE) - 1);
+        close_client(core, client, 1);
+        return;
+    }
+
+    c->line[c->len] = '\0';
+    if (requests(c->line, "/H"))
+    {
+        queue_move(core, &FEED_MOVE);
+    }
+    else if (requests(c->line, "/L"))
+    {
+        queue_move(core, &SLOW_MOVE);
+    }
+    c->len = 0;
+}
+
+/**
+ * Answers a settings command.
+ */
+static void send_ack(feeder_core *core, unsigned id, const char *status)
+{
+    char ack[64];
+    int len = snprintf(ack, sizeof(ack), "Ack:[%u %s]\r\n", id, status);
+    if (len > 0 && len < (int)sizeof(ack))
+    {
+        core->hal.serial_write(core->hal.ctx, (const uint8_t *)ack, (size_t)len);
+    }
+}
+
+/**
+ * Applies one settings command line, "Set:[<id> <key>=<value>]".
+ */
+static void command_line(feeder_core *core)
+{
+    core->command[core->command_len] = '\0';
+    const char *start = strstr(core->command, "Set:[");
+    if (start == NULL)
+    {
+        return;
+    }
+
+    unsigned id;
+    char key[33];
+    char value[33];
+    int fields = sscanf(start + 5, "%u %32[^=]=%32[^]]", &id, key, value);
+    if (fields < 1)
+    {
+        return;
+    }
+    core->stats.commands++;
+    if (fields != 3)
+    {
+        send_ack(core, id, "error malformed command");
+        return;
+    }
+    if (strcmp(key, "delay") != 0)
+    {
+        send_ack(core, id, "error unknown setting");
+        return;
+    }
+
+    long delay = 0;
+    int used = 0;
+    if (sscanf(value, "%ld%n", &delay, &used) != 1 || value[used] != '\0' || delay < 0 || delay > FEEDER_MAX_DELAY_MS)
+    {
+        send_ack(core, id, "error bad value");
+        return;
+    }
+
+    // Flash is only written when the value changes, so a retried command costs nothing
+    if (delay != core->delay_ms)
+    {
+        if (core->hal.save_delay(core->hal.ctx, delay) != 0)
+        {
+            send_ack(core, id, "error flash write failed");
+            return;
+        }
+        core->delay_ms = delay;
+        core->stats.flash_writes++;
+    }
+    send_ack(core, id, "ok");
+}
+
+void feeder_init(feeder_core *core, const feeder_hal *hal, long delay_ms, uint8_t device, int binary)
+{
+    memset(core, 0, sizeof(*core));
+    core->hal = *hal;
+    core->delay_ms = delay_ms;
+    core->device = device;
+    core->binary = (uint8_t)(binary != 0);
+    core->echo = (uint8_t)(binary == 0);
+    core->phase = PHASE_IDLE;
+}
+
+void feeder_serial_input(feeder_core *core, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        char c = data[i];
+        if (c == '\n' || c == '\r')
+        {
+            if (core->command_len > 0)
+            {
+                command_line(core);
+            }
+            core->command_len = 0;
+        }
+        else if (core->command_len + 1 < FEEDER_LINE_MAX)
+        {
+            core->command[core->command_len++] = c;
+        }
+    }
+}
+
+int feeder_client_open(feeder_core *core)
+{
+    for (int i = 0; i < FEEDER_MAX_CLIENTS; i++)
+    {
+        feeder_client *c = &core->clients[i];
+        if (!c->used)
+        {
+            c->used = 1;
+            c->len = 0;
+            c->last_seen = core->hal.millis(core->hal.ctx);
+            send_event(core, FEEDER_LINK_CONNECT, 0);
+            if (!core->sweep_pending)
+            {
+                core->sweep_pending = 1;
+                timer_add(core, TIMER_SWEEP, 1000);
+            }
+            return i;
+        }
+    }
+    core->stats.rejected_clients++;
+    return -1;
+}
+
+void feeder_client_input(feeder_core *core, int client, const char *data, size_t len)
+{
+    if (client < 0 || client >= FEEDER_MAX_CLIENTS || !core->clients[client].used)
+    {
+        return;
+    }
+    feeder_client *c = &core->clients[client];
+    c->last_seen = core->hal.millis(core->hal.ctx);
+    if (core->echo)
+    {
+        // Echo the request while debugging, as the text firmware did
+        core->hal.serial_write(core->hal.ctx, (const uint8_t *)data, len);
+    }
+
+    for (size_t i = 0; i < len && c->used; i++)
+    {
+        char ch = data[i];
+        if (ch == '\n')
+        {
+            client_line(core, client);
+        }
+        else if (ch != '\r' && c->len + 1 < FEEDER_LINE_MAX)
+        {
+            c->line[c->len++] = ch;
+        }
+    }
+}
+
+void feeder_client_gone(feeder_core *core, int client)
+{
+    if (client >= 0 && client < FEEDER_MAX_CLIENTS && core->clients[client].used)
+    {
+        close_client(core, client, 0);
+    }
+}
+
+void feeder_poll(feeder_core *core)
+{
+    uint32_t now = core->hal.millis(core->hal.ctx);
+    while (core->timer_count > 0 && !before(now, core->timers[0].due))
+    {
+        feeder_timer timer = timer_pop(core);
+        switch (timer.kind)
+        {
+        case TIMER_SERVO:
+            servo_tick(core);
+            break;
+        case TIMER_FLUSH:
+            core->flush_pending = 0;
+            flush_events(core);
+            break;
+        case TIMER_SWEEP:
+            sweep_clients(core);
+            break;
+        }
+    }
+}
+
+long feeder_next_due(const feeder_core *core)
+{
+    if (core->timer_count == 0)
+    {
+        return -1;
+    }
+    int32_t wait = (int32_t)(core->timers[0].due - core->hal.millis(core->hal.ctx));
+    return wait > 0 ? wait : 0;
+}
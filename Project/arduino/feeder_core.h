@@ -0,0 +1,200 @@
+#ifndef FEEDER_CORE_H
+#define FEEDER_CORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// HTTP clients served at the same time
+#define FEEDER_MAX_CLIENTS 4
+// Pending timers; each of the servo, the event batch and the client sweep uses one
+#define FEEDER_MAX_TIMERS 8
+// Servo moves waiting for the servo to be free
+#define FEEDER_MAX_MOVES 8
+// Longest request or command line kept; the rest of a longer line is ignored
+#define FEEDER_LINE_MAX 128
+// A client that sends nothing for this long is disconnected
+#define FEEDER_CLIENT_TIMEOUT_MS 5000
+// Longest delay accepted by the delay setting
+#define FEEDER_MAX_DELAY_MS 600000
+
+// Events batched into one link frame, and the longest time one waits in a batch
+#define FEEDER_LINK_MAX_EVENTS 16
+#define FEEDER_LINK_FLUSH_MS 200
+// Frame layout and event kinds, the same as serial/packet.h on the host
+#define FEEDER_LINK_HEADER 7
+#define FEEDER_LINK_EVENT 5
+#define FEEDER_LINK_DURATION 1
+#define FEEDER_LINK_CONNECT 2
+#define FEEDER_LINK_DISCONNECT 3
+
+/**
+ * @brief Hardware access used by the core
+ *
+ * Every function receives ctx. The firmware implements these on the ESP32
+ * (arduino.ino); the host simulator implements them on a pseudo-terminal,
+ * sockets and a file (simulator.c).
+ */
+typedef struct feeder_hal {
+    uint32_t (*millis)(void *ctx);
+    void (*servo_write)(void *ctx, int angle);
+    void (*serial_write)(void *ctx, const uint8_t *data, size_t len);
+    void (*client_write)(void *ctx, int client, const char *data, size_t len);
+    void (*client_close)(void *ctx, int client);
+    int (*save_delay)(void *ctx, long delay_ms);    // Returns 0 once the delay is in flash
+    void *ctx;
+} feeder_hal;
+
+/**
+ * @brief A servo move: up to top degrees one step at a time, hold, and back
+ */
+typedef struct feeder_move {
+    uint8_t top;
+    uint8_t report;    // 1 to report the duration of the move to the host
+    uint16_t step_ms;
+} feeder_move;
+
+/**
+ * @brief Something to do at a given time
+ */
+typedef struct feeder_timer {
+    uint32_t due;
+    uint8_t kind;
+} feeder_timer;
+
+/**
+ * @brief An HTTP client being served
+ */
+typedef struct feeder_client {
+    uint8_t used;
+    uint32_t last_seen;
+    size_t len;
+    char line[FEEDER_LINE_MAX];
+} feeder_client;
+
+/**
+ * @brief Counters kept by the core
+ */
+typedef struct feeder_stats {
+    uint32_t requests;
+    uint32_t feedings;
+    uint32_t rejected_clients;
+    uint32_t dropped_moves;
+    uint32_t commands;
+    uint32_t flash_writes;
+} feeder_stats;
+
+/**
+ * @brief State of the feeder
+ *
+ * Nothing in the core waits: input is pushed in as it arrives, and
+ * feeder_poll() runs the timers that are due. The servo moves one degree
+ * per timer tick, so HTTP clients and commands are served while it runs.
+ * All state is inside the struct, so the core needs no heap.
+ */
+typedef struct feeder_core {
+    feeder_hal hal;
+    long delay_ms;
+    uint8_t device;
+    uint8_t binary;
+    uint8_t echo;
+
+    // Servo
+    int phase;
+    int angle;
+    uint32_t move_start;
+    uint32_t move_hold;
+    feeder_move moves[FEEDER_MAX_MOVES];
+    size_t move_head;
+    size_t move_count;
+
+    // Timer queue, a binary heap ordered by due time
+    feeder_timer timers[FEEDER_MAX_TIMERS];
+    size_t timer_count;
+    uint8_t flush_pending;
+    uint8_t sweep_pending;
+
+    feeder_client clients[FEEDER_MAX_CLIENTS];
+
+    // Settings command line received over serial
+    char command[FEEDER_LINE_MAX];
+    size_t command_len;
+
+    // Events not sent to the host yet
+    uint8_t frame[FEEDER_LINK_HEADER + FEEDER_LINK_MAX_EVENTS * FEEDER_LINK_EVENT + 2];
+    size_t event_count;
+    uint16_t seq;
+
+    feeder_stats stats;
+} feeder_core;
+
+/**
+ * @brief Prepares the core
+ *
+ * @param core Core to initialize
+ * @param hal Hardware access, copied
+ * @param delay_ms Feeding delay read from flash at boot
+ * @param device Device id sent in link frames
+ * @param binary 1 to send events as binary frames, 0 for text lines
+ */
+void feeder_init(feeder_core *core, const feeder_hal *hal, long delay_ms, uint8_t device, int binary);
+
+/**
+ * @brief Hands bytes received over serial to the core
+ *
+ * @param core Initialized core
+ * @param data Received bytes
+ * @param len Number of bytes
+ */
+void feeder_serial_input(feeder_core *core, const char *data, size_t len);
+
+/**
+ * @brief Registers a new HTTP client
+ *
+ * @param core Initialized core
+ * @return int Client slot used in the other calls and the HAL, or -1 if
+ *         every slot is busy (the caller then closes the connection)
+ */
+int feeder_client_open(feeder_core *core);
+
+/**
+ * @brief Hands bytes received from an HTTP client to the core
+ *
+ * @param core Initialized core
+ * @param client Slot returned by feeder_client_open()
+ * @param data Received bytes
+ * @param len Number of bytes
+ */
+void feeder_client_input(feeder_core *core, int client, const char *data, size_t len);
+
+/**
+ * @brief Tells the core that a client went away without being closed by it
+ *
+ * @param core Initialized core
+ * @param client Slot returned by feeder_client_open()
+ */
+void feeder_client_gone(feeder_core *core, int client);
+
+/**
+ * @brief Runs every timer that is due
+ *
+ * @param core Initialized core
+ */
+void feeder_poll(feeder_core *core);
+
+/**
+ * @brief Milliseconds until the next timer is due
+ *
+ * @param core Initialized core
+ * @return long 0 if a timer is due, -1 if none is pending
+ */
+long feeder_next_due(const feeder_core *core);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FEEDER_CORE_H */
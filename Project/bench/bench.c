@@ -0,0 +1,489 @@
+/**
+ * @file bench.c
+ * @brief Benchmarks of the recorder and the stats path, without hardware
+ *
+ * The ingestion benchmark plays the feeder: it creates one pseudo-terminal
+ * per emulated device, starts record_ports() on them in a child process
+ * (the recorder only stops on a signal) and writes "Duration:[n]" records
+ * at the requested rate, each preceded by noise bytes like the HTTP request
+ * echo of the firmware. Events per second are counted from the first event
+ * sent to the last record that reached the stats file; events missing from
+ * the file were dropped. The recorder's own pipeline counters are read from
+ * its output.
+ *
+ * The stats benchmark generates stats files of increasing size and times
+ * print_stats() once without sidecars (the index is built from the log)
+ * and then with them (median of BENCH_RUNS runs).
+ *
+ * Every result is one JSON object on its own line of stdout, so runs can
+ * be compared by scripts.
+ */
+// posix_openpt() is hidden by glibc otherwise; macOS has it by default
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "bench.h"
+#include "../ingest/ingest.h"
+#include "../stats/stats.h"
+
+// Runs of print_stats() with sidecars; the median is reported
+#define BENCH_RUNS 5
+// The recorder is done once its stats file stops growing for this long
+#define SETTLE_MS 1000
+// Longest time to wait for the recorder to open its ports
+#define START_TIMEOUT_MS 5000
+// Text the noise bytes are drawn from, like an echoed HTTP request
+#define NOISE_TEXT "GET /H HTTP/1.1\r\nHost: 192.168.1.20\r\nAccept: text/html\r\nUser-Agent: bench\r\n"
+
+/**
+ * Small xorshift generator, so generated files are the same on every platform.
+ */
+static unsigned next_random(unsigned *state)
+{
+    unsigned x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/**
+ * Microseconds on a clock that does not jump.
+ */
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Sleeps for a number of microseconds.
+ */
+static void sleep_us(long long us)
+{
+    struct timespec pause = { (time_t)(us / 1000000), (long)(us % 1000000) * 1000 };
+    while (nanosleep(&pause, &pause) != 0 && errno == EINTR)
+    {
+    }
+}
+
+void bench_defaults(bench_options *options)
+{
+    memset(options, 0, sizeof(*options));
+    options->ingest = 1;
+    options->stats = 1;
+    options->events = 20000;
+    options->rate = 0;
+    options->noise = 0;
+    options->ports = 2;
+    options->sizes[0] = 10000;
+    options->sizes[1] = 100000;
+    options->sizes[2] = 1000000;
+    options->size_count = 3;
+    options->days = 365;
+}
+
+long bench_generate(const char *path, long records, int days, int devices, unsigned seed)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        printf("Error creating %s.\n", path);
+        return -1;
+    }
+
+    unsigned state = seed ? seed : 1;
+    long long span = (long long)(days > 0 ? days : 1) * 86400;
+    long long t = (long long)time(NULL) - span;
+    // Gaps are drawn from [0, 2 * mean] so the records end close to now
+    long long max_gap = records > 0 ? 2 * span / records : 0;
+
+    for (long i = 0; i < records; i++)
+    {
+        if (max_gap > 0)
+        {
+            t += next_random(&state) % (unsigned)(max_gap + 1);
+        }
+        unsigned duration = 1 + next_random(&state) % 9;
+        if (devices > 0)
+        {
+            fprintf(file, "%lld,%u,%u\n", t, duration, 1 + next_random(&state) % (unsigned)devices);
+        }
+        else
+        {
+            fprintf(file, "%lld,%u\n", t, duration);
+        }
+    }
+
+    long bytes = ftell(file);
+    if (fclose(file) != 0)
+    {
+        printf("Error writing %s.\n", path);
+        return -1;
+    }
+    return bytes;
+}
+
+/**
+ * Removes a benchmark directory and the files in it.
+ */
+static void remove_dir(const char *dir)
+{
+    DIR *d = opendir(dir);
+    if (d != NULL)
+    {
+        struct dirent *entry;
+        char path[600];
+        while ((entry = readdir(d)) != NULL)
+        {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            {
+                snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+                unlink(path);
+            }
+        }
+        closedir(d);
+    }
+    rmdir(dir);
+}
+
+/**
+ * Creates a pseudo-terminal for an emulated device. Returns the master
+ * descriptor and fills name with the path the recorder opens, or -1.
+ */
+static int open_device(char *name, size_t size)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0 || ptsname(master) == NULL)
+    {
+        printf("Error creating terminal: %s\n", strerror(errno));
+        if (master >= 0)
+        {
+            close(master);
+        }
+        return -1;
+    }
+    snprintf(name, size, "%s", ptsname(master));
+    return master;
+}
+
+/**
+ * Counts the lines in a file from offset on, moving offset to the end.
+ */
+static long count_lines(const char *path, long *offset)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return 0;
+    }
+    long lines = 0;
+    char buffer[65536];
+    size_t n;
+    fseek(file, *offset, SEEK_SET);
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            lines += buffer[i] == '\n';
+        }
+        *offset += (long)n;
+    }
+    fclose(file);
+    return lines;
+}
+
+/**
+ * Counts the lines of the recorder output that contain text.
+ */
+static int count_output(const char *path, const char *text)
+{
+    FILE *file = fopen(path, "r");
+    int count = 0;
+    char line[512];
+    while (file != NULL && fgets(line, sizeof(line), file) != NULL)
+    {
+        count += strstr(line, text) != NULL;
+    }
+    if (file != NULL)
+    {
+        fclose(file);
+    }
+    return count;
+}
+
+/**
+ * Reads a counter printed by the recorder when it stops, e.g. the number
+ * before "events dropped". Returns 0 if the line is missing.
+ */
+static unsigned long long read_counter(const char *path, const char *prefix, const char *format)
+{
+    FILE *file = fopen(path, "r");
+    unsigned long long value = 0;
+    char line[512];
+    while (file != NULL && fgets(line, sizeof(line), file) != NULL)
+    {
+        char *at = strstr(line, prefix);
+        if (at != NULL && sscanf(at, format, &value) == 1)
+        {
+            break;
+        }
+    }
+    if (file != NULL)
+    {
+        fclose(file);
+    }
+    return value;
+}
+
+/**
+ * Sends the events to the emulated devices at the requested rate.
+ * Returns the time the last event was written.
+ */
+static long long emulate(const bench_options *options, const int *masters, long long start)
+{
+    unsigned state = 12345;
+    char event[512];
+    size_t noise_len = strlen(NOISE_TEXT);
+
+    for (long i = 0; i < options->events; i++)
+    {
+        if (options->rate > 0)
+        {
+            long long due = start + i * 1000000LL / options->rate;
+            long long wait = due - now_us();
+            if (wait > 0)
+            {
+                sleep_us(wait);
+            }
+        }
+
+        int len = 0;
+        for (int k = 0; k < options->noise && len < (int)sizeof(event) - 32; k++)
+        {
+            event[len++] = NOISE_TEXT[next_random(&state) % noise_len];
+        }
+        len += snprintf(event + len, sizeof(event) - (size_t)len, "Duration:[%u]\r\n", 1 + next_random(&state) % 9);
+
+        // Writes block while the terminal buffer is full, so events are only dropped inside the recorder
+        int fd = masters[i % options->ports];
+        for (int done = 0; done < len;)
+        {
+            ssize_t n = write(fd, event + done, (size_t)(len - done));
+            if (n < 0 && errno != EINTR)
+            {
+                return now_us();
+            }
+            done += n > 0 ? (int)n : 0;
+        }
+    }
+    return now_us();
+}
+
+/**
+ * Runs the ingestion benchmark in dir.
+ */
+static int bench_ingest(const bench_options *options, const char *dir)
+{
+    char log_path[600];
+    char out_path[600];
+    snprintf(log_path, sizeof(log_path), "%s/ingest.csv", dir);
+    snprintf(out_path, sizeof(out_path), "%s/recorder.out", dir);
+
+    int *masters = calloc((size_t)options->ports, sizeof(*masters));
+    char (*names)[128] = calloc((size_t)options->ports, sizeof(*names));
+    const char **ports = calloc((size_t)options->ports, sizeof(*ports));
+    int opened = 0;
+    while (masters != NULL && names != NULL && ports != NULL && opened < options->ports &&
+           (masters[opened] = open_device(names[opened], sizeof(names[opened]))) >= 0)
+    {
+        ports[opened] = names[opened];
+        opened++;
+    }
+
+    pid_t child = -1;
+    if (opened == options->ports)
+    {
+        fflush(stdout);
+        child = fork();
+    }
+    if (child == 0)
+    {
+        // Recorder: its status lines go to a file, line by line so readiness can be seen
+        int out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0 || dup2(out, 1) < 0)
+        {
+            _exit(1);
+        }
+        setvbuf(stdout, NULL, _IOLBF, 0);
+        exit(record_ports(ports, options->ports, 1, log_path, &options->policy));
+    }
+
+    int status = 1;
+    if (child > 0)
+    {
+        // Events sent before the recorder opened its ports would be counted as dropped
+        long long deadline = now_us() + START_TIMEOUT_MS * 1000LL;
+        while (count_output(out_path, "Recording stats from") < options->ports && now_us() < deadline)
+        {
+            sleep_us(10000);
+        }
+
+        long long start = now_us();
+        long long sent = emulate(options, masters, start);
+
+        // Wait until every event is in the file, or the file stops growing
+        long offset = 0;
+        long recorded = 0;
+        long long last_growth = now_us();
+        while (recorded < options->events && now_us() - last_growth < SETTLE_MS * 1000LL)
+        {
+            long lines = count_lines(log_path, &offset);
+            if (lines > 0)
+            {
+                recorded += lines;
+                last_growth = now_us();
+            }
+            else
+            {
+                sleep_us(5000);
+            }
+        }
+
+        kill(child, SIGTERM);
+        waitpid(child, NULL, 0);
+
+        double seconds = (last_growth - start) / 1e6;
+        printf("{\"bench\":\"ingest\",\"ports\":%d,\"events\":%ld,\"rate\":%ld,\"noise\":%d,"
+               "\"sent_per_s\":%.0f,\"recorded\":%ld,\"dropped\":%ld,"
+               "\"dropped_reads\":%llu,\"dropped_queue_events\":%llu,\"unparsable_bytes\":%llu,"
+               "\"seconds\":%.3f,\"events_per_s\":%.0f}\n",
+               options->ports, options->events, options->rate, options->noise,
+               options->events / ((sent - start) / 1e6 + 1e-9), recorded, options->events - recorded,
+               read_counter(out_path, "Raw queue:", "Raw queue: %*[^,], %llu"),
+               read_counter(out_path, "Event queue:", "Event queue: %*[^,], %llu"),
+               read_counter(out_path, "Unparsable bytes:", "Unparsable bytes: %llu"),
+               seconds, recorded / (seconds > 0 ? seconds : 1e-9));
+        fflush(stdout);
+        status = 0;
+    }
+    else
+    {
+        printf("Error starting the recorder.\n");
+    }
+
+    for (int i = 0; i < opened; i++)
+    {
+        close(masters[i]);
+    }
+    free(masters);
+    free(names);
+    free(ports);
+    return status;
+}
+
+/**
+ * Calls print_stats() with stdout sent to /dev/null and returns its run time in ms.
+ */
+static double time_print_stats(char *path)
+{
+    fflush(stdout);
+    int saved = dup(1);
+    int null = open("/dev/null", O_WRONLY);
+    if (saved < 0 || null < 0)
+    {
+        return -1;
+    }
+    dup2(null, 1);
+    close(null);
+
+    long long start = now_us();
+    print_stats(path);
+    fflush(stdout);
+    long long end = now_us();
+
+    dup2(saved, 1);
+    close(saved);
+    return (end - start) / 1000.0;
+}
+
+/**
+ * Orders run times for the median.
+ */
+static int compare_times(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Runs the stats benchmark in dir.
+ */
+static int bench_stats(const bench_options *options, const char *dir)
+{
+    for (int s = 0; s < options->size_count; s++)
+    {
+        char path[600];
+        snprintf(path, sizeof(path), "%s/stats_%ld.csv", dir, options->sizes[s]);
+        long long start = now_us();
+        long bytes = bench_generate(path, options->sizes[s], options->days, 0, (unsigned)(s + 1));
+        if (bytes < 0)
+        {
+            return 1;
+        }
+        double generate_ms = (now_us() - start) / 1000.0;
+
+        double cold = time_print_stats(path);
+        double warm[BENCH_RUNS];
+        for (int r = 0; r < BENCH_RUNS; r++)
+        {
+            warm[r] = time_print_stats(path);
+        }
+        qsort(warm, BENCH_RUNS, sizeof(warm[0]), compare_times);
+
+        printf("{\"bench\":\"stats\",\"records\":%ld,\"bytes\":%ld,\"days\":%d,\"generate_ms\":%.1f,"
+               "\"cold_ms\":%.3f,\"warm_ms\":%.3f}\n",
+               options->sizes[s], bytes, options->days, generate_ms, cold, warm[BENCH_RUNS / 2]);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+int run_bench(const bench_options *options)
+{
+    if (options->events < 1 || options->ports < 1 || options->noise < 0 || options->rate < 0)
+    {
+        printf("Error: Invalid benchmark parameters.\n");
+        return 1;
+    }
+
+    char dir[] = "/tmp/feedbench.XXXXXX";
+    if (mkdtemp(dir) == NULL)
+    {
+        printf("Error creating a directory for the benchmark: %s\n", strerror(errno));
+        return 1;
+    }
+
+    int status = 0;
+    if (options->ingest)
+    {
+        status |= bench_ingest(options, dir);
+    }
+    if (options->stats)
+    {
+        status |= bench_stats(options, dir);
+    }
+    remove_dir(dir);
+    return status;
+}
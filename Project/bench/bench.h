@@ -0,0 +1,63 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "../writer/writer.h"
+
+// Most file sizes one stats benchmark run can cover
+#define BENCH_MAX_SIZES 8
+
+/**
+ * @brief What -bench runs and with which parameters
+ */
+typedef struct bench_options {
+    int ingest;                     // 1 to run the ingestion benchmark
+    int stats;                      // 1 to run the print_stats() benchmark
+    long events;                    // Events sent by the device emulator
+    long rate;                      // Events per second over all ports, 0 for as fast as possible
+    int noise;                      // Bytes of non-record text sent before every event
+    int ports;                      // Emulated devices
+    writer_policy policy;           // Commit policy of the recorder
+    long sizes[BENCH_MAX_SIZES];    // Records in each generated stats file
+    int size_count;
+    int days;                       // Days the generated records are spread over
+} bench_options;
+
+/**
+ * @brief Fills options with the defaults of -bench
+ *
+ * @param options Options to fill
+ */
+void bench_defaults(bench_options *options);
+
+/**
+ * @brief Writes a synthetic stats file
+ *
+ * Timestamps are sorted and spread evenly over the days that end now, with
+ * random gaps; durations are random whole seconds from 1 to 9.
+ *
+ * @param path File to create or replace
+ * @param records Number of records
+ * @param days Days the records are spread over, at least 1
+ * @param devices 0 for "timestamp,duration" records, otherwise the number
+ *                of device ids to append at random
+ * @param seed Seed of the random generator, so a file can be made again
+ * @return long Bytes written, or -1 if error occurs
+ */
+long bench_generate(const char *path, long records, int days, int devices, unsigned seed);
+
+/**
+ * @brief Runs the benchmarks and prints one JSON object per result line
+ *
+ * The ingestion benchmark starts the recorder on pseudo-terminals in a
+ * child process and sends it "Duration:[n]" records like the firmware; it
+ * reports events per second and how many events were dropped. The stats
+ * benchmark times print_stats() on generated files of each size, without
+ * and with the index sidecars. Files are made in a temporary directory
+ * that is removed afterwards.
+ *
+ * @param options What to run
+ * @return int 0 on success, 1 if a benchmark could not run
+ */
+int run_bench(const bench_options *options);
+
+#endif /* BENCH_H */
@@ -0,0 +1,272 @@
+/**
+ * @file binlog.c
+ * @brief Fixed-width binary record log, an alternative to stats.csv
+ *
+ * Layout: a 32-byte binlog_header followed by 16-byte binlog_record entries
+ * in append order. Values are stored in host byte order so a log can be
+ * read through mmap() without any per-field parsing; the bom field lets a
+ * reader on a host of the other endianness reject the file instead of
+ * returning garbage.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "binlog.h"
+#include "../index/dayindex.h"
+
+/**
+ * Checks that a header belongs to a log this build can read.
+ */
+static int header_valid(const binlog_header *header)
+{
+    return memcmp(header->magic, BINLOG_MAGIC, sizeof(BINLOG_MAGIC)) == 0 &&
+           header->bom == BINLOG_BOM &&
+           header->version == BINLOG_VERSION &&
+           header->record_size == sizeof(binlog_record);
+}
+
+int binlog_detect(const char *filename)
+{
+    binlog_header header;
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        return 0;
+    }
+
+    size_t n = fread(&header, 1, sizeof(header), file);
+    fclose(file);
+    return n == sizeof(header) && memcmp(header.magic, BINLOG_MAGIC, sizeof(BINLOG_MAGIC)) == 0;
+}
+
+FILE *binlog_open(const char *filename, uint32_t device_id)
+{
+    FILE *log = fopen(filename, "a+b");
+    if (log == NULL)
+    {
+        return NULL;
+    }
+
+    fseek(log, 0, SEEK_END);
+    long size = ftell(log);
+
+    if (size == 0)
+    {
+        binlog_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, BINLOG_MAGIC, sizeof(BINLOG_MAGIC));
+        header.bom = BINLOG_BOM;
+        header.version = BINLOG_VERSION;
+        header.units = BINLOG_UNITS_SECONDS;
+        header.device_id = device_id;
+        header.record_size = sizeof(binlog_record);
+
+        if (fwrite(&header, sizeof(header), 1, log) != 1 || fflush(log) != 0)
+        {
+            fclose(log);
+            return NULL;
+        }
+        return log;
+    }
+
+    binlog_header header;
+    rewind(log);
+    if (fread(&header, sizeof(header), 1, log) != 1 || !header_valid(&header))
+    {
+        printf("Error: %s is not a binary stats log.\n", filename);
+        fclose(log);
+        return NULL;
+    }
+
+    // Drop a record that was only partly written before a crash
+    long records_end = sizeof(header) +
+                       (size - (long)sizeof(header)) / (long)sizeof(binlog_record) * (long)sizeof(binlog_record);
+    if (records_end != size && ftruncate(fileno(log), records_end) != 0)
+    {
+        fclose(log);
+        return NULL;
+    }
+
+    fseek(log, 0, SEEK_END);
+    return log;
+}
+
+int binlog_append(FILE *log, int64_t timestamp, float duration, uint32_t device)
+{
+    binlog_record record;
+    memset(&record, 0, sizeof(record));
+    record.timestamp = timestamp;
+    record.duration = duration;
+    record.device = device;
+    return fwrite(&record, sizeof(record), 1, log) == 1 ? 0 : -1;
+}
+
+int binlog_map_file(const char *filename, binlog_map *map)
+{
+    memset(map, 0, sizeof(*map));
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(binlog_header))
+    {
+        close(fd);
+        return -1;
+    }
+
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    const binlog_header *header = base;
+    if (!header_valid(header))
+    {
+        munmap(base, st.st_size);
+        return -1;
+    }
+
+    // Records are read front to back exactly once
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    map->base = base;
+    map->length = st.st_size;
+    map->header = header;
+    map->records = (const binlog_record *)((const char *)base + sizeof(binlog_header));
+    map->count = (st.st_size - sizeof(binlog_header)) / sizeof(binlog_record);
+    return 0;
+}
+
+void binlog_unmap(binlog_map *map)
+{
+    if (map->base != NULL)
+    {
+        munmap(map->base, map->length);
+    }
+    memset(map, 0, sizeof(*map));
+}
+
+/**
+ * @brief Binary log a CSV file is converted into
+ */
+struct conversion
+{
+    FILE *out;
+    long count;
+    int failed;
+};
+
+/**
+ * log_scan_records() callback appending each CSV record to the binary log.
+ */
+static int append_record(int64_t offset, int64_t end, const binlog_record *record, void *ctx)
+{
+    (void)offset;
+    (void)end;
+    struct conversion *conversion = ctx;
+    if (binlog_append(conversion->out, record->timestamp, record->duration, record->device) != 0)
+    {
+        conversion->failed = 1;
+        return 1;
+    }
+    conversion->count++;
+    return 0;
+}
+
+long csv_to_binlog(const char *csv_file, const char *bin_file)
+{
+    if (access(csv_file, R_OK) != 0)
+    {
+        printf("Error opening %s.\n", csv_file);
+        return -1;
+    }
+
+    // Start from an empty log so the conversion can be rerun
+    FILE *out = fopen(bin_file, "w");
+    if (out != NULL)
+    {
+        fclose(out);
+        out = binlog_open(bin_file, 0);
+    }
+    if (out == NULL)
+    {
+        printf("Error opening %s.\n", bin_file);
+        return -1;
+    }
+
+    // Lines are read by the same rules as every CSV reader, so both logs hold the same records
+    struct conversion conversion = { out, 0, 0 };
+    if (log_scan_records(csv_file, 0, 0, append_record, &conversion) < 0)
+    {
+        printf("Error opening %s.\n", csv_file);
+        conversion.failed = 1;
+    }
+    if (fclose(out) != 0)
+    {
+        conversion.failed = 1;
+    }
+    return conversion.failed ? -1 : conversion.count;
+}
+
+void binlog_format_duration(char *out, size_t size, float duration)
+{
+    for (int digits = 6; digits <= 9; digits++)
+    {
+        snprintf(out, size, "%.*g", digits, duration);
+        if (strtof(out, NULL) == duration)
+        {
+            return;
+        }
+    }
+}
+
+long binlog_to_csv(const char *bin_file, const char *csv_file)
+{
+    binlog_map map;
+    if (binlog_map_file(bin_file, &map) != 0)
+    {
+        printf("Error: %s is not a binary stats log.\n", bin_file);
+        return -1;
+    }
+
+    FILE *out = fopen(csv_file, "w");
+    if (out == NULL)
+    {
+        printf("Error opening %s.\n", csv_file);
+        binlog_unmap(&map);
+        return -1;
+    }
+
+    for (size_t i = 0; i < map.count; i++)
+    {
+        const binlog_record *r = &map.records[i];
+        char duration[32];
+        binlog_format_duration(duration, sizeof(duration), r->duration);
+        if (r->device > 0)
+        {
+            fprintf(out, "%ld,%s,%u\n", (long)r->timestamp, duration, r->device);
+        }
+        else
+        {
+            fprintf(out, "%ld,%s\n", (long)r->timestamp, duration);
+        }
+    }
+
+    long count = (long)map.count;
+    binlog_unmap(&map);
+    if (fclose(out) != 0)
+    {
+        count = -1;
+    }
+    return count;
+}
@@ -0,0 +1,127 @@
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// First bytes of every binary log
+#define BINLOG_MAGIC "FEEDLOG"
+#define BINLOG_VERSION 1
+// Byte order mark, read back as something else on a host of the other endianness
+#define BINLOG_BOM 0x01020304u
+// Durations are stored in seconds, as printed by the firmware
+#define BINLOG_UNITS_SECONDS 1
+
+/**
+ * @brief Header at the start of a binary log (32 bytes)
+ */
+typedef struct binlog_header {
+    char magic[8];
+    uint32_t bom;
+    uint16_t version;
+    uint16_t units;
+    uint32_t device_id;
+    uint32_t record_size;
+    uint8_t reserved[8];
+} binlog_header;
+
+/**
+ * @brief One fixed-width record (16 bytes)
+ *
+ * device is 0 for records that were not tagged with a device id.
+ */
+typedef struct binlog_record {
+    int64_t timestamp;
+    float duration;
+    uint32_t device;
+} binlog_record;
+
+/**
+ * @brief Read-only memory mapping of a binary log
+ */
+typedef struct binlog_map {
+    const binlog_header *header;
+    const binlog_record *records;
+    size_t count;
+    void *base;
+    size_t length;
+} binlog_map;
+
+/**
+ * @brief Checks whether a file starts with a binary log header
+ *
+ * @param filename Path of the file
+ * @return int 1 if it is a binary log, 0 otherwise
+ */
+int binlog_detect(const char *filename);
+
+/**
+ * @brief Opens a binary log for appending, writing the header if the file is new
+ *
+ * @param filename Path of the log
+ * @param device_id Device id stored in the header of a new log (0 for mixed devices)
+ * @return FILE* Stream positioned at the end, or NULL if error occurs
+ */
+FILE *binlog_open(const char *filename, uint32_t device_id);
+
+/**
+ * @brief Appends one record to a log opened with binlog_open()
+ *
+ * @param log Stream returned by binlog_open()
+ * @param timestamp Unix timestamp of the event
+ * @param duration Duration in seconds
+ * @param device Device id, 0 if untagged
+ * @return int 0 on success, -1 if error occurs
+ */
+int binlog_append(FILE *log, int64_t timestamp, float duration, uint32_t device);
+
+/**
+ * @brief Maps a binary log into memory for reading
+ *
+ * @param filename Path of the log
+ * @param map Filled with the mapping on success
+ * @return int 0 on success, -1 if the file cannot be mapped or is not a valid log
+ */
+int binlog_map_file(const char *filename, binlog_map *map);
+
+/**
+ * @brief Releases a mapping made by binlog_map_file()
+ *
+ * @param map Mapping to release
+ */
+void binlog_unmap(binlog_map *map);
+
+/**
+ * @brief Converts a CSV stats file into a binary log
+ *
+ * Lines that are not records, overlong ones included, are skipped as
+ * log_scan() skips them.
+ *
+ * @param csv_file Path of the CSV file (timestamp,duration[,device])
+ * @param bin_file Path of the binary log to create
+ * @return long Number of records converted, or -1 if error occurs
+ */
+long csv_to_binlog(const char *csv_file, const char *bin_file);
+
+/**
+ * @brief Formats a duration with the fewest digits that read back to the same float
+ *
+ * @param out Buffer for the text, 32 bytes are always enough
+ * @param size Size of out
+ * @param duration Duration in seconds
+ */
+void binlog_format_duration(char *out, size_t size, float duration);
+
+/**
+ * @brief Converts a binary log into a CSV stats file
+ *
+ * Durations are written by binlog_format_duration(), so they read back exactly.
+ *
+ * @param bin_file Path of the binary log
+ * @param csv_file Path of the CSV file to create
+ * @return long Number of records converted, or -1 if error occurs
+ */
+long binlog_to_csv(const char *bin_file, const char *csv_file);
+
+#endif /* BINLOG_H */
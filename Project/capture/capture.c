@@ -0,0 +1,202 @@
+/**
+ * @file capture.c
+ * @brief Raw serial captures for replaying field traffic at the desk
+ *
+ * A capture keeps every read of every port exactly as it arrived, with the
+ * time it was read, so a replay goes through the link decoder and the
+ * matchers with the same chunk boundaries and gaps as in the field. The
+ * feeder sends a few dozen bytes per event, so the varint entry header of
+ * two to four bytes keeps a capture close to the size of the raw stream.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include "capture.h"
+#include "../metrics/metrics.h"
+
+struct capture_writer
+{
+    FILE *file;
+    int64_t base_us;     // metrics_now_us() when the capture started
+    int64_t last_us;     // offset of the previous entry
+    int failed;
+};
+
+/**
+ * Appends a varint to a buffer, returning the new end.
+ */
+static uint8_t *put_varint(uint8_t *p, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        *p++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (uint8_t)value;
+    return p;
+}
+
+/**
+ * Reads a varint from a file. Returns 1 on success, 0 at the end of the file, -1 if it is torn.
+ */
+static int get_varint(FILE *file, uint64_t *value)
+{
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        int byte = getc(file);
+        if (byte == EOF)
+        {
+            return shift == 0 ? 0 : -1;
+        }
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            *value = result;
+            return 1;
+        }
+    }
+    return -1;
+}
+
+capture_writer *capture_create(const char *path, int ports, int tagged)
+{
+    capture_writer *w = calloc(1, sizeof(*w));
+    if (w == NULL)
+    {
+        return NULL;
+    }
+    w->file = fopen(path, "wb");
+    if (w->file == NULL)
+    {
+        free(w);
+        return NULL;
+    }
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    capture_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+    header.bom = CAPTURE_BOM;
+    header.version = CAPTURE_VERSION;
+    header.ports = (uint16_t)ports;
+    header.tagged = (uint32_t)tagged;
+    header.start_us = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    w->base_us = metrics_now_us();
+
+    if (fwrite(&header, sizeof(header), 1, w->file) != 1 || fflush(w->file) != 0)
+    {
+        fclose(w->file);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+int capture_write(capture_writer *w, int64_t at_us, int port, int reset, const char *data, size_t len)
+{
+    if (w->failed || len > CAPTURE_CHUNK_MAX)
+    {
+        return -1;
+    }
+
+    // Chunks can be written slightly out of order across ports; time never goes back in a capture
+    int64_t offset = at_us - w->base_us;
+    if (offset < w->last_us)
+    {
+        offset = w->last_us;
+    }
+
+    uint8_t entry[30];
+    uint8_t *p = put_varint(entry, (uint64_t)(offset - w->last_us));
+    p = put_varint(p, (uint64_t)port * 2 + (reset ? 1 : 0));
+    p = put_varint(p, reset ? 0 : len);
+    w->last_us = offset;
+
+    if (fwrite(entry, 1, (size_t)(p - entry), w->file) != (size_t)(p - entry) ||
+            (!reset && len > 0 && fwrite(data, 1, len, w->file) != len))
+    {
+        w->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+int capture_flush(capture_writer *w)
+{
+    if (w->failed || fflush(w->file) != 0)
+    {
+        w->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+int capture_close(capture_writer *w)
+{
+    if (w == NULL)
+    {
+        return 0;
+    }
+    int ok = !w->failed;
+    ok = fclose(w->file) == 0 && ok;
+    free(w);
+    return ok ? 0 : -1;
+}
+
+int capture_open(capture_reader *reader, const char *path)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->file = fopen(path, "rb");
+    if (reader->file == NULL)
+    {
+        return -1;
+    }
+
+    capture_header *h = &reader->header;
+    if (fread(h, sizeof(*h), 1, reader->file) != 1 || memcmp(h->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0 ||
+            h->bom != CAPTURE_BOM || h->version != CAPTURE_VERSION || h->ports == 0)
+    {
+        fclose(reader->file);
+        reader->file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int capture_next(capture_reader *reader, capture_chunk *chunk)
+{
+    uint64_t delta, port, len;
+    int status = get_varint(reader->file, &delta);
+    if (status <= 0)
+    {
+        return status;
+    }
+    if (get_varint(reader->file, &port) != 1 || get_varint(reader->file, &len) != 1 ||
+            port / 2 >= reader->header.ports || len > CAPTURE_CHUNK_MAX)
+    {
+        return -1;
+    }
+
+    reader->offset_us += (int64_t)delta;
+    chunk->offset_us = reader->offset_us;
+    chunk->port = (int)(port / 2);
+    chunk->reset = (int)(port % 2);
+    chunk->len = (size_t)len;
+    if (len > 0 && fread(chunk->data, 1, (size_t)len, reader->file) != (size_t)len)
+    {
+        return -1;
+    }
+    return 1;
+}
+
+void capture_end(capture_reader *reader)
+{
+    if (reader->file != NULL)
+    {
+        fclose(reader->file);
+        reader->file = NULL;
+    }
+}
@@ -0,0 +1,124 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// First bytes of every capture file
+#define CAPTURE_MAGIC "FEEDCAP"
+#define CAPTURE_VERSION 1
+// Byte order mark, read back as something else on a host of the other endianness
+#define CAPTURE_BOM 0x01020304u
+// Most bytes in one captured chunk
+#define CAPTURE_CHUNK_MAX 4096
+
+/**
+ * @brief Header at the start of a capture file (32 bytes)
+ *
+ * It is followed by one entry per read, each made of three varints and the
+ * bytes: microseconds since the previous entry, port index * 2 + 1 if the
+ * port was (re)opened there or * 2 for data, and the byte count.
+ */
+typedef struct capture_header {
+    char magic[8];
+    uint32_t bom;
+    uint16_t version;
+    uint16_t ports;        // ports recorded from
+    uint32_t tagged;       // 1 if records were tagged with the device id
+    uint32_t reserved;
+    int64_t start_us;      // Unix time the capture started, in microseconds
+} capture_header;
+
+/**
+ * @brief One read of a port, as stored in a capture
+ */
+typedef struct capture_chunk {
+    int64_t offset_us;     // microseconds since the capture started
+    int port;              // index of the port in the recorder's port list
+    int reset;             // 1 if the port was (re)opened here; carries no data
+    size_t len;
+    char data[CAPTURE_CHUNK_MAX];
+} capture_chunk;
+
+/**
+ * @brief Capture file being written
+ */
+typedef struct capture_writer capture_writer;
+
+/**
+ * @brief Capture file being read
+ */
+typedef struct capture_reader {
+    FILE *file;
+    capture_header header;
+    int64_t offset_us;
+} capture_reader;
+
+/**
+ * @brief Creates or replaces a capture file
+ *
+ * @param path Path of the capture file
+ * @param ports Number of ports that are recorded from
+ * @param tagged 1 if records are tagged with the device id
+ * @return capture_writer* Writer, or NULL if the file cannot be created
+ */
+capture_writer *capture_create(const char *path, int ports, int tagged);
+
+/**
+ * @brief Appends one read of a port
+ *
+ * Entries are buffered; capture_flush() hands them to the kernel.
+ *
+ * @param writer Writer from capture_create()
+ * @param at_us When the bytes were read, from metrics_now_us()
+ * @param port Index of the port
+ * @param reset 1 if the port was (re)opened, with no data
+ * @param data Bytes read
+ * @param len Number of bytes, at most CAPTURE_CHUNK_MAX
+ * @return int 0 on success, -1 if error occurs
+ */
+int capture_write(capture_writer *writer, int64_t at_us, int port, int reset, const char *data, size_t len);
+
+/**
+ * @brief Writes buffered entries to the capture file
+ *
+ * @param writer Writer from capture_create()
+ * @return int 0 on success, -1 if error occurs
+ */
+int capture_flush(capture_writer *writer);
+
+/**
+ * @brief Flushes and closes a capture file
+ *
+ * @param writer Writer to close, may be NULL
+ * @return int 0 on success, -1 if the last entries could not be written
+ */
+int capture_close(capture_writer *writer);
+
+/**
+ * @brief Opens a capture file and reads its header
+ *
+ * @param reader Reader to fill
+ * @param path Path of the capture file
+ * @return int 0 on success, -1 if the file cannot be read or is not a capture
+ */
+int capture_open(capture_reader *reader, const char *path);
+
+/**
+ * @brief Reads the next entry of a capture
+ *
+ * @param reader Reader from capture_open()
+ * @param chunk Filled with the entry
+ * @return int 1 if an entry was read, 0 at the end, -1 if the rest of the file is torn or corrupt
+ */
+int capture_next(capture_reader *reader, capture_chunk *chunk);
+
+/**
+ * @brief Closes a capture opened with capture_open()
+ *
+ * @param reader Reader to close
+ */
+void capture_end(capture_reader *reader);
+
+#endif /* CAPTURE_H */
@@ -0,0 +1,320 @@
+/**
+ * @file daemon.c
+ * @brief Long-running recorder that answers stats queries over a Unix socket
+ *
+ * Every -stats command opens and reads the log again. The daemon instead
+ * keeps the whole log in a stats_store, fed by the recorder through the
+ * ingest observer, and answers queries from memory.
+ *
+ * The protocol is one query line per connection; the answer is the text the
+ * matching -stats command prints, and the daemon closes the connection
+ * when it is complete. Queries are served by one thread that only holds
+ * the store's read lock while formatting the answer into memory, so a slow
+ * client never holds up the writer thread that adds new records.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "daemon.h"
+#include "store.h"
+#include "../ingest/ingest.h"
+#include "../metrics/metrics.h"
+
+// How long a client may take to send its query
+#define QUERY_TIMEOUT_MS 1000
+
+/**
+ * @brief Listening socket and thread answering queries
+ */
+struct server
+{
+    int fd;
+    int stop[2];
+    stats_store *store;
+    pthread_t thread;
+};
+
+/**
+ * Fills a socket address for the daemon of a stats file. Returns -1 if the path is too long.
+ */
+static int socket_address(const char *stats_file, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int len = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s%s", stats_file, DAEMON_SUFFIX);
+    return len > 0 && len < (int)sizeof(addr->sun_path) ? 0 : -1;
+}
+
+/**
+ * Writes all of buffer to a socket.
+ */
+static int write_all(int fd, const char *buffer, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buffer, len);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        buffer += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * Reads one query line from a client, giving up after QUERY_TIMEOUT_MS.
+ */
+static int read_query(int fd, char *query, size_t size)
+{
+    size_t len = 0;
+    while (len + 1 < size)
+    {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, QUERY_TIMEOUT_MS) <= 0)
+        {
+            return -1;
+        }
+        ssize_t n = read(fd, query + len, size - 1 - len);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        len += (size_t)n;
+        if (memchr(query, '\n', len) != NULL)
+        {
+            break;
+        }
+    }
+    query[len] = '\0';
+    query[strcspn(query, "\r\n")] = '\0';
+    return len > 0 ? 0 : -1;
+}
+
+/**
+ * Answers the query of one client.
+ */
+static void serve(struct server *server, int client)
+{
+    char query[DAEMON_QUERY_MAX];
+    if (read_query(client, query, sizeof(query)) != 0)
+    {
+        return;
+    }
+
+    // The answer is formatted into memory so the lock is not held while sending
+    char *answer = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&answer, &len);
+    if (out == NULL)
+    {
+        return;
+    }
+    int64_t start = metrics_now_us();
+    if (store_query(server->store, query, out) != 0)
+    {
+        fprintf(out, "Error: Invalid query '%s'.\n", query);
+    }
+    fclose(out);
+    metrics_since(METRIC_QUERY_LATENCY, start);
+
+    write_all(client, answer, len);
+    free(answer);
+}
+
+/**
+ * Server thread: accepts and answers clients until asked to stop.
+ */
+static void *serve_queries(void *arg)
+{
+    struct server *server = arg;
+    struct pollfd pfds[2] = { { server->fd, POLLIN, 0 }, { server->stop[0], POLLIN, 0 } };
+
+    for (;;)
+    {
+        if (poll(pfds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        if (pfds[1].revents != 0)
+        {
+            break;
+        }
+        if (pfds[0].revents & POLLIN)
+        {
+            int client = accept(server->fd, NULL, NULL);
+            if (client >= 0)
+            {
+                serve(server, client);
+                close(client);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Binds the socket of a stats file and starts answering queries.
+ */
+static int start_server(struct server *server, const char *stats_file, stats_store *store)
+{
+    struct sockaddr_un addr;
+    if (socket_address(stats_file, &addr) != 0)
+    {
+        printf("Error: Socket path for %s is too long.\n", stats_file);
+        return -1;
+    }
+
+    server->store = store;
+    server->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server->fd < 0)
+    {
+        printf("Error creating socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // A socket file nobody answers on was left by a daemon that did not exit cleanly
+    if (connect(server->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+    {
+        printf("Error: A daemon is already running for %s.\n", stats_file);
+        close(server->fd);
+        return -1;
+    }
+    close(server->fd);
+    unlink(addr.sun_path);
+
+    server->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server->fd < 0 || bind(server->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(server->fd, 16) != 0 || pipe(server->stop) != 0)
+    {
+        printf("Error opening socket %s: %s\n", addr.sun_path, strerror(errno));
+        if (server->fd >= 0)
+        {
+            close(server->fd);
+        }
+        unlink(addr.sun_path);
+        return -1;
+    }
+
+    if (pthread_create(&server->thread, NULL, serve_queries, server) != 0)
+    {
+        printf("Error starting query thread.\n");
+        close(server->fd);
+        close(server->stop[0]);
+        close(server->stop[1]);
+        unlink(addr.sun_path);
+        return -1;
+    }
+    printf("Answering queries on %s\n", addr.sun_path);
+    return 0;
+}
+
+/**
+ * Stops the server thread and removes the socket.
+ */
+static void stop_server(struct server *server, const char *stats_file)
+{
+    struct sockaddr_un addr;
+    if (write(server->stop[1], "x", 1) == 1)
+    {
+        pthread_join(server->thread, NULL);
+    }
+    close(server->fd);
+    close(server->stop[0]);
+    close(server->stop[1]);
+    if (socket_address(stats_file, &addr) == 0)
+    {
+        unlink(addr.sun_path);
+    }
+}
+
+int run_daemon(const char **ports, int count, int tag_devices, const char *stats_file, const writer_policy *policy)
+{
+    // A client that hangs up early must not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    stats_store store;
+    if (store_load(&store, stats_file) != 0)
+    {
+        printf("Error opening stats file.\n");
+        return 1;
+    }
+    printf("Loaded %zu records from %s.\n", store.count, stats_file);
+
+    struct server server;
+    if (start_server(&server, stats_file, &store) != 0)
+    {
+        store_free(&store);
+        return 1;
+    }
+
+    ingest_set_observer(store_commit, &store);
+    int status = record_ports(ports, count, tag_devices, stats_file, policy);
+    ingest_set_observer(NULL, NULL);
+
+    stop_server(&server, stats_file);
+    store_free(&store);
+    return status;
+}
+
+int daemon_query(const char *stats_file, const char *query)
+{
+    struct sockaddr_un addr;
+    if (socket_address(stats_file, &addr) != 0)
+    {
+        printf("Error: Socket path for %s is too long.\n", stats_file);
+        return 1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        printf("Error: No daemon is running for %s.\n", stats_file);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return 1;
+    }
+
+    char line[DAEMON_QUERY_MAX];
+    int len = snprintf(line, sizeof(line), "%s\n", query);
+    if (len <= 0 || len >= (int)sizeof(line) || write_all(fd, line, (size_t)len) != 0)
+    {
+        printf("Error sending query.\n");
+        close(fd);
+        return 1;
+    }
+
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0 || (n < 0 && errno == EINTR))
+    {
+        if (n > 0)
+        {
+            fwrite(buffer, 1, (size_t)n, stdout);
+        }
+    }
+    close(fd);
+    return 0;
+}
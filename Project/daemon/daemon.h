@@ -0,0 +1,36 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "../writer/writer.h"
+
+// Appended to the stats file path to get the path of the daemon's socket
+#define DAEMON_SUFFIX ".sock"
+// Longest query line accepted by the daemon
+#define DAEMON_QUERY_MAX 128
+
+/**
+ * @brief Records like record_ports() and answers stats queries from memory
+ *
+ * The whole stats file is loaded once; queries sent with daemon_query() to
+ * the Unix socket "<stats_file>.sock" are answered from memory on a
+ * separate thread while recording goes on.
+ *
+ * @param ports Serial port device paths
+ * @param count Number of ports
+ * @param tag_devices 1 to append the device id to every record, 0 for plain records
+ * @param stats_file Path of the stats file
+ * @param policy When queued records are written to the stats file and synced
+ * @return int 0 after SIGINT or SIGTERM, 1 if the stats file or the socket cannot be opened
+ */
+int run_daemon(const char **ports, int count, int tag_devices, const char *stats_file, const writer_policy *policy);
+
+/**
+ * @brief Sends one query to the daemon of a stats file and prints the answer
+ *
+ * @param stats_file Path of the stats file the daemon records to
+ * @param query Query as accepted by store_query()
+ * @return int 0 on success, 1 if no daemon answers
+ */
+int daemon_query(const char *stats_file, const char *query);
+
+#endif /* DAEMON_H */
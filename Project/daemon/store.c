@@ -0,0 +1,637 @@
+/**
+ * @file store.c
+ * @brief In-memory copy of a stats log that answers queries without touching the disk
+ *
+ * The daemon loads the log once and then only adds the records the
+ * recorder writes, so a query costs a few binary searches and a pass over
+ * precomputed aggregates no matter how large the log is.
+ *
+ * Records are kept sorted by time. The recorder appends in time order, so
+ * a new record normally extends the last block; an older record (after a
+ * clock change) is inserted in place and the aggregates after it are
+ * recomputed.
+ *
+ * Answers are formatted exactly like the matching -stats commands. On a log
+ * that is not in time order the only difference is that the rows of a day
+ * are listed in time order.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "store.h"
+#include "../binlog/binlog.h"
+#include "../index/dayindex.h"
+
+#define K 10 // 10 grams per second
+
+/**
+ * Adds one duration to an aggregate.
+ */
+static void add_value(store_aggregate *a, double value)
+{
+    if (a->count == 0 || value < a->min)
+    {
+        a->min = value;
+    }
+    if (a->count == 0 || value > a->max)
+    {
+        a->max = value;
+    }
+    a->count++;
+    a->sum += value;
+}
+
+/**
+ * Adds one aggregate to another.
+ */
+static void merge(store_aggregate *a, const store_aggregate *b)
+{
+    if (b->count == 0)
+    {
+        return;
+    }
+    if (a->count == 0 || b->min < a->min)
+    {
+        a->min = b->min;
+    }
+    if (a->count == 0 || b->max > a->max)
+    {
+        a->max = b->max;
+    }
+    a->count += b->count;
+    a->sum += b->sum;
+}
+
+/**
+ * Makes room for one more record and its blocks.
+ */
+static int reserve(stats_store *store)
+{
+    if (store->count < store->capacity)
+    {
+        return 0;
+    }
+    size_t capacity = store->capacity ? store->capacity * 2 : 4096;
+    size_t blocks = capacity / STORE_BLOCK + 1;
+    size_t supers = blocks / STORE_SUPER + 1;
+
+    int64_t *timestamps = realloc(store->timestamps, capacity * sizeof(*timestamps));
+    if (timestamps == NULL)
+    {
+        return -1;
+    }
+    store->timestamps = timestamps;
+    float *durations = realloc(store->durations, capacity * sizeof(*durations));
+    if (durations == NULL)
+    {
+        return -1;
+    }
+    store->durations = durations;
+    store_aggregate *block = realloc(store->blocks, blocks * sizeof(*block));
+    if (block == NULL)
+    {
+        return -1;
+    }
+    store->blocks = block;
+    store_aggregate *super = realloc(store->supers, supers * sizeof(*super));
+    if (super == NULL)
+    {
+        return -1;
+    }
+    store->supers = super;
+    store->capacity = capacity;
+    return 0;
+}
+
+/**
+ * Recomputes the blocks and superblocks holding records from pos on.
+ */
+static void aggregate(stats_store *store, size_t pos)
+{
+    size_t blocks = (store->count + STORE_BLOCK - 1) / STORE_BLOCK;
+    for (size_t b = pos / STORE_BLOCK; b < blocks; b++)
+    {
+        store_aggregate a = { 0, 0, 0, 0 };
+        size_t end = (b + 1) * STORE_BLOCK < store->count ? (b + 1) * STORE_BLOCK : store->count;
+        for (size_t i = b * STORE_BLOCK; i < end; i++)
+        {
+            add_value(&a, store->durations[i]);
+        }
+        store->blocks[b] = a;
+    }
+
+    size_t supers = (blocks + STORE_SUPER - 1) / STORE_SUPER;
+    for (size_t s = pos / STORE_BLOCK / STORE_SUPER; s < supers; s++)
+    {
+        store_aggregate a = { 0, 0, 0, 0 };
+        size_t end = (s + 1) * STORE_SUPER < blocks ? (s + 1) * STORE_SUPER : blocks;
+        for (size_t b = s * STORE_SUPER; b < end; b++)
+        {
+            merge(&a, &store->blocks[b]);
+        }
+        store->supers[s] = a;
+    }
+}
+
+/**
+ * Recomputes the day runs from the record at pos on.
+ */
+static int index_days(stats_store *store, size_t pos)
+{
+    while (store->day_count > 0 && store->days[store->day_count - 1].first >= pos)
+    {
+        store->day_count--;
+    }
+
+    for (size_t i = pos; i < store->count; i++)
+    {
+        int32_t day = day_bucket(&store->bucketer, (time_t)store->timestamps[i]);
+        if (store->day_count > 0 && store->days[store->day_count - 1].day == day)
+        {
+            continue;
+        }
+        if (store->day_count == store->day_capacity)
+        {
+            size_t capacity = store->day_capacity ? store->day_capacity * 2 : 64;
+            store_day *days = realloc(store->days, capacity * sizeof(*days));
+            if (days == NULL)
+            {
+                return -1;
+            }
+            store->days = days;
+            store->day_capacity = capacity;
+        }
+        store_day run = { day, i };
+        store->days[store->day_count++] = run;
+    }
+    return 0;
+}
+
+/**
+ * Index of the first record at or after t.
+ */
+static size_t lower_bound(const stats_store *store, int64_t t)
+{
+    size_t lo = 0;
+    size_t hi = store->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (store->timestamps[mid] < t)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Index of the day run holding record i.
+ */
+static size_t day_of(const stats_store *store, size_t i)
+{
+    size_t lo = 0;
+    size_t hi = store->day_count;
+    while (hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (store->days[mid].first <= i)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Aggregate of the records lo..hi-1 from the precomputed blocks.
+ */
+static store_aggregate totals(const stats_store *store, size_t lo, size_t hi)
+{
+    const size_t span = (size_t)STORE_BLOCK * STORE_SUPER;
+    store_aggregate a = { 0, 0, 0, 0 };
+
+    while (lo < hi && lo % STORE_BLOCK != 0)
+    {
+        add_value(&a, store->durations[lo++]);
+    }
+    while (lo + STORE_BLOCK <= hi && lo % span != 0)
+    {
+        merge(&a, &store->blocks[lo / STORE_BLOCK]);
+        lo += STORE_BLOCK;
+    }
+    while (lo + span <= hi)
+    {
+        merge(&a, &store->supers[lo / span]);
+        lo += span;
+    }
+    while (lo + STORE_BLOCK <= hi)
+    {
+        merge(&a, &store->blocks[lo / STORE_BLOCK]);
+        lo += STORE_BLOCK;
+    }
+    while (lo < hi)
+    {
+        add_value(&a, store->durations[lo++]);
+    }
+    return a;
+}
+
+/**
+ * @brief Record of a log being loaded, for sorting
+ */
+struct loaded
+{
+    int64_t timestamp;
+    float duration;
+    size_t order;
+};
+
+/**
+ * Orders loaded records by time, keeping log order for equal times.
+ */
+static int compare_loaded(const void *a, const void *b)
+{
+    const struct loaded *x = a;
+    const struct loaded *y = b;
+    if (x->timestamp != y->timestamp)
+    {
+        return x->timestamp < y->timestamp ? -1 : 1;
+    }
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/**
+ * Sorts the records of a log that was not written in time order.
+ */
+static int sort_records(stats_store *store)
+{
+    struct loaded *records = malloc(store->count * sizeof(*records));
+    if (records == NULL)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < store->count; i++)
+    {
+        records[i].timestamp = store->timestamps[i];
+        records[i].duration = store->durations[i];
+        records[i].order = i;
+    }
+    qsort(records, store->count, sizeof(*records), compare_loaded);
+    for (size_t i = 0; i < store->count; i++)
+    {
+        store->timestamps[i] = records[i].timestamp;
+        store->durations[i] = records[i].duration;
+    }
+    free(records);
+    return 0;
+}
+
+/**
+ * log_scan() callback appending each record; aggregates are computed afterwards.
+ */
+static int add_loaded(int64_t offset, int64_t end, time_t timestamp, float duration, void *ctx)
+{
+    (void)offset;
+    (void)end;
+    stats_store *store = ctx;
+    if (reserve(store) != 0)
+    {
+        store->covered = -1;
+        return 1;
+    }
+    store->timestamps[store->count] = (int64_t)timestamp;
+    store->durations[store->count] = duration;
+    store->count++;
+    return 0;
+}
+
+int store_load(stats_store *store, const char *log_path)
+{
+    memset(store, 0, sizeof(*store));
+    day_bucketer_init(&store->bucketer);
+    for (int g = 0; g < ROLLUP_COUNT; g++)
+    {
+        store->rollups[g].fd = -1;
+    }
+    if (pthread_rwlock_init(&store->lock, NULL) != 0)
+    {
+        return -1;
+    }
+
+    if (snprintf(store->path, sizeof(store->path), "%s", log_path) >= (int)sizeof(store->path))
+    {
+        pthread_rwlock_destroy(&store->lock);
+        return -1;
+    }
+    int binary = binlog_detect(log_path);
+    store->binary = binary;
+    store->covered = binary ? (int64_t)sizeof(binlog_header) : 0;
+    int64_t covered = log_scan(log_path, binary, store->covered, add_loaded, store);
+    int sorted = 1;
+    for (size_t i = 1; i < store->count && sorted; i++)
+    {
+        sorted = store->timestamps[i - 1] <= store->timestamps[i];
+    }
+
+    // A failed allocation stops the scan early and marks it by clearing covered
+    int ok = covered >= 0 && store->covered >= 0 && (sorted || sort_records(store) == 0);
+    store->covered = covered;
+    store->sorted = sorted;
+    if (ok)
+    {
+        aggregate(store, 0);
+        ok = index_days(store, 0) == 0;
+    }
+    for (int g = 0; ok && g < ROLLUP_COUNT; g++)
+    {
+        ok = rollup_load(&store->rollups[g], log_path, (rollup_granularity)g, 0) == 0;
+    }
+    if (!ok)
+    {
+        store_free(store);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Adds one record written at offset. Returns -1 if there is no memory for it.
+ */
+static int insert_record(stats_store *store, int64_t offset, int64_t end, time_t timestamp, double duration)
+{
+    store->covered = end;
+    if (reserve(store) != 0)
+    {
+        return -1;
+    }
+
+    // Records are appended in time order unless the clock went back
+    size_t pos = store->count;
+    if (pos > 0 && store->timestamps[pos - 1] > (int64_t)timestamp)
+    {
+        store->sorted = 0;
+        pos = lower_bound(store, (int64_t)timestamp + 1);
+        memmove(&store->timestamps[pos + 1], &store->timestamps[pos], (store->count - pos) * sizeof(int64_t));
+        memmove(&store->durations[pos + 1], &store->durations[pos], (store->count - pos) * sizeof(float));
+    }
+    store->timestamps[pos] = (int64_t)timestamp;
+    store->durations[pos] = (float)duration;
+    store->count++;
+
+    aggregate(store, pos);
+    int failed = index_days(store, pos) != 0;
+    for (int g = 0; g < ROLLUP_COUNT; g++)
+    {
+        // The rollups were loaded after the records and may hold this one already
+        rollup_table *table = &store->rollups[g];
+        if (offset >= table->covered)
+        {
+            failed |= rollup_table_add(table, timestamp, duration) != 0;
+            table->covered = end;
+        }
+    }
+    return failed ? -1 : 0;
+}
+
+/**
+ * @brief Records written before the one being committed that the store missed
+ */
+struct missed
+{
+    stats_store *store;
+    int64_t limit;     // offset of the committed record
+    int failed;
+};
+
+/**
+ * log_scan() callback adding the records before the committed one.
+ */
+static int add_missed(int64_t offset, int64_t end, time_t timestamp, float duration, void *ctx)
+{
+    struct missed *m = ctx;
+    if (offset >= m->limit)
+    {
+        return 1;
+    }
+    m->failed |= insert_record(m->store, offset, end, timestamp, duration) != 0;
+    return 0;
+}
+
+void store_commit(int64_t offset, int64_t end, time_t timestamp, double duration, void *ctx)
+{
+    stats_store *store = ctx;
+
+    pthread_rwlock_wrlock(&store->lock);
+
+    // Records appended after the store was loaded and before the recorder opened the log,
+    // by an earlier recorder or another process, are read from the log first
+    int unread = 0;
+    int failed = 0;
+    if (offset > store->covered)
+    {
+        struct missed m = { store, offset, 0 };
+        unread = log_scan(store->path, store->binary, store->covered, add_missed, &m) < 0;
+        failed = m.failed;
+        store->covered = offset;
+    }
+    failed |= insert_record(store, offset, end, timestamp, duration) != 0;
+    pthread_rwlock_unlock(&store->lock);
+
+    if (unread)
+    {
+        printf("Error reading stats file, the daemon misses the records written before it started.\n");
+    }
+    if (failed)
+    {
+        printf("Out of memory, the daemon misses a record.\n");
+    }
+}
+
+/**
+ * Writes the records of one day and the all-time daily average, like print_day_stats().
+ */
+static void query_day(const stats_store *store, time_t t, const char *title, const char *label, FILE *out)
+{
+    time_t start, end;
+    day_bounds(t, &start, &end);
+    size_t lo = lower_bound(store, (int64_t)start);
+    size_t hi = lower_bound(store, (int64_t)end);
+
+    fprintf(out, "%s\n", title);
+    fprintf(out, "-----------------------\n");
+    fprintf(out, "%-11s|%11s\n", "Time", "Amount");
+    fprintf(out, "-----------------------\n");
+    for (size_t i = lo; i < hi; i++)
+    {
+        time_t time = (time_t)store->timestamps[i];
+        struct tm tm_info;
+        if (end - start == 86400)
+        {
+            // Without a DST change the time of day is the offset from midnight
+            int seconds = (int)(time - start);
+            tm_info.tm_hour = seconds / 3600;
+            tm_info.tm_min = seconds / 60 % 60;
+            tm_info.tm_sec = seconds % 60;
+        }
+        else if (!localtime_r(&time, &tm_info))
+        {
+            continue;
+        }
+        fprintf(out, "%02d:%02d:%02d   |%9.2f g\n", tm_info.tm_hour, tm_info.tm_min, tm_info.tm_sec,
+                store->durations[i] * K);
+    }
+
+    store_aggregate day = totals(store, lo, hi);
+    store_aggregate all = totals(store, 0, store->count);
+    fprintf(out, "-----------------------\n");
+    fprintf(out, "%s: %.2f g\n", label, day.sum * K);
+    // Records are in time order, so each day run is a distinct day, as -stats counts them
+    if (store->day_count > 0)
+    {
+        fprintf(out, "All-time average: %.2f g\n", (all.sum * K) / store->day_count);
+    }
+}
+
+/**
+ * Writes the statistics of [from, to), like print_range().
+ */
+static void query_range(const stats_store *store, time_t from, time_t to, FILE *out)
+{
+    size_t lo = lower_bound(store, (int64_t)from);
+    size_t hi = lower_bound(store, (int64_t)to);
+    if (hi < lo)
+    {
+        hi = lo;
+    }
+    store_aggregate range = totals(store, lo, hi);
+    size_t days = hi > lo ? day_of(store, hi - 1) - day_of(store, lo) + 1 : 0;
+
+    char fromstr[26];
+    char tostr[26];
+    struct tm tm_from, tm_to;
+    time_t last = to - 1;
+    localtime_r(&from, &tm_from);
+    localtime_r(&last, &tm_to);
+    strftime(fromstr, sizeof(fromstr), "%Y-%m-%d %H:%M:%S", &tm_from);
+    strftime(tostr, sizeof(tostr), "%Y-%m-%d %H:%M:%S", &tm_to);
+
+    fprintf(out, "Logs from %s to %s\n", fromstr, tostr);
+    if (!store->sorted)
+    {
+        fprintf(out, "(log is not in time order, all records were read)\n");
+    }
+    fprintf(out, "-----------------------\n");
+    fprintf(out, "Records: %zu\n", range.count);
+    fprintf(out, "Days: %zu\n", days);
+    fprintf(out, "Total: %.2f g\n", range.sum * K);
+    if (days > 0)
+    {
+        fprintf(out, "Daily average: %.2f g\n", range.sum * K / days);
+        fprintf(out, "Min / max: %.2f g / %.2f g\n", range.min * K, range.max * K);
+    }
+}
+
+/**
+ * Writes the last buckets of one rollup table, like print_rollup().
+ */
+static void query_rollup(const stats_store *store, rollup_granularity granularity, int last, FILE *out)
+{
+    static const char *titles[ROLLUP_COUNT] = { "Hourly", "Daily", "Weekly", "Monthly" };
+    static const char *formats[ROLLUP_COUNT] = { "%Y-%m-%d %H:00", "%Y-%m-%d", "%Y-%m-%d", "%Y-%m" };
+
+    const rollup_table *table = &store->rollups[granularity];
+    size_t first = last > 0 && table->count > (size_t)last ? table->count - (size_t)last : 0;
+
+    fprintf(out, "%s rollup\n", titles[granularity]);
+    fprintf(out, "-----------------------------------------------------------------\n");
+    fprintf(out, "%-17s|%6s|%11s|%11s|%8s|%8s\n", "Start", "Count", "Total", "Amount", "Min", "Max");
+    fprintf(out, "-----------------------------------------------------------------\n");
+    for (size_t i = first; i < table->count; i++)
+    {
+        const rollup_bucket *b = &table->buckets[i];
+        char timestr[26];
+        time_t start = (time_t)b->start;
+        struct tm tm_start;
+        if (!localtime_r(&start, &tm_start))
+        {
+            continue;
+        }
+        strftime(timestr, sizeof(timestr), formats[granularity], &tm_start);
+        fprintf(out, "%-17s|%6u|%9.2f s|%9.2f g|%6.2f s|%6.2f s\n",
+                timestr, b->count, b->sum, b->sum * K, b->min, b->max);
+    }
+    fprintf(out, "-----------------------------------------------------------------\n");
+}
+
+int store_query(stats_store *store, const char *query, FILE *out)
+{
+    int day;
+    long long from, to;
+    char name[16];
+    int last;
+    int status = 0;
+
+    pthread_rwlock_rdlock(&store->lock);
+    if (strcmp(query, "today") == 0)
+    {
+        query_day(store, time(NULL), "Today's logs", "Today's total", out);
+    }
+    else if (sscanf(query, "day %d", &day) == 1)
+    {
+        // Noon is inside the day even where midnight is skipped by a DST change
+        struct tm tm_day;
+        memset(&tm_day, 0, sizeof(tm_day));
+        tm_day.tm_year = day / 10000 - 1900;
+        tm_day.tm_mon = day / 100 % 100 - 1;
+        tm_day.tm_mday = day % 100;
+        tm_day.tm_hour = 12;
+        tm_day.tm_isdst = -1;
+
+        char title[32];
+        snprintf(title, sizeof(title), "Logs of %04d-%02d-%02d", day / 10000, day / 100 % 100, day % 100);
+        query_day(store, mktime(&tm_day), title, "Day total", out);
+    }
+    else if (sscanf(query, "range %lld %lld", &from, &to) == 2)
+    {
+        query_range(store, (time_t)from, (time_t)to, out);
+    }
+    else if (sscanf(query, "rollup %15s %d", name, &last) == 2)
+    {
+        rollup_granularity granularity;
+        status = rollup_parse(name, &granularity);
+        if (status == 0)
+        {
+            query_rollup(store, granularity, last, out);
+        }
+    }
+    else
+    {
+        status = -1;
+    }
+    pthread_rwlock_unlock(&store->lock);
+    return status;
+}
+
+void store_free(stats_store *store)
+{
+    free(store->timestamps);
+    free(store->durations);
+    free(store->blocks);
+    free(store->supers);
+    free(store->days);
+    for (int g = 0; g < ROLLUP_COUNT; g++)
+    {
+        rollup_free(&store->rollups[g]);
+    }
+    pthread_rwlock_destroy(&store->lock);
+    memset(store, 0, sizeof(*store));
+}
@@ -0,0 +1,108 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include "../daybucket/daybucket.h"
+#include "../rollup/rollup.h"
+
+// Records per block of precomputed aggregates
+#define STORE_BLOCK 64
+// Blocks per superblock
+#define STORE_SUPER 64
+
+/**
+ * @brief Count, sum, min and max of a run of records
+ */
+typedef struct store_aggregate {
+    size_t count;
+    double sum;
+    double min;
+    double max;
+} store_aggregate;
+
+/**
+ * @brief First record of a run of same-day records
+ */
+typedef struct store_day {
+    int32_t day;
+    size_t first;
+} store_day;
+
+/**
+ * @brief Every record of a log kept in memory, in time order, with aggregates
+ *
+ * Blocks of STORE_BLOCK records and superblocks of STORE_SUPER blocks carry
+ * their count, sum, min and max, so the totals of any time range need at
+ * most two partial blocks, two partial superblocks and one pass over the
+ * superblocks. The rollup tables are kept in memory as well.
+ *
+ * Every access goes through the lock: queries take it for reading and
+ * store_commit() for writing.
+ */
+typedef struct stats_store {
+    pthread_rwlock_t lock;
+    char path[512];
+    int binary;
+    int64_t *timestamps;
+    float *durations;
+    size_t count;
+    size_t capacity;
+    store_aggregate *blocks;
+    store_aggregate *supers;
+    store_day *days;
+    size_t day_count;     // distinct days, since the records are in time order
+    size_t day_capacity;
+    day_bucketer bucketer;
+    rollup_table rollups[ROLLUP_COUNT];
+    int64_t covered;   // log offset up to which records are in the store
+    int sorted;        // whether every record was appended in time order, as the day index records it
+} stats_store;
+
+/**
+ * @brief Loads every record of a log and its rollups into memory
+ *
+ * @param store Store to fill
+ * @param log_path Path of the CSV stats file or binary log
+ * @return int 0 on success, -1 if the log cannot be read
+ */
+int store_load(stats_store *store, const char *log_path);
+
+/**
+ * @brief Adds a record the recorder just wrote; matches writer_commit_fn
+ *
+ * Records before offset that the store has not seen, written after it was
+ * loaded, are read from the log first.
+ *
+ * @param offset Byte offset of the record in the log
+ * @param end Byte offset just after the record
+ * @param timestamp Timestamp of the record
+ * @param duration Duration of the record in seconds
+ * @param ctx The stats_store
+ */
+void store_commit(int64_t offset, int64_t end, time_t timestamp, double duration, void *ctx);
+
+/**
+ * @brief Answers one query, writing the same text the -stats commands print
+ *
+ * Queries are "today", "day YYYYMMDD", "range FROM TO" (Unix timestamps,
+ * TO exclusive) and "rollup hour|day|week|month N".
+ *
+ * @param store Loaded store
+ * @param query Query to answer
+ * @param out Where the answer is written
+ * @return int 0 on success, -1 if the query is invalid
+ */
+int store_query(stats_store *store, const char *query, FILE *out);
+
+/**
+ * @brief Releases a store
+ *
+ * @param store Store to release
+ */
+void store_free(stats_store *store);
+
+#endif /* STORE_H */
@@ -0,0 +1,124 @@
+/**
+ * @file daybucket.c
+ * @brief Local-day bucketing of timestamps for the stats readers
+ *
+ * The stats path used to call localtime() for every record, once or twice,
+ * which made glibc's time zone handling the most expensive part of reading
+ * the log. Records arrive in time order, so consecutive records nearly
+ * always share a day: day_bucket() resolves the local-midnight bounds of a
+ * day once and then answers from them with two integer comparisons.
+ *
+ * Only the reentrant localtime_r() and mktime() are used, and all state
+ * lives in the caller's day_bucketer, so the functions are thread-safe.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "daybucket.h"
+
+int32_t day_bounds(time_t t, time_t *start, time_t *end)
+{
+    struct tm tm_day;
+    // Years past 214747 do not fit a YYYYMMDD key
+    if (localtime_r(&t, &tm_day) == NULL || tm_day.tm_year > 214747 - 1900 || tm_day.tm_year < -214747 - 1900)
+    {
+        // An empty interval, so the next lookup tries again
+        *start = 0;
+        *end = 0;
+        return -1;
+    }
+
+    int32_t key = (tm_day.tm_year + 1900) * 10000 + (tm_day.tm_mon + 1) * 100 + tm_day.tm_mday;
+
+    tm_day.tm_sec = 0;
+    tm_day.tm_min = 0;
+    tm_day.tm_hour = 0;
+    tm_day.tm_isdst = -1;
+    struct tm tm_next = tm_day;
+    tm_next.tm_mday += 1;
+
+    *start = mktime(&tm_day);
+    *end = mktime(&tm_next);
+
+    // mktime() can fail far outside the supported range; fall back to this second only
+    if (*start == (time_t)-1 || *end == (time_t)-1 || t < *start || t >= *end)
+    {
+        *start = t;
+        *end = t + 1;
+    }
+    return key;
+}
+
+void day_bucketer_init(day_bucketer *bucketer)
+{
+    memset(bucketer, 0, sizeof(*bucketer));
+    bucketer->key = -1;
+}
+
+void day_bucketer_at(day_bucketer *bucketer, time_t t)
+{
+    bucketer->key = day_bounds(t, &bucketer->start, &bucketer->end);
+}
+
+int32_t day_key(time_t t)
+{
+    time_t start, end;
+    return day_bounds(t, &start, &end);
+}
+
+void day_set_init(day_set *set)
+{
+    memset(set, 0, sizeof(*set));
+    set->last = -1;
+}
+
+void day_set_add(day_set *set, int32_t day)
+{
+    if (day < 0 || day == set->last)
+    {
+        return;
+    }
+    set->last = day;
+
+    size_t lo = 0;
+    size_t hi = set->stored;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (set->days[mid] < day)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    if (lo < set->stored && set->days[lo] == day)
+    {
+        return;
+    }
+
+    set->count++;
+    if (set->stored == set->capacity)
+    {
+        size_t capacity = set->capacity ? set->capacity * 2 : 64;
+        int32_t *grown = realloc(set->days, capacity * sizeof(*grown));
+        if (grown == NULL)
+        {
+            // Without room the day is still counted, only not remembered
+            return;
+        }
+        set->days = grown;
+        set->capacity = capacity;
+    }
+    memmove(&set->days[lo + 1], &set->days[lo], (set->stored - lo) * sizeof(*set->days));
+    set->days[lo] = day;
+    set->stored++;
+}
+
+void day_set_free(day_set *set)
+{
+    free(set->days);
+    set->days = NULL;
+    set->stored = set->capacity = 0;
+}
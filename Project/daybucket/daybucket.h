@@ -0,0 +1,125 @@
+#ifndef DAYBUCKET_H
+#define DAYBUCKET_H
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @brief Cached local day used to bucket timestamps with integer comparisons
+ *
+ * Holds the [start, end) interval of the last day that was resolved. As long
+ * as timestamps fall inside it, finding their day costs two comparisons;
+ * only when a timestamp leaves the interval is the local calendar consulted
+ * again. Each bucketer belongs to one caller, so separate threads can use
+ * their own bucketers at the same time.
+ */
+typedef struct day_bucketer {
+    time_t start;
+    time_t end;
+    int32_t key;
+} day_bucketer;
+
+/**
+ * @brief Resolves the local day containing a timestamp
+ *
+ * The bounds are local midnights, found with mktime() so days of 23 or 25
+ * hours around DST changes are handled.
+ *
+ * @param t Timestamp
+ * @param start Set to the first second of the day
+ * @param end Set to the first second of the next day
+ * @return int32_t Day key YYYYMMDD, or -1 if the time cannot be converted
+ */
+int32_t day_bounds(time_t t, time_t *start, time_t *end);
+
+/**
+ * @brief Prepares a bucketer with no day resolved yet
+ *
+ * @param bucketer Bucketer to initialize
+ */
+void day_bucketer_init(day_bucketer *bucketer);
+
+/**
+ * @brief Prepares a bucketer for the day containing t
+ *
+ * @param bucketer Bucketer to initialize
+ * @param t Timestamp whose day is resolved right away
+ */
+void day_bucketer_at(day_bucketer *bucketer, time_t t);
+
+/**
+ * @brief Local day of a timestamp as YYYYMMDD
+ *
+ * @param bucketer Bucketer owned by the caller
+ * @param t Timestamp
+ * @return int32_t Day key, or -1 if the time cannot be converted
+ */
+static inline int32_t day_bucket(day_bucketer *bucketer, time_t t)
+{
+    if (t >= bucketer->start && t < bucketer->end)
+    {
+        return bucketer->key;
+    }
+    bucketer->key = day_bounds(t, &bucketer->start, &bucketer->end);
+    return bucketer->key;
+}
+
+/**
+ * @brief Checks whether a timestamp is in the day held by a bucketer
+ *
+ * @param bucketer Bucketer prepared with day_bucketer_at()
+ * @param t Timestamp
+ * @return int 1 if t is in that day, 0 otherwise
+ */
+static inline int day_contains(const day_bucketer *bucketer, time_t t)
+{
+    return t >= bucketer->start && t < bucketer->end;
+}
+
+/**
+ * @brief Local calendar day of a timestamp as YYYYMMDD, without caching
+ *
+ * @param t Unix timestamp
+ * @return int32_t Day key, or -1 if the time cannot be converted
+ */
+int32_t day_key(time_t t);
+
+/**
+ * @brief Distinct local days seen, for averages over logs that are not in time order
+ *
+ * Logs merged from several hosts come back to a day after other days, so
+ * counting day changes would count such a day several times. The days are
+ * kept sorted; a record of the same day as the one before costs a single
+ * comparison.
+ */
+typedef struct day_set {
+    int32_t *days;       // the days remembered, sorted
+    size_t stored;
+    size_t capacity;
+    size_t count;        // distinct days added, also those there was no memory to remember
+    int32_t last;
+} day_set;
+
+/**
+ * @brief Prepares an empty day set
+ *
+ * @param set Set to initialize
+ */
+void day_set_init(day_set *set);
+
+/**
+ * @brief Adds a day to a set unless it is in it already
+ *
+ * @param set Set from day_set_init()
+ * @param day Day key, ignored if negative
+ */
+void day_set_add(day_set *set, int32_t day);
+
+/**
+ * @brief Releases the memory of a day set
+ *
+ * @param set Set to release
+ */
+void day_set_free(day_set *set);
+
+#endif /* DAYBUCKET_H */
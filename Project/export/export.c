@@ -0,0 +1,282 @@
+/**
+ * @file export.c
+ * @brief Columnar export of a stats log for analysis tools
+ *
+ * Parsing "timestamp,duration" text is most of the time an analysis of a
+ * large log spends. The export holds the same records as typed columns, so
+ * a reader maps each column chunk as an array (numpy.frombuffer() with an
+ * offset, for instance) instead of parsing it.
+ *
+ * Records are buffered until the local day changes or EXPORT_GROUP_ROWS
+ * rows are buffered, and then written as one row group: each column as a
+ * contiguous chunk, aligned to 8 bytes, with its min/max. The row group
+ * directory is written at the end, where the trailer points to it, so the
+ * log is read once and only the directory, one entry per day, is kept
+ * until the end. In a log merged from several hosts out of order a day can
+ * have several row groups; readers select groups by their day or by the
+ * min/max of the timestamp column, which hold either way.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "export.h"
+#include "../binlog/binlog.h"
+#include "../index/dayindex.h"
+#include "../stats/stats.h"
+
+// Output buffer, about two column chunks of a full row group
+#define EXPORT_BUFFER (1 << 20)
+
+static const export_column columns[EXPORT_COLUMNS] = {
+    { "timestamp", EXPORT_INT64, 8, { 0 }, "s" },
+    { "duration", EXPORT_FLOAT32, 4, { 0 }, "s" },
+    { "grams", EXPORT_FLOAT64, 8, { 0 }, "g" },
+    { "device", EXPORT_UINT32, 4, { 0 }, "" },
+};
+
+struct exporter
+{
+    FILE *file;
+    uint64_t position;
+    day_bucketer bucketer;
+    int32_t day;
+    size_t rows;             // rows buffered for the current group
+    int64_t *timestamps;
+    float *durations;
+    double *grams;
+    uint32_t *devices;
+    export_group *groups;
+    size_t group_count;
+    size_t group_capacity;
+    uint64_t total;
+    int failed;
+};
+
+/**
+ * Writes bytes at the current position of the export.
+ */
+static int put(struct exporter *e, const void *data, size_t len)
+{
+    if (len > 0 && fwrite(data, 1, len, e->file) != len)
+    {
+        e->failed = 1;
+        return -1;
+    }
+    e->position += len;
+    return 0;
+}
+
+/**
+ * Writes one column chunk of the buffered rows, starting on a multiple of 8.
+ */
+static int put_chunk(struct exporter *e, const void *values, size_t width, export_chunk *chunk)
+{
+    static const uint8_t zeros[8];
+    if (put(e, zeros, (size_t)(-e->position & 7)) != 0)
+    {
+        return -1;
+    }
+    chunk->offset = e->position;
+    chunk->length = e->rows * width;
+    return put(e, values, e->rows * width);
+}
+
+/**
+ * Writes the buffered rows as one row group and adds it to the directory.
+ */
+static int flush_group(struct exporter *e)
+{
+    if (e->rows == 0)
+    {
+        return 0;
+    }
+    if (e->group_count == e->group_capacity)
+    {
+        size_t capacity = e->group_capacity ? e->group_capacity * 2 : 1024;
+        export_group *grown = realloc(e->groups, capacity * sizeof(*grown));
+        if (grown == NULL)
+        {
+            e->failed = 1;
+            return -1;
+        }
+        e->groups = grown;
+        e->group_capacity = capacity;
+    }
+
+    export_group *group = &e->groups[e->group_count];
+    memset(group, 0, sizeof(*group));
+    group->day = e->day;
+    group->rows = (uint32_t)e->rows;
+
+    export_chunk *c = group->chunks;
+    c[0].min.i = c[0].max.i = e->timestamps[0];
+    c[1].min.f = c[1].max.f = e->durations[0];
+    c[2].min.f = c[2].max.f = e->grams[0];
+    c[3].min.u = c[3].max.u = e->devices[0];
+    for (size_t i = 1; i < e->rows; i++)
+    {
+        c[0].min.i = e->timestamps[i] < c[0].min.i ? e->timestamps[i] : c[0].min.i;
+        c[0].max.i = e->timestamps[i] > c[0].max.i ? e->timestamps[i] : c[0].max.i;
+        c[1].min.f = e->durations[i] < c[1].min.f ? e->durations[i] : c[1].min.f;
+        c[1].max.f = e->durations[i] > c[1].max.f ? e->durations[i] : c[1].max.f;
+        c[2].min.f = e->grams[i] < c[2].min.f ? e->grams[i] : c[2].min.f;
+        c[2].max.f = e->grams[i] > c[2].max.f ? e->grams[i] : c[2].max.f;
+        c[3].min.u = e->devices[i] < c[3].min.u ? e->devices[i] : c[3].min.u;
+        c[3].max.u = e->devices[i] > c[3].max.u ? e->devices[i] : c[3].max.u;
+    }
+
+    if (put_chunk(e, e->timestamps, sizeof(*e->timestamps), &c[0]) != 0 ||
+        put_chunk(e, e->durations, sizeof(*e->durations), &c[1]) != 0 ||
+        put_chunk(e, e->grams, sizeof(*e->grams), &c[2]) != 0 ||
+        put_chunk(e, e->devices, sizeof(*e->devices), &c[3]) != 0)
+    {
+        return -1;
+    }
+    e->group_count++;
+    e->total += e->rows;
+    e->rows = 0;
+    return 0;
+}
+
+/**
+ * log_scan_records() callback buffering each record in the row group of its day.
+ */
+static int add_record(int64_t offset, int64_t end, const binlog_record *record, void *ctx)
+{
+    (void)offset;
+    (void)end;
+    struct exporter *e = ctx;
+
+    int32_t day = day_bucket(&e->bucketer, (time_t)record->timestamp);
+    if (e->rows > 0 && (day != e->day || e->rows == EXPORT_GROUP_ROWS))
+    {
+        if (flush_group(e) != 0)
+        {
+            return 1;
+        }
+    }
+    e->day = day;
+    e->timestamps[e->rows] = record->timestamp;
+    e->durations[e->rows] = record->duration;
+    e->grams[e->rows] = (double)record->duration * K;
+    e->devices[e->rows] = record->device;
+    e->rows++;
+    return 0;
+}
+
+/**
+ * Writes the column descriptions, the row group directory and the trailer.
+ */
+static int put_footer(struct exporter *e)
+{
+    export_trailer trailer;
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.footer = e->position;
+    trailer.groups = e->group_count;
+    trailer.rows = e->total;
+    memcpy(trailer.magic, EXPORT_MAGIC, sizeof(EXPORT_MAGIC));
+
+    if (put(e, columns, sizeof(columns)) != 0 || put(e, e->groups, e->group_count * sizeof(*e->groups)) != 0)
+    {
+        return -1;
+    }
+    return put(e, &trailer, sizeof(trailer));
+}
+
+int export_log(const char *log_path, const char *output)
+{
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    char tmp[600];
+    if (snprintf(tmp, sizeof(tmp), "%s.export", output) >= (int)sizeof(tmp))
+    {
+        printf("Error: Export path is too long.\n");
+        return 1;
+    }
+
+    struct exporter e;
+    memset(&e, 0, sizeof(e));
+    day_bucketer_init(&e.bucketer);
+    e.timestamps = malloc(EXPORT_GROUP_ROWS * sizeof(*e.timestamps));
+    e.durations = malloc(EXPORT_GROUP_ROWS * sizeof(*e.durations));
+    e.grams = malloc(EXPORT_GROUP_ROWS * sizeof(*e.grams));
+    e.devices = malloc(EXPORT_GROUP_ROWS * sizeof(*e.devices));
+    if (e.timestamps == NULL || e.durations == NULL || e.grams == NULL || e.devices == NULL)
+    {
+        printf("Out of memory.\n");
+        free(e.timestamps);
+        free(e.durations);
+        free(e.grams);
+        free(e.devices);
+        return 1;
+    }
+
+    e.file = fopen(tmp, "wb");
+    if (e.file == NULL)
+    {
+        printf("Error creating %s: %s\n", tmp, strerror(errno));
+        free(e.timestamps);
+        free(e.durations);
+        free(e.grams);
+        free(e.devices);
+        return 1;
+    }
+    setvbuf(e.file, NULL, _IOFBF, EXPORT_BUFFER);
+
+    export_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, EXPORT_MAGIC, sizeof(EXPORT_MAGIC));
+    header.bom = EXPORT_BOM;
+    header.version = EXPORT_VERSION;
+    header.columns = EXPORT_COLUMNS;
+    put(&e, &header, sizeof(header));
+
+    int binary = binlog_detect(log_path);
+    int64_t read = log_scan_records(log_path, binary, binary ? (int64_t)sizeof(binlog_header) : 0, add_record, &e);
+    int status = 0;
+    if (read < 0)
+    {
+        printf("Error opening stats file.\n");
+        status = 1;
+    }
+    else if (e.failed || flush_group(&e) != 0 || put_footer(&e) != 0 || fflush(e.file) != 0 ||
+             fsync(fileno(e.file)) != 0)
+    {
+        printf("Error writing %s: %s\n", tmp, strerror(errno));
+        status = 1;
+    }
+    if (fclose(e.file) != 0 && status == 0)
+    {
+        printf("Error writing %s: %s\n", tmp, strerror(errno));
+        status = 1;
+    }
+    if (status == 0 && rename(tmp, output) != 0)
+    {
+        printf("Error writing %s: %s\n", output, strerror(errno));
+        status = 1;
+    }
+    if (status != 0)
+    {
+        unlink(tmp);
+    }
+    free(e.timestamps);
+    free(e.durations);
+    free(e.grams);
+    free(e.devices);
+    free(e.groups);
+    if (status != 0)
+    {
+        return 1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    printf("Exported %llu records in %zu row groups to %s (%.1f MB) in %.1f s.\n", (unsigned long long)e.total,
+           e.group_count, output, (double)e.position / (1 << 20),
+           (double)(now.tv_sec - started.tv_sec) + (double)(now.tv_nsec - started.tv_nsec) / 1e9);
+    return 0;
+}
@@ -0,0 +1,112 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <stdint.h>
+
+// First bytes of every export file, and of its trailer
+#define EXPORT_MAGIC "FEEDCOL"
+#define EXPORT_VERSION 1
+// Byte order mark, read back as something else on a host of the other endianness
+#define EXPORT_BOM 0x01020304u
+// Columns of every export: timestamp, duration, grams, device
+#define EXPORT_COLUMNS 4
+// Most rows in one row group; a day with more records spans several groups
+#define EXPORT_GROUP_ROWS 65536
+
+/**
+ * @brief Type of the values of a column
+ */
+enum export_type {
+    EXPORT_INT64 = 1,
+    EXPORT_UINT32 = 2,
+    EXPORT_FLOAT32 = 3,
+    EXPORT_FLOAT64 = 4
+};
+
+/**
+ * @brief Header at the start of an export file (32 bytes)
+ *
+ * It is followed by the row groups, then the column descriptions, then one
+ * export_group per row group and finally an export_trailer. Every value is
+ * stored in the byte order of the host that wrote the file.
+ */
+typedef struct export_header {
+    char magic[8];
+    uint32_t bom;
+    uint16_t version;
+    uint16_t columns;
+    uint8_t reserved[16];
+} export_header;
+
+/**
+ * @brief Description of one column (32 bytes)
+ */
+typedef struct export_column {
+    char name[16];         // "timestamp", "duration", "grams" or "device"
+    uint8_t type;          // enum export_type
+    uint8_t width;         // bytes per value
+    uint8_t reserved[6];
+    char unit[8];          // "s" (Unix seconds for timestamp), "g", or empty
+} export_column;
+
+/**
+ * @brief Smallest or largest value of a column chunk
+ *
+ * i holds INT64 values, u UINT32 values and f FLOAT32 and FLOAT64 values.
+ */
+typedef union export_value {
+    int64_t i;
+    uint64_t u;
+    double f;
+} export_value;
+
+/**
+ * @brief Values of one column in one row group (32 bytes)
+ *
+ * The values are a plain array of rows * width bytes starting at offset,
+ * which is a multiple of 8, so the chunk can be mapped and used in place.
+ */
+typedef struct export_chunk {
+    uint64_t offset;
+    uint64_t length;
+    export_value min;
+    export_value max;
+} export_chunk;
+
+/**
+ * @brief Row group: consecutive records of one local day (144 bytes)
+ */
+typedef struct export_group {
+    int32_t day;           // local day as YYYYMMDD
+    uint32_t rows;
+    uint8_t reserved[8];
+    export_chunk chunks[EXPORT_COLUMNS];
+} export_group;
+
+/**
+ * @brief Last 32 bytes of an export file
+ */
+typedef struct export_trailer {
+    uint64_t footer;       // offset of the column descriptions
+    uint64_t groups;
+    uint64_t rows;
+    char magic[8];
+} export_trailer;
+
+/**
+ * @brief Writes the records of a stats log to a columnar export file
+ *
+ * The log is read once, sealed segments included, and records are written
+ * as they come in row groups of one local day, so memory use does not grow
+ * with the size of the log. Readers find the row groups and their min/max
+ * statistics from the trailer and only read the groups they need.
+ *
+ * The file is written next to its final path and renamed over it.
+ *
+ * @param log_path Path of the stats log (CSV or binary)
+ * @param output Path of the export file; replaced if it exists
+ * @return int 0 on success, 1 if the log cannot be read or the export cannot be written
+ */
+int export_log(const char *log_path, const char *output);
+
+#endif /* EXPORT_H */
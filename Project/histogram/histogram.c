@@ -0,0 +1,484 @@
+/**
+ * @file histogram.c
+ * @brief Duration percentiles per day and for all time, maintained while recording
+ *
+ * A sum and an average hide outliers such as the huge durations the
+ * firmware reports when its start time is stale. Percentiles show them, but
+ * computing one exactly needs every duration. A log-linear histogram needs
+ * a fixed 1880 bytes instead and gives every percentile within about 6%,
+ * and histograms of chunks, devices or days merge by adding buckets.
+ *
+ * The sidecar "<log>.hist" uses the layout of the rollup tables:
+ *
+ * - a header holding the covered log offset, the number of days, the
+ *   all-time histogram and the newest day, which is the one that changes
+ *   while recording
+ * - the older, sealed days in day order
+ *
+ * Appending a record in time order therefore costs one pwrite() of the
+ * header. A record of an older day updates that day in place, and one that
+ * needs a new day in the middle makes the whole file be rewritten.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "histogram.h"
+#include "../binlog/binlog.h"
+#include "../index/dayindex.h"
+#include "../segment/segment.h"
+
+#define SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+/**
+ * @brief On-disk header of the histogram sidecar
+ */
+struct histogram_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t buckets;
+    int64_t covered;
+    uint64_t count;
+    duration_histogram all;
+    day_histogram open;
+};
+
+/**
+ * Bucket holding a duration of ms milliseconds.
+ */
+static size_t bucket_of(uint64_t ms)
+{
+    if (ms < SUB_BUCKETS)
+    {
+        return (size_t)ms;
+    }
+    if (ms >> HISTOGRAM_MAX_BITS)
+    {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    int exponent = 63 - __builtin_clzll(ms);
+    size_t sub = (size_t)(ms >> (exponent - HISTOGRAM_SUB_BITS)) & (SUB_BUCKETS - 1);
+    return SUB_BUCKETS + (size_t)(exponent - HISTOGRAM_SUB_BITS) * SUB_BUCKETS + sub;
+}
+
+/**
+ * Smallest duration in milliseconds that falls into a bucket, and the bucket width.
+ */
+static uint64_t bucket_start(size_t bucket, uint64_t *width)
+{
+    if (bucket < SUB_BUCKETS)
+    {
+        *width = 1;
+        return bucket;
+    }
+    int shift = (int)((bucket - SUB_BUCKETS) / SUB_BUCKETS);
+    uint64_t sub = (bucket - SUB_BUCKETS) % SUB_BUCKETS;
+    *width = 1ull << shift;
+    return (SUB_BUCKETS + sub) << shift;
+}
+
+void histogram_init(duration_histogram *hist)
+{
+    memset(hist, 0, sizeof(*hist));
+}
+
+void histogram_add(duration_histogram *hist, double duration)
+{
+    // Negative durations come from a clock going back and count as 0
+    double ms = duration > 0 ? duration * 1000.0 + 0.5 : 0;
+    uint64_t rounded = ms < 18446744073709549568.0 ? (uint64_t)ms : UINT64_MAX;
+
+    if (hist->count == 0 || duration < hist->min)
+    {
+        hist->min = (float)duration;
+    }
+    if (hist->count == 0 || duration > hist->max)
+    {
+        hist->max = (float)duration;
+    }
+    hist->count++;
+    hist->sum += duration;
+    hist->buckets[bucket_of(rounded)]++;
+}
+
+void histogram_merge(duration_histogram *into, const duration_histogram *from)
+{
+    if (from->count == 0)
+    {
+        return;
+    }
+    if (into->count == 0 || from->min < into->min)
+    {
+        into->min = from->min;
+    }
+    if (into->count == 0 || from->max > into->max)
+    {
+        into->max = from->max;
+    }
+    into->count += from->count;
+    into->sum += from->sum;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        into->buckets[i] += from->buckets[i];
+    }
+}
+
+double histogram_percentile(const duration_histogram *hist, double q)
+{
+    if (hist->count == 0)
+    {
+        return 0;
+    }
+    if (q >= 1)
+    {
+        return hist->max;
+    }
+
+    // Rank of the wanted duration, from 1
+    uint64_t rank = (uint64_t)(q * (double)hist->count);
+    if ((double)rank < q * (double)hist->count || rank == 0)
+    {
+        rank++;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += hist->buckets[i];
+        if (seen >= rank)
+        {
+            // The middle of the bucket, but never outside what was seen
+            uint64_t width;
+            double value = ((double)bucket_start(i, &width) + (double)(width - 1) / 2) / 1000.0;
+            if (value < hist->min)
+            {
+                value = hist->min;
+            }
+            if (value > hist->max)
+            {
+                value = hist->max;
+            }
+            return value;
+        }
+    }
+    return hist->max;
+}
+
+/**
+ * Index of the histogram of a day, or of where it would be inserted.
+ */
+static size_t find_day(const histogram_set *set, int32_t day)
+{
+    // Records usually belong to the newest day
+    if (set->count > 0 && set->days[set->count - 1].day <= day)
+    {
+        return set->days[set->count - 1].day == day ? set->count - 1 : set->count;
+    }
+
+    size_t lo = 0;
+    size_t hi = set->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (set->days[mid].day < day)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+enum {
+    CHANGED_DAY,
+    CHANGED_APPENDED,
+    CHANGED_INSERTED
+};
+
+/**
+ * Adds a record to the in-memory histograms and says what changed.
+ *
+ * pos is set to the index of the day that was updated or created.
+ */
+static int add_memory(histogram_set *set, time_t timestamp, double duration, size_t *pos)
+{
+    int32_t day = day_bucket(&set->bucketer, timestamp);
+    size_t i = find_day(set, day);
+    *pos = i;
+
+    if (i < set->count && set->days[i].day == day)
+    {
+        histogram_add(&set->all, duration);
+        histogram_add(&set->days[i].hist, duration);
+        return CHANGED_DAY;
+    }
+
+    if (set->count == set->capacity)
+    {
+        size_t capacity = set->capacity ? set->capacity * 2 : 64;
+        day_histogram *days = realloc(set->days, capacity * sizeof(*days));
+        if (days == NULL)
+        {
+            return -1;
+        }
+        set->days = days;
+        set->capacity = capacity;
+    }
+    memmove(&set->days[i + 1], &set->days[i], (set->count - i) * sizeof(day_histogram));
+    memset(&set->days[i], 0, sizeof(day_histogram));
+    set->days[i].day = day;
+    histogram_add(&set->all, duration);
+    histogram_add(&set->days[i].hist, duration);
+    set->count++;
+    return i == set->count - 1 ? CHANGED_APPENDED : CHANGED_INSERTED;
+}
+
+/**
+ * Fills the on-disk header from the in-memory histograms.
+ */
+static void fill_header(const histogram_set *set, struct histogram_header *header)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, HISTOGRAM_MAGIC, sizeof(HISTOGRAM_MAGIC));
+    header->version = HISTOGRAM_VERSION;
+    header->buckets = HISTOGRAM_BUCKETS;
+    header->covered = set->covered;
+    header->count = set->count;
+    header->all = set->all;
+    if (set->count > 0)
+    {
+        header->open = set->days[set->count - 1];
+    }
+}
+
+/**
+ * Writes the whole sidecar through a temporary file renamed into place.
+ */
+static int save(histogram_set *set)
+{
+    char tmp_path[sizeof(set->path) + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", set->path);
+
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    struct histogram_header header;
+    fill_header(set, &header);
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    if (ok && set->count > 1)
+    {
+        ok = fwrite(set->days, sizeof(day_histogram), set->count - 1, file) == set->count - 1;
+    }
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok || rename(tmp_path, set->path) != 0)
+    {
+        remove(tmp_path);
+        return -1;
+    }
+
+    if (set->fd >= 0)
+    {
+        close(set->fd);
+        set->fd = open(set->path, O_RDWR);
+        if (set->fd < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Writes the day touched by the last add and the header.
+ */
+static int persist(histogram_set *set, int changed, size_t pos)
+{
+    if (changed == CHANGED_INSERTED)
+    {
+        return save(set);
+    }
+
+    // Sealed days sit right after the header; the newest one lives in the header
+    if (changed == CHANGED_APPENDED && set->count >= 2)
+    {
+        pos = set->count - 2;
+        changed = CHANGED_DAY;
+    }
+    if (changed == CHANGED_DAY && pos + 1 < set->count)
+    {
+        off_t at = sizeof(struct histogram_header) + (off_t)pos * sizeof(day_histogram);
+        if (pwrite(set->fd, &set->days[pos], sizeof(day_histogram), at) != sizeof(day_histogram))
+        {
+            return -1;
+        }
+    }
+
+    struct histogram_header header;
+    fill_header(set, &header);
+    return pwrite(set->fd, &header, sizeof(header), 0) == sizeof(header) ? 0 : -1;
+}
+
+/**
+ * log_scan() callback adding each record to the in-memory histograms.
+ */
+static int add_scanned(int64_t offset, int64_t end, time_t timestamp, float duration, void *ctx)
+{
+    (void)offset;
+    histogram_set *set = ctx;
+    size_t pos;
+    if (add_memory(set, timestamp, duration, &pos) < 0)
+    {
+        // Marks the scan as failed rather than skipping the record for good
+        set->covered = -1;
+        return 1;
+    }
+    set->covered = end;
+    return 0;
+}
+
+/**
+ * Reads the whole sidecar. Returns 0 if it was valid for the log.
+ */
+static int read_sidecar(histogram_set *set, const char *log_path)
+{
+    FILE *file = fopen(set->path, "rb");
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    struct histogram_header header;
+    int ok = fread(&header, sizeof(header), 1, file) == 1 &&
+             memcmp(header.magic, HISTOGRAM_MAGIC, sizeof(HISTOGRAM_MAGIC)) == 0 &&
+             header.version == HISTOGRAM_VERSION &&
+             header.buckets == HISTOGRAM_BUCKETS;
+    // A log cut short after a crash no longer holds every record the sidecar counted. The log
+    // is measured after the header is read, so a recorder appending meanwhile only makes it longer.
+    ok = ok && header.covered <= segment_log_size(log_path);
+
+    // The count comes from disk; the file must be large enough to hold that many days
+    struct stat st;
+    ok = ok && fstat(fileno(file), &st) == 0 &&
+         header.count <= ((uint64_t)st.st_size - sizeof(header)) / sizeof(day_histogram) + 1;
+
+    if (ok && header.count > 0)
+    {
+        set->days = malloc(header.count * sizeof(day_histogram));
+        ok = set->days != NULL &&
+             fread(set->days, sizeof(day_histogram), header.count - 1, file) == header.count - 1;
+        if (ok)
+        {
+            set->days[header.count - 1] = header.open;
+            set->count = set->capacity = header.count;
+        }
+    }
+    fclose(file);
+
+    if (!ok)
+    {
+        free(set->days);
+        set->days = NULL;
+        set->count = set->capacity = 0;
+        return -1;
+    }
+    set->all = header.all;
+    set->covered = header.covered;
+    return 0;
+}
+
+int histogram_load(histogram_set *set, const char *log_path)
+{
+    memset(set, 0, sizeof(*set));
+    set->fd = -1;
+    day_bucketer_init(&set->bucketer);
+
+    if (snprintf(set->path, sizeof(set->path), "%s.hist", log_path) >= (int)sizeof(set->path))
+    {
+        return -1;
+    }
+
+    int binary = binlog_detect(log_path);
+    if (read_sidecar(set, log_path) != 0)
+    {
+        histogram_init(&set->all);
+        set->covered = binary ? (int64_t)sizeof(binlog_header) : 0;
+    }
+
+    int64_t covered = log_scan(log_path, binary, set->covered, add_scanned, set);
+    if (covered < 0 || set->covered < 0)
+    {
+        histogram_free(set);
+        return -1;
+    }
+    set->covered = covered;
+    return 0;
+}
+
+int histogram_open(histogram_set *set, const char *log_path)
+{
+    if (histogram_load(set, log_path) != 0)
+    {
+        return -1;
+    }
+    if (save(set) != 0)
+    {
+        histogram_free(set);
+        return -1;
+    }
+    set->fd = open(set->path, O_RDWR);
+    if (set->fd < 0)
+    {
+        histogram_free(set);
+        return -1;
+    }
+    return 0;
+}
+
+int histogram_add_record(histogram_set *set, int64_t end, time_t timestamp, double duration)
+{
+    size_t pos;
+    int changed = add_memory(set, timestamp, duration, &pos);
+    set->covered = end;
+    if (changed < 0)
+    {
+        return -1;
+    }
+    return persist(set, changed, pos);
+}
+
+int histogram_rebuild(const char *log_path)
+{
+    char path[sizeof(((histogram_set *)0)->path)];
+    snprintf(path, sizeof(path), "%s.hist", log_path);
+    remove(path);
+
+    histogram_set set;
+    if (histogram_open(&set, log_path) != 0)
+    {
+        return -1;
+    }
+    histogram_free(&set);
+    return 0;
+}
+
+void histogram_free(histogram_set *set)
+{
+    if (set->fd >= 0)
+    {
+        close(set->fd);
+    }
+    free(set->days);
+    set->days = NULL;
+    set->count = 0;
+    set->capacity = 0;
+    set->fd = -1;
+}
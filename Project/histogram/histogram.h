@@ -0,0 +1,137 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include "../daybucket/daybucket.h"
+
+#define HISTOGRAM_MAGIC "FEEDHST"
+#define HISTOGRAM_VERSION 1
+
+// Each power of two of milliseconds is split into 2^HISTOGRAM_SUB_BITS linear buckets
+#define HISTOGRAM_SUB_BITS 4
+// Durations of 2^HISTOGRAM_MAX_BITS ms (about 50 days) and more share the last bucket
+#define HISTOGRAM_MAX_BITS 32
+#define HISTOGRAM_BUCKETS ((1 << HISTOGRAM_SUB_BITS) * (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1))
+
+/**
+ * @brief Log-linear histogram of durations (1880 bytes)
+ *
+ * Durations are counted in millisecond buckets that are exact below 16 ms
+ * and at most 1/16 of their value wide above, so a percentile is within
+ * about 6% of the true value. Count, sum, min and max are exact. Two
+ * histograms are merged by adding their buckets.
+ */
+typedef struct duration_histogram {
+    uint64_t count;
+    double sum;
+    float min;
+    float max;
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+} duration_histogram;
+
+/**
+ * @brief Histogram of the durations of one local day
+ */
+typedef struct day_histogram {
+    int32_t day;
+    uint32_t reserved;
+    duration_histogram hist;
+} day_histogram;
+
+/**
+ * @brief Per-day and all-time histograms of a log, kept sorted by day
+ */
+typedef struct histogram_set {
+    char path[512];
+    duration_histogram all;
+    day_histogram *days;
+    size_t count;
+    size_t capacity;
+    int64_t covered;
+    day_bucketer bucketer;
+    int fd;
+} histogram_set;
+
+/**
+ * @brief Prepares an empty histogram
+ *
+ * @param hist Histogram to clear
+ */
+void histogram_init(duration_histogram *hist);
+
+/**
+ * @brief Counts one duration
+ *
+ * @param hist Histogram to update
+ * @param duration Duration in seconds
+ */
+void histogram_add(duration_histogram *hist, double duration);
+
+/**
+ * @brief Adds every duration counted in one histogram to another
+ *
+ * @param into Histogram to update
+ * @param from Histogram to add
+ */
+void histogram_merge(duration_histogram *into, const duration_histogram *from);
+
+/**
+ * @brief Estimates a percentile
+ *
+ * @param hist Histogram to read
+ * @param q Fraction of durations at or below the result, from 0 to 1
+ * @return double Duration in seconds, 0 for an empty histogram
+ */
+double histogram_percentile(const duration_histogram *hist, double q);
+
+/**
+ * @brief Loads the histograms of a log for reading
+ *
+ * The sidecar "<log>.hist" is read and records appended since it was
+ * written are added from the log, so the cost does not depend on the size
+ * of the log.
+ *
+ * @param set Set to fill
+ * @param log_path Path of the log
+ * @return int 0 on success, -1 if error occurs
+ */
+int histogram_load(histogram_set *set, const char *log_path);
+
+/**
+ * @brief Opens the histograms of a log for maintenance by the recorder
+ *
+ * @param set Set to fill
+ * @param log_path Path of the log
+ * @return int 0 on success, -1 if error occurs
+ */
+int histogram_open(histogram_set *set, const char *log_path);
+
+/**
+ * @brief Adds a record that was just appended to the log
+ *
+ * @param set Set opened with histogram_open()
+ * @param end Byte offset just after the record in the log
+ * @param timestamp Timestamp of the record
+ * @param duration Duration of the record in seconds
+ * @return int 0 on success, -1 if error occurs
+ */
+int histogram_add_record(histogram_set *set, int64_t end, time_t timestamp, double duration);
+
+/**
+ * @brief Throws away the histograms of a log and rebuilds them from the whole log
+ *
+ * @param log_path Path of the log
+ * @return int 0 on success, -1 if error occurs
+ */
+int histogram_rebuild(const char *log_path);
+
+/**
+ * @brief Releases a set loaded with histogram_load() or histogram_open()
+ *
+ * @param set Set to release
+ */
+void histogram_free(histogram_set *set);
+
+#endif /* HISTOGRAM_H */
@@ -0,0 +1,793 @@
+/**
+ * @file import.c
+ * @brief Bulk import of stats logs with an external merge sort
+ *
+ * Logs copied off several hosts interleave in time and, together, do not
+ * fit in memory. They are sorted in two phases that never hold more than
+ * the memory budget:
+ *
+ * - run generation: the inputs are read in blocks that end on a line
+ *   break; each block is handed to a worker thread that parses it, sorts
+ *   the records, drops duplicates and writes them to a run file as binary
+ *   records, while the next block is being read
+ * - merge: up to MERGE_MAX_FAN_IN runs are merged at once through a binary
+ *   heap, each read through its own buffer; with more runs than that,
+ *   intermediate passes merge groups of runs into longer ones first
+ *
+ * Records are ordered by timestamp, then device, then duration, so
+ * identical records from several inputs end up next to each other and the
+ * merge keeps only the first of them. Run files live in a temporary
+ * directory next to the output, on the same file system.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include "import.h"
+#include "../binlog/binlog.h"
+#include "../index/csvscan.h"
+#include "../index/dayindex.h"
+#include "../rollup/rollup.h"
+#include "../histogram/histogram.h"
+#include "../segment/segment.h"
+
+// Longest CSV line; longer ones are dropped as unparsable
+#define IMPORT_LINE_MAX 65536
+// Most threads cutting runs
+#define IMPORT_MAX_THREADS 32
+// Smallest block a run generation thread works on
+#define IMPORT_MIN_BLOCK (1 << 20)
+// Smallest read buffer of a run during a merge
+#define MERGE_MIN_BUFFER (256 << 10)
+// Most runs merged at once, well within the open file limit
+#define MERGE_MAX_FAN_IN 128
+
+/**
+ * @brief Run files shared by the run generation threads
+ */
+struct runs
+{
+    char dir[600];
+    pthread_mutex_t lock;
+    int count;
+    int failed;
+};
+
+/**
+ * @brief Block of an input and the worker sorting it into runs
+ */
+struct slot
+{
+    char *text;
+    size_t len;
+    int binary;
+    binlog_record *records;
+    size_t capacity;
+    struct runs *runs;
+    pthread_t thread;
+    int busy;
+    unsigned long long parsed;
+    unsigned long long unparsable;
+};
+
+/**
+ * @brief Where merged records go: a run file or the output log
+ */
+struct sink
+{
+    FILE *file;
+    int csv;
+    unsigned long long written;
+    binlog_record last;
+};
+
+/**
+ * @brief Run being merged, with its smallest record not yet written
+ */
+struct cursor
+{
+    FILE *file;
+    binlog_record current;
+};
+
+/**
+ * Orders records by timestamp, device and duration.
+ */
+static int compare_records(const void *a, const void *b)
+{
+    const binlog_record *x = a;
+    const binlog_record *y = b;
+    if (x->timestamp != y->timestamp)
+    {
+        return x->timestamp < y->timestamp ? -1 : 1;
+    }
+    if (x->device != y->device)
+    {
+        return x->device < y->device ? -1 : 1;
+    }
+    if (x->duration != y->duration)
+    {
+        return x->duration < y->duration ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * Path of a run file.
+ */
+static void run_path(const struct runs *runs, int id, char *path, size_t size)
+{
+    snprintf(path, size, "%s/run-%d", runs->dir, id);
+}
+
+/**
+ * Reserves the id of a new run file.
+ */
+static int next_run(struct runs *runs)
+{
+    pthread_mutex_lock(&runs->lock);
+    int id = runs->count++;
+    pthread_mutex_unlock(&runs->lock);
+    return id;
+}
+
+/**
+ * Sorts records, drops duplicates and writes them to a new run file.
+ */
+static void write_run(struct runs *runs, binlog_record *records, size_t count)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    qsort(records, count, sizeof(*records), compare_records);
+    size_t kept = 1;
+    for (size_t i = 1; i < count; i++)
+    {
+        if (compare_records(&records[i], &records[kept - 1]) != 0)
+        {
+            records[kept++] = records[i];
+        }
+    }
+
+    char path[700];
+    run_path(runs, next_run(runs), path, sizeof(path));
+    FILE *file = fopen(path, "wb");
+    int ok = file != NULL && fwrite(records, sizeof(*records), kept, file) == kept;
+    ok = file != NULL && fclose(file) == 0 && ok;
+    if (!ok)
+    {
+        pthread_mutex_lock(&runs->lock);
+        runs->failed = 1;
+        pthread_mutex_unlock(&runs->lock);
+    }
+}
+
+/**
+ * Parses a "timestamp,duration[,device]" line ending in a NUL. Returns -1 if it is not a record.
+ */
+static int parse_line(const char *line, size_t len, binlog_record *record)
+{
+    const char *comma = memchr(line, ',', len);
+    if (comma == NULL)
+    {
+        return -1;
+    }
+
+    time_t timestamp;
+    float duration;
+    uint32_t device = 0;
+    size_t at = (size_t)(comma - line);
+    // Plain two-column lines take the fast path of the index scanner
+    if (memchr(comma + 1, ',', len - at - 1) != NULL || csv_parse_row(line, len, at, &timestamp, &duration) != 0)
+    {
+        char *end;
+        long long t = strtoll(line, &end, 10);
+        if (end == line || *end != ',')
+        {
+            return -1;
+        }
+        const char *start = end + 1;
+        duration = strtof(start, &end);
+        if (end == start)
+        {
+            return -1;
+        }
+        if (*end == ',')
+        {
+            start = end + 1;
+            unsigned long id = strtoul(start, &end, 10);
+            if (end == start)
+            {
+                return -1;
+            }
+            device = (uint32_t)id;
+        }
+        timestamp = (time_t)t;
+    }
+    if (!isfinite(duration))
+    {
+        return -1;
+    }
+
+    memset(record, 0, sizeof(*record));
+    record->timestamp = timestamp;
+    record->duration = duration;
+    record->device = device;
+    return 0;
+}
+
+/**
+ * Run generation thread: turns one block of an input into sorted runs.
+ */
+static void *cut_runs(void *arg)
+{
+    struct slot *s = arg;
+    s->parsed = 0;
+    s->unparsable = 0;
+
+    // Blocks of a binary log already are records and are sorted in place
+    if (s->binary)
+    {
+        size_t count = s->len / sizeof(binlog_record);
+        s->parsed = count;
+        write_run(s->runs, (binlog_record *)s->text, count);
+        return NULL;
+    }
+
+    size_t count = 0;
+    char *p = s->text;
+    char *end = s->text + s->len;
+    while (p < end)
+    {
+        char *nl = memchr(p, '\n', (size_t)(end - p));
+        char *line_end = nl != NULL ? nl : end;
+        *line_end = '\0';
+        size_t len = (size_t)(line_end - p);
+        if (len > 0 && p[len - 1] == '\r')
+        {
+            p[--len] = '\0';
+        }
+
+        if (len > 0)
+        {
+            if (parse_line(p, len, &s->records[count]) == 0)
+            {
+                s->parsed++;
+                if (++count == s->capacity)
+                {
+                    write_run(s->runs, s->records, count);
+                    count = 0;
+                }
+            }
+            else
+            {
+                s->unparsable++;
+            }
+        }
+        p = line_end + 1;
+    }
+    write_run(s->runs, s->records, count);
+    return NULL;
+}
+
+/**
+ * Waits for the worker of a slot and adds up what it did.
+ */
+static void finish_slot(struct slot *s, unsigned long long *parsed, unsigned long long *unparsable)
+{
+    if (s->busy)
+    {
+        pthread_join(s->thread, NULL);
+        s->busy = 0;
+        *parsed += s->parsed;
+        *unparsable += s->unparsable;
+    }
+}
+
+/**
+ * Opens an input log, checking that it can be imported. Returns NULL if it cannot.
+ */
+static FILE *open_input(const char *path, int *binary)
+{
+    segment_list segments;
+    if (segment_list_load(&segments, path) == 0)
+    {
+        size_t sealed = segments.count;
+        segment_list_free(&segments);
+        if (sealed > 0)
+        {
+            printf("Error: %s has sealed segments; import the logs it was made from instead.\n", path);
+            return NULL;
+        }
+    }
+
+    FILE *in = fopen(path, "rb");
+    if (in == NULL)
+    {
+        printf("Error opening %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    *binary = binlog_detect(path);
+    binlog_header header;
+    if (*binary && (fread(&header, sizeof(header), 1, in) != 1 || header.bom != BINLOG_BOM ||
+                    header.record_size != sizeof(binlog_record)))
+    {
+        printf("Error: %s is a binary log of another format.\n", path);
+        fclose(in);
+        return NULL;
+    }
+    return in;
+}
+
+/**
+ * Cuts every input into sorted runs, reading the next block while workers sort.
+ */
+static int generate_runs(const char **inputs, int count, struct slot *slots, int threads, size_t block,
+                         unsigned long long *parsed, unsigned long long *unparsable)
+{
+    char *carry = malloc(IMPORT_LINE_MAX);
+    if (carry == NULL)
+    {
+        printf("Out of memory.\n");
+        return -1;
+    }
+
+    int next = 0;
+    int status = 0;
+    for (int i = 0; i < count && status == 0; i++)
+    {
+        int binary;
+        FILE *in = open_input(inputs[i], &binary);
+        if (in == NULL)
+        {
+            status = -1;
+            break;
+        }
+
+        size_t carried = 0;
+        int skipping = 0;
+        int eof = 0;
+        while (!eof)
+        {
+            struct slot *s = &slots[next];
+            finish_slot(s, parsed, unparsable);
+
+            size_t len;
+            if (binary)
+            {
+                size_t records = fread(s->text, sizeof(binlog_record), block / sizeof(binlog_record), in);
+                len = records * sizeof(binlog_record);
+                eof = len < block;
+            }
+            else
+            {
+                memcpy(s->text, carry, carried);
+                size_t got = fread(s->text + carried, 1, block - carried, in);
+                len = carried + got;
+                carried = 0;
+                eof = len < block;
+
+                // The rest of a line that was too long to import
+                size_t start = 0;
+                if (skipping)
+                {
+                    char *nl = memchr(s->text, '\n', len);
+                    start = nl != NULL ? (size_t)(nl + 1 - s->text) : len;
+                    skipping = nl == NULL;
+                    memmove(s->text, s->text + start, len - start);
+                    len -= start;
+                }
+
+                // A block ends on a line break; the line it cuts goes to the next block
+                if (!eof)
+                {
+                    size_t whole = len;
+                    while (whole > 0 && s->text[whole - 1] != '\n')
+                    {
+                        whole--;
+                    }
+                    if (len - whole > IMPORT_LINE_MAX)
+                    {
+                        (*unparsable)++;
+                        skipping = 1;
+                    }
+                    else
+                    {
+                        carried = len - whole;
+                        memcpy(carry, s->text + whole, carried);
+                    }
+                    len = whole;
+                }
+            }
+            if (ferror(in))
+            {
+                printf("Error reading %s: %s\n", inputs[i], strerror(errno));
+                status = -1;
+                break;
+            }
+            if (len == 0)
+            {
+                continue;
+            }
+
+            s->len = len;
+            s->binary = binary;
+            if (pthread_create(&s->thread, NULL, cut_runs, s) != 0)
+            {
+                cut_runs(s);
+                *parsed += s->parsed;
+                *unparsable += s->unparsable;
+            }
+            else
+            {
+                s->busy = 1;
+            }
+            next = (next + 1) % threads;
+        }
+        fclose(in);
+    }
+
+    for (int i = 0; i < threads; i++)
+    {
+        finish_slot(&slots[i], parsed, unparsable);
+    }
+    free(carry);
+    return status;
+}
+
+/**
+ * Writes one merged record unless it repeats the previous one.
+ */
+static int emit(struct sink *sink, const binlog_record *record)
+{
+    if (sink->written > 0 && compare_records(record, &sink->last) == 0)
+    {
+        return 0;
+    }
+    sink->last = *record;
+    sink->written++;
+
+    if (!sink->csv)
+    {
+        return fwrite(record, sizeof(*record), 1, sink->file) == 1 ? 0 : -1;
+    }
+    char duration[32];
+    binlog_format_duration(duration, sizeof(duration), record->duration);
+    int n = record->device > 0
+                ? fprintf(sink->file, "%lld,%s,%u\n", (long long)record->timestamp, duration, record->device)
+                : fprintf(sink->file, "%lld,%s\n", (long long)record->timestamp, duration);
+    return n > 0 ? 0 : -1;
+}
+
+/**
+ * Moves the cursor at position i of a heap down to its place.
+ */
+static void sift_down(struct cursor **heap, int n, int i)
+{
+    for (;;)
+    {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < n && compare_records(&heap[left]->current, &heap[smallest]->current) < 0)
+        {
+            smallest = left;
+        }
+        if (right < n && compare_records(&heap[right]->current, &heap[smallest]->current) < 0)
+        {
+            smallest = right;
+        }
+        if (smallest == i)
+        {
+            return;
+        }
+        struct cursor *swap = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+/**
+ * Merges runs into a sink, reading each run through a buffer of the given size.
+ */
+static int merge_runs(const struct runs *runs, const int *ids, int count, struct sink *sink, size_t buffer)
+{
+    struct cursor *cursors = calloc(count > 0 ? count : 1, sizeof(*cursors));
+    struct cursor **heap = calloc(count > 0 ? count : 1, sizeof(*heap));
+    int status = cursors != NULL && heap != NULL ? 0 : -1;
+    int n = 0;
+
+    for (int i = 0; i < count && status == 0; i++)
+    {
+        char path[700];
+        run_path(runs, ids[i], path, sizeof(path));
+        cursors[i].file = fopen(path, "rb");
+        if (cursors[i].file == NULL)
+        {
+            status = -1;
+            break;
+        }
+        setvbuf(cursors[i].file, NULL, _IOFBF, buffer);
+        if (fread(&cursors[i].current, sizeof(binlog_record), 1, cursors[i].file) == 1)
+        {
+            heap[n++] = &cursors[i];
+        }
+    }
+    for (int i = n / 2 - 1; i >= 0; i--)
+    {
+        sift_down(heap, n, i);
+    }
+
+    while (n > 0 && status == 0)
+    {
+        struct cursor *c = heap[0];
+        status = emit(sink, &c->current);
+        if (fread(&c->current, sizeof(binlog_record), 1, c->file) != 1)
+        {
+            status = ferror(c->file) ? -1 : status;
+            heap[0] = heap[--n];
+        }
+        sift_down(heap, n, 0);
+    }
+
+    for (int i = 0; cursors != NULL && i < count; i++)
+    {
+        if (cursors[i].file != NULL)
+        {
+            fclose(cursors[i].file);
+        }
+    }
+    free(cursors);
+    free(heap);
+    return status;
+}
+
+/**
+ * Merges groups of runs into longer runs until at most fan_in are left.
+ * Returns the number of passes made, or -1 if error occurs.
+ */
+static int reduce_runs(struct runs *runs, int *ids, int *count, int fan_in, size_t buffer)
+{
+    int passes = 0;
+    while (*count > fan_in)
+    {
+        int kept = 0;
+        for (int i = 0; i < *count; i += fan_in)
+        {
+            int group = *count - i < fan_in ? *count - i : fan_in;
+            if (group == 1)
+            {
+                ids[kept++] = ids[i];
+                continue;
+            }
+
+            int id = next_run(runs);
+            char path[700];
+            run_path(runs, id, path, sizeof(path));
+            struct sink sink = { fopen(path, "wb"), 0, 0, { 0, 0, 0 } };
+            int ok = sink.file != NULL;
+            if (ok)
+            {
+                setvbuf(sink.file, NULL, _IOFBF, buffer);
+                ok = merge_runs(runs, ids + i, group, &sink, buffer) == 0;
+                ok = fclose(sink.file) == 0 && ok;
+            }
+            if (!ok)
+            {
+                return -1;
+            }
+            for (int j = i; j < i + group; j++)
+            {
+                run_path(runs, ids[j], path, sizeof(path));
+                unlink(path);
+            }
+            ids[kept++] = id;
+        }
+        *count = kept;
+        passes++;
+    }
+    return passes;
+}
+
+/**
+ * Removes the run directory and the runs left in it.
+ */
+static void remove_runs(struct runs *runs)
+{
+    char path[700];
+    for (int i = 0; i < runs->count; i++)
+    {
+        run_path(runs, i, path, sizeof(path));
+        unlink(path);
+    }
+    rmdir(runs->dir);
+}
+
+/**
+ * Writes the final merge to a new log next to the output and renames it over the output.
+ */
+static int write_output(struct runs *runs, int *ids, int count, const char *output, int binary, size_t buffer,
+                        unsigned long long *written)
+{
+    char tmp[600];
+    if (snprintf(tmp, sizeof(tmp), "%s.import", output) >= (int)sizeof(tmp))
+    {
+        return -1;
+    }
+    unlink(tmp);
+
+    // binlog_open() writes the header of the new binary log
+    struct sink sink = { binary ? binlog_open(tmp, 0) : fopen(tmp, "w"), !binary, 0, { 0, 0, 0 } };
+    if (sink.file == NULL)
+    {
+        printf("Error creating %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    setvbuf(sink.file, NULL, _IOFBF, buffer);
+    int ok = merge_runs(runs, ids, count, &sink, buffer) == 0;
+    ok = ok && fflush(sink.file) == 0 && fsync(fileno(sink.file)) == 0;
+    ok = fclose(sink.file) == 0 && ok;
+    if (!ok || rename(tmp, output) != 0)
+    {
+        printf("Error writing %s: %s\n", output, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    *written = sink.written;
+    return 0;
+}
+
+int import_logs(const char **inputs, int count, const char *output, size_t memory, int threads)
+{
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    if (threads <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
+    // Each thread gets a block and the records parsed from it
+    threads = threads > IMPORT_MAX_THREADS ? IMPORT_MAX_THREADS : threads;
+    while (threads > 1 && memory / (size_t)threads / 2 < IMPORT_MIN_BLOCK)
+    {
+        threads--;
+    }
+    size_t block = memory / (size_t)threads / 2 / sizeof(binlog_record) * sizeof(binlog_record);
+
+    // The output is replaced, so a recorder appending to it would lose records
+    segment_list segments;
+    if (segment_list_load(&segments, output) == 0)
+    {
+        size_t sealed = segments.count;
+        segment_list_free(&segments);
+        if (sealed > 0)
+        {
+            printf("Error: %s has sealed segments; import into a new log.\n", output);
+            return 1;
+        }
+    }
+    int held = open(output, O_RDONLY);
+    if (held >= 0 && flock(held, LOCK_EX | LOCK_NB) != 0)
+    {
+        printf("Error: %s is being recorded; stop the recorder first.\n", output);
+        close(held);
+        return 1;
+    }
+    size_t name_len = strlen(output);
+    int binary = binlog_detect(output) || (name_len > 4 && strcmp(output + name_len - 4, ".bin") == 0);
+
+    struct runs runs;
+    memset(&runs, 0, sizeof(runs));
+    pthread_mutex_init(&runs.lock, NULL);
+    snprintf(runs.dir, sizeof(runs.dir), "%s.runsXXXXXX", output);
+    struct slot *slots = calloc(threads, sizeof(*slots));
+    int status = slots != NULL && mkdtemp(runs.dir) != NULL ? 0 : -1;
+    if (status != 0)
+    {
+        printf("Error creating a directory for runs next to %s: %s\n", output, strerror(errno));
+        free(slots);
+        pthread_mutex_destroy(&runs.lock);
+        if (held >= 0)
+        {
+            close(held);
+        }
+        return 1;
+    }
+
+    for (int i = 0; i < threads && status == 0; i++)
+    {
+        // One spare byte ends the last line of a block with a NUL
+        slots[i].text = malloc(block + 1);
+        slots[i].capacity = block / sizeof(binlog_record);
+        slots[i].records = malloc(slots[i].capacity * sizeof(binlog_record));
+        slots[i].runs = &runs;
+        status = slots[i].text != NULL && slots[i].records != NULL ? 0 : -1;
+    }
+
+    unsigned long long parsed = 0;
+    unsigned long long unparsable = 0;
+    if (status == 0)
+    {
+        status = generate_runs(inputs, count, slots, threads, block, &parsed, &unparsable);
+    }
+    else
+    {
+        printf("Out of memory.\n");
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        free(slots[i].text);
+        free(slots[i].records);
+    }
+    free(slots);
+    if (status == 0 && runs.failed)
+    {
+        printf("Error writing runs to %s.\n", runs.dir);
+        status = -1;
+    }
+
+    // Each open run gets an equal share of the budget, and so does the output
+    int fan_in = (int)(memory / MERGE_MIN_BUFFER) - 1;
+    fan_in = fan_in > MERGE_MAX_FAN_IN ? MERGE_MAX_FAN_IN : fan_in < 2 ? 2 : fan_in;
+    size_t buffer = memory / (size_t)(fan_in + 1);
+
+    int run_count = runs.count;
+    int passes = 0;
+    unsigned long long written = 0;
+    int *ids = malloc((run_count > 0 ? run_count : 1) * sizeof(*ids));
+    if (status == 0 && ids != NULL)
+    {
+        for (int i = 0; i < run_count; i++)
+        {
+            ids[i] = i;
+        }
+        int remaining = run_count;
+        passes = reduce_runs(&runs, ids, &remaining, fan_in, buffer);
+        status = passes < 0 ? -1 : write_output(&runs, ids, remaining, output, binary, buffer, &written);
+        if (passes < 0)
+        {
+            printf("Error merging runs in %s.\n", runs.dir);
+        }
+    }
+    else if (ids == NULL)
+    {
+        printf("Out of memory.\n");
+        status = -1;
+    }
+    free(ids);
+    remove_runs(&runs);
+    pthread_mutex_destroy(&runs.lock);
+    if (held >= 0)
+    {
+        close(held);
+    }
+    if (status != 0)
+    {
+        return 1;
+    }
+
+    if (dayindex_rebuild(output) != 0 || rollup_rebuild(output) != 0 || histogram_rebuild(output) != 0)
+    {
+        printf("Error rebuilding index of %s.\n", output);
+        return 1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    printf("Imported %llu records from %d log%s into %s (%llu duplicates and %llu unparsable lines dropped).\n",
+           written, count, count > 1 ? "s" : "", output, parsed - written, unparsable);
+    printf("%d runs merged in %d pass%s by %d thread%s in %.1f s.\n", run_count, passes + 1, passes > 0 ? "es" : "",
+           threads, threads > 1 ? "s" : "",
+           (double)(now.tv_sec - started.tv_sec) + (double)(now.tv_nsec - started.tv_nsec) / 1e9);
+    return 0;
+}
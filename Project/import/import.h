@@ -0,0 +1,34 @@
+#ifndef IMPORT_H
+#define IMPORT_H
+
+#include <stddef.h>
+
+// Memory budget of an import unless another one is given, in MiB
+#define IMPORT_MEMORY_MB 256
+// Smallest memory budget accepted, in MiB
+#define IMPORT_MIN_MEMORY_MB 8
+
+/**
+ * @brief Merges stats logs into one sorted log without duplicates
+ *
+ * The inputs may be CSV logs ("timestamp,duration[,device]", in any order)
+ * or binary logs, and together may be much larger than memory. They are cut
+ * into sorted runs by up to threads workers, which are then merged k ways,
+ * in several passes if there are too many runs to open at once. Records
+ * that are identical in timestamp, duration and device are kept once.
+ * Memory use stays within memory bytes however large the inputs are.
+ *
+ * The output is written next to its final path and renamed over it, so it
+ * may also be one of the inputs; it is a binary log if it ends in ".bin" or
+ * already is one. Its day index, rollups and histograms are rebuilt.
+ *
+ * @param inputs Paths of the logs to import
+ * @param count Number of inputs
+ * @param output Path of the log to write; replaced if it exists
+ * @param memory Memory budget in bytes
+ * @param threads Threads cutting runs, 0 for one per CPU
+ * @return int 0 on success, 1 if an input cannot be read or the output cannot be written
+ */
+int import_logs(const char **inputs, int count, const char *output, size_t memory, int threads);
+
+#endif /* IMPORT_H */
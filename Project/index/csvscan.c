@@ -0,0 +1,360 @@
+/**
+ * @file csvscan.c
+ * @brief Vectorized line and field scanner for CSV stats logs
+ *
+ * Each step classifies a 64-byte block into two bit masks, one bit per byte
+ * for '\n' and one for ','. Lines are then taken out of the newline mask
+ * with count-trailing-zeros, and the first comma of a line is the lowest
+ * comma bit between the line start and its newline. The last partial block
+ * is copied into a zero-padded buffer so no byte past the end is read.
+ *
+ * The block classifier is picked once per process: AVX2 if the CPU has it,
+ * SSE2 on other x86 CPUs, and a plain loop elsewhere. The x86 versions are
+ * compiled with target attributes, so no special compiler flags are needed.
+ *
+ * Timestamps are converted eight digits at a time with SWAR arithmetic on
+ * little-endian hosts. Durations are converted as an integer mantissa over
+ * a power of ten, which is exact for the short decimals the recorder writes;
+ * every case where that could round differently from strtof() is left to
+ * log_parse_row().
+ */
+#include <string.h>
+#include <float.h>
+#include <pthread.h>
+#include "csvscan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSVSCAN_X86 1
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CSVSCAN_SWAR 1
+#endif
+
+static const double powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/**
+ * Classifies one block byte by byte.
+ */
+static void masks_scalar(const char *p, uint64_t *newlines, uint64_t *commas)
+{
+    uint64_t nl = 0;
+    uint64_t cm = 0;
+    for (int i = 0; i < CSVSCAN_BLOCK; i++)
+    {
+        nl |= (uint64_t)(p[i] == '\n') << i;
+        cm |= (uint64_t)(p[i] == ',') << i;
+    }
+    *newlines = nl;
+    *commas = cm;
+}
+
+#ifdef CSVSCAN_X86
+/**
+ * Classifies one block with four 16-byte compares per character.
+ */
+__attribute__((target("sse2")))
+static void masks_sse2(const char *p, uint64_t *newlines, uint64_t *commas)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i cm = _mm_set1_epi8(',');
+    uint64_t n = 0;
+    uint64_t c = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+        n |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)) << (16 * i);
+        c |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, cm)) << (16 * i);
+    }
+    *newlines = n;
+    *commas = c;
+}
+
+/**
+ * Classifies one block with two 32-byte compares per character.
+ */
+__attribute__((target("avx2")))
+static void masks_avx2(const char *p, uint64_t *newlines, uint64_t *commas)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i cm = _mm256_set1_epi8(',');
+    __m256i lo = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+    *newlines = (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, nl)) |
+                (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, nl)) << 32;
+    *commas = (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, cm)) |
+              (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, cm)) << 32;
+}
+#endif
+
+static void (*classify)(const char *p, uint64_t *newlines, uint64_t *commas) = masks_scalar;
+static const char *classify_name = "scalar";
+static pthread_once_t classify_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Picks the block classifier for this CPU.
+ */
+static void select_classifier(void)
+{
+#ifdef CSVSCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        classify = masks_avx2;
+        classify_name = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        classify = masks_sse2;
+        classify_name = "sse2";
+    }
+#endif
+}
+
+const char *csv_scan_isa(void)
+{
+    pthread_once(&classify_once, select_classifier);
+    return classify_name;
+}
+
+int csv_scan_use_isa(const char *isa)
+{
+    pthread_once(&classify_once, select_classifier);
+    if (!strcmp(isa, "scalar"))
+    {
+        classify = masks_scalar;
+        classify_name = "scalar";
+        return 0;
+    }
+#ifdef CSVSCAN_X86
+    if (!strcmp(isa, "sse2") && __builtin_cpu_supports("sse2"))
+    {
+        classify = masks_sse2;
+        classify_name = "sse2";
+        return 0;
+    }
+    if (!strcmp(isa, "avx2") && __builtin_cpu_supports("avx2"))
+    {
+        classify = masks_avx2;
+        classify_name = "avx2";
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+void csv_scan_init(csv_scanner *scanner, const char *data, size_t len)
+{
+    pthread_once(&classify_once, select_classifier);
+    memset(scanner, 0, sizeof(*scanner));
+    scanner->data = data;
+    scanner->len = len;
+}
+
+/**
+ * Classifies the next block. Returns 0 when the buffer is used up.
+ */
+static int load_block(csv_scanner *s)
+{
+    size_t at = s->next_block;
+    if (at >= s->len)
+    {
+        return 0;
+    }
+    if (s->len - at >= CSVSCAN_BLOCK)
+    {
+        classify(s->data + at, &s->newlines, &s->commas);
+    }
+    else
+    {
+        char padded[CSVSCAN_BLOCK];
+        memset(padded, 0, sizeof(padded));
+        memcpy(padded, s->data + at, s->len - at);
+        classify(padded, &s->newlines, &s->commas);
+    }
+    s->block = at;
+    s->next_block = at + CSVSCAN_BLOCK;
+    return 1;
+}
+
+/**
+ * Offset of the first comma in [start, end), where end is in the current block.
+ */
+static size_t first_comma(const csv_scanner *s, size_t start, size_t end)
+{
+    uint64_t mask = s->commas;
+    if (start < s->block)
+    {
+        // The line began in an earlier block
+        const char *found = memchr(s->data + start, ',', s->block - start);
+        if (found != NULL)
+        {
+            return (size_t)(found - s->data);
+        }
+    }
+    else
+    {
+        mask &= ~0ULL << (start - s->block);
+    }
+    if (end - s->block < CSVSCAN_BLOCK)
+    {
+        mask &= (1ULL << (end - s->block)) - 1;
+    }
+    return mask ? s->block + (size_t)__builtin_ctzll(mask) : end;
+}
+
+int csv_scan_next(csv_scanner *s, size_t *start, size_t *len, size_t *comma)
+{
+    while (s->newlines == 0)
+    {
+        if (!load_block(s))
+        {
+            if (s->line >= s->len)
+            {
+                return 0;
+            }
+            // Last line without a newline
+            const char *found = memchr(s->data + s->line, ',', s->len - s->line);
+            *start = s->line;
+            *len = s->len - s->line;
+            *comma = found ? (size_t)(found - s->data) - s->line : *len;
+            s->line = s->len;
+            return 2;
+        }
+    }
+
+    size_t newline = s->block + (size_t)__builtin_ctzll(s->newlines);
+    s->newlines &= s->newlines - 1;
+
+    *start = s->line;
+    *len = newline - s->line;
+    *comma = first_comma(s, s->line, newline) - s->line;
+    s->line = newline + 1;
+    return 1;
+}
+
+/**
+ * Converts eight ASCII digits at p. Returns -1 if any of them is not a digit.
+ */
+static int eight_digits(const char *p, uint64_t *value)
+{
+#ifdef CSVSCAN_SWAR
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    // Every byte must be 0x30..0x39
+    if (((v & 0xF0F0F0F0F0F0F0F0ULL) | (((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) !=
+        0x3333333333333333ULL)
+    {
+        return -1;
+    }
+    v -= 0x3030303030303030ULL;
+    v = (v * 10) + (v >> 8);
+    v = (((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+         (((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+    *value = v;
+    return 0;
+#else
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        if (p[i] < '0' || p[i] > '9')
+        {
+            return -1;
+        }
+        v = v * 10 + (uint64_t)(p[i] - '0');
+    }
+    *value = v;
+    return 0;
+#endif
+}
+
+int csv_parse_row(const char *line, size_t len, size_t comma, time_t *timestamp, float *duration)
+{
+    // strtol() would also take a sign or spaces, and more digits could overflow
+    if (comma == 0 || comma > 18 || comma >= len)
+    {
+        return -1;
+    }
+
+    uint64_t t = 0;
+    size_t i = 0;
+    for (; i + 8 <= comma; i += 8)
+    {
+        uint64_t eight;
+        if (eight_digits(line + i, &eight) != 0)
+        {
+            return -1;
+        }
+        t = t * 100000000ULL + eight;
+    }
+    for (; i < comma; i++)
+    {
+        if (line[i] < '0' || line[i] > '9')
+        {
+            return -1;
+        }
+        t = t * 10 + (uint64_t)(line[i] - '0');
+    }
+
+    const char *p = line + comma + 1;
+    const char *end = line + len;
+    uint64_t mantissa = 0;
+    int significant = 0;
+    int fraction = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+    {
+        if (++significant > 19)
+        {
+            return -1;
+        }
+        mantissa = mantissa * 10 + (uint64_t)(*p++ - '0');
+    }
+    // "0x" is a hexadecimal float for strtof()
+    if (p < end && (*p == 'x' || *p == 'X'))
+    {
+        return -1;
+    }
+    if (p < end && *p == '.')
+    {
+        p++;
+        while (p < end && *p >= '0' && *p <= '9')
+        {
+            if (++significant > 19)
+            {
+                return -1;
+            }
+            mantissa = mantissa * 10 + (uint64_t)(*p++ - '0');
+            fraction++;
+        }
+    }
+    if (significant == 0 || (p < end && (*p == 'e' || *p == 'E')))
+    {
+        return -1;
+    }
+    // Below these limits the quotient is the correctly rounded double
+    if (mantissa > (1ULL << 53) || fraction > 22)
+    {
+        return -1;
+    }
+
+    double value = fraction ? (double)mantissa / powers_of_ten[fraction] : (double)mantissa;
+    if (value != 0 && (value < FLT_MIN || value > FLT_MAX))
+    {
+        return -1;
+    }
+    // Rounding the double to float again only differs from strtof() when it lands halfway between two floats
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    if ((bits & 0x1FFFFFFFu) == 0x10000000u)
+    {
+        return -1;
+    }
+
+    *timestamp = (time_t)t;
+    *duration = (float)value;
+    return 0;
+}
@@ -0,0 +1,81 @@
+#ifndef CSVSCAN_H
+#define CSVSCAN_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+// Bytes classified per step of the scanner
+#define CSVSCAN_BLOCK 64
+
+/**
+ * @brief Line iterator over an in-memory CSV log
+ *
+ * Newlines and commas are located 64 bytes at a time with SSE2 or AVX2
+ * compares (chosen at runtime, with a scalar fallback), so finding a line
+ * and its first comma costs a few bit operations instead of a byte loop.
+ */
+typedef struct csv_scanner {
+    const char *data;
+    size_t len;
+    size_t block;
+    size_t next_block;
+    uint64_t newlines;
+    uint64_t commas;
+    size_t line;
+} csv_scanner;
+
+/**
+ * @brief Starts scanning a buffer
+ *
+ * @param scanner Scanner to initialize
+ * @param data First byte of the buffer, which should be a line start
+ * @param len Length of the buffer
+ */
+void csv_scan_init(csv_scanner *scanner, const char *data, size_t len);
+
+/**
+ * @brief Returns the next line of the buffer
+ *
+ * @param scanner Scanner started with csv_scan_init()
+ * @param start Set to the offset of the line in the buffer
+ * @param len Set to the length of the line without its newline
+ * @param comma Set to the offset of the first comma in the line, or len if there is none
+ * @return int 1 for a line ending in a newline, 2 for a last line without one, 0 at the end
+ */
+int csv_scan_next(csv_scanner *scanner, size_t *start, size_t *len, size_t *comma);
+
+/**
+ * @brief Converts a plain "timestamp,duration" line without strtol()/strtof()
+ *
+ * Only digit runs ("digits,digits[.digits]") are handled; for anything
+ * else, or a value that could not be rounded exactly like strtof(), -1 is
+ * returned and the line should go through log_parse_row().
+ *
+ * @param line First byte of the line
+ * @param len Length of the line
+ * @param comma Offset of the first comma, as found by csv_scan_next()
+ * @param timestamp Set to the timestamp on success
+ * @param duration Set to the duration on success
+ * @return int 0 on success, -1 if the line needs the full parser
+ */
+int csv_parse_row(const char *line, size_t len, size_t comma, time_t *timestamp, float *duration);
+
+/**
+ * @brief Name of the instruction set the scanner uses on this CPU
+ *
+ * @return const char* "avx2", "sse2" or "scalar"
+ */
+const char *csv_scan_isa(void);
+
+/**
+ * @brief Makes the scanner use a given instruction set, to compare them
+ *
+ * Must not be called while another thread is scanning.
+ *
+ * @param isa "avx2", "sse2" or "scalar"
+ * @return int 0 on success, -1 if this CPU or build does not have it
+ */
+int csv_scan_use_isa(const char *isa);
+
+#endif /* CSVSCAN_H */
@@ -0,0 +1,587 @@
+/**
+ * @file dayindex.c
+ * @brief Sidecar index mapping each local day of a stats log to its records
+ *
+ * The index of "stats.csv" lives in "stats.csv.idx":
+ *
+ * - a 64-byte header with the number of log bytes covered, the timestamp of
+ *   the last record, a sorted flag and the entry that is still growing
+ * - the sealed day_entry records, one per run of same-day records
+ *
+ * While recording only the header changes, so each record costs a single
+ * pwrite(); the previous entry is sealed into the array when the day
+ * changes. If the recorder stops between writing a record and updating the
+ * index, the next load scans the log from the covered offset and catches up,
+ * so the index never needs a full rebuild after a crash.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "dayindex.h"
+#include "dayscan.h"
+#include "../binlog/binlog.h"
+#include "../segment/segment.h"
+
+// Below this many unread log bytes a catch-up is not worth starting threads for
+#define PARALLEL_MIN_BYTES (4 << 20)
+
+// Threads used to scan a log, 0 for one per online CPU
+static int scan_threads = 0;
+
+/**
+ * @brief On-disk header of the index (64 bytes)
+ */
+struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    int64_t covered;
+    int64_t last_ts;
+    uint32_t entries;
+    uint32_t reserved;
+    day_entry open;
+};
+
+/**
+ * Appends an entry to the in-memory array.
+ */
+static int push_entry(day_index *idx, const day_entry *entry)
+{
+    if (idx->count == idx->capacity)
+    {
+        size_t capacity = idx->capacity ? idx->capacity * 2 : 64;
+        day_entry *entries = realloc(idx->entries, capacity * sizeof(*entries));
+        if (entries == NULL)
+        {
+            return -1;
+        }
+        idx->entries = entries;
+        idx->capacity = capacity;
+    }
+    idx->entries[idx->count++] = *entry;
+    return 0;
+}
+
+/**
+ * Fills the on-disk header from the in-memory index.
+ */
+static void fill_header(const day_index *idx, struct index_header *header)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, DAYINDEX_MAGIC, sizeof(DAYINDEX_MAGIC));
+    header->version = DAYINDEX_VERSION;
+    header->flags = idx->flags;
+    header->covered = idx->covered;
+    header->last_ts = idx->last_ts;
+    header->entries = (uint32_t)idx->count;
+    if (idx->count > 0)
+    {
+        header->open = idx->entries[idx->count - 1];
+    }
+}
+
+/**
+ * Resets the index to cover nothing.
+ */
+static void reset(day_index *idx)
+{
+    idx->count = 0;
+    idx->covered = idx->binary ? (int64_t)sizeof(binlog_header) : 0;
+    idx->last_ts = 0;
+    idx->flags = DAYINDEX_SORTED;
+}
+
+/**
+ * Reads the sidecar into idx. Returns 0 if it was valid for the log.
+ */
+static int read_sidecar(day_index *idx, const char *index_path, const char *log_path)
+{
+    FILE *file = fopen(index_path, "rb");
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    struct index_header header;
+    int ok = fread(&header, sizeof(header), 1, file) == 1 &&
+             memcmp(header.magic, DAYINDEX_MAGIC, sizeof(DAYINDEX_MAGIC)) == 0 &&
+             header.version == DAYINDEX_VERSION;
+    // Sealed segments count towards the size; offsets run across them and the live file. The
+    // log is measured after the header is read, so a recorder appending meanwhile only makes it
+    // longer than what the header covers.
+    ok = ok && header.covered <= segment_log_size(log_path);
+
+    for (uint32_t i = 0; ok && i + 1 < header.entries; i++)
+    {
+        day_entry entry;
+        ok = fread(&entry, sizeof(entry), 1, file) == 1 && push_entry(idx, &entry) == 0;
+    }
+    if (ok && header.entries > 0)
+    {
+        ok = push_entry(idx, &header.open) == 0;
+    }
+    fclose(file);
+
+    if (!ok)
+    {
+        reset(idx);
+        return -1;
+    }
+    idx->covered = header.covered;
+    idx->last_ts = header.last_ts;
+    idx->flags = header.flags;
+    return 0;
+}
+
+/**
+ * Adds a record to the in-memory index only.
+ */
+static int add_memory(day_index *idx, int64_t offset, int64_t end, time_t timestamp, double duration)
+{
+    int32_t day = day_bucket(&idx->bucketer, timestamp);
+
+    if (idx->count > 0 && timestamp < idx->last_ts)
+    {
+        idx->flags &= ~DAYINDEX_SORTED;
+    }
+    idx->last_ts = timestamp;
+    idx->covered = end;
+
+    if (idx->count > 0 && idx->entries[idx->count - 1].day == day)
+    {
+        day_entry *last = &idx->entries[idx->count - 1];
+        last->count++;
+        last->sum += duration;
+        return 0;
+    }
+
+    day_entry entry = { day, 1, offset, duration };
+    return push_entry(idx, &entry);
+}
+
+int log_parse_row(const char *line, time_t *timestamp, float *duration)
+{
+    char *end;
+    long t = strtol(line, &end, 10);
+    if (end == line || *end != ',')
+    {
+        return -1;
+    }
+    const char *start = end + 1;
+    float d = strtof(start, &end);
+    if (end == start)
+    {
+        return -1;
+    }
+    *timestamp = (time_t)t;
+    *duration = d;
+    return 0;
+}
+
+/**
+ * Reports a CSV line to fn, or with its device to record_fn. Returns -1 if it is not a record,
+ * otherwise what the callback returned.
+ */
+static int report_line(const char *line, int64_t offset, int64_t end, log_row_fn fn, log_record_fn record_fn,
+                       void *ctx)
+{
+    time_t timestamp;
+    float duration;
+    if (log_parse_row(line, &timestamp, &duration) != 0)
+    {
+        return -1;
+    }
+    if (fn != NULL)
+    {
+        return fn(offset, end, timestamp, duration, ctx) != 0;
+    }
+
+    binlog_record record = { (int64_t)timestamp, duration, 0 };
+    const char *device = strchr(strchr(line, ',') + 1, ',');
+    if (device != NULL)
+    {
+        record.device = (uint32_t)strtoul(device + 1, NULL, 10);
+    }
+    return record_fn(offset, end, &record, ctx) != 0;
+}
+
+/**
+ * Reads the records of a log from a byte offset, reporting them to fn, or with their device to record_fn.
+ */
+static int64_t scan_log(const char *log_path, int binary, int64_t from, log_row_fn fn, log_record_fn record_fn,
+                        void *ctx)
+{
+    segment_list segments;
+    FILE *log = segment_open_live(log_path, &segments);
+    if (log == NULL)
+    {
+        return -1;
+    }
+
+    // Records before the live file are decoded from the sealed segments
+    if (from < segments.sealed)
+    {
+        int stopped;
+        int64_t sealed = fn != NULL ? segment_scan(&segments, from, fn, ctx, &stopped)
+                                    : segment_scan_records(&segments, from, record_fn, ctx, &stopped);
+        if (sealed < 0 || stopped)
+        {
+            segment_list_free(&segments);
+            fclose(log);
+            return sealed;
+        }
+        from = sealed;
+    }
+    int64_t base = segments.base;
+    segment_list_free(&segments);
+    if (fseek(log, from - base, SEEK_SET) != 0)
+    {
+        fclose(log);
+        return -1;
+    }
+
+    int64_t offset = from;
+
+    if (binary)
+    {
+        binlog_record record;
+        while (fread(&record, sizeof(record), 1, log) == 1)
+        {
+            int64_t end = offset + sizeof(record);
+            int stop = fn != NULL ? fn(offset, end, (time_t)record.timestamp, record.duration, ctx)
+                                  : record_fn(offset, end, &record, ctx);
+            offset = end;
+            if (stop)
+            {
+                break;
+            }
+        }
+    }
+    else
+    {
+        char line[256];
+        while (fgets(line, sizeof(line), log) != NULL)
+        {
+            size_t len = strlen(line);
+
+            if (len == 0 || line[len - 1] != '\n')
+            {
+                // Last line without a newline, or an overlong line that is not a record
+                if (feof(log))
+                {
+                    if (report_line(line, offset, offset + len, fn, record_fn, ctx) >= 0)
+                    {
+                        offset += len;
+                    }
+                    break;
+                }
+                int c;
+                while ((c = fgetc(log)) != EOF && c != '\n')
+                {
+                    len++;
+                }
+                if (c == EOF)
+                {
+                    break;
+                }
+                offset += len + 1;
+                continue;
+            }
+
+            int64_t end = offset + len;
+            int stop = report_line(line, offset, end, fn, record_fn, ctx);
+            offset = end;
+            if (stop > 0)
+            {
+                break;
+            }
+        }
+    }
+
+    fclose(log);
+    return offset;
+}
+
+int64_t log_scan(const char *log_path, int binary, int64_t from, log_row_fn fn, void *ctx)
+{
+    return scan_log(log_path, binary, from, fn, NULL, ctx);
+}
+
+int64_t log_scan_records(const char *log_path, int binary, int64_t from, log_record_fn fn, void *ctx)
+{
+    return scan_log(log_path, binary, from, NULL, fn, ctx);
+}
+
+/**
+ * log_scan() callback adding each record to the in-memory index.
+ */
+static int add_scanned(int64_t offset, int64_t end, time_t timestamp, float duration, void *ctx)
+{
+    add_memory(ctx, offset, end, timestamp, duration);
+    return 0;
+}
+
+/**
+ * Scans the log from the covered offset and adds every complete record.
+ */
+static int catch_up(day_index *idx, const char *log_path)
+{
+    int threads = scan_threads;
+    if (threads <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
+    if (threads > DAYSCAN_MAX_THREADS)
+    {
+        threads = DAYSCAN_MAX_THREADS;
+    }
+
+    int64_t size = segment_log_size(log_path);
+    if (threads > 1 && size - idx->covered >= PARALLEL_MIN_BYTES && dayscan_parallel(idx, log_path, threads) == 0)
+    {
+        return 0;
+    }
+
+    int64_t covered = log_scan(log_path, idx->binary, idx->covered, add_scanned, idx);
+    if (covered < 0)
+    {
+        return -1;
+    }
+    idx->covered = covered;
+    return 0;
+}
+
+void dayindex_set_threads(int threads)
+{
+    scan_threads = threads;
+}
+
+/**
+ * Writes the index to a new file at path. Returns 0 on success.
+ */
+static int write_sidecar(const day_index *idx, int fd, const char *path)
+{
+    FILE *file = fdopen(fd, "wb");
+    if (file == NULL)
+    {
+        close(fd);
+        remove(path);
+        return -1;
+    }
+
+    struct index_header header;
+    fill_header(idx, &header);
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    if (ok && idx->count > 1)
+    {
+        ok = fwrite(idx->entries, sizeof(day_entry), idx->count - 1, file) == idx->count - 1;
+    }
+    ok = (fclose(file) == 0) && ok;
+    if (!ok)
+    {
+        remove(path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Writes the index next to its path and links it into place unless an index exists by then.
+ */
+static int create_sidecar(const day_index *idx)
+{
+    char tmp_path[sizeof(idx->path) + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", idx->path);
+    int fd = mkstemp(tmp_path);
+    if (fd >= 0)
+    {
+        // Readable like a sidecar created by the recorder
+        fchmod(fd, 0644);
+    }
+    if (fd < 0 || write_sidecar(idx, fd, tmp_path) != 0)
+    {
+        return -1;
+    }
+
+    // link() fails if another process created the index meanwhile; its copy is kept
+    int ok = link(tmp_path, idx->path) == 0;
+    remove(tmp_path);
+    return ok ? 0 : -1;
+}
+
+int dayindex_load(day_index *idx, const char *log_path)
+{
+    memset(idx, 0, sizeof(*idx));
+    idx->fd = -1;
+    day_bucketer_init(&idx->bucketer);
+
+    if (snprintf(idx->path, sizeof(idx->path), "%s%s", log_path, DAYINDEX_SUFFIX) >= (int)sizeof(idx->path))
+    {
+        return -1;
+    }
+    idx->binary = binlog_detect(log_path);
+    reset(idx);
+
+    int had_sidecar = read_sidecar(idx, idx->path, log_path) == 0;
+
+    if (catch_up(idx, log_path) != 0)
+    {
+        dayindex_free(idx);
+        return -1;
+    }
+
+    // A reader only creates a missing index. One it found stale may belong to a recorder
+    // that keeps writing to it, which replacing the file would cut off from the index on disk.
+    if (!had_sidecar)
+    {
+        create_sidecar(idx);
+    }
+    return 0;
+}
+
+int dayindex_save(day_index *idx)
+{
+    char tmp_path[sizeof(idx->path) + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", idx->path);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write_sidecar(idx, fd, tmp_path) != 0)
+    {
+        return -1;
+    }
+    if (rename(tmp_path, idx->path) != 0)
+    {
+        remove(tmp_path);
+        return -1;
+    }
+
+    // The recorder keeps writing through a descriptor on the new file
+    if (idx->fd >= 0)
+    {
+        close(idx->fd);
+        idx->fd = open(idx->path, O_RDWR);
+    }
+    return 0;
+}
+
+int dayindex_open(day_index *idx, const char *log_path)
+{
+    if (dayindex_load(idx, log_path) != 0)
+    {
+        return -1;
+    }
+    if (dayindex_save(idx) != 0)
+    {
+        dayindex_free(idx);
+        return -1;
+    }
+    idx->fd = open(idx->path, O_RDWR);
+    if (idx->fd < 0)
+    {
+        dayindex_free(idx);
+        return -1;
+    }
+    return 0;
+}
+
+int dayindex_rebuild(const char *log_path)
+{
+    char index_path[sizeof(((day_index *)0)->path)];
+    snprintf(index_path, sizeof(index_path), "%s%s", log_path, DAYINDEX_SUFFIX);
+    remove(index_path);
+
+    day_index idx;
+    if (dayindex_load(&idx, log_path) != 0)
+    {
+        return -1;
+    }
+    dayindex_free(&idx);
+    return 0;
+}
+
+int dayindex_add(day_index *idx, int64_t offset, int64_t end, time_t timestamp, double duration)
+{
+    size_t before = idx->count;
+    if (add_memory(idx, offset, end, timestamp, duration) != 0)
+    {
+        return -1;
+    }
+    if (idx->fd < 0)
+    {
+        return 0;
+    }
+
+    // A new day seals the previous entry into the array before the header moves on
+    if (idx->count > before && idx->count >= 2)
+    {
+        off_t at = sizeof(struct index_header) + (off_t)(idx->count - 2) * sizeof(day_entry);
+        if (pwrite(idx->fd, &idx->entries[idx->count - 2], sizeof(day_entry), at) != sizeof(day_entry))
+        {
+            return -1;
+        }
+    }
+
+    struct index_header header;
+    fill_header(idx, &header);
+    if (pwrite(idx->fd, &header, sizeof(header), 0) != sizeof(header))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Passes the records of one day entry to the caller of dayindex_rows()
+ */
+struct entry_rows {
+    uint32_t count;
+    uint32_t seen;
+    void (*fn)(time_t timestamp, float duration, void *ctx);
+    void *ctx;
+};
+
+/**
+ * log_scan() callback stopping after the records of the entry.
+ */
+static int add_entry_row(int64_t offset, int64_t end, time_t timestamp, float duration, void *ctx)
+{
+    (void)offset;
+    (void)end;
+    struct entry_rows *rows = ctx;
+    rows->fn(timestamp, duration, rows->ctx);
+    return ++rows->seen >= rows->count;
+}
+
+int dayindex_rows(const day_index *idx, const day_entry *entry,
+                  void (*fn)(time_t timestamp, float duration, void *ctx), void *ctx)
+{
+    char log_path[sizeof(idx->path)];
+    size_t len = strlen(idx->path) - strlen(DAYINDEX_SUFFIX);
+    memcpy(log_path, idx->path, len);
+    log_path[len] = '\0';
+
+    if (entry->count == 0)
+    {
+        return 0;
+    }
+    // The entry may start in a sealed segment and run on into the live file
+    struct entry_rows rows = { entry->count, 0, fn, ctx };
+    return log_scan(log_path, idx->binary, entry->offset, add_entry_row, &rows) < 0 ? -1 : 0;
+}
+
+void dayindex_free(day_index *idx)
+{
+    if (idx->fd >= 0)
+    {
+        close(idx->fd);
+    }
+    free(idx->entries);
+    idx->entries = NULL;
+    idx->count = 0;
+    idx->capacity = 0;
+    idx->fd = -1;
+}
@@ -0,0 +1,193 @@
+#ifndef DAYINDEX_H
+#define DAYINDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include "../daybucket/daybucket.h"
+#include "../binlog/binlog.h"
+
+#define DAYINDEX_MAGIC "FEEDIDX"
+#define DAYINDEX_VERSION 1
+// Appended to the log path to get the path of its index
+#define DAYINDEX_SUFFIX ".idx"
+// Set in flags while every record so far was appended in time order
+#define DAYINDEX_SORTED 1u
+
+/**
+ * @brief Run of consecutive records of one local day (24 bytes)
+ *
+ * A new entry starts whenever the day of a record differs from the day of
+ * the record before it, so in a time-ordered log there is one entry per day.
+ */
+typedef struct day_entry {
+    int32_t day;
+    uint32_t count;
+    int64_t offset;
+    double sum;
+} day_entry;
+
+/**
+ * @brief In-memory copy of a log's day index
+ */
+typedef struct day_index {
+    char path[512];
+    int binary;
+    day_entry *entries;
+    size_t count;
+    size_t capacity;
+    int64_t covered;
+    int64_t last_ts;
+    uint32_t flags;
+    int fd;
+    day_bucketer bucketer;
+} day_index;
+
+/**
+ * @brief Called by log_scan() for every record
+ *
+ * @param offset Byte offset of the record in the log
+ * @param end Byte offset just after the record
+ * @param timestamp Timestamp of the record
+ * @param duration Duration of the record
+ * @param ctx Context passed to log_scan()
+ * @return int 0 to continue, non-zero to stop the scan after this record
+ */
+typedef int (*log_row_fn)(int64_t offset, int64_t end, time_t timestamp, float duration, void *ctx);
+
+/**
+ * @brief Called by log_scan_records() for every record
+ *
+ * @param offset Byte offset of the record in the log
+ * @param end Byte offset just after the record
+ * @param record Timestamp, duration and device id (0 if untagged) of the record
+ * @param ctx Context passed to log_scan_records()
+ * @return int 0 to continue, non-zero to stop the scan after this record
+ */
+typedef int (*log_record_fn)(int64_t offset, int64_t end, const binlog_record *record, void *ctx);
+
+/**
+ * @brief Parses a "timestamp,duration[,...]" CSV line
+ *
+ * @param line Line to parse
+ * @param timestamp Set to the timestamp on success
+ * @param duration Set to the duration on success
+ * @return int 0 on success, -1 if the line is not a record
+ */
+int log_parse_row(const char *line, time_t *timestamp, float *duration);
+
+/**
+ * @brief Reads every complete record of a CSV or binary log from a byte offset
+ *
+ * Lines that are not records are skipped. A last line without a newline is
+ * still reported if it holds a whole record. Offsets run across the sealed
+ * segments of the log (see segment.h) and its live file, and records before
+ * the live file are decoded from the segments.
+ *
+ * @param log_path Path of the log
+ * @param binary 1 for a binary log, 0 for CSV
+ * @param from Byte offset of the first record to read
+ * @param fn Called for each record
+ * @param ctx Passed to fn
+ * @return int64_t Offset up to which the log was read (just after the last record
+ *         reported when fn stopped the scan), or -1 if it cannot be read
+ */
+int64_t log_scan(const char *log_path, int binary, int64_t from, log_row_fn fn, void *ctx);
+
+/**
+ * @brief Reads every complete record of a log from a byte offset, with its device id
+ *
+ * Same as log_scan(), for callers that need the whole record. A CSV line
+ * without a third column, or with one that is not a number, has device 0.
+ *
+ * @param log_path Path of the log
+ * @param binary 1 for a binary log, 0 for CSV
+ * @param from Byte offset of the first record to read
+ * @param fn Called for each record
+ * @param ctx Passed to fn
+ * @return int64_t Same as log_scan()
+ */
+int64_t log_scan_records(const char *log_path, int binary, int64_t from, log_record_fn fn, void *ctx);
+
+/**
+ * @brief Sets how many threads scan the log when an index is built or far behind
+ *
+ * The result does not depend on the number of threads. Small catch-ups
+ * are always scanned on the calling thread.
+ *
+ * @param threads Number of threads, 1 to scan serially, 0 for one per online CPU (the default)
+ */
+void dayindex_set_threads(int threads);
+
+/**
+ * @brief Loads the index of a log and brings it up to date with the log
+ *
+ * Records appended after the index was last written are scanned and added
+ * in memory. A missing or damaged index is rebuilt from the whole log.
+ *
+ * @param idx Index to fill
+ * @param log_path Path of the CSV stats file or binary log
+ * @return int 0 on success, -1 if the log cannot be read
+ */
+int dayindex_load(day_index *idx, const char *log_path);
+
+/**
+ * @brief Opens the index of a log for maintenance by the recorder
+ *
+ * Like dayindex_load(), then writes the whole index so that later calls to
+ * dayindex_add() only have to update its tail.
+ *
+ * @param idx Index to fill
+ * @param log_path Path of the log the recorder appends to
+ * @return int 0 on success, -1 if error occurs
+ */
+int dayindex_open(day_index *idx, const char *log_path);
+
+/**
+ * @brief Adds a record that was just appended to the log
+ *
+ * @param idx Index loaded with dayindex_load() or dayindex_open()
+ * @param offset Byte offset of the record in the log
+ * @param end Byte offset just after the record
+ * @param timestamp Timestamp of the record
+ * @param duration Duration of the record
+ * @return int 0 on success, -1 if error occurs
+ */
+int dayindex_add(day_index *idx, int64_t offset, int64_t end, time_t timestamp, double duration);
+
+/**
+ * @brief Writes the whole index next to its log, replacing any previous one
+ *
+ * @param idx Index to write
+ * @return int 0 on success, -1 if error occurs
+ */
+int dayindex_save(day_index *idx);
+
+/**
+ * @brief Throws away the index of a log and builds it again from the whole log
+ *
+ * @param log_path Path of the log
+ * @return int 0 on success, -1 if error occurs
+ */
+int dayindex_rebuild(const char *log_path);
+
+/**
+ * @brief Calls fn for every record of one index entry, read straight from its offset
+ *
+ * @param idx Loaded index
+ * @param entry Entry whose records are wanted
+ * @param fn Called with the timestamp and duration of each record
+ * @param ctx Passed to fn
+ * @return int 0 on success, -1 if the log cannot be read
+ */
+int dayindex_rows(const day_index *idx, const day_entry *entry,
+                  void (*fn)(time_t timestamp, float duration, void *ctx), void *ctx);
+
+/**
+ * @brief Releases an index
+ *
+ * @param idx Index to release
+ */
+void dayindex_free(day_index *idx);
+
+#endif /* DAYINDEX_H */
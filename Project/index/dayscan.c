@@ -0,0 +1,376 @@
+/**
+ * @file dayscan.c
+ * @brief Parallel scan of a stats log into day index entries
+ *
+ * Building the index of a log with hundreds of millions of rows is bound by
+ * parsing, so the log is mapped and cut into chunks at line starts (or
+ * record boundaries for a binary log), and every chunk is parsed on its own
+ * thread into runs of same-day records.
+ *
+ * The merge has to give exactly what a serial scan gives, including the
+ * floating-point sums. A run that continues the last run of the previous
+ * chunk is therefore not added as a partial sum: its durations are kept
+ * and added one by one to the previous run, in the same order as the
+ * serial scan adds them. Runs that start a new day start from zero in both
+ * cases, so their sums are already identical. -selftest compares the two
+ * entry by entry on generated CSV and binary logs.
+ *
+ * CSV lines are found and converted by the vectorized scanner in
+ * csvscan.c. Rows it cannot convert exactly like strtof() go through
+ * log_parse_row(), and lines are accepted or skipped by the same length
+ * rules as log_scan().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dayscan.h"
+#include "csvscan.h"
+#include "../binlog/binlog.h"
+#include "../segment/segment.h"
+
+// log_scan() reads lines with a 256-byte buffer, so longer lines are not records
+#define LINE_MAX_LEN 254
+
+/**
+ * @brief Work and result of one thread
+ */
+struct chunk {
+    const char *base;
+    int64_t shift;     // offset of the mapped live file in the logical log
+    int binary;
+    int64_t begin;
+    int64_t end;
+    int last;
+
+    day_entry *entries;
+    size_t count;
+    size_t capacity;
+    // Durations of the first run, replayed if it continues the previous chunk
+    float *lead;
+    size_t lead_count;
+    size_t lead_capacity;
+
+    int64_t covered;
+    int has_records;
+    int sorted;
+    time_t first_ts;
+    time_t last_ts;
+    int error;
+    day_bucketer bucketer;
+};
+
+/**
+ * Parses one line of len bytes (without its newline).
+ */
+static int parse_line(const char *p, size_t len, size_t comma, time_t *timestamp, float *duration)
+{
+    if (csv_parse_row(p, len, comma, timestamp, duration) == 0)
+    {
+        return 0;
+    }
+    char line[LINE_MAX_LEN + 1];
+    memcpy(line, p, len);
+    line[len] = '\0';
+    return log_parse_row(line, timestamp, duration);
+}
+
+/**
+ * Appends to a growable array of elements of the given size.
+ */
+static int grow(void **array, size_t *capacity, size_t count, size_t size)
+{
+    if (count < *capacity)
+    {
+        return 0;
+    }
+    size_t wanted = *capacity ? *capacity * 2 : 64;
+    void *grown = realloc(*array, wanted * size);
+    if (grown == NULL)
+    {
+        return -1;
+    }
+    *array = grown;
+    *capacity = wanted;
+    return 0;
+}
+
+/**
+ * Adds one record to the runs of a chunk, like add_memory() does for the index.
+ */
+static void add_record(struct chunk *c, int64_t offset, time_t timestamp, float duration)
+{
+    int32_t day = day_bucket(&c->bucketer, timestamp);
+
+    if (!c->has_records)
+    {
+        c->first_ts = timestamp;
+        c->has_records = 1;
+    }
+    else if (timestamp < c->last_ts)
+    {
+        c->sorted = 0;
+    }
+    c->last_ts = timestamp;
+
+    if (c->count > 0 && c->entries[c->count - 1].day == day)
+    {
+        day_entry *last = &c->entries[c->count - 1];
+        last->count++;
+        last->sum += duration;
+    }
+    else
+    {
+        if (grow((void **)&c->entries, &c->capacity, c->count, sizeof(day_entry)) != 0)
+        {
+            c->error = 1;
+            return;
+        }
+        day_entry entry = { day, 1, offset + c->shift, duration };
+        c->entries[c->count++] = entry;
+    }
+
+    if (c->count == 1)
+    {
+        if (grow((void **)&c->lead, &c->lead_capacity, c->lead_count, sizeof(float)) != 0)
+        {
+            c->error = 1;
+            return;
+        }
+        c->lead[c->lead_count++] = duration;
+    }
+}
+
+/**
+ * Thread body: parses the records of one chunk.
+ */
+static void *scan_chunk(void *arg)
+{
+    struct chunk *c = arg;
+    int64_t offset = c->begin;
+
+    if (c->binary)
+    {
+        const binlog_record *record = (const binlog_record *)(c->base + c->begin);
+        for (; offset + (int64_t)sizeof(*record) <= c->end && !c->error; offset += sizeof(*record), record++)
+        {
+            add_record(c, offset, (time_t)record->timestamp, record->duration);
+        }
+        c->covered = offset;
+        return NULL;
+    }
+
+    csv_scanner scanner;
+    csv_scan_init(&scanner, c->base + c->begin, (size_t)(c->end - c->begin));
+    size_t start, len, comma;
+    int found;
+    while (!c->error && (found = csv_scan_next(&scanner, &start, &len, &comma)) != 0)
+    {
+        const char *line = c->base + c->begin + start;
+        time_t timestamp;
+        float duration;
+
+        if (found == 2)
+        {
+            // Only the last chunk can end without a newline; its last line counts if it is a record
+            if (c->last && len <= LINE_MAX_LEN && parse_line(line, len, comma, &timestamp, &duration) == 0)
+            {
+                add_record(c, offset, timestamp, duration);
+                offset += len;
+            }
+            break;
+        }
+
+        if (len <= LINE_MAX_LEN && parse_line(line, len, comma, &timestamp, &duration) == 0)
+        {
+            add_record(c, offset, timestamp, duration);
+        }
+        offset += len + 1;
+    }
+    c->covered = offset;
+    return NULL;
+}
+
+/**
+ * Moves the runs of every chunk into the index, in log order.
+ */
+static void merge(day_index *idx, struct chunk *chunks, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        struct chunk *c = &chunks[i];
+        if (!c->has_records)
+        {
+            continue;
+        }
+
+        if (!c->sorted || (idx->count > 0 && c->first_ts < idx->last_ts))
+        {
+            idx->flags &= ~DAYINDEX_SORTED;
+        }
+        idx->last_ts = c->last_ts;
+
+        size_t first = 0;
+        if (idx->count > 0 && idx->entries[idx->count - 1].day == c->entries[0].day)
+        {
+            day_entry *last = &idx->entries[idx->count - 1];
+            last->count += c->entries[0].count;
+            for (size_t j = 0; j < c->lead_count; j++)
+            {
+                last->sum += c->lead[j];
+            }
+            first = 1;
+        }
+        memcpy(&idx->entries[idx->count], &c->entries[first], (c->count - first) * sizeof(day_entry));
+        idx->count += c->count - first;
+    }
+    idx->covered = chunks[count - 1].covered + chunks[count - 1].shift;
+}
+
+int dayscan_parallel(day_index *idx, const char *log_path, int threads)
+{
+    if (threads < 1 || threads > DAYSCAN_MAX_THREADS)
+    {
+        return -1;
+    }
+
+    // Only the live file is mapped; records still in sealed segments are left to log_scan()
+    segment_list segments;
+    FILE *live = segment_open_live(log_path, &segments);
+    if (live == NULL)
+    {
+        return -1;
+    }
+    int64_t shift = segments.base;
+    int64_t sealed = segments.sealed;
+    segment_list_free(&segments);
+    int fd = dup(fileno(live));
+    fclose(live);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    struct stat st;
+    if (idx->covered < sealed || fstat(fd, &st) != 0 || st.st_size < idx->covered - shift)
+    {
+        close(fd);
+        return -1;
+    }
+
+    int64_t size = st.st_size;
+    int64_t from = idx->covered - shift;
+    if (idx->binary)
+    {
+        // Only whole records are read
+        size = from + (size - from) / (int64_t)sizeof(binlog_record) * (int64_t)sizeof(binlog_record);
+    }
+    if (size == from)
+    {
+        close(fd);
+        return 0;
+    }
+
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+    const char *base = map;
+
+    struct chunk chunks[DAYSCAN_MAX_THREADS];
+    pthread_t ids[DAYSCAN_MAX_THREADS];
+    memset(chunks, 0, sizeof(chunks));
+
+    int64_t begin = from;
+    for (int i = 0; i < threads; i++)
+    {
+        int64_t end = from + (size - from) / threads * (i + 1);
+        if (i == threads - 1)
+        {
+            end = size;
+        }
+        else if (idx->binary)
+        {
+            end -= (end - from) % (int64_t)sizeof(binlog_record);
+        }
+        else
+        {
+            // Move the cut to the start of the next line
+            while (end < size && end > begin && base[end - 1] != '\n')
+            {
+                end++;
+            }
+        }
+        if (end < begin)
+        {
+            end = begin;
+        }
+
+        chunks[i].base = base;
+        chunks[i].shift = shift;
+        chunks[i].binary = idx->binary;
+        chunks[i].begin = begin;
+        chunks[i].end = end;
+        chunks[i].last = end == size;
+        chunks[i].covered = begin;
+        chunks[i].sorted = 1;
+        day_bucketer_init(&chunks[i].bucketer);
+        begin = end;
+    }
+
+    // The calling thread takes the first chunk
+    int started = 1;
+    int error = 0;
+    for (; started < threads; started++)
+    {
+        if (pthread_create(&ids[started], NULL, scan_chunk, &chunks[started]) != 0)
+        {
+            error = 1;
+            break;
+        }
+    }
+    scan_chunk(&chunks[0]);
+    for (int i = 1; i < started; i++)
+    {
+        pthread_join(ids[i], NULL);
+    }
+
+    // Reserve room for every run up front so the merge cannot fail half way
+    size_t needed = idx->count;
+    for (int i = 0; i < threads; i++)
+    {
+        error |= chunks[i].error;
+        needed += chunks[i].count;
+    }
+    if (!error && needed > idx->capacity)
+    {
+        day_entry *entries = realloc(idx->entries, needed * sizeof(day_entry));
+        if (entries == NULL)
+        {
+            error = 1;
+        }
+        else
+        {
+            idx->entries = entries;
+            idx->capacity = needed;
+        }
+    }
+    if (!error)
+    {
+        merge(idx, chunks, threads);
+    }
+
+    for (int i = 0; i < threads; i++)
+    {
+        free(chunks[i].entries);
+        free(chunks[i].lead);
+    }
+    munmap(map, (size_t)st.st_size);
+    return error ? -1 : 0;
+}
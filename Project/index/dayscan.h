@@ -0,0 +1,24 @@
+#ifndef DAYSCAN_H
+#define DAYSCAN_H
+
+#include "dayindex.h"
+
+// Most threads a scan is split over
+#define DAYSCAN_MAX_THREADS 64
+
+/**
+ * @brief Brings an index up to date by scanning the rest of the log on several threads
+ *
+ * The part of the log after idx->covered is split at record boundaries
+ * into one chunk per thread. Each thread parses its chunk into day runs and
+ * the runs are merged in log order, so the index ends up exactly as a
+ * serial scan with log_scan() would leave it.
+ *
+ * @param idx Index loaded from its sidecar (or reset), left unchanged on error
+ * @param log_path Path of the log
+ * @param threads Number of threads, 1..DAYSCAN_MAX_THREADS
+ * @return int 0 on success, -1 if the log cannot be mapped or a thread cannot be started
+ */
+int dayscan_parallel(day_index *idx, const char *log_path, int threads);
+
+#endif /* DAYSCAN_H */
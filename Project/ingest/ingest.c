@@ -0,0 +1,1037 @@
+/**
+ * @file ingest.c
+ * @brief Recording pipeline that ingests feed events from many devices at once
+ *
+ * Recording runs in three stages, each on its own thread:
+ *
+ * - reader (the calling thread): one poll() call waits on every open port
+ *   and the bytes are read straight into slots of the raw queue
+ * - parser: feeds the bytes to the link decoder of their device (see
+ *   packet.h), which hands binary frames on as events and text to the
+ *   matcher of the device, and puts every event found into the event queue
+ * - output: formats records, hands them to the group-commit writer (see
+ *   writer.h) and prints the status lines
+ *
+ * The stages are joined by bounded lock-free SPSC queues (see spsc.h) with
+ * preallocated slots, so no stage allocates per record and a slow disk or
+ * terminal never makes the reader wait: when a queue is full the newest
+ * data is dropped and counted instead. Queue depths, high-water marks and
+ * drop counters are printed on SIGUSR1 and when recording stops.
+ *
+ * Each stage also counts bytes, events and latencies in its own metrics
+ * shard (see metrics.h). Chunks carry the time they were read, so the
+ * writer can tell how long each record took from its first byte to the
+ * file; the totals are exported to "<stats file>.prom" while recording.
+ *
+ * The parser can also write every read it gets to a capture file (see
+ * capture.h), and replay_capture() feeds such a file back into the same
+ * stages in place of the ports, so field traffic can be reproduced. A
+ * replay has no device to keep up with, so its reader and parser wait for
+ * room in the queues instead of dropping.
+ *
+ * Records are written as
+ *
+ *     timestamp,duration[,device]
+ *
+ * where the device column is only present when devices are tagged, or as
+ * binlog records when the stats file is a binary log. The writer thread
+ * updates the day index, the rollup tables and the duration histograms next
+ * to the stats file once a record is in the file.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "ingest.h"
+#include "../serial/serial.h"
+#include "../serial/packet.h"
+#include "../binlog/binlog.h"
+#include "../index/dayindex.h"
+#include "../rollup/rollup.h"
+#include "../histogram/histogram.h"
+#include "../writer/writer.h"
+#include "../segment/segment.h"
+#include "../queue/spsc.h"
+#include "../metrics/metrics.h"
+#include "../capture/capture.h"
+
+// How often ports that are down are retried
+#define RETRY_MS 1000
+// Bytes carried by one raw queue slot
+#define RAW_CHUNK 256
+// Slots of the reader -> parser queue
+#define RAW_SLOTS 1024
+// Slots of the parser -> output queue
+#define EVENT_SLOTS 1024
+// Longest tag carried by an event
+#define EVENT_TAG_MAX 32
+// Reads per port and wakeup, so one busy port cannot starve the others
+#define READS_PER_WAKEUP 4
+
+// Set by SIGINT/SIGTERM so queued records are written before exiting
+static volatile sig_atomic_t stopping = 0;
+// Set by SIGUSR1 to print the pipeline counters
+static volatile sig_atomic_t reporting = 0;
+
+// Told about every written record, see ingest_set_observer()
+static writer_commit_fn observer = NULL;
+static void *observer_ctx = NULL;
+
+// Raw reads are also written here, see ingest_set_capture()
+static const char *capture_path = NULL;
+
+// Stats file shared by all devices, with its day index
+struct output
+{
+    log_writer *writer;
+    int binary;
+    int indexed;
+    day_index index;
+    int rolled;
+    rollup_set rollups;
+    int histograms;
+    histogram_set hist;
+};
+
+// Bytes read from one port, or a marker that the port was (re)opened
+struct raw_chunk
+{
+    int device;
+    int reset;
+    time_t time;
+    int64_t read_us;
+    size_t len;
+    char data[RAW_CHUNK];
+};
+
+// Event found by the parser
+struct event
+{
+    int device_id;
+    int duration;
+    time_t time;
+    int64_t first_us;
+    char tag[EVENT_TAG_MAX];
+    char value[MATCH_VALUE_MAX];
+};
+
+// Queues and counters shared by the stages
+struct pipeline
+{
+    spsc_queue raw;
+    spsc_queue events;
+    atomic_ullong dropped_bytes;
+    atomic_ullong discarded;
+    atomic_ullong frames;
+    atomic_ullong bad_frames;
+    atomic_ullong lost;
+    int lossless;        // replaying: the parser waits for room in the event queue instead of dropping
+    struct output *out;
+};
+
+// Reader side of a device
+struct device
+{
+    const char *port;
+    int id;
+    serial_session *session;
+    time_t next_retry;
+};
+
+// Parser side of a device
+struct parser_device
+{
+    int id;
+    matcher *events;
+    unsigned long long discarded;
+    packet_decoder link;
+    time_t time;
+    int64_t read_us;     // when the chunk being parsed was read
+    int64_t first_us;    // when the first byte of the event being received was read, 0 if none
+    struct pipeline *pipe;
+};
+
+// Arguments of the parser thread
+struct parser_stage
+{
+    struct pipeline *pipe;
+    struct parser_device *devices;
+    int count;
+    capture_writer *capture;
+};
+
+// Everything a recording owns apart from where the bytes come from
+struct recording
+{
+    struct output out;
+    struct pipeline pipe;
+    struct parser_stage stage;
+    pthread_t parser_thread;
+    pthread_t output_thread;
+};
+
+/**
+ * Reserves a queue slot, waiting for the consumer if the queue is full.
+ */
+static void *reserve_waiting(spsc_queue *queue)
+{
+    void *slot;
+    // Neither consumer blocks for long, so room appears quickly
+    while ((slot = spsc_reserve(queue)) == NULL)
+    {
+        struct timespec pause = { 0, 1000000 };
+        nanosleep(&pause, NULL);
+    }
+    return slot;
+}
+
+/**
+ * Queues an event of a device for the output stage.
+ */
+static void queue_event(struct parser_device *dev, int duration, const char *tag, const char *value)
+{
+    // An event that follows in the same read started in that read
+    int64_t first_us = dev->first_us ? dev->first_us : dev->read_us;
+    dev->first_us = 0;
+    metrics_count(METRIC_EVENTS_MATCHED, 1);
+
+    spsc_queue *events = &dev->pipe->events;
+    struct event *ev = dev->pipe->lossless ? reserve_waiting(events) : spsc_reserve(events);
+    if (ev == NULL)
+    {
+        spsc_drop(events);
+        return;
+    }
+    ev->device_id = dev->id;
+    ev->duration = duration;
+    ev->time = dev->time;
+    ev->first_us = first_us;
+    snprintf(ev->tag, sizeof(ev->tag), "%s", tag);
+    snprintf(ev->value, sizeof(ev->value), "%s", value ? value : "");
+    spsc_push(&dev->pipe->events);
+}
+
+/**
+ * Matcher handler for "Duration:[n]" events.
+ */
+static void on_duration(const char *tag, const char *value, void *ctx)
+{
+    queue_event(ctx, 1, tag, value);
+}
+
+/**
+ * Matcher handler for client connect and disconnect events.
+ */
+static void on_client_event(const char *tag, const char *value, void *ctx)
+{
+    queue_event(ctx, 0, tag, value);
+}
+
+/**
+ * Writes a duration in milliseconds as seconds, without trailing zeros.
+ */
+static void format_millis(char *out, size_t size, uint32_t ms)
+{
+    unsigned frac = ms % 1000;
+    if (frac == 0)
+    {
+        snprintf(out, size, "%u", (unsigned)(ms / 1000));
+        return;
+    }
+    int digits = 3;
+    while (frac % 10 == 0)
+    {
+        frac /= 10;
+        digits--;
+    }
+    snprintf(out, size, "%u.%0*u", (unsigned)(ms / 1000), digits, frac);
+}
+
+/**
+ * Link decoder handler: queues the events of a binary frame, named like
+ * the text events so the output stage treats both the same way.
+ */
+static void on_frame(const packet_frame *frame, void *ctx)
+{
+    char value[16];
+    for (size_t i = 0; i < frame->count; i++)
+    {
+        const packet_event *e = &frame->events[i];
+        switch (e->kind)
+        {
+        case PACKET_DURATION:
+            format_millis(value, sizeof(value), e->value);
+            queue_event(ctx, 1, "Duration:", value);
+            break;
+        case PACKET_CONNECT:
+            queue_event(ctx, 0, "New Client.", NULL);
+            break;
+        case PACKET_DISCONNECT:
+            queue_event(ctx, 0, "Client Disconnected.", NULL);
+            break;
+        }
+    }
+}
+
+/**
+ * Link decoder handler: text between frames goes through the matcher, so
+ * firmware built in text mode still works.
+ */
+static void on_text(const char *data, size_t len, void *ctx)
+{
+    struct parser_device *dev = ctx;
+    if (dev->events != NULL)
+    {
+        matcher_feed(dev->events, data, len);
+    }
+}
+
+/**
+ * Moves the counters of a link decoder into the pipeline totals.
+ */
+static void count_link(struct parser_device *dev)
+{
+    packet_decoder *link = &dev->link;
+    struct pipeline *pipe = dev->pipe;
+    atomic_fetch_add_explicit(&pipe->frames, link->frames, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pipe->bad_frames, link->bad_frames, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pipe->lost, link->lost, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pipe->discarded, link->discarded, memory_order_relaxed);
+    metrics_count(METRIC_BYTES_DISCARDED, link->discarded);
+    link->frames = 0;
+    link->bad_frames = 0;
+    link->lost = 0;
+    link->discarded = 0;
+}
+
+/**
+ * Creates the matcher for one device; every event type the firmware prints
+ * is extracted in one pass.
+ */
+static matcher *create_events(struct parser_device *dev)
+{
+    matcher *events = matcher_create();
+    if (events == NULL
+            || matcher_add(events, "Duration:", 1, on_duration, dev) != 0
+            || matcher_add(events, "New Client.", 0, on_client_event, dev) != 0
+            || matcher_add(events, "Client Disconnected.", 0, on_client_event, dev) != 0
+            || matcher_build(events) != 0)
+    {
+        matcher_destroy(events);
+        return NULL;
+    }
+    return events;
+}
+
+/**
+ * Parser thread: runs the matchers over the raw queue until the reader closes it.
+ */
+static void *parse_stage(void *arg)
+{
+    struct parser_stage *stage = arg;
+    struct pipeline *pipe = stage->pipe;
+
+    while (spsc_wait(&pipe->raw, -1) > 0)
+    {
+        struct raw_chunk *chunk;
+        while ((chunk = spsc_peek(&pipe->raw)) != NULL)
+        {
+            struct parser_device *dev = &stage->devices[chunk->device];
+            if (stage->capture != NULL &&
+                    capture_write(stage->capture, chunk->read_us, chunk->device, chunk->reset, chunk->data, chunk->len) != 0)
+            {
+                printf("Error writing capture file, capture stopped.\n");
+                capture_close(stage->capture);
+                stage->capture = NULL;
+            }
+            if (chunk->reset)
+            {
+                // A fresh matcher so a half-received event from before the drop is not completed
+                matcher_destroy(dev->events);
+                dev->events = create_events(dev);
+                dev->discarded = 0;
+                dev->first_us = 0;
+                packet_reset(&dev->link);
+                count_link(dev);
+                if (dev->events == NULL)
+                {
+                    printf("Out of memory.\n");
+                }
+            }
+            else if (dev->events != NULL)
+            {
+                dev->time = chunk->time;
+                dev->read_us = chunk->read_us;
+                if (dev->first_us == 0)
+                {
+                    dev->first_us = chunk->read_us;
+                }
+                packet_feed(&dev->link, chunk->data, chunk->len);
+                count_link(dev);
+                // The next event starts in a later read unless this one ends inside it
+                if (dev->link.len == 0 && !matcher_partial(dev->events))
+                {
+                    dev->first_us = 0;
+                }
+                else if (dev->first_us == 0)
+                {
+                    dev->first_us = chunk->read_us;
+                }
+
+                unsigned long long discarded = matcher_discarded(dev->events);
+                atomic_fetch_add_explicit(&pipe->discarded, discarded - dev->discarded, memory_order_relaxed);
+                metrics_count(METRIC_BYTES_DISCARDED, discarded - dev->discarded);
+                dev->discarded = discarded;
+            }
+            spsc_pop(&pipe->raw);
+        }
+        // The queue is drained, so a crash loses at most what arrived since
+        if (stage->capture != NULL && capture_flush(stage->capture) != 0)
+        {
+            printf("Error writing capture file, capture stopped.\n");
+            capture_close(stage->capture);
+            stage->capture = NULL;
+        }
+    }
+
+    spsc_close(&pipe->events);
+    return NULL;
+}
+
+/**
+ * Writes one duration event to the stats file.
+ */
+static int record_duration(struct output *out, const struct event *ev)
+{
+    double duration = strtod(ev->value, NULL);
+
+    if (out->binary)
+    {
+        binlog_record record;
+        memset(&record, 0, sizeof(record));
+        record.timestamp = ev->time;
+        record.duration = strtof(ev->value, NULL);
+        record.device = (uint32_t)ev->device_id;
+        return writer_append(out->writer, &record, sizeof(record), ev->time, duration, ev->first_us);
+    }
+
+    char line[128];
+    int len = ev->device_id > 0 ? snprintf(line, sizeof(line), "%ld,%s,%d\n", (long)ev->time, ev->value, ev->device_id)
+                                : snprintf(line, sizeof(line), "%ld,%s\n", (long)ev->time, ev->value);
+    if (len <= 0 || len >= (int)sizeof(line))
+    {
+        return -1;
+    }
+    return writer_append(out->writer, line, (size_t)len, ev->time, duration, ev->first_us);
+}
+
+/**
+ * Reports a client connect or disconnect event with its local time.
+ */
+static void print_client_event(const struct event *ev)
+{
+    char timestr[26];
+    struct tm tm_event;
+
+    if (localtime_r(&ev->time, &tm_event))
+    {
+        strftime(timestr, sizeof(timestr), "%H:%M:%S", &tm_event);
+        if (ev->device_id > 0)
+        {
+            printf("%s [device %d] %s\n", timestr, ev->device_id, ev->tag);
+        }
+        else
+        {
+            printf("%s %s\n", timestr, ev->tag);
+        }
+    }
+}
+
+/**
+ * Output thread: records and reports events until the parser closes the queue.
+ */
+static void *output_stage(void *arg)
+{
+    struct pipeline *pipe = arg;
+
+    while (spsc_wait(&pipe->events, -1) > 0)
+    {
+        struct event *ev;
+        while ((ev = spsc_peek(&pipe->events)) != NULL)
+        {
+            if (!ev->duration)
+            {
+                print_client_event(ev);
+            }
+            else if (record_duration(pipe->out, ev) != 0)
+            {
+                printf("Error recording event.\n");
+            }
+            else if (ev->device_id > 0)
+            {
+                printf("Recorded (device %d).\n", ev->device_id);
+            }
+            else
+            {
+                printf("Recorded.\n");
+            }
+            spsc_pop(&pipe->events);
+        }
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+/**
+ * Writer callback: indexes a record once it is in the stats file.
+ *
+ * Runs on the writer thread, which is the only thread using the index and
+ * the rollups while recording.
+ */
+static void on_commit(int64_t offset, int64_t end, time_t timestamp, double duration, void *ctx)
+{
+    struct output *out = ctx;
+    if (out->indexed)
+    {
+        dayindex_add(&out->index, offset, end, timestamp, duration);
+    }
+    if (out->rolled)
+    {
+        rollup_add(&out->rollups, end, timestamp, duration);
+    }
+    if (out->histograms)
+    {
+        histogram_add_record(&out->hist, end, timestamp, duration);
+    }
+    if (observer != NULL)
+    {
+        observer(offset, end, timestamp, duration, observer_ctx);
+    }
+}
+
+/**
+ * Asks the recording loop to stop.
+ */
+static void on_stop(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+/**
+ * Asks the recording loop to print the pipeline counters.
+ */
+static void on_report(int sig)
+{
+    (void)sig;
+    reporting = 1;
+}
+
+/**
+ * Prints the depth, high-water mark and drop counter of every queue.
+ */
+static void print_pipeline(struct pipeline *pipe)
+{
+    printf("Raw queue: %zu/%zu (max %zu), %llu reads dropped (%llu bytes)\n",
+           spsc_depth(&pipe->raw), spsc_capacity(&pipe->raw),
+           atomic_load(&pipe->raw.high_water),
+           atomic_load(&pipe->raw.dropped), atomic_load(&pipe->dropped_bytes));
+    printf("Event queue: %zu/%zu (max %zu), %llu events dropped\n",
+           spsc_depth(&pipe->events), spsc_capacity(&pipe->events),
+           atomic_load(&pipe->events.high_water), atomic_load(&pipe->events.dropped));
+    printf("Unparsable bytes: %llu\n", atomic_load(&pipe->discarded));
+    printf("Device frames: %llu (%llu rejected), %llu events lost\n",
+           atomic_load(&pipe->frames), atomic_load(&pipe->bad_frames), atomic_load(&pipe->lost));
+}
+
+/**
+ * Queues a marker telling the parser that a device starts a new stream.
+ */
+static void queue_reset(struct pipeline *pipe, int index)
+{
+    struct raw_chunk *chunk = reserve_waiting(&pipe->raw);
+    chunk->device = index;
+    chunk->reset = 1;
+    chunk->time = time(NULL);
+    chunk->read_us = metrics_now_us();
+    chunk->len = 0;
+    spsc_push(&pipe->raw);
+}
+
+/**
+ * Tries to (re)open the port of a device that is down.
+ */
+static void try_open(struct device *dev, struct pipeline *pipe, int index, time_t now)
+{
+    if (dev->session != NULL || now < dev->next_retry)
+    {
+        return;
+    }
+
+    dev->session = serial_open(dev->port);
+    if (dev->session == NULL)
+    {
+        dev->next_retry = now + RETRY_MS / 1000;
+        return;
+    }
+    queue_reset(pipe, index);
+
+    if (dev->id > 0)
+    {
+        printf("Recording stats from %s as device %d..\n", dev->port, dev->id);
+    }
+    else
+    {
+        printf("Recording stats..\n");
+    }
+}
+
+/**
+ * Closes the port of a device after an error; it is retried later.
+ */
+static void drop(struct device *dev, time_t now)
+{
+    printf("Failed to read from device %s\n", dev->port);
+    serial_close(dev->session);
+    dev->session = NULL;
+    dev->next_retry = now + RETRY_MS / 1000;
+}
+
+/**
+ * Reads what a ready port has into the raw queue. Returns -1 if the port failed.
+ */
+static int pull(struct pipeline *pipe, struct device *dev, int index, time_t now)
+{
+    for (int i = 0; i < READS_PER_WAKEUP; i++)
+    {
+        struct raw_chunk *chunk = spsc_reserve(&pipe->raw);
+        char scratch[RAW_CHUNK];
+        int n = serial_read_raw(dev->session, chunk ? chunk->data : scratch, RAW_CHUNK);
+        if (n <= 0)
+        {
+            return n;
+        }
+
+        if (chunk == NULL)
+        {
+            // The port is still drained, so a stalled parser cannot stall the reader
+            spsc_drop(&pipe->raw);
+            atomic_fetch_add_explicit(&pipe->dropped_bytes, (unsigned long long)n, memory_order_relaxed);
+        }
+        else
+        {
+            chunk->device = index;
+            chunk->reset = 0;
+            chunk->time = now;
+            chunk->read_us = metrics_now_us();
+            chunk->len = (size_t)n;
+            spsc_push(&pipe->raw);
+        }
+        if (n < RAW_CHUNK)
+        {
+            break;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Opens the stats file through the group-commit writer, with its day index,
+ * rollups and histograms. Returns -1 if the stats file cannot be opened.
+ */
+static int open_output(struct output *out, const char *stats_file, const writer_policy *policy)
+{
+    // Binary logs are picked by content, or by extension for a new file
+    size_t name_len = strlen(stats_file);
+    out->binary = binlog_detect(stats_file) ||
+                  (name_len > 4 && strcmp(stats_file + name_len - 4, ".bin") == 0);
+
+    // A seal cut short by a crash is finished before anything reads the live file
+    if (segment_recover(stats_file) != 0)
+    {
+        printf("Warning: cannot read the segment list of %s.\n", stats_file);
+    }
+
+    // Writes the header of a new binary log or drops a torn record; a CSV log gets its torn line repaired
+    int prepared;
+    if (out->binary)
+    {
+        FILE *log = binlog_open(stats_file, 0);
+        prepared = log != NULL && fclose(log) == 0;
+    }
+    else
+    {
+        prepared = writer_repair_tail(stats_file) == 0;
+    }
+    if (!prepared)
+    {
+        printf("Error opening stats file.\n");
+        return -1;
+    }
+
+    // Nothing is queued yet, so the commit callback cannot run before the index is open
+    out->writer = writer_open(stats_file, policy, on_commit, out);
+    if (out->writer == NULL)
+    {
+        printf("Error opening stats file.\n");
+        return -1;
+    }
+
+    // Recording still works without an index; readers then catch up from the log
+    out->indexed = dayindex_open(&out->index, stats_file) == 0;
+    if (!out->indexed)
+    {
+        printf("Warning: cannot maintain the day index of %s.\n", stats_file);
+    }
+    out->rolled = rollup_open(&out->rollups, stats_file) == 0;
+    if (!out->rolled)
+    {
+        printf("Warning: cannot maintain the rollups of %s.\n", stats_file);
+    }
+    out->histograms = histogram_open(&out->hist, stats_file) == 0;
+    if (!out->histograms)
+    {
+        printf("Warning: cannot maintain the duration histograms of %s.\n", stats_file);
+    }
+    return 0;
+}
+
+/**
+ * Writes everything queued and closes the stats file and its sidecars.
+ */
+static void close_output(struct output *out)
+{
+    // Everything queued reaches the file (and the index) before the index is closed
+    writer_close(out->writer);
+    if (out->indexed)
+    {
+        dayindex_free(&out->index);
+    }
+    if (out->rolled)
+    {
+        rollup_close(&out->rollups);
+    }
+    if (out->histograms)
+    {
+        histogram_free(&out->hist);
+    }
+}
+
+/**
+ * Opens the output and starts the parser and output threads for count
+ * devices. Returns -1 if the stats file, the capture or the threads cannot
+ * be set up.
+ */
+static int start_recording(struct recording *rec, int count, int tag_devices, const char *stats_file,
+                           const writer_policy *policy)
+{
+    memset(rec, 0, sizeof(*rec));
+    if (open_output(&rec->out, stats_file, policy) != 0)
+    {
+        return -1;
+    }
+
+    struct pipeline *pipe = &rec->pipe;
+    pipe->out = &rec->out;
+    atomic_init(&pipe->dropped_bytes, 0);
+    atomic_init(&pipe->discarded, 0);
+    atomic_init(&pipe->frames, 0);
+    atomic_init(&pipe->bad_frames, 0);
+    atomic_init(&pipe->lost, 0);
+
+    struct parser_device *parsers = calloc(count, sizeof(*parsers));
+    int queues = spsc_init(&pipe->raw, RAW_SLOTS, sizeof(struct raw_chunk)) == 0;
+    queues = queues && spsc_init(&pipe->events, EVENT_SLOTS, sizeof(struct event)) == 0;
+
+    for (int i = 0; parsers != NULL && i < count; i++)
+    {
+        parsers[i].id = tag_devices ? i + 1 : 0;
+        parsers[i].pipe = pipe;
+        packet_init(&parsers[i].link, on_frame, on_text, &parsers[i]);
+    }
+
+    struct parser_stage stage = { pipe, parsers, count, NULL };
+    rec->stage = stage;
+    if (capture_path != NULL)
+    {
+        rec->stage.capture = capture_create(capture_path, count, tag_devices);
+        if (rec->stage.capture == NULL)
+        {
+            printf("Error creating capture file %s.\n", capture_path);
+            free(parsers);
+            if (pipe->raw.slots != NULL)
+            {
+                spsc_destroy(&pipe->raw);
+            }
+            if (pipe->events.slots != NULL)
+            {
+                spsc_destroy(&pipe->events);
+            }
+            close_output(&rec->out);
+            return -1;
+        }
+        printf("Capturing raw data to %s\n", capture_path);
+    }
+
+    int started = parsers != NULL && queues &&
+                  pthread_create(&rec->output_thread, NULL, output_stage, pipe) == 0;
+    if (started && pthread_create(&rec->parser_thread, NULL, parse_stage, &rec->stage) != 0)
+    {
+        spsc_close(&pipe->events);
+        pthread_join(rec->output_thread, NULL);
+        started = 0;
+    }
+    if (!started)
+    {
+        printf("Out of memory.\n");
+        free(parsers);
+        capture_close(rec->stage.capture);
+        if (pipe->raw.slots != NULL)
+        {
+            spsc_destroy(&pipe->raw);
+        }
+        if (pipe->events.slots != NULL)
+        {
+            spsc_destroy(&pipe->events);
+        }
+        close_output(&rec->out);
+        return -1;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_handler = on_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = on_report;
+    sigaction(SIGUSR1, &action, NULL);
+
+    if (metrics_export_start(stats_file) != 0)
+    {
+        printf("Warning: cannot export the metrics of %s.\n", stats_file);
+    }
+    return 0;
+}
+
+/**
+ * Lets the threads write everything queued, prints the pipeline counters
+ * and closes the stats file. Returns the number of reads and events dropped.
+ */
+static unsigned long long finish_recording(struct recording *rec)
+{
+    // Closing the raw queue drains the parser, which then closes the event queue
+    spsc_close(&rec->pipe.raw);
+    pthread_join(rec->parser_thread, NULL);
+    pthread_join(rec->output_thread, NULL);
+    print_pipeline(&rec->pipe);
+    unsigned long long dropped = atomic_load(&rec->pipe.raw.dropped) + atomic_load(&rec->pipe.events.dropped);
+
+    if (capture_close(rec->stage.capture) != 0)
+    {
+        printf("Error writing capture file.\n");
+    }
+    for (int i = 0; i < rec->stage.count; i++)
+    {
+        matcher_destroy(rec->stage.devices[i].events);
+    }
+    free(rec->stage.devices);
+    spsc_destroy(&rec->pipe.raw);
+    spsc_destroy(&rec->pipe.events);
+
+    close_output(&rec->out);
+    metrics_export_stop();
+    return dropped;
+}
+
+void ingest_set_observer(writer_commit_fn fn, void *ctx)
+{
+    observer = fn;
+    observer_ctx = ctx;
+}
+
+void ingest_set_capture(const char *path)
+{
+    capture_path = path;
+}
+
+int record_ports(const char **ports, int count, int tag_devices, const char *stats_file, const writer_policy *policy)
+{
+    struct recording rec;
+    if (start_recording(&rec, count, tag_devices, stats_file, policy) != 0)
+    {
+        return 1;
+    }
+
+    struct device *devices = calloc(count, sizeof(*devices));
+    struct pollfd *pfds = calloc(count, sizeof(*pfds));
+    int *owner = calloc(count, sizeof(*owner));
+    if (devices == NULL || pfds == NULL || owner == NULL)
+    {
+        printf("Out of memory.\n");
+        free(devices);
+        free(pfds);
+        free(owner);
+        finish_recording(&rec);
+        return 1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        devices[i].port = ports[i];
+        devices[i].id = tag_devices ? i + 1 : 0;
+    }
+
+    struct pipeline *pipe = &rec.pipe;
+    while (!stopping)
+    {
+        time_t now = time(NULL);
+        int nfds = 0;
+        int down = 0;
+
+        if (reporting)
+        {
+            reporting = 0;
+            print_pipeline(pipe);
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            try_open(&devices[i], pipe, i, now);
+            if (devices[i].session == NULL)
+            {
+                down++;
+                continue;
+            }
+            pfds[nfds].fd = serial_fd(devices[i].session);
+            pfds[nfds].events = POLLIN;
+            pfds[nfds].revents = 0;
+            owner[nfds] = i;
+            nfds++;
+        }
+
+        // Only wake up periodically while some port still has to be reopened
+        int ready = poll(pfds, nfds, down > 0 ? RETRY_MS : -1);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf("Error from poll: %s\n", strerror(errno));
+            break;
+        }
+
+        now = time(NULL);
+        for (int i = 0; i < nfds && ready > 0; i++)
+        {
+            if (pfds[i].revents == 0)
+            {
+                continue;
+            }
+            ready--;
+
+            struct device *dev = &devices[owner[i]];
+            if (pull(pipe, dev, owner[i], now) < 0)
+            {
+                drop(dev, now);
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        serial_close(devices[i].session);
+    }
+    free(devices);
+    free(pfds);
+    free(owner);
+    finish_recording(&rec);
+    return stopping ? 0 : 1;
+}
+
+int replay_capture(const char *path, const char *stats_file, const writer_policy *policy, double speed)
+{
+    capture_reader reader;
+    if (capture_open(&reader, path) != 0)
+    {
+        printf("Error: %s is not a capture file.\n", path);
+        return 1;
+    }
+
+    struct recording rec;
+    if (start_recording(&rec, reader.header.ports, (int)reader.header.tagged, stats_file, policy) != 0)
+    {
+        capture_end(&reader);
+        return 1;
+    }
+    // Set before the first chunk is queued, so the parser thread sees it through the queue
+    rec.pipe.lossless = 1;
+    if (speed > 0)
+    {
+        printf("Replaying %s at %gx speed..\n", path, speed);
+    }
+    else
+    {
+        printf("Replaying %s as fast as possible..\n", path);
+    }
+
+    capture_chunk entry;
+    int64_t start = metrics_now_us();
+    unsigned long long entries = 0;
+    unsigned long long bytes = 0;
+    int status = 0;
+    while (!stopping && (status = capture_next(&reader, &entry)) > 0)
+    {
+        if (speed > 0)
+        {
+            int64_t wait = start + (int64_t)(entry.offset_us / speed) - metrics_now_us();
+            if (wait > 0)
+            {
+                struct timespec pause = { (time_t)(wait / 1000000), (long)(wait % 1000000) * 1000 };
+                nanosleep(&pause, NULL);
+            }
+        }
+        entries++;
+        if (entry.reset)
+        {
+            queue_reset(&rec.pipe, entry.port);
+            continue;
+        }
+
+        // Records get the time the bytes arrived in the field; the queue waits instead of dropping
+        time_t arrived = (time_t)((reader.header.start_us + entry.offset_us) / 1000000);
+        for (size_t at = 0; at < entry.len; at += RAW_CHUNK)
+        {
+            struct raw_chunk *chunk = reserve_waiting(&rec.pipe.raw);
+            chunk->device = entry.port;
+            chunk->reset = 0;
+            chunk->time = arrived;
+            chunk->read_us = metrics_now_us();
+            chunk->len = entry.len - at < RAW_CHUNK ? entry.len - at : RAW_CHUNK;
+            memcpy(chunk->data, entry.data + at, chunk->len);
+            spsc_push(&rec.pipe.raw);
+        }
+        bytes += entry.len;
+    }
+    if (!stopping && status < 0)
+    {
+        printf("Warning: %s ends with a torn or corrupt entry.\n", path);
+    }
+    double captured_s = (double)reader.offset_us / 1e6;
+    capture_end(&reader);
+
+    unsigned long long dropped = finish_recording(&rec);
+    printf("Replayed %llu bytes in %llu reads, captured over %.1f s, in %.3f s.\n",
+           bytes, entries, captured_s, (double)(metrics_now_us() - start) / 1e6);
+    if (dropped > 0)
+    {
+        printf("Error: %llu reads or events were dropped, the replay is incomplete.\n", dropped);
+        return 1;
+    }
+    return 0;
+}
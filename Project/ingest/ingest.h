@@ -0,0 +1,64 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+#include "../writer/writer.h"
+
+/**
+ * @brief Sets a function that is told about every record record_ports() writes
+ *
+ * The function runs on the writer thread after the record is in the stats
+ * file and in its day index and rollups.
+ *
+ * @param fn Called for each written record, NULL for none
+ * @param ctx Passed to fn
+ */
+void ingest_set_observer(writer_commit_fn fn, void *ctx);
+
+/**
+ * @brief Makes record_ports() and replay_capture() also write every raw read to a capture file
+ *
+ * The file is replaced when recording starts; see capture.h for its format.
+ *
+ * @param path Path of the capture file, NULL for none
+ */
+void ingest_set_capture(const char *path);
+
+/**
+ * @brief Records feed events from one or more serial devices into a stats file
+ *
+ * All ports are waited on together with a single poll() loop. Ports that
+ * cannot be opened or that hang up are retried once per second.
+ * Metrics of the recorder are rewritten to "<stats_file>.prom" in the
+ * Prometheus text format every few seconds (see metrics.h).
+ *
+ * @param ports Serial port device paths
+ * @param count Number of ports
+ * @param tag_devices 1 to append the device id (position in ports, from 1) to every record,
+ *                    0 to write plain "timestamp,duration" records
+ * @param stats_file Path of the stats file records are appended to; an existing
+ *                   binary log or a new file ending in ".bin" is written as a binary log
+ * @param policy When queued records are written to the stats file and synced
+ * @return int 0 after SIGINT or SIGTERM once every queued record is written,
+ *             1 if the stats file cannot be opened or polling fails
+ */
+int record_ports(const char **ports, int count, int tag_devices, const char *stats_file, const writer_policy *policy);
+
+/**
+ * @brief Feeds a capture file through the recording pipeline in place of the serial ports
+ *
+ * Every read in the capture goes through the same link decoders, matchers
+ * and writer as in record_ports(), with the chunk boundaries it had in the
+ * field. Records get the time their bytes were captured, and devices are
+ * tagged if they were when capturing. Nothing is dropped: the replay waits
+ * for the pipeline instead.
+ *
+ * @param path Path of the capture file
+ * @param stats_file Path of the stats file records are appended to
+ * @param policy When queued records are written to the stats file and synced
+ * @param speed 1 to replay with the captured timing, 60 for a minute per second, 0 as fast as possible
+ * @return int 0 once the capture is replayed (or after SIGINT or SIGTERM),
+ *             1 if the capture or the stats file cannot be opened or anything was dropped
+ */
+int replay_capture(const char *path, const char *stats_file, const writer_policy *policy, double speed);
+
+#endif /* INGEST_H */
@@ -12,7 +12,44 @@
  *
  * Command line arguments:
  * - No argument: Continuously records duration stats from serial device
+ * - -ports or --p <port>...: Records from several devices at once, tagging
+ *   each record with the device id (position of its port, from 1)
+ * - -import <output> <input>... [--memory MB]: Merges logs in any order into one sorted log
+ *   without duplicates, within a fixed memory budget, and rebuilds its index
+ * - -export <file>: Writes the stats file to a columnar file with typed columns and
+ *   per-day row groups for analysis tools
+ * - -tobin <csv> <bin> / -tocsv <bin> <csv>: Converts between the CSV and binary log formats
+ * - -f or --f <file> <command>: Runs the command on <file> instead of stats.csv
+ * - -commit <policy> [-ports ...]: Records with a group-commit policy such as
+ *   "records=50,interval=1000" or "fsync" (default: write every record at once)
+ * - -capture <capture> [-ports ...]: Also writes the raw bytes read from the ports,
+ *   with their arrival times, to a capture file
+ * - -replay <capture> [--fast | --speed X]: Records a capture into the stats file through
+ *   the same parsing and logging path, with its timing, X times faster or as fast as possible
  * - -stats or --s: Displays usage statistics
+ * - -stats --percentiles [N]: Displays duration percentiles of the last N days and of all time
+ * - -stats --follow: Displays usage statistics and updates them as records are appended
+ * - -stats --day YYYY-MM-DD: Displays the statistics of one day
+ * - -stats --from <ts|date> --to <ts|date> / --last 7d: Displays statistics of a time range
+ * - -stats --rollup hour|day|week|month [N]: Displays the last N rollup buckets
+ * - -daemon [<port>...]: Records like the commands above and answers queries
+ *   from memory on the Unix socket <file>.sock
+ * - -query [--day ... | --from ... | --rollup ...]: Runs the -stats command on the daemon
+ * - -reindex: Rebuilds the day index, rollups and histograms kept next to the stats file
+ * - -compact: Seals the records of the stats file into a compressed segment
+ *   (-commit roll=day or roll=<size> does the same while recording)
+ * - <command> --threads N: Scans the log with N threads when its index has to be built
+ * - -delaytime or --d [<port>]: Sends a new feeding delay to the feeder as an acknowledged command
+ * - -config <key>=<value> [<port>]: Sends any setting to the feeder the same way
+ * - -simulate [--text] [--every S] [--flash <file>] [--http <port>]: Runs the firmware core on a
+ *   simulated feeder (pseudo-terminal, sockets and a file in place of the hardware)
+ * - -generate <file> <records> [--days N] [--devices N]: Writes a synthetic stats file
+ * - -bench [ingest|stats] [options]: Benchmarks recording from emulated devices and
+ *   print_stats() on generated files, printing JSON lines
+ * - -metrics: Prints the metrics the recorder exports to <file>.prom in the Prometheus
+ *   text format (byte and event counters, record, write, fsync and query latency histograms)
+ * - -selftest [rows] [--seed S]: Checks the CSV scanner, its row parser and the parallel
+ *   index scan against their plain versions on random rows
  * - -qr: Creates and displays QR code for connection
  * - -help or --h: Displays usage information
  *
@@ -29,68 +66,517 @@
 #include <unistd.h>
 #include <time.h>
 #include "stats/stats.h"
+#include "stats/range.h"
 #include "serial/serial.h"
+#include "serial/command.h"
+#include "ingest/ingest.h"
+#include "binlog/binlog.h"
+#include "index/dayindex.h"
+#include "rollup/rollup.h"
+#include "histogram/histogram.h"
+#include "writer/writer.h"
+#include "daemon/daemon.h"
+#include "segment/segment.h"
+#include "simulator/simulator.h"
+#include "bench/bench.h"
+#include "metrics/metrics.h"
+#include "import/import.h"
+#include "export/export.h"
+#include "selftest/selftest.h"
+
+#define SERIAL_PORT "/dev/cu.usbserial-0001"
 
 int main(int argc, char **argv)
 {
-    if (argc == 1)
+    char *stats_file = "stats.csv";
+
+    // "-f <file>" selects another stats file for the command that follows
+    if (argc >= 3 && (!(strcmp(argv[1], "-f")) || !(strcmp(argv[1], "--f"))))
+    {
+        stats_file = argv[2];
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+
+    // "-commit <policy>" sets when recorded events are written and synced
+    writer_policy policy;
+    memset(&policy, 0, sizeof(policy));
+    if (argc >= 3 && !(strcmp(argv[1], "-commit")))
     {
-        FILE *ptr = fopen("stats.csv", "a");
+        if (writer_parse_policy(argv[2], &policy) != 0)
+        {
+            printf("Error: Invalid commit policy '%s'. Use -help or --h for usage details.\n", argv[2]);
+            return 2;
+        }
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+
+    // "-capture <file>" also writes the raw bytes read from the ports to a capture file
+    if (argc >= 3 && !(strcmp(argv[1], "-capture")))
+    {
+        ingest_set_capture(argv[2]);
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
 
-        if (ptr == NULL)
+    // "--threads N" after -stats, -reindex or -import sets how many threads build the day index or sort
+    int threads = 0;
+    if (argc >= 4 && !(strcmp(argv[argc - 2], "--threads")))
+    {
+        threads = atoi(argv[argc - 1]);
+        if (threads < 1)
+        {
+            printf("Error: Invalid thread count '%s'.\n", argv[argc - 1]);
+            return 2;
+        }
+        dayindex_set_threads(threads);
+        argc -= 2;
+    }
+
+    // "-query" sends the -stats command that follows to the daemon of the stats file
+    int ask_daemon = 0;
+    if (argc >= 2 && !(strcmp(argv[1], "-query")))
+    {
+        ask_daemon = 1;
+        argv[1] = "-stats";
+    }
+
+    if (argc == 1)
+    {
+        const char *port = SERIAL_PORT;
+        return record_ports(&port, 1, 0, stats_file, &policy);
+    }
+    else if (argc >= 3 && (!(strcmp(argv[1], "-ports")) || !(strcmp(argv[1], "--p"))))
+    {
+        return record_ports((const char **)&argv[2], argc - 2, 1, stats_file, &policy);
+    }
+    else if (argc >= 2 && !(strcmp(argv[1], "-daemon")))
+    {
+        if (argc == 2)
+        {
+            const char *port = SERIAL_PORT;
+            return run_daemon(&port, 1, 0, stats_file, &policy);
+        }
+        return run_daemon((const char **)&argv[2], argc - 2, 1, stats_file, &policy);
+    }
+    else if ((argc == 3 || argc == 4 || argc == 5) && !(strcmp(argv[1], "-replay")))
+    {
+        double speed = 1;
+        if (argc == 4 && !(strcmp(argv[3], "--fast")))
+        {
+            speed = 0;
+        }
+        else if (argc == 5 && !(strcmp(argv[3], "--speed")))
+        {
+            speed = atof(argv[4]);
+            if (speed <= 0)
+            {
+                printf("Error: Invalid replay speed '%s'.\n", argv[4]);
+                return 2;
+            }
+        }
+        else if (argc != 3)
+        {
+            printf("Error: Invalid argument '%s'. Use -help or --h for usage details.\n", argv[3]);
+            return 2;
+        }
+        return replay_capture(argv[2], stats_file, &policy, speed);
+    }
+    else if (argc >= 4 && !(strcmp(argv[1], "-import")))
+    {
+        size_t memory = (size_t)IMPORT_MEMORY_MB << 20;
+        if (argc >= 6 && !(strcmp(argv[argc - 2], "--memory")))
+        {
+            long mb = atol(argv[argc - 1]);
+            if (mb < IMPORT_MIN_MEMORY_MB)
+            {
+                printf("Error: Invalid memory budget '%s', at least %d MB are needed.\n", argv[argc - 1],
+                       IMPORT_MIN_MEMORY_MB);
+                return 2;
+            }
+            memory = (size_t)mb << 20;
+            argc -= 2;
+        }
+        return import_logs((const char **)&argv[3], argc - 3, argv[2], memory, threads);
+    }
+    else if (argc == 3 && !(strcmp(argv[1], "-export")))
+    {
+        return export_log(stats_file, argv[2]);
+    }
+    else if (argc == 4 && !(strcmp(argv[1], "-tobin")))
+    {
+        long count = csv_to_binlog(argv[2], argv[3]);
+        if (count < 0)
+        {
+            return 1;
+        }
+        printf("Converted %ld records.\n", count);
+        return 0;
+    }
+    else if (argc == 4 && !(strcmp(argv[1], "-tocsv")))
+    {
+        long count = binlog_to_csv(argv[2], argv[3]);
+        if (count < 0)
         {
-            printf("Error opening stats file.\n");
             return 1;
         }
+        printf("Converted %ld records.\n", count);
+        return 0;
+    }
+    else if (argc == 3 && (!(strcmp(argv[1], "-stats")) || !(strcmp(argv[1], "--s"))) && !(strcmp(argv[2], "--follow"))
+             && !ask_daemon)
+    {
+        return follow_stats(stats_file);
+    }
+    else if ((argc == 3 || argc == 4) && (!(strcmp(argv[1], "-stats")) || !(strcmp(argv[1], "--s")))
+             && !(strcmp(argv[2], "--percentiles")) && !ask_daemon)
+    {
+        return print_percentiles(stats_file, argc == 4 ? atoi(argv[3]) : 0);
+    }
+    else if (argc == 4 && (!(strcmp(argv[1], "-stats")) || !(strcmp(argv[1], "--s"))) && !(strcmp(argv[2], "--day")))
+    {
+        int year, month, day;
+        if (sscanf(argv[3], "%d-%d-%d", &year, &month, &day) != 3)
+        {
+            printf("Error: Invalid date '%s', expected YYYY-MM-DD.\n", argv[3]);
+            return 2;
+        }
+        if (ask_daemon)
+        {
+            char query[DAEMON_QUERY_MAX];
+            snprintf(query, sizeof(query), "day %d", year * 10000 + month * 100 + day);
+            return daemon_query(stats_file, query);
+        }
+        return print_day_stats(stats_file, year * 10000 + month * 100 + day);
+    }
+    else if ((argc == 4 || argc == 5) && (!(strcmp(argv[1], "-stats")) || !(strcmp(argv[1], "--s")))
+             && !(strcmp(argv[2], "--rollup")))
+    {
+        rollup_granularity granularity;
+        if (rollup_parse(argv[3], &granularity) != 0)
+        {
+            printf("Error: Invalid rollup '%s', expected hour, day, week or month.\n", argv[3]);
+            return 2;
+        }
+        if (ask_daemon)
+        {
+            char query[DAEMON_QUERY_MAX];
+            snprintf(query, sizeof(query), "rollup %s %d", argv[3], argc == 5 ? atoi(argv[4]) : 0);
+            return daemon_query(stats_file, query);
+        }
+        return print_rollup(stats_file, granularity, argc == 5 ? atoi(argv[4]) : 0);
+    }
+    else if (argc >= 4 && (!(strcmp(argv[1], "-stats")) || !(strcmp(argv[1], "--s")))
+             && (!(strcmp(argv[2], "--from")) || !(strcmp(argv[2], "--to")) || !(strcmp(argv[2], "--last"))))
+    {
+        time_t from = 0;
+        time_t to = time(NULL) + 1;
+        for (int i = 2; i + 1 < argc; i += 2)
+        {
+            time_t span;
+            int ok = 0;
+            if (!(strcmp(argv[i], "--from")))
+            {
+                ok = parse_time_arg(argv[i + 1], 0, &from) == 0;
+            }
+            else if (!(strcmp(argv[i], "--to")))
+            {
+                ok = parse_time_arg(argv[i + 1], 1, &to) == 0;
+            }
+            else if (!(strcmp(argv[i], "--last")))
+            {
+                ok = parse_span_arg(argv[i + 1], &span) == 0;
+                from = time(NULL) - span;
+            }
+            if (!ok)
+            {
+                printf("Error: Invalid argument '%s %s'. Use -help or --h for usage details.\n", argv[i], argv[i + 1]);
+                return 2;
+            }
+        }
+        if (argc % 2 != 0)
+        {
+            printf("Error: Missing value for '%s'.\n", argv[argc - 1]);
+            return 2;
+        }
+        if (ask_daemon)
+        {
+            char query[DAEMON_QUERY_MAX];
+            snprintf(query, sizeof(query), "range %lld %lld", (long long)from, (long long)to);
+            return daemon_query(stats_file, query);
+        }
+        return print_range(stats_file, from, to);
+    }
+    else if ((argc == 2 || argc == 3) && (!(strcmp(argv[1], "-delaytime")) || !(strcmp(argv[1], "--d"))))
+    {
+        int time = 0;
+        printf("Please input timer in seconds: ");
+        if (scanf("%i", &time) != 1 || time < 0)
+        {
+            printf("Error: Invalid delay time.\n");
+            return 2;
+        }
 
-        while (1)
-        {
-            printf("Recording stats..\n");
-            char *dur = listen_for_pattern("/dev/cu.usbserial-0001", "Duration:");
-            if (dur != NULL) {
-                time_t now = time(NULL);
-                fprintf(ptr, "%ld,%s\n", now, dur);
-                // Flush the file buffer to ensure data is written
-                fflush(ptr);
-                // Free the allocated memory
-                free(dur);
-                printf("Recorded.\n");
+        // The feeder keeps the delay in RAM and only writes its flash when it changes
+        char value[16];
+        snprintf(value, sizeof(value), "%d", time * 1000);
+        if (command_send(argc == 3 ? argv[2] : SERIAL_PORT, "delay", value) != 0)
+        {
+            printf("Delay time not changed.\n");
+            return 1;
+        }
+        printf("Successfully changed delay time.\n");
+        return 0;
+    }
+    else if ((argc == 3 || argc == 4) && !(strcmp(argv[1], "-config")))
+    {
+        char key[COMMAND_FIELD_MAX + 1];
+        const char *value = strchr(argv[2], '=');
+        if (value != NULL && value - argv[2] <= COMMAND_FIELD_MAX)
+        {
+            snprintf(key, sizeof(key), "%.*s", (int)(value - argv[2]), argv[2]);
+        }
+        if (value == NULL || value - argv[2] > COMMAND_FIELD_MAX || command_check(key, value + 1) != 0)
+        {
+            printf("Error: Invalid setting '%s', expected <key>=<value>.\n", argv[2]);
+            return 2;
+        }
+        if (command_send(argc == 4 ? argv[3] : SERIAL_PORT, key, value + 1) != 0)
+        {
+            return 1;
+        }
+        printf("Feeder acknowledged %s.\n", argv[2]);
+        return 0;
+    }
+    else if (argc >= 2 && !(strcmp(argv[1], "-simulate")))
+    {
+        simulator_options options = { "arduino/time.txt", 10, 0, 1, 0 };
+        for (int i = 2; i < argc; i++)
+        {
+            if (!(strcmp(argv[i], "--text")))
+            {
+                options.text = 1;
+            }
+            else if (!(strcmp(argv[i], "--every")) && i + 1 < argc)
+            {
+                options.every_s = atoi(argv[++i]);
+            }
+            else if (!(strcmp(argv[i], "--flash")) && i + 1 < argc)
+            {
+                options.flash_path = argv[++i];
+            }
+            else if (!(strcmp(argv[i], "--http")) && i + 1 < argc)
+            {
+                options.http_port = atoi(argv[++i]);
             }
             else
             {
-                printf("Failed to get duration\n");
+                printf("Error: Invalid argument '%s'. Use -help or --h for usage details.\n", argv[i]);
+                return 2;
             }
         }
+        return run_simulator(&options);
     }
-    else if (argc == 2)
+    else if (argc >= 4 && !(strcmp(argv[1], "-generate")))
     {
-        if (!(strcmp(argv[1], "-stats")) || !(strcmp(argv[1], "--s")))
+        long records = atol(argv[3]);
+        int days = 1;
+        int devices = 0;
+        for (int i = 4; i < argc; i++)
+        {
+            if (!(strcmp(argv[i], "--days")) && i + 1 < argc)
+            {
+                days = atoi(argv[++i]);
+            }
+            else if (!(strcmp(argv[i], "--devices")) && i + 1 < argc)
+            {
+                devices = atoi(argv[++i]);
+            }
+            else
+            {
+                printf("Error: Invalid argument '%s'. Use -help or --h for usage details.\n", argv[i]);
+                return 2;
+            }
+        }
+        if (records < 0 || days < 1 || devices < 0)
         {
-            print_stats("stats.csv");
+            printf("Error: Invalid record, day or device count.\n");
+            return 2;
         }
-        else if (!(strcmp(argv[1], "-help")) || !(strcmp(argv[1], "--h")))
+        long bytes = bench_generate(argv[2], records, days, devices, 1);
+        if (bytes < 0)
         {
-            printf("Arguments:\n-stats --s: Displays usage stats.\n-qr: Creates and displays QR-code for connection.\n"
-                    "When used without an argument, records usage stats.\n");
+            return 1;
         }
-        else if (!(strcmp(argv[1], "-delaytime")) || !(strcmp(argv[1], "--d")))
+        printf("Generated %ld records (%ld bytes) over %d days in %s.\n", records, bytes, days, argv[2]);
+        return 0;
+    }
+    else if (argc >= 2 && !(strcmp(argv[1], "-bench")))
+    {
+        bench_options options;
+        bench_defaults(&options);
+        options.policy = policy;
+        int i = 2;
+        if (i < argc && (!(strcmp(argv[i], "ingest")) || !(strcmp(argv[i], "stats"))))
         {
-            int time = 0;
-            printf("Please input timer in seconds: ");
-            scanf("%i", &time);
-            time *= 1000;
-
-            FILE *ptr = fopen("arduino/time.txt", "w");
-            
-            if (ptr == NULL)
+            options.ingest = !(strcmp(argv[i], "ingest"));
+            options.stats = !options.ingest;
+            i++;
+        }
+        for (; i < argc; i++)
+        {
+            int has_value = i + 1 < argc;
+            if (!(strcmp(argv[i], "--events")) && has_value)
             {
-                printf("Error opening file.\n");
-                return 1;
+                options.events = atol(argv[++i]);
             }
-
-            fprintf(ptr, "%i", time);
-            printf("Successfully changed delay time.\n");
-            return 0;
+            else if (!(strcmp(argv[i], "--rate")) && has_value)
+            {
+                options.rate = atol(argv[++i]);
+            }
+            else if (!(strcmp(argv[i], "--noise")) && has_value)
+            {
+                options.noise = atoi(argv[++i]);
+            }
+            else if (!(strcmp(argv[i], "--ports")) && has_value)
+            {
+                options.ports = atoi(argv[++i]);
+            }
+            else if (!(strcmp(argv[i], "--days")) && has_value)
+            {
+                options.days = atoi(argv[++i]);
+            }
+            else if (!(strcmp(argv[i], "--sizes")) && has_value)
+            {
+                options.size_count = 0;
+                for (char *size = strtok(argv[++i], ","); size != NULL && options.size_count < BENCH_MAX_SIZES;
+                     size = strtok(NULL, ","))
+                {
+                    options.sizes[options.size_count++] = atol(size);
+                }
+            }
+            else
+            {
+                printf("Error: Invalid argument '%s'. Use -help or --h for usage details.\n", argv[i]);
+                return 2;
+            }
+        }
+        return run_bench(&options);
+    }
+    else if (argc >= 2 && !(strcmp(argv[1], "-selftest")))
+    {
+        long rows = SELFTEST_ROWS;
+        unsigned seed = (unsigned)time(NULL) | 1;
+        for (int i = 2; i < argc; i++)
+        {
+            if (!(strcmp(argv[i], "--seed")) && i + 1 < argc)
+            {
+                seed = (unsigned)strtoul(argv[++i], NULL, 10);
+            }
+            else if (argv[i][0] != '-' && atol(argv[i]) > 0)
+            {
+                rows = atol(argv[i]);
+            }
+            else
+            {
+                printf("Error: Invalid argument '%s'. Use -help or --h for usage details.\n", argv[i]);
+                return 2;
+            }
+        }
+        if (seed == 0)
+        {
+            printf("Error: The seed must not be 0.\n");
+            return 2;
+        }
+        return run_selftest(rows, seed);
+    }
+    else if (argc == 2 && !(strcmp(argv[1], "-metrics")))
+    {
+        return print_metrics(stats_file);
+    }
+    else if (argc == 2 && !(strcmp(argv[1], "-compact")))
+    {
+        uint64_t records;
+        int result = segment_compact(stats_file, &records);
+        if (result > 0)
+        {
+            printf("%s is being recorded; use -commit roll=day or roll=<size> to seal it while recording.\n",
+                   stats_file);
+            return 1;
+        }
+        if (result < 0)
+        {
+            printf("Error compacting %s.\n", stats_file);
+            return 1;
+        }
+        printf("Sealed %llu records of %s into a compressed segment.\n", (unsigned long long)records, stats_file);
+        return 0;
+    }
+    else if (argc == 2 && !(strcmp(argv[1], "-reindex")))
+    {
+        if (dayindex_rebuild(stats_file) != 0 || rollup_rebuild(stats_file) != 0 || histogram_rebuild(stats_file) != 0)
+        {
+            printf("Error rebuilding index of %s.\n", stats_file);
+            return 1;
+        }
+        printf("Rebuilt index, rollups and histograms of %s.\n", stats_file);
+        return 0;
+    }
+    else if (argc == 2)
+    {
+        if (ask_daemon)
+        {
+            return daemon_query(stats_file, "today");
+        }
+        else if (!(strcmp(argv[1], "-stats")) || !(strcmp(argv[1], "--s")))
+        {
+            print_stats(stats_file);
+        }
+        else if (!(strcmp(argv[1], "-help")) || !(strcmp(argv[1], "--h")))
+        {
+            printf("Arguments:\n-stats --s: Displays usage stats.\n-qr: Creates and displays QR-code for connection.\n"
+                    "-ports --p <port>...: Records usage stats from several devices, tagged with device ids 1..n.\n"
+                    "-stats --percentiles [N]: Displays p50/p90/p99/max durations of the last N days and of all time.\n"
+                    "-stats --follow: Displays usage stats and updates them whenever the stats file grows.\n"
+                    "-stats --day YYYY-MM-DD: Displays the logs of one day.\n"
+                    "-stats --from <ts|date> --to <ts|date>: Displays stats of a time range (dates are YYYY-MM-DD[ HH:MM[:SS]]).\n"
+                    "-stats --last <N>m|h|d|w: Displays stats of the last N minutes, hours, days or weeks.\n"
+                    "-stats --rollup hour|day|week|month [N]: Displays the last N hourly, daily, weekly or monthly totals.\n"
+                    "-daemon [<port>...]: Records usage stats and answers -query commands from memory.\n"
+                    "-query [--day ... | --from ... --to ... | --last ... | --rollup ...]: Runs -stats on the running daemon.\n"
+                    "-reindex: Rebuilds the day index, rollups and histograms of the stats file from the raw log.\n"
+                    "-metrics: Prints the metrics the recorder rewrites every 5 s in <file>.prom (Prometheus format).\n"
+                    "-compact: Seals the stats file into a compressed segment; stats still cover all records.\n"
+                    "<command> --threads N: Uses N threads to build the day index of a large stats file (default: one per CPU).\n"
+                    "-delaytime --d [<port>]: Asks for the feeding delay in seconds and sends it to the feeder.\n"
+                    "-config <key>=<value> [<port>]: Sends a setting to the feeder and waits for it to be acknowledged.\n"
+                    "-simulate [--text] [--every S] [--flash <file>] [--http <port>]: Runs the feeder firmware on a\n"
+                    "    pseudo-terminal. It feeds every S seconds (default 10, 0 for never), keeps its delay in <file>\n"
+                    "    (default arduino/time.txt) and serves its web page on 127.0.0.1:<port>.\n"
+                    "-generate <file> <records> [--days N] [--devices N]: Writes a synthetic stats file spread over N days.\n"
+                    "-bench [ingest|stats] [--events N] [--rate R] [--noise B] [--ports P] [--sizes N,...] [--days D]:\n"
+                    "    Benchmarks the recorder on emulated devices (R events/s, 0 = unlimited, with B noise bytes per event)\n"
+                    "    and -stats on generated files of each size; prints one JSON result per line.\n"
+                    "-import <output> <input>... [--memory MB] [--threads N]: Sorts and merges logs from several hosts\n"
+                    "    into <output> (replaced), dropping duplicate records; uses at most MB MiB (default 256).\n"
+                    "-export <file>: Writes the stats file to <file> in a columnar format (timestamp, duration, grams\n"
+                    "    and device columns in row groups of one day, with min/max per column) for analysis tools.\n"
+                    "-selftest [rows] [--seed S]: Checks the fast CSV scanner and parser and the parallel index scan\n"
+                    "    against their plain versions on random rows (default 200000) and reports any difference.\n"
+                    "-tobin <csv> <bin>: Converts a CSV stats file to a binary log.\n"
+                    "-tocsv <bin> <csv>: Converts a binary log to a CSV stats file.\n"
+                    "-commit <policy> [-ports ...]: Records with a commit policy: records=N, interval=MS and/or fsync,\n"
+                    "    e.g. -commit records=50,interval=1000. By default every record is written at once.\n"
+                    "    roll=day or roll=<size>[k|m|g] seals the stats file into a compressed segment daily or by size.\n"
+                    "-capture <capture> [-ports ...]: Also writes the raw serial data, with arrival times, to <capture>.\n"
+                    "-replay <capture> [--fast | --speed X]: Records a capture into the stats file in real time,\n"
+                    "    X times faster or as fast as possible, through the same parsing and logging path.\n"
+                    "-f --f <file> <command>: Uses <file> instead of stats.csv; files ending in .bin are binary logs.\n"
+                    "When used without an argument, records usage stats.\n");
         }
         else
         {
@@ -0,0 +1,407 @@
+/**
+ * @file metrics.c
+ * @brief Low-overhead counters and latency histograms with a Prometheus export
+ *
+ * Every thread updates its own shard, found through a thread-local pointer,
+ * so counting never takes a lock or bounces a shared counter between
+ * cores. Only the owning thread writes to a shard; it uses plain
+ * relaxed loads and stores, which cost the same as ordinary memory
+ * accesses, and readers use relaxed loads. Shards are added up on demand
+ * by metrics_collect(). A thread that ends folds its shard into the
+ * retired totals, so nothing it counted is lost.
+ *
+ * Latencies are counted in power-of-two buckets of microseconds, which is
+ * coarse but enough to tell a 1 ms write from a 200 ms stall, and maps
+ * directly onto the cumulative buckets of a Prometheus histogram.
+ *
+ * The recorder rewrites "<stats file>.prom" every METRICS_EXPORT_MS, so
+ * node_exporter's textfile collector (or -metrics) can pick it up; the
+ * timestamp in the file shows whether the recorder is still running.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "metrics.h"
+
+/**
+ * @brief Histogram of one latency in a shard
+ */
+struct latency_shard
+{
+    atomic_uint_fast64_t sum_us;
+    atomic_uint_fast64_t max_us;
+    atomic_uint_fast64_t buckets[METRICS_BUCKETS];
+};
+
+/**
+ * @brief Counters and histograms of one thread
+ */
+struct shard
+{
+    atomic_uint_fast64_t counters[METRIC_COUNTERS];
+    struct latency_shard latencies[METRIC_LATENCIES];
+    struct shard *next;
+};
+
+/**
+ * @brief Name and help text of a metric in the export
+ */
+struct metric_info
+{
+    const char *name;
+    const char *help;
+};
+
+static const struct metric_info counter_info[METRIC_COUNTERS] = {
+    { "feed_bytes_read_total", "Bytes read from serial ports." },
+    { "feed_events_matched_total", "Events found in the data read from serial ports." },
+    { "feed_bytes_discarded_total", "Received bytes discarded without being parsed." },
+    { "feed_records_written_total", "Records written to the stats file." },
+};
+
+static const struct metric_info latency_info[METRIC_LATENCIES] = {
+    { "feed_record_latency_seconds", "Time from reading the first byte of a record to writing it to the stats file." },
+    { "feed_write_latency_seconds", "Time to write one batch of records to the stats file." },
+    { "feed_sync_latency_seconds", "Time to fsync the stats file." },
+    { "feed_query_latency_seconds", "Time to answer one stats query." },
+};
+
+// Shards of running threads, and what ended threads counted
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct shard *shards = NULL;
+static metrics_snapshot retired;
+
+// The key only exists for its destructor, which retires the shard of an ending thread
+static pthread_key_t shard_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static _Thread_local struct shard *local = NULL;
+
+// Exporter thread
+static pthread_mutex_t export_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t export_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t export_thread;
+static int exporting = 0;
+static int export_stopping = 0;
+static char export_path[512];
+static time_t started;
+
+/**
+ * Adds a shard to a snapshot.
+ */
+static void add_shard(metrics_snapshot *snapshot, struct shard *s)
+{
+    for (int i = 0; i < METRIC_COUNTERS; i++)
+    {
+        snapshot->counters[i] += atomic_load_explicit(&s->counters[i], memory_order_relaxed);
+    }
+    for (int i = 0; i < METRIC_LATENCIES; i++)
+    {
+        struct latency_shard *from = &s->latencies[i];
+        metrics_latency *into = &snapshot->latencies[i];
+        uint64_t max_us = atomic_load_explicit(&from->max_us, memory_order_relaxed);
+        into->sum_us += atomic_load_explicit(&from->sum_us, memory_order_relaxed);
+        into->max_us = max_us > into->max_us ? max_us : into->max_us;
+        // The owner keeps observing while this runs; a count taken from the buckets read
+        // always equals their sum, as the +Inf bucket and _count must in the export
+        for (int b = 0; b < METRICS_BUCKETS; b++)
+        {
+            uint64_t n = atomic_load_explicit(&from->buckets[b], memory_order_relaxed);
+            into->buckets[b] += n;
+            into->count += n;
+        }
+    }
+}
+
+/**
+ * Key destructor: keeps what an ending thread counted and frees its shard.
+ */
+static void retire_shard(void *arg)
+{
+    struct shard *s = arg;
+    pthread_mutex_lock(&shards_lock);
+    add_shard(&retired, s);
+    for (struct shard **at = &shards; *at != NULL; at = &(*at)->next)
+    {
+        if (*at == s)
+        {
+            *at = s->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shards_lock);
+    free(s);
+}
+
+static void create_key(void)
+{
+    pthread_key_create(&shard_key, retire_shard);
+}
+
+/**
+ * Returns the shard of the calling thread, creating it on first use, or NULL if out of memory.
+ */
+static struct shard *own_shard(void)
+{
+    if (local != NULL)
+    {
+        return local;
+    }
+
+    pthread_once(&key_once, create_key);
+    struct shard *s = calloc(1, sizeof(*s));
+    if (s == NULL)
+    {
+        return NULL;
+    }
+    pthread_mutex_lock(&shards_lock);
+    s->next = shards;
+    shards = s;
+    pthread_mutex_unlock(&shards_lock);
+    pthread_setspecific(shard_key, s);
+    local = s;
+    return s;
+}
+
+/**
+ * Adds to a value only the calling thread writes; no atomic read-modify-write is needed.
+ */
+static void bump(atomic_uint_fast64_t *value, uint64_t n)
+{
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+int64_t metrics_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void metrics_count(metric_counter counter, uint64_t n)
+{
+    struct shard *s = own_shard();
+    if (s != NULL && n > 0)
+    {
+        bump(&s->counters[counter], n);
+    }
+}
+
+void metrics_observe(metric_latency latency, int64_t us)
+{
+    struct shard *s = own_shard();
+    if (s == NULL)
+    {
+        return;
+    }
+
+    uint64_t value = us > 0 ? (uint64_t)us : 0;
+    // The smallest bucket b with value <= 2^b us
+    int bucket = 0;
+    while (bucket < METRICS_BUCKETS - 1 && (1ULL << bucket) < value)
+    {
+        bucket++;
+    }
+
+    struct latency_shard *l = &s->latencies[latency];
+    bump(&l->sum_us, value);
+    bump(&l->buckets[bucket], 1);
+    if (value > atomic_load_explicit(&l->max_us, memory_order_relaxed))
+    {
+        atomic_store_explicit(&l->max_us, value, memory_order_relaxed);
+    }
+}
+
+void metrics_since(metric_latency latency, int64_t start_us)
+{
+    metrics_observe(latency, metrics_now_us() - start_us);
+}
+
+void metrics_collect(metrics_snapshot *snapshot)
+{
+    pthread_mutex_lock(&shards_lock);
+    *snapshot = retired;
+    for (struct shard *s = shards; s != NULL; s = s->next)
+    {
+        add_shard(snapshot, s);
+    }
+    pthread_mutex_unlock(&shards_lock);
+}
+
+int metrics_write(FILE *out)
+{
+    metrics_snapshot snapshot;
+    metrics_collect(&snapshot);
+
+    for (int i = 0; i < METRIC_COUNTERS; i++)
+    {
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counter_info[i].name, counter_info[i].help,
+                counter_info[i].name, counter_info[i].name, (unsigned long long)snapshot.counters[i]);
+    }
+
+    for (int i = 0; i < METRIC_LATENCIES; i++)
+    {
+        const char *name = latency_info[i].name;
+        const metrics_latency *l = &snapshot.latencies[i];
+        fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, latency_info[i].help, name);
+        uint64_t cumulative = 0;
+        for (int b = 0; b < METRICS_BUCKETS - 1; b++)
+        {
+            cumulative += l->buckets[b];
+            fprintf(out, "%s_bucket{le=\"%g\"} %llu\n", name, (double)(1ULL << b) / 1e6, (unsigned long long)cumulative);
+        }
+        fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)l->count);
+        fprintf(out, "%s_sum %.6f\n%s_count %llu\n", name, (double)l->sum_us / 1e6, name, (unsigned long long)l->count);
+    }
+
+    // Longest latencies since the start, the first thing to look at after a stall
+    fprintf(out, "# HELP feed_latency_max_seconds Longest latency seen since the recorder started.\n"
+                 "# TYPE feed_latency_max_seconds gauge\n");
+    for (int i = 0; i < METRIC_LATENCIES; i++)
+    {
+        const char *name = latency_info[i].name;
+        int len = (int)(strlen(name) - strlen("_latency_seconds") - strlen("feed_"));
+        fprintf(out, "feed_latency_max_seconds{stage=\"%.*s\"} %.6f\n", len, name + strlen("feed_"),
+                (double)snapshot.latencies[i].max_us / 1e6);
+    }
+
+    fprintf(out, "# HELP feed_start_time_seconds Unix time the recorder started.\n"
+                 "# TYPE feed_start_time_seconds gauge\nfeed_start_time_seconds %lld\n", (long long)started);
+    fprintf(out, "# HELP feed_metrics_time_seconds Unix time these metrics were written.\n"
+                 "# TYPE feed_metrics_time_seconds gauge\nfeed_metrics_time_seconds %lld\n", (long long)time(NULL));
+    return ferror(out) ? -1 : 0;
+}
+
+int metrics_export(const char *path)
+{
+    char tmp[600];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+    {
+        return -1;
+    }
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL)
+    {
+        return -1;
+    }
+    int ok = metrics_write(out) == 0;
+    ok = fclose(out) == 0 && ok;
+    if (!ok || rename(tmp, path) != 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Exporter thread: rewrites the metrics file until metrics_export_stop().
+ */
+static void *run_export(void *arg)
+{
+    (void)arg;
+    int failed = 0;
+
+    pthread_mutex_lock(&export_lock);
+    while (!export_stopping)
+    {
+        pthread_mutex_unlock(&export_lock);
+        if (metrics_export(export_path) != 0 && !failed)
+        {
+            printf("Warning: cannot write metrics to %s: %s\n", export_path, strerror(errno));
+            failed = 1;
+        }
+        pthread_mutex_lock(&export_lock);
+
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        struct timespec at = { tv.tv_sec + METRICS_EXPORT_MS / 1000,
+                               (long)tv.tv_usec * 1000 + (long)(METRICS_EXPORT_MS % 1000) * 1000000 };
+        if (at.tv_nsec >= 1000000000)
+        {
+            at.tv_sec++;
+            at.tv_nsec -= 1000000000;
+        }
+        while (!export_stopping && pthread_cond_timedwait(&export_wake, &export_lock, &at) != ETIMEDOUT)
+        {
+        }
+    }
+    pthread_mutex_unlock(&export_lock);
+
+    // The last totals, with every queued record written
+    metrics_export(export_path);
+    return NULL;
+}
+
+int metrics_export_start(const char *stats_file)
+{
+    if (exporting)
+    {
+        return 0;
+    }
+    if (snprintf(export_path, sizeof(export_path), "%s%s", stats_file, METRICS_SUFFIX) >= (int)sizeof(export_path))
+    {
+        return -1;
+    }
+    started = time(NULL);
+    export_stopping = 0;
+    if (pthread_create(&export_thread, NULL, run_export, NULL) != 0)
+    {
+        return -1;
+    }
+    exporting = 1;
+    return 0;
+}
+
+void metrics_export_stop(void)
+{
+    if (!exporting)
+    {
+        return;
+    }
+    pthread_mutex_lock(&export_lock);
+    export_stopping = 1;
+    pthread_cond_signal(&export_wake);
+    pthread_mutex_unlock(&export_lock);
+    pthread_join(export_thread, NULL);
+    exporting = 0;
+}
+
+int print_metrics(const char *stats_file)
+{
+    char path[600];
+    snprintf(path, sizeof(path), "%s%s", stats_file, METRICS_SUFFIX);
+    FILE *file = fopen(path, "r");
+    struct stat st;
+    if (file == NULL || fstat(fileno(file), &st) != 0)
+    {
+        printf("Error: No metrics for %s; the recorder writes them to %s.\n", stats_file, path);
+        if (file != NULL)
+        {
+            fclose(file);
+        }
+        return 1;
+    }
+
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        fwrite(buffer, 1, n, stdout);
+    }
+    fclose(file);
+
+    long long age = (long long)(time(NULL) - st.st_mtime);
+    printf("# Written %lld s ago to %s\n", age, path);
+    if (age * 1000 > 3 * METRICS_EXPORT_MS)
+    {
+        printf("# Warning: the recorder stopped or stalled; metrics are rewritten every %d ms while it runs.\n",
+               METRICS_EXPORT_MS);
+    }
+    return 0;
+}
@@ -0,0 +1,134 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Appended to the stats file path to get the path of the exported metrics
+#define METRICS_SUFFIX ".prom"
+// How often the recorder rewrites the metrics file
+#define METRICS_EXPORT_MS 5000
+// Latency buckets; bucket i counts latencies up to 2^i microseconds, the last one all longer ones
+#define METRICS_BUCKETS 27
+
+/**
+ * @brief Counters kept by the recorder and the stats commands
+ */
+typedef enum metric_counter {
+    METRIC_BYTES_READ,         // bytes read from serial ports
+    METRIC_EVENTS_MATCHED,     // events found by the frame parser, the matchers and the link decoders
+    METRIC_BYTES_DISCARDED,    // received bytes thrown away without being parsed
+    METRIC_RECORDS_WRITTEN,    // records written to the stats file
+    METRIC_COUNTERS
+} metric_counter;
+
+/**
+ * @brief Latencies kept as histograms
+ */
+typedef enum metric_latency {
+    METRIC_RECORD_LATENCY,     // first byte of a record read until the record is written
+    METRIC_WRITE_LATENCY,      // write() of one batch of records to the stats file
+    METRIC_SYNC_LATENCY,       // fsync() of the stats file
+    METRIC_QUERY_LATENCY,      // one stats query
+    METRIC_LATENCIES
+} metric_latency;
+
+/**
+ * @brief Histogram of one latency, in microseconds
+ */
+typedef struct metrics_latency {
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t max_us;
+    uint64_t buckets[METRICS_BUCKETS];
+} metrics_latency;
+
+/**
+ * @brief Totals of every thread at one point in time
+ */
+typedef struct metrics_snapshot {
+    uint64_t counters[METRIC_COUNTERS];
+    metrics_latency latencies[METRIC_LATENCIES];
+} metrics_snapshot;
+
+/**
+ * @brief Microseconds on a clock that does not jump, for timing with metrics_since()
+ *
+ * @return int64_t Current time in microseconds
+ */
+int64_t metrics_now_us(void);
+
+/**
+ * @brief Adds to a counter of the calling thread
+ *
+ * @param counter Counter to update
+ * @param n Amount to add
+ */
+void metrics_count(metric_counter counter, uint64_t n);
+
+/**
+ * @brief Counts one latency in a histogram of the calling thread
+ *
+ * @param latency Histogram to update
+ * @param us Latency in microseconds; negative values count as 0
+ */
+void metrics_observe(metric_latency latency, int64_t us);
+
+/**
+ * @brief Counts the time since start in a histogram of the calling thread
+ *
+ * @param latency Histogram to update
+ * @param start_us Start time from metrics_now_us()
+ */
+void metrics_since(metric_latency latency, int64_t start_us);
+
+/**
+ * @brief Adds up the counters and histograms of every thread
+ *
+ * Threads that ended are included.
+ *
+ * @param snapshot Filled with the totals
+ */
+void metrics_collect(metrics_snapshot *snapshot);
+
+/**
+ * @brief Writes the current totals in the Prometheus text exposition format
+ *
+ * @param out Stream to write to
+ * @return int 0 on success, -1 if error occurs
+ */
+int metrics_write(FILE *out);
+
+/**
+ * @brief Replaces a file with the current totals in the Prometheus text format
+ *
+ * The file is written under a temporary name and renamed, so a scraper
+ * never reads half of it.
+ *
+ * @param path File to replace
+ * @return int 0 on success, -1 if error occurs
+ */
+int metrics_export(const char *path);
+
+/**
+ * @brief Starts a thread that rewrites "<stats_file>.prom" every METRICS_EXPORT_MS
+ *
+ * @param stats_file Path of the stats file being recorded
+ * @return int 0 on success, -1 if the thread cannot start
+ */
+int metrics_export_start(const char *stats_file);
+
+/**
+ * @brief Stops the thread started by metrics_export_start() after a last export
+ */
+void metrics_export_stop(void);
+
+/**
+ * @brief Prints the metrics last exported by the recorder of a stats file, with their age
+ *
+ * @param stats_file Path of the stats file
+ * @return int 0 on success, 1 if no metrics were exported for the file
+ */
+int print_metrics(const char *stats_file);
+
+#endif /* METRICS_H */
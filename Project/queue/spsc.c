@@ -0,0 +1,187 @@
+/**
+ * @file spsc.c
+ * @brief Lock-free single-producer/single-consumer ring of preallocated slots
+ *
+ * head and tail only ever grow; a slot index is the counter masked by the
+ * power-of-two capacity. Each side keeps a cached copy of the other side's
+ * counter and only reloads it when the queue looks full (producer) or empty
+ * (consumer), so in the steady state neither side touches the other's
+ * cache line. The two counters live on separate cache lines for the same
+ * reason.
+ *
+ * An idle consumer sleeps on a condition variable. It sets waiting before
+ * checking for data one last time, and the producer checks waiting after
+ * publishing; both use sequentially consistent atomics, so at least one of
+ * them sees the other and no wakeup is lost.
+ */
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/time.h>
+#include "spsc.h"
+
+int spsc_init(spsc_queue *queue, size_t slots, size_t slot_size)
+{
+    memset(queue, 0, sizeof(*queue));
+
+    size_t capacity = 1;
+    while (capacity < slots)
+    {
+        capacity *= 2;
+    }
+    // Keep every slot aligned for whatever record type it holds
+    slot_size = (slot_size + 15) & ~(size_t)15;
+
+    queue->slots = calloc(capacity, slot_size);
+    if (queue->slots == NULL)
+    {
+        return -1;
+    }
+    queue->mask = capacity - 1;
+    queue->slot_size = slot_size;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->high_water, 0);
+    atomic_init(&queue->pushed, 0);
+    atomic_init(&queue->dropped, 0);
+    atomic_init(&queue->waiting, 0);
+    atomic_init(&queue->closed, 0);
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->ready, NULL);
+    return 0;
+}
+
+void spsc_destroy(spsc_queue *queue)
+{
+    pthread_cond_destroy(&queue->ready);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->slots);
+    queue->slots = NULL;
+}
+
+void *spsc_reserve(spsc_queue *queue)
+{
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    if (tail - queue->cached_head > queue->mask)
+    {
+        queue->cached_head = atomic_load_explicit(&queue->head, memory_order_acquire);
+        if (tail - queue->cached_head > queue->mask)
+        {
+            return NULL;
+        }
+    }
+    return queue->slots + (tail & queue->mask) * queue->slot_size;
+}
+
+void spsc_push(spsc_queue *queue)
+{
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed) + 1;
+    atomic_store(&queue->tail, tail);
+    atomic_fetch_add_explicit(&queue->pushed, 1, memory_order_relaxed);
+
+    size_t depth = tail - queue->cached_head;
+    if (depth > atomic_load_explicit(&queue->high_water, memory_order_relaxed))
+    {
+        atomic_store_explicit(&queue->high_water, depth, memory_order_relaxed);
+    }
+
+    if (atomic_load(&queue->waiting))
+    {
+        pthread_mutex_lock(&queue->lock);
+        pthread_cond_signal(&queue->ready);
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+void spsc_drop(spsc_queue *queue)
+{
+    atomic_fetch_add_explicit(&queue->dropped, 1, memory_order_relaxed);
+}
+
+void spsc_close(spsc_queue *queue)
+{
+    atomic_store(&queue->closed, 1);
+    pthread_mutex_lock(&queue->lock);
+    pthread_cond_signal(&queue->ready);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void *spsc_peek(spsc_queue *queue)
+{
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    if (head == queue->cached_tail)
+    {
+        queue->cached_tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+        if (head == queue->cached_tail)
+        {
+            return NULL;
+        }
+    }
+    return queue->slots + (head & queue->mask) * queue->slot_size;
+}
+
+void spsc_pop(spsc_queue *queue)
+{
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+}
+
+int spsc_wait(spsc_queue *queue, int timeout_ms)
+{
+    if (spsc_peek(queue) != NULL)
+    {
+        return 1;
+    }
+
+    struct timespec until;
+    if (timeout_ms >= 0)
+    {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        until.tv_sec = now.tv_sec + timeout_ms / 1000;
+        until.tv_nsec = (long)now.tv_usec * 1000 + (long)(timeout_ms % 1000) * 1000000;
+        if (until.tv_nsec >= 1000000000)
+        {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+    }
+
+    int result = 0;
+    pthread_mutex_lock(&queue->lock);
+    atomic_store(&queue->waiting, 1);
+    while (1)
+    {
+        if (atomic_load(&queue->tail) != atomic_load_explicit(&queue->head, memory_order_relaxed))
+        {
+            result = 1;
+            break;
+        }
+        if (atomic_load(&queue->closed))
+        {
+            result = -1;
+            break;
+        }
+        int rc = timeout_ms >= 0 ? pthread_cond_timedwait(&queue->ready, &queue->lock, &until)
+                                 : pthread_cond_wait(&queue->ready, &queue->lock);
+        if (rc == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    atomic_store(&queue->waiting, 0);
+    pthread_mutex_unlock(&queue->lock);
+    return result;
+}
+
+size_t spsc_depth(spsc_queue *queue)
+{
+    size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    return tail >= head ? tail - head : 0;
+}
+
+size_t spsc_capacity(const spsc_queue *queue)
+{
+    return queue->mask + 1;
+}
@@ -0,0 +1,126 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/**
+ * @brief Bounded single-producer/single-consumer queue of fixed-size slots
+ *
+ * All slots are allocated up front and records are built and read in
+ * place, so passing a record costs no allocation and no copy. Pushing and
+ * popping only use atomic loads and stores; the lock is only taken to put
+ * an idle consumer to sleep and to wake it up.
+ *
+ * Exactly one thread may call the producer functions (spsc_reserve,
+ * spsc_push, spsc_drop, spsc_close) and one thread the consumer functions
+ * (spsc_peek, spsc_pop, spsc_wait).
+ */
+typedef struct spsc_queue {
+    // Consumer side
+    _Alignas(64) atomic_size_t head;
+    size_t cached_tail;
+    // Producer side
+    _Alignas(64) atomic_size_t tail;
+    size_t cached_head;
+    atomic_size_t high_water;
+    atomic_ullong pushed;
+    atomic_ullong dropped;
+    // Shared, read-mostly
+    _Alignas(64) size_t mask;
+    size_t slot_size;
+    unsigned char *slots;
+    atomic_int waiting;
+    atomic_int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} spsc_queue;
+
+/**
+ * @brief Allocates the slots of a queue
+ *
+ * @param queue Queue to initialize
+ * @param slots Number of slots, rounded up to a power of two
+ * @param slot_size Size of one slot in bytes
+ * @return int 0 on success, -1 if out of memory
+ */
+int spsc_init(spsc_queue *queue, size_t slots, size_t slot_size);
+
+/**
+ * @brief Releases the slots of a queue
+ *
+ * @param queue Queue to destroy
+ */
+void spsc_destroy(spsc_queue *queue);
+
+/**
+ * @brief Producer: returns the next free slot to fill in place
+ *
+ * @param queue Queue
+ * @return void* Slot, or NULL if the queue is full
+ */
+void *spsc_reserve(spsc_queue *queue);
+
+/**
+ * @brief Producer: publishes the slot returned by spsc_reserve()
+ *
+ * @param queue Queue
+ */
+void spsc_push(spsc_queue *queue);
+
+/**
+ * @brief Producer: counts a record that was thrown away because the queue was full
+ *
+ * @param queue Queue
+ */
+void spsc_drop(spsc_queue *queue);
+
+/**
+ * @brief Producer: tells the consumer that nothing more will be pushed
+ *
+ * @param queue Queue
+ */
+void spsc_close(spsc_queue *queue);
+
+/**
+ * @brief Consumer: returns the oldest published slot without removing it
+ *
+ * @param queue Queue
+ * @return void* Slot, or NULL if the queue is empty
+ */
+void *spsc_peek(spsc_queue *queue);
+
+/**
+ * @brief Consumer: frees the slot returned by spsc_peek()
+ *
+ * @param queue Queue
+ */
+void spsc_pop(spsc_queue *queue);
+
+/**
+ * @brief Consumer: sleeps until a slot is published, the queue is closed or the timeout passes
+ *
+ * @param queue Queue
+ * @param timeout_ms Longest wait in milliseconds, -1 to wait without limit
+ * @return int 1 if a slot is available, 0 on timeout, -1 if the queue is closed and empty
+ */
+int spsc_wait(spsc_queue *queue, int timeout_ms);
+
+/**
+ * @brief Number of slots currently in use (a snapshot, callable from any thread)
+ *
+ * @param queue Queue
+ * @return size_t Queue depth
+ */
+size_t spsc_depth(spsc_queue *queue);
+
+/**
+ * @brief Number of slots of a queue
+ *
+ * @param queue Queue
+ * @return size_t Capacity
+ */
+size_t spsc_capacity(const spsc_queue *queue);
+
+#endif /* SPSC_H */
@@ -0,0 +1,503 @@
+/**
+ * @file rollup.c
+ * @brief Hourly, daily, weekly and monthly aggregates maintained while recording
+ *
+ * Each granularity has its own sidecar next to the log ("stats.csv.hour",
+ * ".day", ".week", ".month") with the same layout as the day index:
+ *
+ * - a 72-byte header holding the covered log offset, the number of buckets
+ *   and the newest bucket, which is the one that changes while recording
+ * - the older, sealed buckets in start order
+ *
+ * Appending a record in time order therefore costs one pwrite() of the
+ * header per table. Records that land in an older bucket update that bucket
+ * in place; a record that needs a new bucket in the middle of the table makes
+ * the whole table be rewritten. Records appended after the covered offset are
+ * added from the log on load, and rollup_rebuild() recreates the tables from
+ * scratch, so the tables survive a crash of the recorder.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "rollup.h"
+#include "../binlog/binlog.h"
+#include "../index/dayindex.h"
+#include "../segment/segment.h"
+
+/**
+ * @brief On-disk header of a rollup table (72 bytes)
+ */
+struct rollup_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t granularity;
+    int64_t covered;
+    uint32_t count;
+    uint32_t reserved;
+    rollup_bucket open;
+};
+
+static const char *names[ROLLUP_COUNT] = { "hour", "day", "week", "month" };
+
+int rollup_parse(const char *name, rollup_granularity *granularity)
+{
+    for (int g = 0; g < ROLLUP_COUNT; g++)
+    {
+        if (strcmp(name, names[g]) == 0)
+        {
+            *granularity = (rollup_granularity)g;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void rollup_bounds(rollup_granularity granularity, time_t t, int64_t *start, int64_t *end)
+{
+    struct tm tm_start;
+    if (localtime_r(&t, &tm_start) == NULL)
+    {
+        // A time that cannot be converted gets a bucket of its own second, as in day_bounds()
+        *start = (int64_t)t;
+        *end = (int64_t)t + 1;
+        return;
+    }
+
+    if (granularity == ROLLUP_HOUR)
+    {
+        // Whole hours are the same in local time and UTC, also across DST changes
+        *start = (int64_t)t - tm_start.tm_min * 60 - tm_start.tm_sec;
+        *end = *start + 3600;
+        return;
+    }
+
+    tm_start.tm_sec = 0;
+    tm_start.tm_min = 0;
+    tm_start.tm_hour = 0;
+    if (granularity == ROLLUP_WEEK)
+    {
+        tm_start.tm_mday -= (tm_start.tm_wday + 6) % 7;
+    }
+    else if (granularity == ROLLUP_MONTH)
+    {
+        tm_start.tm_mday = 1;
+    }
+
+    struct tm tm_end = tm_start;
+    if (granularity == ROLLUP_DAY)
+    {
+        tm_end.tm_mday += 1;
+    }
+    else if (granularity == ROLLUP_WEEK)
+    {
+        tm_end.tm_mday += 7;
+    }
+    else
+    {
+        tm_end.tm_mon += 1;
+    }
+
+    tm_start.tm_isdst = -1;
+    tm_end.tm_isdst = -1;
+    time_t first = mktime(&tm_start);
+    time_t next = mktime(&tm_end);
+
+    // mktime() can fail far outside the supported range; fall back to this second only
+    if (first == (time_t)-1 || next == (time_t)-1 || t < first || t >= next)
+    {
+        first = t;
+        next = t + 1;
+    }
+    *start = (int64_t)first;
+    *end = (int64_t)next;
+}
+
+/**
+ * Index of the bucket starting at start, or of where it would be inserted.
+ */
+static size_t find_bucket(const rollup_table *table, int64_t start)
+{
+    size_t lo = 0;
+    size_t hi = table->count;
+
+    // Records usually belong to the newest bucket
+    if (hi > 0 && table->buckets[hi - 1].start <= start)
+    {
+        return table->buckets[hi - 1].start == start ? hi - 1 : hi;
+    }
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (table->buckets[mid].start < start)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Makes room for one more bucket.
+ */
+static int reserve(rollup_table *table)
+{
+    if (table->count < table->capacity)
+    {
+        return 0;
+    }
+    size_t capacity = table->capacity ? table->capacity * 2 : 64;
+    rollup_bucket *buckets = realloc(table->buckets, capacity * sizeof(*buckets));
+    if (buckets == NULL)
+    {
+        return -1;
+    }
+    table->buckets = buckets;
+    table->capacity = capacity;
+    return 0;
+}
+
+enum {
+    CHANGED_NONE,
+    CHANGED_BUCKET,
+    CHANGED_APPENDED,
+    CHANGED_INSERTED
+};
+
+/**
+ * Adds a record to the in-memory table and says what changed.
+ *
+ * pos is set to the index of the bucket that was updated or created.
+ */
+static int add_memory(rollup_table *table, time_t timestamp, double duration, size_t *pos)
+{
+    if ((int64_t)timestamp < table->cached_start || (int64_t)timestamp >= table->cached_end)
+    {
+        rollup_bounds(table->granularity, timestamp, &table->cached_start, &table->cached_end);
+    }
+    int64_t start = table->cached_start;
+
+    size_t i = find_bucket(table, start);
+    *pos = i;
+
+    if (i < table->count && table->buckets[i].start == start)
+    {
+        rollup_bucket *b = &table->buckets[i];
+        b->count++;
+        b->sum += duration;
+        if (duration < b->min)
+        {
+            b->min = duration;
+        }
+        if (duration > b->max)
+        {
+            b->max = duration;
+        }
+        return CHANGED_BUCKET;
+    }
+
+    // A partly loaded table cannot tell whether older buckets exist
+    if (table->partial && i == 0)
+    {
+        return CHANGED_NONE;
+    }
+
+    if (reserve(table) != 0)
+    {
+        return -1;
+    }
+    memmove(&table->buckets[i + 1], &table->buckets[i], (table->count - i) * sizeof(rollup_bucket));
+    rollup_bucket b = { start, 1, 0, duration, duration, duration };
+    table->buckets[i] = b;
+    table->count++;
+    return i == table->count - 1 ? CHANGED_APPENDED : CHANGED_INSERTED;
+}
+
+/**
+ * Fills the on-disk header from the in-memory table.
+ */
+static void fill_header(const rollup_table *table, struct rollup_header *header)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, ROLLUP_MAGIC, sizeof(ROLLUP_MAGIC));
+    header->version = ROLLUP_VERSION;
+    header->granularity = table->granularity;
+    header->covered = table->covered;
+    header->count = (uint32_t)table->count;
+    if (table->count > 0)
+    {
+        header->open = table->buckets[table->count - 1];
+    }
+}
+
+/**
+ * Writes the whole table through a temporary file renamed into place.
+ */
+static int save(rollup_table *table)
+{
+    char tmp_path[sizeof(table->path) + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", table->path);
+
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    struct rollup_header header;
+    fill_header(table, &header);
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    if (ok && table->count > 1)
+    {
+        ok = fwrite(table->buckets, sizeof(rollup_bucket), table->count - 1, file) == table->count - 1;
+    }
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok || rename(tmp_path, table->path) != 0)
+    {
+        remove(tmp_path);
+        return -1;
+    }
+
+    if (table->fd >= 0)
+    {
+        close(table->fd);
+        table->fd = open(table->path, O_RDWR);
+        if (table->fd < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Writes the buckets touched by the last add and the header.
+ */
+static int persist(rollup_table *table, int changed, size_t pos)
+{
+    if (changed == CHANGED_INSERTED)
+    {
+        return save(table);
+    }
+
+    // Sealed buckets sit right after the header; the newest one lives in the header
+    if (changed == CHANGED_APPENDED && table->count >= 2)
+    {
+        pos = table->count - 2;
+        changed = CHANGED_BUCKET;
+    }
+    if (changed == CHANGED_BUCKET && pos + 1 < table->count)
+    {
+        off_t at = sizeof(struct rollup_header) + (off_t)pos * sizeof(rollup_bucket);
+        if (pwrite(table->fd, &table->buckets[pos], sizeof(rollup_bucket), at) != sizeof(rollup_bucket))
+        {
+            return -1;
+        }
+    }
+
+    struct rollup_header header;
+    fill_header(table, &header);
+    return pwrite(table->fd, &header, sizeof(header), 0) == sizeof(header) ? 0 : -1;
+}
+
+/**
+ * log_scan() callback adding each record to the in-memory table.
+ */
+static int add_scanned(int64_t offset, int64_t end, time_t timestamp, float duration, void *ctx)
+{
+    (void)offset;
+    rollup_table *table = ctx;
+    size_t pos;
+    add_memory(table, timestamp, duration, &pos);
+    table->covered = end;
+    return 0;
+}
+
+/**
+ * Reads the header and the last buckets of a sidecar. Returns 0 if it was valid for the log.
+ */
+static int read_sidecar(rollup_table *table, const char *log_path, size_t last)
+{
+    FILE *file = fopen(table->path, "rb");
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    struct rollup_header header;
+    int ok = fread(&header, sizeof(header), 1, file) == 1 &&
+             memcmp(header.magic, ROLLUP_MAGIC, sizeof(ROLLUP_MAGIC)) == 0 &&
+             header.version == ROLLUP_VERSION &&
+             header.granularity == (uint32_t)table->granularity;
+    // A log cut short after a crash no longer holds every record the sidecar counted. The log
+    // is measured after the header is read, so a recorder appending meanwhile only makes it longer.
+    ok = ok && header.covered <= segment_log_size(log_path);
+
+    size_t sealed = ok && header.count > 0 ? header.count - 1 : 0;
+    size_t first = 0;
+    if (last > 0 && sealed + 1 > last)
+    {
+        first = sealed + 1 - last;
+        table->partial = 1;
+    }
+
+    if (ok && first < sealed)
+    {
+        ok = fseek(file, sizeof(header) + (long)first * sizeof(rollup_bucket), SEEK_SET) == 0;
+    }
+    for (size_t i = first; ok && i < sealed; i++)
+    {
+        ok = reserve(table) == 0 && fread(&table->buckets[table->count], sizeof(rollup_bucket), 1, file) == 1;
+        if (ok)
+        {
+            table->count++;
+        }
+    }
+    if (ok && header.count > 0)
+    {
+        ok = reserve(table) == 0;
+        if (ok)
+        {
+            table->buckets[table->count++] = header.open;
+        }
+    }
+    fclose(file);
+
+    if (!ok)
+    {
+        table->count = 0;
+        table->partial = 0;
+        return -1;
+    }
+    table->covered = header.covered;
+    return 0;
+}
+
+int rollup_load(rollup_table *table, const char *log_path, rollup_granularity granularity, size_t last)
+{
+    memset(table, 0, sizeof(*table));
+    table->granularity = granularity;
+    table->fd = -1;
+
+    if (snprintf(table->path, sizeof(table->path), "%s.%s", log_path, names[granularity]) >= (int)sizeof(table->path))
+    {
+        return -1;
+    }
+
+    int binary = binlog_detect(log_path);
+    if (read_sidecar(table, log_path, last) != 0)
+    {
+        table->covered = binary ? (int64_t)sizeof(binlog_header) : 0;
+    }
+
+    int64_t covered = log_scan(log_path, binary, table->covered, add_scanned, table);
+    if (covered < 0)
+    {
+        rollup_free(table);
+        return -1;
+    }
+    table->covered = covered;
+
+    // Keep only the requested number of buckets
+    if (last > 0 && table->count > last)
+    {
+        memmove(table->buckets, &table->buckets[table->count - last], last * sizeof(rollup_bucket));
+        table->count = last;
+    }
+    return 0;
+}
+
+int rollup_open(rollup_set *set, const char *log_path)
+{
+    memset(set, 0, sizeof(*set));
+    for (int g = 0; g < ROLLUP_COUNT; g++)
+    {
+        set->tables[g].fd = -1;
+    }
+
+    for (int g = 0; g < ROLLUP_COUNT; g++)
+    {
+        rollup_table *table = &set->tables[g];
+        if (rollup_load(table, log_path, (rollup_granularity)g, 0) != 0 || save(table) != 0)
+        {
+            rollup_close(set);
+            return -1;
+        }
+        table->fd = open(table->path, O_RDWR);
+        if (table->fd < 0)
+        {
+            rollup_close(set);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int rollup_add(rollup_set *set, int64_t end, time_t timestamp, double duration)
+{
+    int status = 0;
+    for (int g = 0; g < ROLLUP_COUNT; g++)
+    {
+        rollup_table *table = &set->tables[g];
+        size_t pos;
+        int changed = add_memory(table, timestamp, duration, &pos);
+        table->covered = end;
+        if (changed < 0 || persist(table, changed, pos) != 0)
+        {
+            status = -1;
+        }
+    }
+    return status;
+}
+
+int rollup_table_add(rollup_table *table, time_t timestamp, double duration)
+{
+    size_t pos;
+    return add_memory(table, timestamp, duration, &pos) < 0 ? -1 : 0;
+}
+
+void rollup_close(rollup_set *set)
+{
+    for (int g = 0; g < ROLLUP_COUNT; g++)
+    {
+        rollup_free(&set->tables[g]);
+    }
+}
+
+int rollup_rebuild(const char *log_path)
+{
+    for (int g = 0; g < ROLLUP_COUNT; g++)
+    {
+        char path[sizeof(((rollup_table *)0)->path)];
+        snprintf(path, sizeof(path), "%s.%s", log_path, names[g]);
+        remove(path);
+    }
+
+    rollup_set set;
+    if (rollup_open(&set, log_path) != 0)
+    {
+        return -1;
+    }
+    rollup_close(&set);
+    return 0;
+}
+
+void rollup_free(rollup_table *table)
+{
+    if (table->fd >= 0)
+    {
+        close(table->fd);
+    }
+    free(table->buckets);
+    table->buckets = NULL;
+    table->count = 0;
+    table->capacity = 0;
+    table->fd = -1;
+}
@@ -0,0 +1,152 @@
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#define ROLLUP_MAGIC "FEEDRUP"
+#define ROLLUP_VERSION 1
+
+/**
+ * @brief Granularities of the rollup tables, all in local time
+ */
+typedef enum rollup_granularity {
+    ROLLUP_HOUR,
+    ROLLUP_DAY,
+    ROLLUP_WEEK,   // weeks start on Monday
+    ROLLUP_MONTH,
+    ROLLUP_COUNT
+} rollup_granularity;
+
+/**
+ * @brief Aggregate of all records in one time bucket (40 bytes)
+ *
+ * Durations are in seconds; grams are sum * K.
+ */
+typedef struct rollup_bucket {
+    int64_t start;
+    uint32_t count;
+    uint32_t reserved;
+    double sum;
+    double min;
+    double max;
+} rollup_bucket;
+
+/**
+ * @brief One rollup table, kept sorted by bucket start
+ */
+typedef struct rollup_table {
+    rollup_granularity granularity;
+    char path[512];
+    rollup_bucket *buckets;
+    size_t count;
+    size_t capacity;
+    int64_t covered;
+    int64_t cached_start;
+    int64_t cached_end;
+    int partial;
+    int fd;
+} rollup_table;
+
+/**
+ * @brief All rollup tables of one log, as maintained by the recorder
+ */
+typedef struct rollup_set {
+    rollup_table tables[ROLLUP_COUNT];
+} rollup_set;
+
+/**
+ * @brief Parses a granularity name ("hour", "day", "week" or "month")
+ *
+ * @param name Name to parse
+ * @param granularity Set on success
+ * @return int 0 on success, -1 if the name is unknown
+ */
+int rollup_parse(const char *name, rollup_granularity *granularity);
+
+/**
+ * @brief Start and end of the local bucket that contains a timestamp
+ *
+ * A timestamp that cannot be converted to local time gets a bucket of
+ * just its own second.
+ *
+ * @param granularity Bucket size
+ * @param t Timestamp
+ * @param start Set to the first second of the bucket
+ * @param end Set to the first second of the next bucket
+ */
+void rollup_bounds(rollup_granularity granularity, time_t t, int64_t *start, int64_t *end);
+
+/**
+ * @brief Opens every rollup table of a log for maintenance by the recorder
+ *
+ * Tables are loaded from their sidecar files ("<log>.hour", "<log>.day",
+ * "<log>.week", "<log>.month"), brought up to date with records appended
+ * since they were written, and written back.
+ *
+ * @param set Tables to fill
+ * @param log_path Path of the log
+ * @return int 0 on success, -1 if error occurs
+ */
+int rollup_open(rollup_set *set, const char *log_path);
+
+/**
+ * @brief Adds a record that was just appended to the log to every table
+ *
+ * @param set Tables opened with rollup_open()
+ * @param end Byte offset just after the record in the log
+ * @param timestamp Timestamp of the record
+ * @param duration Duration of the record in seconds
+ * @return int 0 on success, -1 if error occurs
+ */
+int rollup_add(rollup_set *set, int64_t end, time_t timestamp, double duration);
+
+/**
+ * @brief Releases tables opened with rollup_open()
+ *
+ * @param set Tables to release
+ */
+void rollup_close(rollup_set *set);
+
+/**
+ * @brief Loads the last buckets of one table for reading
+ *
+ * Only the header and the last `last` buckets of the sidecar are read, so
+ * the cost does not depend on the size of the log. Records appended since
+ * the table was written are added from the log.
+ *
+ * @param table Table to fill
+ * @param log_path Path of the log
+ * @param granularity Table to read
+ * @param last Number of most recent buckets wanted, 0 for all
+ * @return int 0 on success, -1 if error occurs
+ */
+int rollup_load(rollup_table *table, const char *log_path, rollup_granularity granularity, size_t last);
+
+/**
+ * @brief Adds a record to a table loaded with rollup_load(), in memory only
+ *
+ * @param table Table to update
+ * @param timestamp Timestamp of the record
+ * @param duration Duration of the record in seconds
+ * @return int 0 on success, -1 if error occurs
+ */
+int rollup_table_add(rollup_table *table, time_t timestamp, double duration);
+
+/**
+ * @brief Throws away every rollup table of a log and rebuilds them from the whole log
+ *
+ * @param log_path Path of the log
+ * @return int 0 on success, -1 if error occurs
+ */
+int rollup_rebuild(const char *log_path);
+
+/**
+ * @brief Releases a table loaded with rollup_load()
+ *
+ * @param table Table to release
+ */
+void rollup_free(rollup_table *table);
+
+#endif /* ROLLUP_H */
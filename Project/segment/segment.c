@@ -0,0 +1,1409 @@
+/**
+ * @file segment.c
+ * @brief Sealed, compressed segments of a stats log
+ *
+ * The recorder appends to the live file ("stats.csv"). When the log rolls
+ * (per day or per size, see writer.c) or is compacted, the head of the live
+ * file is re-encoded into "stats.csv.seg.NNNNNN" and cut from the live
+ * file. "stats.csv.segs" lists the segments and where the live file starts
+ * in the logical log, so the offsets kept by the index, rollups and
+ * histograms never change.
+ *
+ * A segment stores its records in columns, SEGMENT_BLOCK records per block:
+ *
+ * - timestamps as deltas or as deltas of deltas, whichever packs smaller
+ * - durations as decimal integers with a per-block scale (2.5 is 25 at
+ *   scale 1), or as raw float bits if no scale gives back the same float
+ * - device ids
+ * - line lengths, as the difference to the length the recorder would have
+ *   printed, and the bytes of non-record lines before each record, so that
+ *   every record keeps its offset
+ *
+ * Every column is frame-of-reference coded: the block minimum as a zig-zag
+ * varint, then each value minus the minimum in as many bits as the largest
+ * one needs, which is no bits at all for a column that does not vary. The
+ * block positions are listed at the end of the file so a reader can start
+ * at any block. Only what the readers use is kept: the text of non-record
+ * lines and the spelling of a duration ("2.50" reads back as 2.5) are not.
+ *
+ * Sealing writes the new list with a pending flag, renames the shortened
+ * live file into place and then clears the flag. Readers wait while the flag
+ * is set, and segment_recover() finishes the rename after a crash. Whoever
+ * seals holds an exclusive flock() on the live file; recorders hold a shared
+ * one.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "segment.h"
+#include "../binlog/binlog.h"
+
+// log_scan() reads lines with a 256-byte buffer, so longer lines are not records
+#define LINE_MAX_LEN 254
+// Durations that no decimal scale reproduces are stored as float bits
+#define RAW_DURATIONS 0xff
+// Readers wait this long for a seal in another process to finish
+#define PENDING_WAIT_US 1000
+#define PENDING_ATTEMPTS 2000
+
+/**
+ * @brief On-disk header of the segment list (64 bytes), followed by the entries
+ */
+struct list_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t pending;
+    uint64_t generation;
+    int64_t base;
+    uint64_t next_id;
+    uint64_t count;
+    uint64_t reserved[2];
+};
+
+/**
+ * @brief On-disk header of a segment (64 bytes), followed by the blocks and their directory
+ */
+struct segment_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t binary;
+    int64_t start;
+    int64_t end;
+    int64_t first_ts;
+    uint64_t count;
+    uint64_t blocks;
+    uint64_t directory;
+};
+
+/**
+ * @brief Records of one block, decoded or waiting to be encoded
+ */
+struct block {
+    size_t count;
+    int64_t start;
+    int64_t offsets[SEGMENT_BLOCK];
+    int64_t ends[SEGMENT_BLOCK];
+    int64_t timestamps[SEGMENT_BLOCK];
+    float durations[SEGMENT_BLOCK];
+    int64_t devices[SEGMENT_BLOCK];
+};
+
+/**
+ * @brief Growable byte buffer
+ */
+struct buffer {
+    uint8_t *data;
+    size_t used;
+    size_t capacity;
+    int error;
+};
+
+/**
+ * @brief Segment file mapped for reading
+ */
+struct segment_file {
+    void *map;
+    size_t length;
+    const struct segment_header *header;
+    const uint32_t *directory;
+};
+
+/**
+ * @brief State of a seal in progress
+ */
+struct sealer {
+    const char *log_path;
+    segment_list *list;
+    int binary;
+    FILE *file;
+    char path[600];
+    char tmp_path[608];
+    struct segment_header header;
+    segment_entry entry;
+    uint32_t *directory;
+    size_t directory_capacity;
+    uint64_t position;
+    int64_t last_end;
+    struct block block;
+    struct buffer out;
+    uint64_t records;
+};
+
+static const double scales[] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+#define SCALE_COUNT ((int)(sizeof(scales) / sizeof(scales[0])))
+
+/**
+ * Subtracts without signed overflow; the decoder adds back the same way.
+ */
+static int64_t difference(int64_t a, int64_t b)
+{
+    return (int64_t)((uint64_t)a - (uint64_t)b);
+}
+
+static uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/**
+ * Number of decimal digits of a value.
+ */
+static int digits(uint64_t value)
+{
+    int n = 1;
+    while (value >= 10)
+    {
+        value /= 10;
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Duration given by a decimal integer at a scale; the encoder checks its values with the same expression.
+ */
+static float scaled_duration(int64_t value, int scale)
+{
+    return (float)((double)value / scales[scale]);
+}
+
+/**
+ * Length of a record as the recorder prints it: "timestamp,duration[,device]\n".
+ */
+static int64_t canonical_length(int binary, int64_t timestamp, int scale, int64_t value, int64_t device)
+{
+    if (binary)
+    {
+        return (int64_t)sizeof(binlog_record);
+    }
+    int64_t len = (timestamp < 0 ? 1 + digits(-(uint64_t)timestamp) : digits((uint64_t)timestamp)) + 2;
+    if (scale != RAW_DURATIONS)
+    {
+        // Like "%.*f": at least one digit before the point
+        int n = digits(value < 0 ? -(uint64_t)value : (uint64_t)value);
+        len += (n > scale ? n : scale + 1) + (scale > 0) + (value < 0);
+    }
+    if (device > 0)
+    {
+        len += 1 + digits((uint64_t)device);
+    }
+    return len;
+}
+
+static void put(struct buffer *b, const void *data, size_t len)
+{
+    if (b->error)
+    {
+        return;
+    }
+    if (b->used + len > b->capacity)
+    {
+        size_t capacity = b->capacity ? b->capacity : 4096;
+        while (capacity < b->used + len)
+        {
+            capacity *= 2;
+        }
+        uint8_t *grown = realloc(b->data, capacity);
+        if (grown == NULL)
+        {
+            b->error = 1;
+            return;
+        }
+        b->data = grown;
+        b->capacity = capacity;
+    }
+    memcpy(b->data + b->used, data, len);
+    b->used += len;
+}
+
+static void put_varint(struct buffer *b, uint64_t value)
+{
+    uint8_t bytes[10];
+    size_t n = 0;
+    while (value >= 0x80)
+    {
+        bytes[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    bytes[n++] = (uint8_t)value;
+    put(b, bytes, n);
+}
+
+static int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *value)
+{
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7)
+    {
+        uint8_t byte = *(*p)++;
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            *value = result;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Bits needed for the largest value minus the smallest one.
+ */
+static int column_width(const int64_t *values, size_t n, int64_t *min)
+{
+    *min = n > 0 ? values[0] : 0;
+    for (size_t i = 1; i < n; i++)
+    {
+        if (values[i] < *min)
+        {
+            *min = values[i];
+        }
+    }
+    uint64_t range = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t x = (uint64_t)values[i] - (uint64_t)*min;
+        range = x > range ? x : range;
+    }
+    return range ? 64 - __builtin_clzll(range) : 0;
+}
+
+/**
+ * Encoded size of a column, to pick between two encodings.
+ */
+static size_t column_size(const int64_t *values, size_t n)
+{
+    int64_t min;
+    int bits = column_width(values, n, &min);
+    uint64_t zz = zigzag(min);
+    size_t size = 2;
+    while (zz >= 0x80)
+    {
+        zz >>= 7;
+        size++;
+    }
+    return size + (n * (size_t)bits + 7) / 8;
+}
+
+/**
+ * Appends a frame-of-reference coded column of n values (at most SEGMENT_BLOCK).
+ */
+static void put_column(struct buffer *b, const int64_t *values, size_t n)
+{
+    int64_t min;
+    int bits = column_width(values, n, &min);
+    put_varint(b, zigzag(min));
+    uint8_t width = (uint8_t)bits;
+    put(b, &width, 1);
+    if (bits == 0)
+    {
+        return;
+    }
+
+    uint8_t packed[SEGMENT_BLOCK * 8];
+    size_t used = 0;
+    uint64_t acc = 0;
+    int filled = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t x = (uint64_t)values[i] - (uint64_t)min;
+        for (int left = bits; left > 0;)
+        {
+            int take = left < 32 ? left : 32;
+            acc |= (x & ((1ull << take) - 1)) << filled;
+            filled += take;
+            x >>= take;
+            left -= take;
+            while (filled >= 8)
+            {
+                packed[used++] = (uint8_t)acc;
+                acc >>= 8;
+                filled -= 8;
+            }
+        }
+    }
+    if (filled > 0)
+    {
+        packed[used++] = (uint8_t)acc;
+    }
+    put(b, packed, used);
+}
+
+/**
+ * Reads a column written by put_column().
+ */
+static int get_column(const uint8_t **p, const uint8_t *end, int64_t *values, size_t n)
+{
+    uint64_t zz;
+    if (get_varint(p, end, &zz) != 0 || *p >= end)
+    {
+        return -1;
+    }
+    int64_t min = unzigzag(zz);
+    int bits = *(*p)++;
+    if (bits > 64)
+    {
+        return -1;
+    }
+    if (bits == 0)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            values[i] = min;
+        }
+        return 0;
+    }
+    size_t bytes = (n * (size_t)bits + 7) / 8;
+    if ((size_t)(end - *p) < bytes)
+    {
+        return -1;
+    }
+
+    const uint8_t *in = *p;
+    uint64_t acc = 0;
+    int filled = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t x = 0;
+        for (int got = 0; got < bits;)
+        {
+            int take = bits - got < 32 ? bits - got : 32;
+            while (filled < take)
+            {
+                acc |= (uint64_t)*in++ << filled;
+                filled += 8;
+            }
+            x |= (acc & ((1ull << take) - 1)) << got;
+            acc >>= take;
+            filled -= take;
+            got += take;
+        }
+        values[i] = (int64_t)((uint64_t)min + x);
+    }
+    *p += bytes;
+    return 0;
+}
+
+/**
+ * Picks the smallest decimal scale that gives back every duration exactly and fills values.
+ */
+static int duration_scale(const float *durations, size_t n, int64_t *values)
+{
+    for (int scale = 0; scale < SCALE_COUNT; scale++)
+    {
+        size_t i;
+        for (i = 0; i < n; i++)
+        {
+            double x = (double)durations[i] * scales[scale];
+            if (!(x > -1e15 && x < 1e15))
+            {
+                break;
+            }
+            int64_t value = (int64_t)(x < 0 ? x - 0.5 : x + 0.5);
+            float back = scaled_duration(value, scale);
+            // Compared bit for bit, so -0.0 is not turned into 0.0
+            if (memcmp(&back, &durations[i], sizeof(float)) != 0)
+            {
+                break;
+            }
+            values[i] = value;
+        }
+        if (i == n)
+        {
+            return scale;
+        }
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        uint32_t bits;
+        memcpy(&bits, &durations[i], sizeof(bits));
+        values[i] = bits;
+    }
+    return RAW_DURATIONS;
+}
+
+static void segment_path(char *out, size_t size, const char *log_path, uint64_t id)
+{
+    snprintf(out, size, "%s.seg.%06llu", log_path, (unsigned long long)id);
+}
+
+static void list_path(char *out, size_t size, const char *log_path)
+{
+    snprintf(out, size, "%s%s", log_path, SEGMENT_LIST_SUFFIX);
+}
+
+static void live_tmp_path(char *out, size_t size, const char *log_path)
+{
+    snprintf(out, size, "%s.live", log_path);
+}
+
+/**
+ * Writes and syncs the segment list, replacing the old one atomically.
+ */
+static int save_list(const segment_list *list, int pending)
+{
+    char path[sizeof(list->path) + 16];
+    char tmp_path[sizeof(path) + 8];
+    list_path(path, sizeof(path), list->path);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    struct list_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SEGMENT_LIST_MAGIC, sizeof(SEGMENT_LIST_MAGIC));
+    header.version = SEGMENT_LIST_VERSION;
+    header.pending = (uint32_t)pending;
+    header.generation = list->generation;
+    header.base = list->base;
+    header.next_id = list->next_id;
+    header.count = list->count;
+
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    if (ok && list->count > 0)
+    {
+        ok = fwrite(list->entries, sizeof(segment_entry), list->count, file) == list->count;
+    }
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(tmp_path, path) != 0)
+    {
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+int segment_list_load(segment_list *list, const char *log_path)
+{
+    memset(list, 0, sizeof(*list));
+    if (snprintf(list->path, sizeof(list->path), "%s", log_path) >= (int)sizeof(list->path))
+    {
+        return -1;
+    }
+
+    char path[sizeof(list->path) + 16];
+    list_path(path, sizeof(path), log_path);
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        // A log that was never sealed
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    struct list_header header;
+    int ok = fread(&header, sizeof(header), 1, file) == 1 &&
+             memcmp(header.magic, SEGMENT_LIST_MAGIC, sizeof(SEGMENT_LIST_MAGIC)) == 0 &&
+             header.version == SEGMENT_LIST_VERSION &&
+             header.count < SIZE_MAX / sizeof(segment_entry);
+    if (ok && header.count > 0)
+    {
+        list->entries = malloc(header.count * sizeof(segment_entry));
+        ok = list->entries != NULL &&
+             fread(list->entries, sizeof(segment_entry), header.count, file) == header.count;
+    }
+    fclose(file);
+    if (!ok)
+    {
+        segment_list_free(list);
+        return -1;
+    }
+
+    list->generation = header.generation;
+    list->pending = header.pending != 0;
+    list->base = header.base;
+    list->next_id = header.next_id;
+    list->count = header.count;
+    list->sealed = list->count > 0 ? list->entries[list->count - 1].end : 0;
+    return 0;
+}
+
+/**
+ * Reads only the generation of the segment list, 0 if there is none.
+ */
+static int read_generation(const char *log_path, uint64_t *generation, int *pending)
+{
+    char path[600];
+    list_path(path, sizeof(path), log_path);
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        *generation = 0;
+        *pending = 0;
+        return errno == ENOENT ? 0 : -1;
+    }
+    struct list_header header;
+    int ok = fread(&header, sizeof(header), 1, file) == 1;
+    fclose(file);
+    *generation = header.generation;
+    *pending = header.pending != 0;
+    return ok ? 0 : -1;
+}
+
+FILE *segment_open_live(const char *log_path, segment_list *list)
+{
+    for (int attempt = 0; attempt < PENDING_ATTEMPTS; attempt++)
+    {
+        if (segment_list_load(list, log_path) != 0)
+        {
+            return NULL;
+        }
+        if (list->pending)
+        {
+            segment_list_free(list);
+            // Still pending after a while: the sealing process died before the rename
+            if (attempt == PENDING_ATTEMPTS / 2)
+            {
+                segment_recover(log_path);
+            }
+            usleep(PENDING_WAIT_US);
+            continue;
+        }
+
+        // The list read before opening must still be current after it
+        FILE *live = fopen(log_path, "rb");
+        uint64_t generation;
+        int pending;
+        if (read_generation(log_path, &generation, &pending) == 0 && !pending &&
+            generation == list->generation)
+        {
+            if (live == NULL)
+            {
+                segment_list_free(list);
+            }
+            return live;
+        }
+        if (live != NULL)
+        {
+            fclose(live);
+        }
+        segment_list_free(list);
+    }
+    return NULL;
+}
+
+int64_t segment_log_size(const char *log_path)
+{
+    segment_list list;
+    FILE *live = segment_open_live(log_path, &list);
+    if (live == NULL)
+    {
+        return -1;
+    }
+    struct stat st;
+    int64_t size = fstat(fileno(live), &st) == 0 ? list.base + st.st_size : -1;
+    fclose(live);
+    segment_list_free(&list);
+    return size;
+}
+
+/**
+ * Maps a segment file and checks that it belongs to the entry.
+ */
+static int map_segment(const segment_list *list, const segment_entry *entry, struct segment_file *seg)
+{
+    char path[sizeof(list->path) + 32];
+    segment_path(path, sizeof(path), list->path, entry->id);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct segment_header))
+    {
+        close(fd);
+        return -1;
+    }
+    seg->length = (size_t)st.st_size;
+    seg->map = mmap(NULL, seg->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (seg->map == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    seg->header = seg->map;
+    const struct segment_header *h = seg->header;
+    if (memcmp(h->magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) != 0 || h->version != SEGMENT_VERSION ||
+        h->start != entry->start || h->count != entry->count ||
+        h->directory < sizeof(*h) || h->directory > seg->length ||
+        h->blocks > (seg->length - h->directory) / sizeof(uint32_t))
+    {
+        munmap(seg->map, seg->length);
+        return -1;
+    }
+    seg->directory = (const uint32_t *)((const char *)seg->map + h->directory);
+    return 0;
+}
+
+/**
+ * Reads the record count, start offset and first timestamp at the head of a block.
+ */
+static int block_head(const struct segment_file *seg, uint64_t index, const uint8_t **p,
+                      uint64_t *count, int64_t *start, int64_t *first_ts)
+{
+    const uint8_t *end = (const uint8_t *)seg->map + seg->header->directory;
+    *p = (const uint8_t *)seg->map + seg->directory[index];
+    uint64_t delta, zz;
+    if (*p < (const uint8_t *)seg->map + sizeof(struct segment_header) || *p >= end ||
+        get_varint(p, end, count) != 0 || get_varint(p, end, &delta) != 0 || get_varint(p, end, &zz) != 0 ||
+        *count == 0 || *count > SEGMENT_BLOCK)
+    {
+        return -1;
+    }
+    *start = (int64_t)((uint64_t)seg->header->start + delta);
+    *first_ts = (int64_t)((uint64_t)seg->header->first_ts + (uint64_t)unzigzag(zz));
+    return 0;
+}
+
+/**
+ * Decodes one block of a mapped segment.
+ */
+static int decode_block(const struct segment_file *seg, uint64_t index, struct block *block)
+{
+    const uint8_t *end = (const uint8_t *)seg->map + seg->header->directory;
+    const uint8_t *p;
+    uint64_t count;
+    int64_t values[SEGMENT_BLOCK];
+    int64_t lengths[SEGMENT_BLOCK];
+    int64_t gaps[SEGMENT_BLOCK];
+
+    if (block_head(seg, index, &p, &count, &block->start, &block->timestamps[0]) != 0 || p >= end)
+    {
+        return -1;
+    }
+    size_t n = (size_t)count;
+    block->count = n;
+
+    // Timestamps: deltas, or a first delta and the deltas between deltas
+    uint8_t mode = *p++;
+    if (mode == 0)
+    {
+        if (get_column(&p, end, values, n - 1) != 0)
+        {
+            return -1;
+        }
+        for (size_t i = 1; i < n; i++)
+        {
+            block->timestamps[i] = (int64_t)((uint64_t)block->timestamps[i - 1] + (uint64_t)values[i - 1]);
+        }
+    }
+    else
+    {
+        uint64_t zz;
+        if (n < 2 || get_varint(&p, end, &zz) != 0 || get_column(&p, end, values, n - 2) != 0)
+        {
+            return -1;
+        }
+        uint64_t delta = (uint64_t)unzigzag(zz);
+        block->timestamps[1] = (int64_t)((uint64_t)block->timestamps[0] + delta);
+        for (size_t i = 2; i < n; i++)
+        {
+            delta += (uint64_t)values[i - 2];
+            block->timestamps[i] = (int64_t)((uint64_t)block->timestamps[i - 1] + delta);
+        }
+    }
+
+    if (p >= end)
+    {
+        return -1;
+    }
+    int scale = *p++;
+    if ((scale >= SCALE_COUNT && scale != RAW_DURATIONS) || get_column(&p, end, values, n) != 0 ||
+        get_column(&p, end, block->devices, n) != 0 || get_column(&p, end, lengths, n) != 0 ||
+        get_column(&p, end, gaps, n) != 0)
+    {
+        return -1;
+    }
+
+    int binary = seg->header->binary != 0;
+    int64_t offset = block->start;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (scale == RAW_DURATIONS)
+        {
+            uint32_t bits = (uint32_t)values[i];
+            memcpy(&block->durations[i], &bits, sizeof(float));
+        }
+        else
+        {
+            block->durations[i] = scaled_duration(values[i], scale);
+        }
+        offset += gaps[i];
+        block->offsets[i] = offset;
+        offset += canonical_length(binary, block->timestamps[i], scale, values[i], block->devices[i]) + lengths[i];
+        block->ends[i] = offset;
+    }
+    return 0;
+}
+
+/**
+ * Index of the last block starting at or before an offset.
+ */
+static uint64_t first_block(const struct segment_file *seg, int64_t from)
+{
+    uint64_t lo = 0;
+    uint64_t hi = seg->header->blocks;
+    while (hi - lo > 1)
+    {
+        uint64_t mid = lo + (hi - lo) / 2;
+        const uint8_t *p;
+        uint64_t count;
+        int64_t start, first_ts;
+        if (block_head(seg, mid, &p, &count, &start, &first_ts) != 0 || start > from)
+        {
+            hi = mid;
+        }
+        else
+        {
+            lo = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Reads the sealed records at or after an offset, reporting them to fn, or with their device to record_fn.
+ */
+static int64_t scan_segments(const segment_list *list, int64_t from, log_row_fn fn, log_record_fn record_fn,
+                             void *ctx, int *stopped)
+{
+    *stopped = 0;
+    for (size_t i = 0; i < list->count; i++)
+    {
+        const segment_entry *entry = &list->entries[i];
+        if (entry->end <= from || entry->count == 0)
+        {
+            continue;
+        }
+
+        struct segment_file seg;
+        if (map_segment(list, entry, &seg) != 0)
+        {
+            return -1;
+        }
+        madvise(seg.map, seg.length, MADV_SEQUENTIAL);
+
+        struct block block;
+        for (uint64_t b = first_block(&seg, from); b < seg.header->blocks; b++)
+        {
+            if (decode_block(&seg, b, &block) != 0)
+            {
+                munmap(seg.map, seg.length);
+                return -1;
+            }
+            for (size_t j = 0; j < block.count; j++)
+            {
+                if (block.offsets[j] < from)
+                {
+                    continue;
+                }
+                int stop;
+                if (fn != NULL)
+                {
+                    stop = fn(block.offsets[j], block.ends[j], (time_t)block.timestamps[j], block.durations[j], ctx);
+                }
+                else
+                {
+                    binlog_record record = { block.timestamps[j], block.durations[j], (uint32_t)block.devices[j] };
+                    stop = record_fn(block.offsets[j], block.ends[j], &record, ctx);
+                }
+                if (stop)
+                {
+                    *stopped = 1;
+                    munmap(seg.map, seg.length);
+                    return block.ends[j];
+                }
+            }
+        }
+        munmap(seg.map, seg.length);
+    }
+    return list->sealed;
+}
+
+int64_t segment_scan(const segment_list *list, int64_t from, log_row_fn fn, void *ctx, int *stopped)
+{
+    return scan_segments(list, from, fn, NULL, ctx, stopped);
+}
+
+int64_t segment_scan_records(const segment_list *list, int64_t from, log_record_fn fn, void *ctx, int *stopped)
+{
+    return scan_segments(list, from, NULL, fn, ctx, stopped);
+}
+
+int64_t segment_seek(const segment_list *list, time_t from)
+{
+    for (size_t i = 0; i < list->count; i++)
+    {
+        const segment_entry *entry = &list->entries[i];
+        if (entry->count == 0 || entry->max_ts < (int64_t)from)
+        {
+            continue;
+        }
+
+        struct segment_file seg;
+        if (map_segment(list, entry, &seg) != 0)
+        {
+            return entry->start;
+        }
+        // Last block whose first record is older; everything before it is older too
+        uint64_t lo = 0;
+        uint64_t hi = seg.header->blocks;
+        while (hi - lo > 1)
+        {
+            uint64_t mid = lo + (hi - lo) / 2;
+            const uint8_t *p;
+            uint64_t count;
+            int64_t start, first_ts;
+            if (block_head(&seg, mid, &p, &count, &start, &first_ts) != 0 || first_ts >= (int64_t)from)
+            {
+                hi = mid;
+            }
+            else
+            {
+                lo = mid;
+            }
+        }
+        const uint8_t *p;
+        uint64_t count;
+        int64_t start, first_ts;
+        int64_t offset = lo > 0 && block_head(&seg, lo, &p, &count, &start, &first_ts) == 0 ? start : entry->start;
+        munmap(seg.map, seg.length);
+        return offset;
+    }
+    return -1;
+}
+
+/**
+ * Starts writing a new segment file at a logical offset.
+ */
+static int begin_segment(struct sealer *s, int64_t start)
+{
+    memset(&s->entry, 0, sizeof(s->entry));
+    s->entry.id = s->list->next_id++;
+    s->entry.start = start;
+    segment_path(s->path, sizeof(s->path), s->log_path, s->entry.id);
+    snprintf(s->tmp_path, sizeof(s->tmp_path), "%s.tmp", s->path);
+
+    memset(&s->header, 0, sizeof(s->header));
+    memcpy(s->header.magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC));
+    s->header.version = SEGMENT_VERSION;
+    s->header.binary = (uint32_t)s->binary;
+    s->header.start = start;
+    s->last_end = start;
+    s->block.count = 0;
+    s->block.start = start;
+
+    s->file = fopen(s->tmp_path, "wb");
+    if (s->file == NULL || fwrite(&s->header, sizeof(s->header), 1, s->file) != 1)
+    {
+        return -1;
+    }
+    s->position = sizeof(s->header);
+    return 0;
+}
+
+/**
+ * Encodes the waiting records of the current block and writes them.
+ */
+static int flush_block(struct sealer *s)
+{
+    struct block *block = &s->block;
+    size_t n = block->count;
+    if (n == 0)
+    {
+        return 0;
+    }
+    if (s->header.blocks == s->directory_capacity)
+    {
+        size_t capacity = s->directory_capacity ? s->directory_capacity * 2 : 256;
+        uint32_t *grown = realloc(s->directory, capacity * sizeof(*grown));
+        if (grown == NULL)
+        {
+            return -1;
+        }
+        s->directory = grown;
+        s->directory_capacity = capacity;
+    }
+    if (s->position > UINT32_MAX)
+    {
+        return -1;
+    }
+
+    struct buffer *out = &s->out;
+    out->used = 0;
+    put_varint(out, n);
+    put_varint(out, (uint64_t)difference(block->start, s->header.start));
+    put_varint(out, zigzag(difference(block->timestamps[0], s->header.first_ts)));
+
+    int64_t deltas[SEGMENT_BLOCK];
+    int64_t second[SEGMENT_BLOCK];
+    for (size_t i = 1; i < n; i++)
+    {
+        deltas[i - 1] = difference(block->timestamps[i], block->timestamps[i - 1]);
+    }
+    for (size_t i = 2; i < n; i++)
+    {
+        second[i - 2] = difference(deltas[i - 1], deltas[i - 2]);
+    }
+    // Regular intervals pack to almost nothing as deltas of deltas, random ones pack better as deltas
+    if (n >= 2 && column_size(second, n - 2) + 10 < column_size(deltas, n - 1))
+    {
+        uint8_t mode = 1;
+        put(out, &mode, 1);
+        put_varint(out, zigzag(deltas[0]));
+        put_column(out, second, n - 2);
+    }
+    else
+    {
+        uint8_t mode = 0;
+        put(out, &mode, 1);
+        put_column(out, deltas, n - 1);
+    }
+
+    int64_t values[SEGMENT_BLOCK];
+    int64_t lengths[SEGMENT_BLOCK];
+    int64_t gaps[SEGMENT_BLOCK];
+    int scale = duration_scale(block->durations, n, values);
+    int64_t offset = block->start;
+    for (size_t i = 0; i < n; i++)
+    {
+        gaps[i] = block->offsets[i] - offset;
+        lengths[i] = block->ends[i] - block->offsets[i] -
+                     canonical_length(s->binary, block->timestamps[i], scale, values[i], block->devices[i]);
+        offset = block->ends[i];
+    }
+    uint8_t scale_byte = (uint8_t)scale;
+    put(out, &scale_byte, 1);
+    put_column(out, values, n);
+    put_column(out, block->devices, n);
+    put_column(out, lengths, n);
+    put_column(out, gaps, n);
+
+    if (out->error || fwrite(out->data, 1, out->used, s->file) != out->used)
+    {
+        return -1;
+    }
+    s->directory[s->header.blocks++] = (uint32_t)s->position;
+    s->position += out->used;
+    block->count = 0;
+    block->start = offset;
+    return 0;
+}
+
+/**
+ * Finishes the current segment file and adds it to the list.
+ */
+static int end_segment(struct sealer *s, int64_t end)
+{
+    if (flush_block(s) != 0)
+    {
+        return -1;
+    }
+    s->header.end = end;
+    s->header.directory = s->position;
+    size_t bytes = s->header.blocks * sizeof(uint32_t);
+    int ok = (bytes == 0 || fwrite(s->directory, 1, bytes, s->file) == bytes) &&
+             fseek(s->file, 0, SEEK_SET) == 0 &&
+             fwrite(&s->header, sizeof(s->header), 1, s->file) == 1 &&
+             fflush(s->file) == 0 && fsync(fileno(s->file)) == 0;
+    ok = (fclose(s->file) == 0) && ok;
+    s->file = NULL;
+    if (!ok || rename(s->tmp_path, s->path) != 0)
+    {
+        return -1;
+    }
+
+    segment_entry *entries = realloc(s->list->entries, (s->list->count + 1) * sizeof(*entries));
+    if (entries == NULL)
+    {
+        return -1;
+    }
+    s->entry.end = end;
+    s->entry.count = s->header.count;
+    s->entry.bytes = s->position + bytes;
+    s->list->entries = entries;
+    s->list->entries[s->list->count++] = s->entry;
+    return 0;
+}
+
+/**
+ * Adds one record of the live file to the segment being written.
+ */
+static int seal_record(struct sealer *s, int64_t offset, int64_t len, int64_t timestamp, float duration,
+                       uint32_t device)
+{
+    if (s->header.count == SEGMENT_MAX_RECORDS)
+    {
+        if (end_segment(s, s->last_end) != 0 || begin_segment(s, s->last_end) != 0)
+        {
+            return -1;
+        }
+    }
+    if (s->header.count == 0)
+    {
+        s->header.first_ts = timestamp;
+        s->entry.min_ts = timestamp;
+        s->entry.max_ts = timestamp;
+    }
+    s->entry.min_ts = timestamp < s->entry.min_ts ? timestamp : s->entry.min_ts;
+    s->entry.max_ts = timestamp > s->entry.max_ts ? timestamp : s->entry.max_ts;
+
+    struct block *block = &s->block;
+    block->offsets[block->count] = offset;
+    block->ends[block->count] = offset + len;
+    block->timestamps[block->count] = timestamp;
+    block->durations[block->count] = duration;
+    block->devices[block->count] = device;
+    block->count++;
+    s->header.count++;
+    s->records++;
+    s->last_end = offset + len;
+    return block->count == SEGMENT_BLOCK ? flush_block(s) : 0;
+}
+
+/**
+ * Device id in the third column of a CSV record, 0 if there is none.
+ */
+static uint32_t csv_device(const char *line)
+{
+    const char *comma = strchr(line, ',');
+    char *end;
+    strtof(comma + 1, &end);
+    if (*end != ',')
+    {
+        return 0;
+    }
+    const char *start = end + 1;
+    long device = strtol(start, &end, 10);
+    return end != start && device > 0 && device <= (long)UINT32_MAX ? (uint32_t)device : 0;
+}
+
+/**
+ * Encodes the records in [head, upto) of the mapped live file.
+ */
+static int seal_records(struct sealer *s, const char *data, int64_t head, int64_t upto)
+{
+    int64_t base = s->list->base;
+
+    if (s->binary)
+    {
+        for (int64_t pos = head; pos + (int64_t)sizeof(binlog_record) <= upto; pos += sizeof(binlog_record))
+        {
+            binlog_record record;
+            memcpy(&record, data + pos, sizeof(record));
+            if (seal_record(s, base + pos, sizeof(record), record.timestamp, record.duration, record.device) != 0)
+            {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    // The same lines are records as for log_scan()
+    for (int64_t pos = head; pos < upto;)
+    {
+        const char *newline = memchr(data + pos, '\n', (size_t)(upto - pos));
+        if (newline == NULL)
+        {
+            break;
+        }
+        int64_t len = newline - (data + pos) + 1;
+        if (len - 1 <= LINE_MAX_LEN)
+        {
+            char line[LINE_MAX_LEN + 2];
+            memcpy(line, data + pos, (size_t)len);
+            line[len] = '\0';
+            time_t timestamp;
+            float duration;
+            if (log_parse_row(line, &timestamp, &duration) == 0 &&
+                seal_record(s, base + pos, len, timestamp, duration, csv_device(line)) != 0)
+            {
+                return -1;
+            }
+        }
+        pos += len;
+    }
+    return 0;
+}
+
+/**
+ * Writes the part of the live file that is not sealed to "<log>.live".
+ */
+static int write_rest(const char *log_path, const char *data, int64_t head, int64_t upto, int64_t size, mode_t mode)
+{
+    char path[600];
+    live_tmp_path(path, sizeof(path), log_path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode & 0777);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    int ok = 1;
+    const char *parts[2] = { data, data + upto };
+    int64_t lengths[2] = { head, size - upto };
+    for (int i = 0; i < 2 && ok; i++)
+    {
+        for (int64_t done = 0; ok && done < lengths[i];)
+        {
+            ssize_t n = write(fd, parts[i] + done, (size_t)(lengths[i] - done));
+            ok = n > 0 || (n < 0 && errno == EINTR);
+            done += n > 0 ? n : 0;
+        }
+    }
+    ok = ok && fsync(fd) == 0;
+    ok = (close(fd) == 0) && ok;
+    if (!ok)
+    {
+        remove(path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Seals [0, upto) of the live file and counts the records that were sealed.
+ */
+static int seal(const char *log_path, int64_t upto, uint64_t *records)
+{
+    *records = 0;
+    segment_list list;
+    if (segment_list_load(&list, log_path) != 0)
+    {
+        return -1;
+    }
+    if (list.pending)
+    {
+        segment_list_free(&list);
+        return -1;
+    }
+
+    int fd = open(log_path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        segment_list_free(&list);
+        return -1;
+    }
+    int64_t size = st.st_size;
+    int binary = binlog_detect(log_path);
+    int64_t head = binary ? (int64_t)sizeof(binlog_header) : 0;
+    if (upto > size || upto <= head)
+    {
+        close(fd);
+        segment_list_free(&list);
+        return upto == head ? 0 : -1;
+    }
+
+    void *map = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        segment_list_free(&list);
+        return -1;
+    }
+    madvise(map, (size_t)size, MADV_SEQUENTIAL);
+
+    struct sealer s;
+    memset(&s, 0, sizeof(s));
+    s.log_path = log_path;
+    s.list = &list;
+    s.binary = binary;
+    size_t first_new = list.count;
+    int64_t start = list.base + head;
+
+    int ok = begin_segment(&s, start) == 0 &&
+             seal_records(&s, map, head, upto) == 0 &&
+             end_segment(&s, list.base + upto) == 0 &&
+             write_rest(log_path, map, head, upto, size, st.st_mode) == 0;
+    if (s.file != NULL)
+    {
+        fclose(s.file);
+        remove(s.tmp_path);
+    }
+    munmap(map, (size_t)size);
+    free(s.directory);
+    free(s.out.data);
+
+    int committed = 0;
+    if (ok)
+    {
+        // The list is the commit point; a crash after it is finished by segment_recover()
+        list.base += upto - head;
+        list.sealed = list.entries[list.count - 1].end;
+        list.generation++;
+        committed = ok = save_list(&list, 1) == 0;
+        if (ok)
+        {
+            char live_path[600];
+            live_tmp_path(live_path, sizeof(live_path), log_path);
+            ok = rename(live_path, log_path) == 0;
+            list.generation++;
+            ok = ok && save_list(&list, 0) == 0;
+        }
+    }
+    if (!committed)
+    {
+        // Nothing refers to the new files unless the list was saved
+        for (size_t i = first_new; i < list.count; i++)
+        {
+            char path[sizeof(list.path) + 32];
+            segment_path(path, sizeof(path), log_path, list.entries[i].id);
+            remove(path);
+        }
+    }
+    *records = ok ? s.records : 0;
+    segment_list_free(&list);
+    return ok ? 0 : -1;
+}
+
+int segment_seal(const char *log_path, int64_t upto)
+{
+    uint64_t records;
+    return seal(log_path, upto, &records);
+}
+
+int segment_compact(const char *log_path, uint64_t *records)
+{
+    *records = 0;
+    if (segment_recover(log_path) != 0)
+    {
+        return -1;
+    }
+
+    // Lock the file that is at the path once the lock is held
+    int fd;
+    struct stat held, named;
+    for (;;)
+    {
+        fd = open(log_path, O_RDONLY);
+        if (fd < 0)
+        {
+            return -1;
+        }
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+        {
+            int busy = errno == EWOULDBLOCK;
+            close(fd);
+            return busy ? 1 : -1;
+        }
+        if (fstat(fd, &held) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+        if (stat(log_path, &named) == 0 && named.st_ino == held.st_ino && named.st_dev == held.st_dev)
+        {
+            break;
+        }
+        close(fd);
+    }
+
+    // Only whole records are sealed; a torn last line stays in the live file
+    int64_t size = held.st_size;
+    int64_t upto = 0;
+    if (binlog_detect(log_path))
+    {
+        int64_t head = (int64_t)sizeof(binlog_header);
+        upto = size > head ? head + (size - head) / (int64_t)sizeof(binlog_record) * (int64_t)sizeof(binlog_record)
+                           : head;
+    }
+    else
+    {
+        char chunk[4096];
+        for (int64_t at = size; at > 0 && upto == 0;)
+        {
+            int64_t from = at > (int64_t)sizeof(chunk) ? at - (int64_t)sizeof(chunk) : 0;
+            if (pread(fd, chunk, (size_t)(at - from), from) != at - from)
+            {
+                close(fd);
+                return -1;
+            }
+            for (int64_t i = at - from; i > 0; i--)
+            {
+                if (chunk[i - 1] == '\n')
+                {
+                    upto = from + i;
+                    break;
+                }
+            }
+            at = from;
+        }
+    }
+
+    int result = seal(log_path, upto, records);
+    close(fd);
+    return result;
+}
+
+int segment_recover(const char *log_path)
+{
+    segment_list list;
+    if (segment_list_load(&list, log_path) != 0)
+    {
+        return -1;
+    }
+
+    // A process sealing or recording the log holds a lock on it
+    int fd = open(log_path, O_RDONLY);
+    if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) != 0)
+    {
+        close(fd);
+        segment_list_free(&list);
+        return 0;
+    }
+
+    char live_path[600];
+    live_tmp_path(live_path, sizeof(live_path), log_path);
+    int result = 0;
+    if (list.pending)
+    {
+        if (access(live_path, F_OK) == 0 && rename(live_path, log_path) != 0)
+        {
+            result = -1;
+        }
+        else
+        {
+            list.generation++;
+            result = save_list(&list, 0);
+        }
+    }
+    else
+    {
+        // Left by a seal that stopped before its list was written
+        remove(live_path);
+    }
+
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    segment_list_free(&list);
+    return result;
+}
+
+void segment_list_free(segment_list *list)
+{
+    free(list->entries);
+    list->entries = NULL;
+    list->count = 0;
+}
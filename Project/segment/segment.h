@@ -0,0 +1,162 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include "../index/dayindex.h"
+
+#define SEGMENT_MAGIC "FEEDSEG"
+#define SEGMENT_VERSION 1
+#define SEGMENT_LIST_MAGIC "FEEDSGL"
+#define SEGMENT_LIST_VERSION 1
+// Appended to the log path to get the path of its segment list
+#define SEGMENT_LIST_SUFFIX ".segs"
+// Records per compressed block; each block can be decoded on its own
+#define SEGMENT_BLOCK 256
+// Longer runs are sealed into several segments
+#define SEGMENT_MAX_RECORDS (1 << 24)
+
+/**
+ * @brief One sealed segment of a log (64 bytes)
+ *
+ * A segment holds every record whose offset is in [start, end) in the
+ * logical log, i.e. the sealed segments followed by the live file.
+ */
+typedef struct segment_entry {
+    uint64_t id;
+    int64_t start;
+    int64_t end;
+    int64_t min_ts;
+    int64_t max_ts;
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t reserved;
+} segment_entry;
+
+/**
+ * @brief Segments of a log, read from "<log>.segs"
+ *
+ * Byte 0 of the live file is at offset base in the logical log, so every
+ * offset kept in the index, rollups and histograms stays valid when the
+ * head of the live file is sealed. A log that was never sealed has no
+ * segments and a base of 0.
+ */
+typedef struct segment_list {
+    char path[512];
+    uint64_t generation;
+    int pending;
+    int64_t base;
+    int64_t sealed;    // end of the last segment, where the records of the live file start
+    uint64_t next_id;
+    segment_entry *entries;
+    size_t count;
+} segment_list;
+
+/**
+ * @brief Reads the segment list of a log
+ *
+ * @param list List to fill; empty if the log was never sealed
+ * @param log_path Path of the log
+ * @return int 0 on success, -1 if the list exists but cannot be read
+ */
+int segment_list_load(segment_list *list, const char *log_path);
+
+/**
+ * @brief Opens the live file of a log together with a matching segment list
+ *
+ * A log that is being sealed by another process is waited for, so the
+ * base in the list always belongs to the file that is returned.
+ *
+ * @param log_path Path of the log
+ * @param list Filled with the segment list; release with segment_list_free()
+ * @return FILE* Live file opened for reading, or NULL if error occurs
+ */
+FILE *segment_open_live(const char *log_path, segment_list *list);
+
+/**
+ * @brief Returns the size of the logical log (sealed segments and live file)
+ *
+ * @param log_path Path of the log
+ * @return int64_t End offset of the live file in the logical log, -1 if error occurs
+ */
+int64_t segment_log_size(const char *log_path);
+
+/**
+ * @brief Reads the sealed records at or after an offset
+ *
+ * @param list Segment list of the log
+ * @param from Offset of the first record to read
+ * @param fn Called for each record, in log order
+ * @param ctx Passed to fn
+ * @param stopped Set to 1 if fn stopped the scan
+ * @return int64_t Offset after the last record reported if fn stopped the scan,
+ *         otherwise the end of the last segment; -1 if a segment cannot be read
+ */
+int64_t segment_scan(const segment_list *list, int64_t from, log_row_fn fn, void *ctx, int *stopped);
+
+/**
+ * @brief Reads the sealed records at or after an offset, with their device ids
+ *
+ * Same as segment_scan(), for callers that need the whole record.
+ *
+ * @param list Segment list of the log
+ * @param from Offset of the first record to read
+ * @param fn Called for each record, in log order
+ * @param ctx Passed to fn
+ * @param stopped Set to 1 if fn stopped the scan
+ * @return int64_t Same as segment_scan()
+ */
+int64_t segment_scan_records(const segment_list *list, int64_t from, log_record_fn fn, void *ctx, int *stopped);
+
+/**
+ * @brief Finds where the records at or after a time start in a sorted log
+ *
+ * @param list Segment list of the log
+ * @param from Timestamp to look for
+ * @return int64_t Start of the first block that can hold such a record, or
+ *         -1 if every sealed record is older
+ */
+int64_t segment_seek(const segment_list *list, time_t from);
+
+/**
+ * @brief Moves the head of the live file into compressed segments
+ *
+ * The records in [0, upto) of the live file are encoded into new segment
+ * files and the rest of the file becomes the new live file. Offsets in the
+ * logical log do not change. The caller must be the only writer of the log.
+ *
+ * @param log_path Path of the log
+ * @param upto Byte position in the live file, at a record boundary
+ * @return int 0 on success, -1 if error occurs
+ */
+int segment_seal(const char *log_path, int64_t upto);
+
+/**
+ * @brief Seals every complete record of a log that is not being recorded
+ *
+ * @param log_path Path of the log
+ * @param records Set to the number of records sealed
+ * @return int 0 on success, -1 if error occurs, 1 if the log is being recorded
+ */
+int segment_compact(const char *log_path, uint64_t *records);
+
+/**
+ * @brief Finishes a seal that was interrupted by a crash
+ *
+ * Does nothing while another process holds the log.
+ *
+ * @param log_path Path of the log
+ * @return int 0 on success, -1 if error occurs
+ */
+int segment_recover(const char *log_path);
+
+/**
+ * @brief Releases a list loaded with segment_list_load()
+ *
+ * @param list List to release
+ */
+void segment_list_free(segment_list *list);
+
+#endif /* SEGMENT_H */
@@ -0,0 +1,430 @@
+/**
+ * @file selftest.c
+ * @brief Equivalence checks of the fast log readers against the plain ones
+ *
+ * The CSV scanner, its SWAR row parser and the parallel index scan are
+ * only correct if they give exactly what the simple code they replace
+ * gives. These checks feed both the same input and compare the results, so
+ * the claim can be checked again after every change to the fast paths:
+ *
+ * - rows are drawn from a generator that mixes plain records with the
+ *   cases the fast parser must hand back to log_parse_row(): long
+ *   mantissas, exponents, signs, hexadecimal floats, values that round
+ *   halfway, overflowing timestamps and random bytes
+ * - the scanner runs once per instruction set, over buffers at every
+ *   alignment, with lines both shorter and longer than one 64-byte block
+ * - the parallel scan is compared entry by entry, sums included, with the
+ *   index a serial scan builds
+ *
+ * The generator is seeded, so a failing run can be repeated with its seed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "selftest.h"
+#include "../binlog/binlog.h"
+#include "../index/csvscan.h"
+#include "../index/dayindex.h"
+#include "../index/dayscan.h"
+
+// Longest generated row
+#define ROW_MAX 320
+// Most lines in one buffer of the scanner check
+#define BUFFER_LINES 400
+// Mismatches printed per check before the rest are only counted
+#define REPORT_MAX 5
+
+/**
+ * Small xorshift generator, so a seed gives the same rows on every platform.
+ */
+static unsigned next_random(unsigned *state)
+{
+    unsigned x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/**
+ * Appends n random digits to a row.
+ */
+static size_t put_digits(char *row, size_t at, int n, unsigned *state)
+{
+    for (int i = 0; i < n && at < ROW_MAX; i++)
+    {
+        row[at++] = (char)('0' + next_random(state) % 10);
+    }
+    return at;
+}
+
+/**
+ * Writes one random row without its newline. Returns its length.
+ */
+static size_t random_row(char *row, unsigned *state)
+{
+    static const char *const odd[] = {
+        "", ",", ",5", "5,", "123", " 12,3", "12, 3", "+12,3", "-12,3", "12,+3", "12,-3", "12,.5", "12,5.",
+        "12,.", "12,0x1p3", "12,0X10", "12,inf", "12,nan", "12,infinity", "12,1e3", "12,2.5E-2", "12,3e",
+        "12,16777217", "12,16777219", "12,0.1", "12,3.4028235e38", "12,340282356779733661637539395458142568448",
+        "12,0.000000000000000000000000000000000000001", "12,1e-45", "12,3.5\r", "12,3.5,7", "12,3.5x",
+        "99999999999999999999,1", "9223372036854775807,1", "12\r,3", "12;3", "0,0", "000000000000000012,1",
+    };
+    size_t at = 0;
+    unsigned kind = next_random(state) % 16;
+    if (kind < 8)
+    {
+        // A record as the recorder writes it, sometimes with a device id
+        at = (size_t)snprintf(row, ROW_MAX, "%u,", 1700000000u + next_random(state) % 100000000u);
+        at = put_digits(row, at, 1 + (int)(next_random(state) % 5), state);
+        if (next_random(state) % 2)
+        {
+            row[at++] = '.';
+            at = put_digits(row, at, (int)(next_random(state) % 4), state);
+        }
+        if (next_random(state) % 4 == 0)
+        {
+            at += (size_t)snprintf(row + at, ROW_MAX - at, ",%u", next_random(state) % 8);
+        }
+    }
+    else if (kind == 8)
+    {
+        // Mantissas around the 19 digits and 2^53 the fast parser takes
+        at = put_digits(row, 0, 1 + (int)(next_random(state) % 19), state);
+        row[at++] = ',';
+        int digits = 10 + (int)(next_random(state) % 16);
+        int dot = (int)(next_random(state) % (unsigned)(digits + 1));
+        for (int i = 0; i < digits; i++)
+        {
+            if (i == dot)
+            {
+                row[at++] = '.';
+            }
+            at = put_digits(row, at, 1, state);
+        }
+    }
+    else if (kind == 9)
+    {
+        // Tiny and huge durations, and zeros
+        at = (size_t)snprintf(row, ROW_MAX, "%u,", next_random(state));
+        if (next_random(state) % 2)
+        {
+            row[at++] = '0';
+            row[at++] = '.';
+            for (int i = (int)(next_random(state) % 48); i > 0; i--)
+            {
+                row[at++] = '0';
+            }
+        }
+        at = put_digits(row, at, 1 + (int)(next_random(state) % 45), state);
+    }
+    else if (kind < 13)
+    {
+        const char *text = odd[next_random(state) % (sizeof(odd) / sizeof(odd[0]))];
+        at = strlen(text);
+        memcpy(row, text, at);
+    }
+    else
+    {
+        // Random bytes, a comma more likely than others, and lines longer than one block
+        size_t len = next_random(state) % (kind == 15 ? ROW_MAX : 40);
+        for (at = 0; at < len; at++)
+        {
+            unsigned r = next_random(state);
+            char c = r % 8 == 0 ? ',' : r % 8 == 1 ? (char)('0' + r / 8 % 10) : (char)(r >> 8);
+            row[at] = c == '\n' ? ',' : c;
+        }
+    }
+    return at;
+}
+
+/**
+ * Checks that csv_parse_row() only accepts rows log_parse_row() reads the same.
+ */
+static int check_parser(long rows, unsigned seed)
+{
+    unsigned state = seed;
+    long fast = 0;
+    long mismatches = 0;
+    char row[ROW_MAX + 1];
+    for (long n = 0; n < rows; n++)
+    {
+        size_t len = random_row(row, &state);
+        row[len] = '\0';
+        const char *found = memchr(row, ',', len);
+        size_t comma = found ? (size_t)(found - row) : len;
+
+        time_t t1, t2;
+        float d1, d2;
+        if (csv_parse_row(row, len, comma, &t1, &d1) != 0)
+        {
+            continue;
+        }
+        fast++;
+        if (log_parse_row(row, &t2, &d2) != 0 || t1 != t2 || memcmp(&d1, &d2, sizeof(float)) != 0)
+        {
+            if (mismatches++ < REPORT_MAX)
+            {
+                printf("  \"%s\": fast parser read %lld,%.9g\n", row, (long long)t1, d1);
+            }
+        }
+    }
+    printf("%s csv_parse_row: %ld rows, %ld on the fast path, %ld mismatches\n", mismatches ? "FAILED" : "ok",
+           rows, fast, mismatches);
+    return mismatches ? 1 : 0;
+}
+
+/**
+ * Compares the lines the scanner finds in a buffer with a byte loop. Returns the mismatches.
+ */
+static long compare_lines(const char *data, size_t len)
+{
+    csv_scanner scanner;
+    csv_scan_init(&scanner, data, len);
+    long mismatches = 0;
+    size_t line = 0;
+    for (;;)
+    {
+        size_t start, got, comma;
+        int kind = csv_scan_next(&scanner, &start, &got, &comma);
+
+        const char *newline = line < len ? memchr(data + line, '\n', len - line) : NULL;
+        size_t want = newline ? (size_t)(newline - data) - line : len - line;
+        const char *found = memchr(data + line, ',', want);
+        size_t want_comma = found ? (size_t)(found - data) - line : want;
+        int want_kind = newline ? 1 : line < len ? 2 : 0;
+
+        if (kind != want_kind || (kind != 0 && (start != line || got != want || comma != want_comma)))
+        {
+            if (mismatches++ < REPORT_MAX)
+            {
+                printf("  line at %zu: scanner gave kind %d at %zu, %zu bytes, comma %zu; expected kind %d, "
+                       "%zu bytes, comma %zu\n", line, kind, start, got, comma, want_kind, want, want_comma);
+            }
+            break;
+        }
+        if (kind == 0)
+        {
+            break;
+        }
+        line = newline ? line + want + 1 : len;
+    }
+    return mismatches;
+}
+
+/**
+ * Checks the line scanner with every instruction set against a byte loop.
+ */
+static int check_scanner(long rows, unsigned seed)
+{
+    char *buffer = malloc(CSVSCAN_BLOCK + BUFFER_LINES * (ROW_MAX + 1));
+    if (buffer == NULL)
+    {
+        printf("Out of memory.\n");
+        return 1;
+    }
+
+    static const char *const isas[] = { "scalar", "sse2", "avx2" };
+    char chosen[16];
+    snprintf(chosen, sizeof(chosen), "%s", csv_scan_isa());
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(isas) / sizeof(isas[0]); i++)
+    {
+        if (csv_scan_use_isa(isas[i]) != 0)
+        {
+            printf("skipped csv_scan_next (%s): not available on this CPU\n", isas[i]);
+            continue;
+        }
+
+        unsigned state = seed;
+        long mismatches = 0;
+        long lines = 0;
+        // Buffers of up to BUFFER_LINES lines, each at another alignment and some without a last newline
+        for (long done = 0; done < rows && mismatches == 0; done += lines)
+        {
+            size_t align = next_random(&state) % CSVSCAN_BLOCK;
+            size_t len = align;
+            lines = 1 + (long)(next_random(&state) % BUFFER_LINES);
+            for (long n = 0; n < lines; n++)
+            {
+                len += random_row(buffer + len, &state);
+                buffer[len++] = '\n';
+            }
+            if (next_random(&state) % 2)
+            {
+                len--;
+            }
+            mismatches += compare_lines(buffer + align, len - align);
+        }
+        printf("%s csv_scan_next (%s): %ld rows\n", mismatches ? "FAILED" : "ok", isas[i], rows);
+        failed |= mismatches != 0;
+    }
+    csv_scan_use_isa(chosen);
+    free(buffer);
+    return failed;
+}
+
+/**
+ * Writes a CSV log spread over several weeks with junk, an out-of-order stretch,
+ * lines too long to be records and a last line without a newline.
+ */
+static int write_log(const char *path, long rows, unsigned seed)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    unsigned state = seed;
+    long long t = 1767225600; // 2026-01-01
+    char row[ROW_MAX + 1];
+    for (long n = 0; n < rows; n++)
+    {
+        unsigned kind = next_random(&state) % 100;
+        t += next_random(&state) % (unsigned)(40 * 86400 / rows + 1);
+        long long at = n > rows / 2 && n < rows / 2 + rows / 20 ? t - (long long)(next_random(&state) % 864000) : t;
+        if (kind < 3)
+        {
+            size_t len = random_row(row, &state);
+            row[len] = '\0';
+            // A NUL would end the line for log_scan() but not for the scanner; neither is a record
+            for (size_t i = 0; i < len; i++)
+            {
+                row[i] = row[i] == '\0' ? ' ' : row[i];
+            }
+            fprintf(file, "%s\n", row);
+        }
+        else if (kind < 4)
+        {
+            fprintf(file, "%lld,3.25,%0*d\n", at, 260, 1);
+        }
+        else if (kind < 5)
+        {
+            fprintf(file, "%lld,%u.5\r\n", at, next_random(&state) % 60);
+        }
+        else
+        {
+            fprintf(file, "%lld,%u.%u\n", at, next_random(&state) % 60, next_random(&state) % 100);
+        }
+    }
+    fprintf(file, "%lld,7.75", t);
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+/**
+ * Compares two indexes. Returns 0 if they are the same.
+ */
+static int compare_indexes(const day_index *a, const day_index *b)
+{
+    if (a->count != b->count || a->covered != b->covered || a->last_ts != b->last_ts || a->flags != b->flags)
+    {
+        printf("  %zu entries up to %lld (flags %u), expected %zu up to %lld (flags %u)\n", b->count,
+               (long long)b->covered, b->flags, a->count, (long long)a->covered, a->flags);
+        return -1;
+    }
+    for (size_t i = 0; i < a->count; i++)
+    {
+        if (memcmp(&a->entries[i], &b->entries[i], sizeof(day_entry)) != 0)
+        {
+            printf("  entry %zu: day %d, %u records at %lld, sum %.17g; expected day %d, %u at %lld, sum %.17g\n", i,
+                   b->entries[i].day, b->entries[i].count, (long long)b->entries[i].offset, b->entries[i].sum,
+                   a->entries[i].day, a->entries[i].count, (long long)a->entries[i].offset, a->entries[i].sum);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Checks the parallel scan of one log against a serial scan.
+ */
+static int check_parallel_log(const char *log_path, const char *kind)
+{
+    char index_path[512];
+    snprintf(index_path, sizeof(index_path), "%s%s", log_path, DAYINDEX_SUFFIX);
+    remove(index_path);
+
+    day_index serial;
+    dayindex_set_threads(1);
+    int status = dayindex_load(&serial, log_path);
+    dayindex_set_threads(0);
+    remove(index_path);
+    if (status != 0)
+    {
+        printf("FAILED dayscan_parallel (%s): the log cannot be read\n", kind);
+        return 1;
+    }
+
+    static const int thread_counts[] = { 2, 3, 4, 7, 16 };
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); i++)
+    {
+        // An index as dayindex_load() starts it when there is no sidecar
+        day_index parallel;
+        memset(&parallel, 0, sizeof(parallel));
+        snprintf(parallel.path, sizeof(parallel.path), "%s", index_path);
+        parallel.fd = -1;
+        parallel.binary = serial.binary;
+        parallel.covered = serial.binary ? (int64_t)sizeof(binlog_header) : 0;
+        parallel.flags = DAYINDEX_SORTED;
+        day_bucketer_init(&parallel.bucketer);
+
+        int differs = dayscan_parallel(&parallel, log_path, thread_counts[i]) != 0;
+        if (differs)
+        {
+            printf("  the scan failed\n");
+        }
+        differs = differs || compare_indexes(&serial, &parallel) != 0;
+        printf("%s dayscan_parallel (%s, %d threads): %zu entries\n", differs ? "FAILED" : "ok", kind,
+               thread_counts[i], parallel.count);
+        failed |= differs;
+        dayindex_free(&parallel);
+    }
+    dayindex_free(&serial);
+    return failed;
+}
+
+/**
+ * Checks the parallel index scan against the serial one on a CSV and a binary log.
+ */
+static int check_parallel(long rows, unsigned seed)
+{
+    char dir[] = "/tmp/feed-selftest.XXXXXX";
+    if (mkdtemp(dir) == NULL)
+    {
+        printf("Error creating a temporary directory.\n");
+        return 1;
+    }
+    char csv[64];
+    char bin[64];
+    snprintf(csv, sizeof(csv), "%s/log.csv", dir);
+    snprintf(bin, sizeof(bin), "%s/log.bin", dir);
+
+    int failed;
+    if (write_log(csv, rows, seed) != 0 || csv_to_binlog(csv, bin) < 0)
+    {
+        printf("Error writing the test logs in %s.\n", dir);
+        failed = 1;
+    }
+    else
+    {
+        failed = check_parallel_log(csv, "csv");
+        failed |= check_parallel_log(bin, "binary");
+    }
+    remove(csv);
+    remove(bin);
+    rmdir(dir);
+    return failed;
+}
+
+int run_selftest(long rows, unsigned seed)
+{
+    printf("Self-test with %ld rows, seed %u\n", rows, seed);
+    int failed = check_parser(rows, seed);
+    failed |= check_scanner(rows, seed);
+    failed |= check_parallel(rows, seed);
+    printf(failed ? "Self-test FAILED.\n" : "Self-test passed.\n");
+    return failed ? 1 : 0;
+}
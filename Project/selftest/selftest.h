@@ -0,0 +1,25 @@
+#ifndef SELFTEST_H
+#define SELFTEST_H
+
+// Rows of each check unless another number is given
+#define SELFTEST_ROWS 200000
+
+/**
+ * @brief Checks the fast paths of the log readers against their plain versions
+ *
+ * - the CSV scanner, with every instruction set this CPU has, splits
+ *   random text into the same lines and first commas as a byte loop
+ * - csv_parse_row() accepts only rows that log_parse_row() reads to the
+ *   same timestamp and the same float, on valid, odd and random rows
+ * - the parallel day index scan builds the same entries as the serial
+ *   one, for a CSV and a binary log and several thread counts
+ *
+ * The logs are written to a temporary directory and removed afterwards.
+ *
+ * @param rows Rows of random text and records per check
+ * @param seed Seed of the random rows, so a failure can be repeated
+ * @return int 0 if every check passed, 1 otherwise
+ */
+int run_selftest(long rows, unsigned seed);
+
+#endif /* SELFTEST_H */
@@ -0,0 +1,112 @@
+/**
+ * @file command.c
+ * @brief Acknowledged settings commands sent to the feeder
+ *
+ * Settings used to be written to a file on the host that had to be copied
+ * to the feeder, which then read it back from flash on every loop. They are
+ * now sent over the serial link and the feeder keeps them in RAM, writing
+ * flash only when a value changes.
+ *
+ * The session used to wait for the answer is opened before the command is
+ * written, so write_to_serial() reuses its descriptor and an answer that
+ * comes back quickly is not missed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "command.h"
+#include "serial.h"
+
+/**
+ * Checks one field of a command line.
+ */
+static int check_field(const char *field, int is_key)
+{
+    size_t len = field ? strlen(field) : 0;
+    if (len == 0 || len > COMMAND_FIELD_MAX)
+    {
+        return -1;
+    }
+    for (const unsigned char *p = (const unsigned char *)field; *p; p++)
+    {
+        if (*p <= ' ' || *p >= 0x7F || *p == '[' || *p == ']' || (is_key && *p == '='))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int command_check(const char *key, const char *value)
+{
+    return check_field(key, 1) == 0 && check_field(value, 0) == 0 ? 0 : -1;
+}
+
+/**
+ * Waits for the acknowledgement of command id.
+ *
+ * Returns 0 if it was applied, 1 if it was rejected and -1 on timeout.
+ * Answers to other commands are skipped.
+ */
+static int wait_ack(serial_session *session, unsigned id)
+{
+    char *reply;
+    while ((reply = serial_read_pattern(session, COMMAND_ACK_PATTERN)) != NULL)
+    {
+        unsigned ack_id;
+        char status[16];
+        int reason = 0;
+        int fields = sscanf(reply, "%u %15s %n", &ack_id, status, &reason);
+        if (fields == 2 && ack_id == id)
+        {
+            int result = strcmp(status, "ok") == 0 ? 0 : 1;
+            if (result != 0)
+            {
+                printf("Feeder rejected the setting: %s\n", reason > 0 ? reply + reason : status);
+            }
+            free(reply);
+            return result;
+        }
+        free(reply);
+    }
+    return -1;
+}
+
+int command_send(const char *port, const char *key, const char *value)
+{
+    if (command_check(key, value) != 0)
+    {
+        printf("Invalid setting '%s=%s'\n", key ? key : "", value ? value : "");
+        return -1;
+    }
+
+    serial_session *session = serial_open(port);
+    if (session == NULL)
+    {
+        return -1;
+    }
+    serial_set_timeout(session, COMMAND_TIMEOUT_MS);
+
+    unsigned id = ((unsigned)time(NULL) ^ ((unsigned)getpid() << 16)) % 1000000;
+    char line[2 * COMMAND_FIELD_MAX + 32];
+    snprintf(line, sizeof(line), "%s[%u %s=%s]\n", COMMAND_PATTERN, id, key, value);
+
+    int result = -1;
+    for (int attempt = 0; attempt < COMMAND_ATTEMPTS && result < 0; attempt++)
+    {
+        if (write_to_serial(port, line) < 0)
+        {
+            break;
+        }
+        result = wait_ack(session, id);
+    }
+
+    if (result < 0)
+    {
+        printf("No acknowledgement from %s.\n", port);
+    }
+    serial_close(session);
+    return result;
+}
@@ -0,0 +1,51 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+/*
+ * Settings are sent to the feeder as one text line
+ *
+ *     Set:[<id> <key>=<value>]
+ *
+ * and the feeder answers with
+ *
+ *     Ack:[<id> ok]   or   Ack:[<id> error <reason>]
+ *
+ * The id is picked by the host and repeated on retries, so an answer to an
+ * earlier command is never taken for the answer to this one. Setting a
+ * value twice has the same effect as setting it once.
+ */
+#define COMMAND_PATTERN "Set:"
+#define COMMAND_ACK_PATTERN "Ack:"
+// Longest key or value of a setting
+#define COMMAND_FIELD_MAX 32
+// How long to wait for an acknowledgement before sending again
+#define COMMAND_TIMEOUT_MS 1000
+// Times a command is sent before giving up
+#define COMMAND_ATTEMPTS 3
+
+/**
+ * @brief Checks that a setting can be sent in a command line
+ *
+ * @param key Name of the setting
+ * @param value Value of the setting
+ * @return int 0 if both are non-empty, short enough and free of spaces,
+ *         brackets, '=' in the key and control characters, -1 otherwise
+ */
+int command_check(const char *key, const char *value);
+
+/**
+ * @brief Sends a setting to the feeder and waits until it is acknowledged
+ *
+ * The command is written with write_to_serial() and sent again up to
+ * COMMAND_ATTEMPTS times if no acknowledgement arrives. The recorder must
+ * not be reading the port at the same time.
+ *
+ * @param port The serial port device path (e.g., "/dev/ttyUSB0")
+ * @param key Name of the setting, e.g. "delay"
+ * @param value Value of the setting
+ * @return int 0 if the feeder applied the setting, 1 if it rejected it,
+ *         -1 if the port cannot be used or no acknowledgement arrived
+ */
+int command_send(const char *port, const char *key, const char *value);
+
+#endif /* COMMAND_H */
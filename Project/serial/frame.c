@@ -0,0 +1,231 @@
+/**
+ * @file frame.c
+ * @brief Streaming parser for "Pattern:[value]" records received over serial
+ *
+ * Received bytes live in a ring buffer of FRAME_RING_SIZE bytes. head and
+ * tail are free-running counters, so tail - head is the number of bytes not
+ * parsed yet. The parser is a small state machine:
+ *
+ * - FRAME_SEEK_TAG: matching the pattern with a KMP failure table, so a
+ *   pattern split across reads or preceded by a partial match is found
+ * - FRAME_SEEK_OPEN: skipping bytes between the pattern and '['
+ * - FRAME_VALUE: copying the value until ']'
+ *
+ * The state is kept between calls, so each byte is looked at exactly once.
+ */
+#include <string.h>
+#include "frame.h"
+
+enum {
+    FRAME_SEEK_TAG,
+    FRAME_SEEK_OPEN,
+    FRAME_VALUE
+};
+
+/**
+ * Builds the KMP failure table for the current pattern.
+ *
+ * fail[i] is the length of the longest proper prefix of pattern[0..i]
+ * that is also a suffix of it.
+ */
+static void build_fail(frame_parser *parser)
+{
+    size_t k = 0;
+    parser->fail[0] = 0;
+    for (size_t i = 1; i < parser->pattern_len; i++)
+    {
+        while (k > 0 && parser->pattern[i] != parser->pattern[k])
+        {
+            k = parser->fail[k - 1];
+        }
+        if (parser->pattern[i] == parser->pattern[k])
+        {
+            k++;
+        }
+        parser->fail[i] = k;
+    }
+}
+
+int frame_set_pattern(frame_parser *parser, const char *pattern)
+{
+    size_t len = pattern ? strlen(pattern) : 0;
+    if (len == 0 || len > FRAME_PATTERN_MAX)
+    {
+        return -1;
+    }
+
+    memcpy(parser->pattern, pattern, len);
+    parser->pattern_len = len;
+    parser->state = FRAME_SEEK_TAG;
+    parser->matched = 0;
+    parser->value_len = 0;
+    build_fail(parser);
+    return 0;
+}
+
+int frame_init(frame_parser *parser, const char *pattern)
+{
+    memset(parser, 0, sizeof(*parser));
+    return frame_set_pattern(parser, pattern);
+}
+
+/**
+ * Abandons the record being parsed and counts the bytes it had consumed.
+ */
+static void abandon(frame_parser *parser, size_t bytes)
+{
+    parser->discarded += bytes;
+    parser->state = FRAME_SEEK_TAG;
+    parser->matched = 0;
+    parser->value_len = 0;
+}
+
+size_t frame_push(frame_parser *parser, const char *data, size_t len)
+{
+    size_t dropped = 0;
+
+    // Only the last FRAME_RING_SIZE bytes of an oversized push can be kept
+    if (len > FRAME_RING_SIZE)
+    {
+        dropped += len - FRAME_RING_SIZE;
+        data += len - FRAME_RING_SIZE;
+        len = FRAME_RING_SIZE;
+    }
+
+    size_t used = parser->tail - parser->head;
+    if (used + len > FRAME_RING_SIZE)
+    {
+        size_t excess = used + len - FRAME_RING_SIZE;
+        parser->head += excess;
+        dropped += excess;
+    }
+
+    if (dropped > 0)
+    {
+        // The record in progress lost bytes, so it cannot be trusted anymore
+        abandon(parser, dropped);
+    }
+
+    while (len > 0)
+    {
+        size_t region;
+        char *dst = frame_write_region(parser, &region);
+        size_t n = len < region ? len : region;
+        memcpy(dst, data, n);
+        frame_commit(parser, n);
+        data += n;
+        len -= n;
+    }
+
+    return dropped;
+}
+
+char *frame_write_region(frame_parser *parser, size_t *len)
+{
+    size_t used = parser->tail - parser->head;
+    size_t offset = parser->tail % FRAME_RING_SIZE;
+    size_t contiguous = FRAME_RING_SIZE - offset;
+    size_t free_bytes = FRAME_RING_SIZE - used;
+
+    *len = free_bytes < contiguous ? free_bytes : contiguous;
+    return (char *)parser->ring + offset;
+}
+
+void frame_commit(frame_parser *parser, size_t len)
+{
+    parser->tail += len;
+}
+
+size_t frame_peek(const frame_parser *parser, const char **data)
+{
+    size_t used = parser->tail - parser->head;
+    size_t offset = parser->head % FRAME_RING_SIZE;
+    size_t contiguous = FRAME_RING_SIZE - offset;
+
+    *data = (const char *)parser->ring + offset;
+    return used < contiguous ? used : contiguous;
+}
+
+void frame_skip(frame_parser *parser, size_t len)
+{
+    parser->head += len;
+}
+
+int frame_next(frame_parser *parser, char *out, size_t out_size)
+{
+    while (parser->head != parser->tail)
+    {
+        char c = (char)parser->ring[parser->head % FRAME_RING_SIZE];
+        parser->head++;
+
+        switch (parser->state)
+        {
+        case FRAME_SEEK_TAG:
+            while (parser->matched > 0 && c != parser->pattern[parser->matched])
+            {
+                parser->matched = parser->fail[parser->matched - 1];
+            }
+            if (c == parser->pattern[parser->matched])
+            {
+                parser->matched++;
+            }
+            if (parser->matched == parser->pattern_len)
+            {
+                parser->state = FRAME_SEEK_OPEN;
+                parser->value_len = 0;
+            }
+            break;
+
+        case FRAME_SEEK_OPEN:
+            if (c == '[')
+            {
+                parser->state = FRAME_VALUE;
+                parser->value_len = 0;
+            }
+            else if (c == ']' || parser->value_len == FRAME_VALUE_MAX)
+            {
+                abandon(parser, parser->pattern_len + parser->value_len + 1);
+            }
+            else
+            {
+                parser->value_len++;
+            }
+            break;
+
+        case FRAME_VALUE:
+            if (c == ']')
+            {
+                size_t len = parser->value_len;
+                parser->state = FRAME_SEEK_TAG;
+                parser->matched = 0;
+                parser->value_len = 0;
+
+                // Empty values are skipped, as the original parser did
+                if (len == 0 || out_size == 0)
+                {
+                    break;
+                }
+                if (len >= out_size)
+                {
+                    len = out_size - 1;
+                }
+                memcpy(out, parser->value, len);
+                out[len] = '\0';
+                return 1;
+            }
+            if (parser->value_len == FRAME_VALUE_MAX)
+            {
+                abandon(parser, parser->pattern_len + FRAME_VALUE_MAX + 2);
+                break;
+            }
+            parser->value[parser->value_len++] = c;
+            break;
+        }
+    }
+    return 0;
+}
+
+unsigned long long frame_discarded(const frame_parser *parser)
+{
+    return parser->discarded;
+}
@@ -0,0 +1,121 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+
+// Size of the ring buffer holding received but not yet parsed bytes
+#define FRAME_RING_SIZE 4096
+// Longest pattern that can be searched for
+#define FRAME_PATTERN_MAX 32
+// Longest value accepted between [] brackets
+#define FRAME_VALUE_MAX 64
+
+/**
+ * @brief Incremental parser for "Pattern:[value]" records over a ring buffer
+ *
+ * Bytes are appended with frame_push() (or frame_write_region() and
+ * frame_commit() to read straight into the ring) and records are taken out
+ * with frame_next(). Matching resumes where the previous call stopped, so a
+ * record split across several reads is still found and no byte is scanned
+ * twice.
+ */
+typedef struct frame_parser {
+    char pattern[FRAME_PATTERN_MAX];
+    size_t pattern_len;
+    size_t fail[FRAME_PATTERN_MAX];
+    unsigned char ring[FRAME_RING_SIZE];
+    size_t head;
+    size_t tail;
+    int state;
+    size_t matched;
+    char value[FRAME_VALUE_MAX];
+    size_t value_len;
+    unsigned long long discarded;
+} frame_parser;
+
+/**
+ * @brief Initializes a parser with an empty ring
+ *
+ * @param parser Parser to initialize
+ * @param pattern Pattern that precedes each record, e.g. "Duration:"
+ * @return int 0 on success, -1 if the pattern is empty or too long
+ */
+int frame_init(frame_parser *parser, const char *pattern);
+
+/**
+ * @brief Changes the pattern, keeping bytes that were not parsed yet
+ *
+ * @param parser Initialized parser
+ * @param pattern New pattern
+ * @return int 0 on success, -1 if the pattern is empty or too long
+ */
+int frame_set_pattern(frame_parser *parser, const char *pattern);
+
+/**
+ * @brief Appends received bytes to the ring
+ *
+ * @param parser Initialized parser
+ * @param data Received bytes
+ * @param len Number of bytes
+ * @return size_t Number of unparsed bytes that had to be dropped to make room
+ */
+size_t frame_push(frame_parser *parser, const char *data, size_t len);
+
+/**
+ * @brief Returns the contiguous free space at the write end of the ring
+ *
+ * @param parser Initialized parser
+ * @param len Set to the number of bytes that may be written
+ * @return char* Where to write, to be followed by frame_commit()
+ */
+char *frame_write_region(frame_parser *parser, size_t *len);
+
+/**
+ * @brief Marks bytes written into frame_write_region() as received
+ *
+ * @param parser Initialized parser
+ * @param len Number of bytes written
+ */
+void frame_commit(frame_parser *parser, size_t len);
+
+/**
+ * @brief Returns the contiguous run of bytes that have not been parsed yet
+ *
+ * Lets another parser take over the buffered bytes, see frame_skip().
+ *
+ * @param parser Initialized parser
+ * @param data Set to the first unparsed byte
+ * @return size_t Number of bytes available at data
+ */
+size_t frame_peek(const frame_parser *parser, const char **data);
+
+/**
+ * @brief Marks unparsed bytes as consumed without parsing them
+ *
+ * @param parser Initialized parser
+ * @param len Number of bytes, at most what frame_peek() returned
+ */
+void frame_skip(frame_parser *parser, size_t len);
+
+/**
+ * @brief Parses buffered bytes up to the next complete record
+ *
+ * @param parser Initialized parser
+ * @param out Receives the NUL-terminated value between the brackets
+ * @param out_size Size of out
+ * @return int 1 if a record was extracted, 0 if more bytes are needed
+ */
+int frame_next(frame_parser *parser, char *out, size_t out_size);
+
+/**
+ * @brief Number of bytes thrown away so far
+ *
+ * Counts bytes dropped because the ring was full and bytes of records that
+ * were abandoned because they were malformed or too long.
+ *
+ * @param parser Initialized parser
+ * @return unsigned long long Discarded byte count
+ */
+unsigned long long frame_discarded(const frame_parser *parser);
+
+#endif /* FRAME_H */
@@ -0,0 +1,292 @@
+/**
+ * @file match.c
+ * @brief Aho-Corasick matcher for the event tags printed by the feeder firmware
+ *
+ * The registered tags are compiled into a complete transition table, so each
+ * received byte costs one table lookup no matter how many tags are
+ * registered. When a tag that carries a value is matched, the matcher
+ * switches to the same "skip to '[' and copy until ']'" states used by
+ * frame.c before going back to matching.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "match.h"
+
+enum {
+    MATCH_SCAN,
+    MATCH_SEEK_OPEN,
+    MATCH_VALUE
+};
+
+struct match_tag {
+    char *text;
+    int has_value;
+    match_handler handler;
+    void *ctx;
+};
+
+struct matcher {
+    struct match_tag tags[MATCH_MAX_TAGS];
+    int tag_count;
+    int built;
+
+    // Transition table, tag ending in each state and next state with an output
+    unsigned char delta[MATCH_MAX_STATES][256];
+    short output[MATCH_MAX_STATES];
+    short dict[MATCH_MAX_STATES];
+    int state_count;
+
+    int state;
+    int mode;
+    int capture_tag;
+    char value[MATCH_VALUE_MAX + 1];
+    size_t value_len;
+    unsigned long long discarded;
+};
+
+matcher *matcher_create(void)
+{
+    return calloc(1, sizeof(matcher));
+}
+
+int matcher_add(matcher *m, const char *tag, int has_value, match_handler handler, void *ctx)
+{
+    if (!m || !tag || !*tag || m->built || m->tag_count == MATCH_MAX_TAGS)
+    {
+        return -1;
+    }
+
+    char *copy = strdup(tag);
+    if (copy == NULL)
+    {
+        return -1;
+    }
+
+    struct match_tag *t = &m->tags[m->tag_count++];
+    t->text = copy;
+    t->has_value = has_value;
+    t->handler = handler;
+    t->ctx = ctx;
+    return 0;
+}
+
+int matcher_build(matcher *m)
+{
+    if (!m || m->built)
+    {
+        return -1;
+    }
+
+    // Trie of the tags; 0 in delta means "no edge yet" since the root is never a child
+    int fail[MATCH_MAX_STATES];
+    m->state_count = 1;
+    m->output[0] = -1;
+
+    for (int i = 0; i < m->tag_count; i++)
+    {
+        int s = 0;
+        for (const unsigned char *p = (const unsigned char *)m->tags[i].text; *p; p++)
+        {
+            if (m->delta[s][*p] == 0)
+            {
+                if (m->state_count == MATCH_MAX_STATES)
+                {
+                    return -1;
+                }
+                m->output[m->state_count] = -1;
+                m->delta[s][*p] = (unsigned char)m->state_count++;
+            }
+            s = m->delta[s][*p];
+        }
+        if (m->output[s] < 0)
+        {
+            m->output[s] = (short)i;
+        }
+    }
+
+    // Breadth-first pass turning the trie into a complete automaton
+    int queue[MATCH_MAX_STATES];
+    int qhead = 0;
+    int qtail = 0;
+
+    fail[0] = 0;
+    m->dict[0] = -1;
+    for (int c = 0; c < 256; c++)
+    {
+        int child = m->delta[0][c];
+        if (child != 0)
+        {
+            fail[child] = 0;
+            m->dict[child] = -1;
+            queue[qtail++] = child;
+        }
+    }
+
+    while (qhead < qtail)
+    {
+        int s = queue[qhead++];
+        for (int c = 0; c < 256; c++)
+        {
+            int child = m->delta[s][c];
+            if (child != 0)
+            {
+                int f = m->delta[fail[s]][c];
+                fail[child] = f;
+                m->dict[child] = m->output[f] >= 0 ? f : m->dict[f];
+                queue[qtail++] = child;
+            }
+            else
+            {
+                m->delta[s][c] = m->delta[fail[s]][c];
+            }
+        }
+    }
+
+    m->built = 1;
+    m->mode = MATCH_SCAN;
+    return 0;
+}
+
+/**
+ * Calls the handlers of every tag ending in state s.
+ *
+ * Returns the index of the first matched tag that carries a value, or -1.
+ */
+static int emit(matcher *m, int s, int *calls)
+{
+    int capture = -1;
+    for (; s >= 0; s = m->dict[s])
+    {
+        int i = m->output[s];
+        if (i < 0)
+        {
+            continue;
+        }
+        struct match_tag *t = &m->tags[i];
+        if (t->has_value)
+        {
+            if (capture < 0)
+            {
+                capture = i;
+            }
+        }
+        else
+        {
+            if (t->handler)
+            {
+                t->handler(t->text, NULL, t->ctx);
+            }
+            (*calls)++;
+        }
+    }
+    return capture;
+}
+
+int matcher_feed(matcher *m, const char *data, size_t len)
+{
+    if (!m || !m->built)
+    {
+        return 0;
+    }
+
+    int calls = 0;
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + len;
+
+    while (p < end)
+    {
+        if (m->mode == MATCH_SCAN)
+        {
+            // Hot loop: one lookup per byte until a state with an output
+            int s = m->state;
+            while (p < end)
+            {
+                s = m->delta[s][*p++];
+                if (m->output[s] >= 0 || m->dict[s] >= 0)
+                {
+                    break;
+                }
+            }
+            m->state = s;
+            if (m->output[s] >= 0 || m->dict[s] >= 0)
+            {
+                int capture = emit(m, s, &calls);
+                if (capture >= 0)
+                {
+                    m->capture_tag = capture;
+                    m->mode = MATCH_SEEK_OPEN;
+                    m->value_len = 0;
+                    m->state = 0;
+                }
+            }
+            continue;
+        }
+
+        char c = (char)*p++;
+        if (m->mode == MATCH_SEEK_OPEN)
+        {
+            if (c == '[')
+            {
+                m->mode = MATCH_VALUE;
+                m->value_len = 0;
+            }
+            else if (c == ']' || m->value_len == MATCH_VALUE_MAX)
+            {
+                m->discarded += strlen(m->tags[m->capture_tag].text) + m->value_len + 1;
+                m->mode = MATCH_SCAN;
+            }
+            else
+            {
+                m->value_len++;
+            }
+        }
+        else if (c == ']')
+        {
+            struct match_tag *t = &m->tags[m->capture_tag];
+            m->mode = MATCH_SCAN;
+            if (m->value_len > 0)
+            {
+                m->value[m->value_len] = '\0';
+                if (t->handler)
+                {
+                    t->handler(t->text, m->value, t->ctx);
+                }
+                calls++;
+            }
+        }
+        else if (m->value_len == MATCH_VALUE_MAX)
+        {
+            m->discarded += strlen(m->tags[m->capture_tag].text) + MATCH_VALUE_MAX + 2;
+            m->mode = MATCH_SCAN;
+        }
+        else
+        {
+            m->value[m->value_len++] = c;
+        }
+    }
+
+    return calls;
+}
+
+unsigned long long matcher_discarded(const matcher *m)
+{
+    return m ? m->discarded : 0;
+}
+
+int matcher_partial(const matcher *m)
+{
+    return m && (m->state != 0 || m->mode != MATCH_SCAN);
+}
+
+void matcher_destroy(matcher *m)
+{
+    if (!m)
+    {
+        return;
+    }
+    for (int i = 0; i < m->tag_count; i++)
+    {
+        free(m->tags[i].text);
+    }
+    free(m);
+}
@@ -0,0 +1,89 @@
+#ifndef MATCH_H
+#define MATCH_H
+
+#include <stddef.h>
+
+// Maximum number of tags one matcher can hold
+#define MATCH_MAX_TAGS 16
+// Maximum number of automaton states (roughly the total length of all tags)
+#define MATCH_MAX_STATES 256
+// Longest value accepted between [] brackets
+#define MATCH_VALUE_MAX 64
+
+/**
+ * @brief Called for every tag found in the stream
+ *
+ * @param tag The registered tag, e.g. "Duration:"
+ * @param value Content between the [] brackets after the tag, or NULL for tags registered without a value
+ * @param ctx Context pointer given to matcher_add()
+ */
+typedef void (*match_handler)(const char *tag, const char *value, void *ctx);
+
+/**
+ * @brief Aho-Corasick matcher that extracts several tags in one pass
+ */
+typedef struct matcher matcher;
+
+/**
+ * @brief Creates an empty matcher
+ *
+ * @return matcher* New matcher, or NULL if out of memory
+ */
+matcher *matcher_create(void);
+
+/**
+ * @brief Registers a tag and the handler to call when it is found
+ *
+ * @param m Matcher that has not been built yet
+ * @param tag Text to look for
+ * @param has_value 1 if the tag is followed by a [value] to extract, 0 for a plain event
+ * @param handler Function called for each match
+ * @param ctx Passed to the handler
+ * @return int 0 on success, -1 if the matcher is full or already built
+ */
+int matcher_add(matcher *m, const char *tag, int has_value, match_handler handler, void *ctx);
+
+/**
+ * @brief Compiles the registered tags into the automaton
+ *
+ * @param m Matcher with all tags added
+ * @return int 0 on success, -1 on error
+ */
+int matcher_build(matcher *m);
+
+/**
+ * @brief Feeds bytes through the automaton and calls handlers for every match
+ *
+ * State is kept between calls, so tags and values may be split across feeds.
+ *
+ * @param m Built matcher
+ * @param data Received bytes
+ * @param len Number of bytes
+ * @return int Number of handlers called
+ */
+int matcher_feed(matcher *m, const char *data, size_t len);
+
+/**
+ * @brief Number of bytes of abandoned (malformed or oversized) values
+ *
+ * @param m Matcher
+ * @return unsigned long long Discarded byte count
+ */
+unsigned long long matcher_discarded(const matcher *m);
+
+/**
+ * @brief Tells whether the bytes fed so far end inside a tag or its value
+ *
+ * @param m Matcher
+ * @return int 1 if a tag may still be completed by the next bytes, 0 otherwise
+ */
+int matcher_partial(const matcher *m);
+
+/**
+ * @brief Frees a matcher
+ *
+ * @param m Matcher to free, may be NULL
+ */
+void matcher_destroy(matcher *m);
+
+#endif /* MATCH_H */
@@ -0,0 +1,261 @@
+/**
+ * @file packet.c
+ * @brief Decoder and encoder for the binary framing of the device link
+ *
+ * Received bytes are appended to a small buffer that only ever holds the
+ * start of one frame, and the buffer is parsed from the front:
+ *
+ * - runs of bytes that cannot start a frame are found with memchr() and
+ *   handed to the text callback in one piece
+ * - a frame is only looked at once all its bytes are in; its length is
+ *   checked before the CRC, and a frame that fails either check is dropped
+ *   one byte at a time so the scan restarts inside it
+ *
+ * A valid frame costs one CRC pass and a copy of its events, whatever the
+ * size of the batch. The CRC uses a 16-entry table, two lookups per byte.
+ */
+#include <string.h>
+#include "packet.h"
+
+// CRC-16/CCITT-FALSE of every 4-bit value
+static const uint16_t crc_nibble[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+};
+
+uint16_t packet_crc16(const unsigned char *data, size_t len)
+{
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc = (uint16_t)((crc << 4) ^ crc_nibble[((crc >> 12) ^ (data[i] >> 4)) & 0x0F]);
+        crc = (uint16_t)((crc << 4) ^ crc_nibble[((crc >> 12) ^ data[i]) & 0x0F]);
+    }
+    return crc;
+}
+
+/**
+ * Reads a little-endian 16-bit field.
+ */
+static uint16_t get16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+/**
+ * Reads a little-endian 32-bit field.
+ */
+static uint32_t get32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * Writes a little-endian 16-bit field.
+ */
+static void put16(unsigned char *p, uint16_t v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+
+void packet_init(packet_decoder *dec, packet_frame_fn on_frame, packet_text_fn on_text, void *ctx)
+{
+    memset(dec, 0, sizeof(*dec));
+    dec->on_frame = on_frame;
+    dec->on_text = on_text;
+    dec->ctx = ctx;
+}
+
+void packet_reset(packet_decoder *dec)
+{
+    dec->discarded += dec->len;
+    dec->len = 0;
+    dec->synced = 0;
+}
+
+/**
+ * Checks the payload length announced in a header.
+ */
+static int valid_length(unsigned type, size_t payload)
+{
+    if (payload > PACKET_MAX_EVENTS * PACKET_EVENT_SIZE)
+    {
+        return 0;
+    }
+    if (type == PACKET_EVENTS)
+    {
+        return payload > 0 && payload % PACKET_EVENT_SIZE == 0;
+    }
+    return 1;
+}
+
+/**
+ * Counts the events lost since the previous frame of the same device.
+ *
+ * A sequence number behind the expected one means the device restarted,
+ * which is not counted as a loss.
+ */
+static void track_sequence(packet_decoder *dec, const packet_frame *frame)
+{
+    if (dec->synced && dec->device == frame->device)
+    {
+        uint16_t gap = (uint16_t)(frame->seq - dec->next_seq);
+        if (gap < 0x8000)
+        {
+            dec->lost += gap;
+        }
+    }
+    dec->synced = 1;
+    dec->device = frame->device;
+    dec->next_seq = (uint16_t)(frame->seq + frame->count);
+}
+
+/**
+ * Decodes a checked frame and hands it to the frame callback.
+ */
+static void deliver(packet_decoder *dec, const unsigned char *p, size_t payload)
+{
+    packet_frame frame;
+    frame.type = p[3];
+    frame.device = p[4];
+    frame.seq = get16(p + 5);
+    frame.count = 0;
+    dec->frames++;
+
+    // Frame types this host does not know are skipped whole
+    if (frame.type != PACKET_EVENTS)
+    {
+        return;
+    }
+
+    const unsigned char *e = p + PACKET_HEADER_SIZE;
+    frame.count = payload / PACKET_EVENT_SIZE;
+    for (size_t i = 0; i < frame.count; i++, e += PACKET_EVENT_SIZE)
+    {
+        frame.events[i].kind = e[0];
+        frame.events[i].seq = (uint16_t)(frame.seq + i);
+        frame.events[i].value = get32(e + 1);
+    }
+    track_sequence(dec, &frame);
+    if (dec->on_frame)
+    {
+        dec->on_frame(&frame, dec->ctx);
+    }
+}
+
+/**
+ * Parses the buffer from the front. Returns the number of bytes used up;
+ * what is left is the start of a frame that is not complete yet.
+ */
+static size_t parse(packet_decoder *dec, size_t *frames)
+{
+    const unsigned char *buf = dec->buf;
+    size_t len = dec->len;
+    size_t pos = 0;
+
+    while (pos < len)
+    {
+        if (buf[pos] != PACKET_SYNC0)
+        {
+            const unsigned char *sync = memchr(buf + pos, PACKET_SYNC0, len - pos);
+            size_t end = sync ? (size_t)(sync - buf) : len;
+            if (dec->on_text)
+            {
+                dec->on_text((const char *)buf + pos, end - pos, dec->ctx);
+            }
+            pos = end;
+            continue;
+        }
+
+        size_t avail = len - pos;
+        if (avail >= 2 && buf[pos + 1] != PACKET_SYNC1)
+        {
+            dec->discarded++;
+            pos++;
+            continue;
+        }
+        if (avail < PACKET_HEADER_SIZE)
+        {
+            break;
+        }
+
+        size_t payload = buf[pos + 2];
+        if (!valid_length(buf[pos + 3], payload))
+        {
+            dec->bad_frames++;
+            dec->discarded++;
+            pos++;
+            continue;
+        }
+        size_t total = PACKET_HEADER_SIZE + payload + PACKET_CRC_SIZE;
+        if (avail < total)
+        {
+            break;
+        }
+
+        size_t checked = total - 2 - PACKET_CRC_SIZE;
+        if (packet_crc16(buf + pos + 2, checked) != get16(buf + pos + 2 + checked))
+        {
+            dec->bad_frames++;
+            dec->discarded++;
+            pos++;
+            continue;
+        }
+
+        deliver(dec, buf + pos, payload);
+        (*frames)++;
+        pos += total;
+    }
+    return pos;
+}
+
+size_t packet_feed(packet_decoder *dec, const char *data, size_t len)
+{
+    size_t frames = 0;
+    while (len > 0)
+    {
+        // What stays in the buffer is shorter than a frame, so there is always room
+        size_t room = sizeof(dec->buf) - dec->len;
+        size_t n = len < room ? len : room;
+        memcpy(dec->buf + dec->len, data, n);
+        dec->len += n;
+        data += n;
+        len -= n;
+
+        size_t used = parse(dec, &frames);
+        memmove(dec->buf, dec->buf + used, dec->len - used);
+        dec->len -= used;
+    }
+    return frames;
+}
+
+size_t packet_encode(unsigned char *out, uint8_t device, uint16_t seq, const packet_event *events, size_t count)
+{
+    if (count == 0 || count > PACKET_MAX_EVENTS)
+    {
+        return 0;
+    }
+
+    size_t payload = count * PACKET_EVENT_SIZE;
+    out[0] = PACKET_SYNC0;
+    out[1] = PACKET_SYNC1;
+    out[2] = (unsigned char)payload;
+    out[3] = PACKET_EVENTS;
+    out[4] = device;
+    put16(out + 5, seq);
+
+    unsigned char *e = out + PACKET_HEADER_SIZE;
+    for (size_t i = 0; i < count; i++, e += PACKET_EVENT_SIZE)
+    {
+        e[0] = events[i].kind;
+        e[1] = (unsigned char)events[i].value;
+        e[2] = (unsigned char)(events[i].value >> 8);
+        e[3] = (unsigned char)(events[i].value >> 16);
+        e[4] = (unsigned char)(events[i].value >> 24);
+    }
+
+    size_t checked = PACKET_HEADER_SIZE - 2 + payload;
+    put16(out + 2 + checked, packet_crc16(out + 2, checked));
+    return PACKET_HEADER_SIZE + payload + PACKET_CRC_SIZE;
+}
@@ -0,0 +1,155 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Binary framing of the device link. All fields are little-endian:
+ *
+ *     offset  size  field
+ *     0       2     sync bytes 0xA5 0x5A
+ *     2       1     payload length in bytes
+ *     3       1     frame type (PACKET_EVENTS)
+ *     4       1     device id set in the firmware, 0 if unset
+ *     5       2     sequence number of the first event in the frame
+ *     7       n     payload
+ *     7 + n   2     CRC-16/CCITT-FALSE of bytes 2 .. 7 + n - 1
+ *
+ * The payload of an events frame is an array of 5-byte events, a kind byte
+ * followed by a 32-bit value. Event i of a frame has sequence number
+ * seq + i, so a gap between frames tells how many events were lost.
+ *
+ * 0xA5 is not ASCII, so text printed by the firmware (boot messages, or
+ * everything when it is built in text mode) can be told apart from frames
+ * and is handed on unchanged.
+ */
+#define PACKET_SYNC0 0xA5
+#define PACKET_SYNC1 0x5A
+#define PACKET_HEADER_SIZE 7
+#define PACKET_CRC_SIZE 2
+#define PACKET_EVENT_SIZE 5
+// Most events one frame can carry
+#define PACKET_MAX_EVENTS 48
+#define PACKET_MAX_SIZE (PACKET_HEADER_SIZE + PACKET_MAX_EVENTS * PACKET_EVENT_SIZE + PACKET_CRC_SIZE)
+
+// Frame types
+#define PACKET_EVENTS 1
+
+// Event kinds
+#define PACKET_DURATION 1      // value: feeding duration in milliseconds
+#define PACKET_CONNECT 2       // value: unused
+#define PACKET_DISCONNECT 3    // value: unused
+
+/**
+ * @brief One event of a decoded frame
+ */
+typedef struct packet_event {
+    uint8_t kind;
+    uint16_t seq;
+    uint32_t value;
+} packet_event;
+
+/**
+ * @brief A decoded and checked frame
+ */
+typedef struct packet_frame {
+    uint8_t type;
+    uint8_t device;
+    uint16_t seq;
+    size_t count;
+    packet_event events[PACKET_MAX_EVENTS];
+} packet_frame;
+
+/**
+ * @brief Called for every frame that passes the checks
+ *
+ * @param frame Decoded frame, only valid during the call
+ * @param ctx Context pointer given to packet_init()
+ */
+typedef void (*packet_frame_fn)(const packet_frame *frame, void *ctx);
+
+/**
+ * @brief Called with bytes that are not part of a frame
+ *
+ * @param data Text bytes, in stream order
+ * @param len Number of bytes
+ * @param ctx Context pointer given to packet_init()
+ */
+typedef void (*packet_text_fn)(const char *data, size_t len, void *ctx);
+
+/**
+ * @brief Streaming decoder for the device link
+ *
+ * Bytes of a frame that is not complete yet are kept between calls. A frame
+ * with a bad length or CRC is dropped one byte at a time, so decoding
+ * resynchronizes on the next sync bytes without losing the frame after it.
+ */
+typedef struct packet_decoder {
+    unsigned char buf[2 * PACKET_MAX_SIZE];
+    size_t len;
+    packet_frame_fn on_frame;
+    packet_text_fn on_text;
+    void *ctx;
+
+    int synced;
+    uint8_t device;
+    uint16_t next_seq;
+
+    unsigned long long frames;
+    unsigned long long bad_frames;
+    unsigned long long lost;
+    unsigned long long discarded;
+} packet_decoder;
+
+/**
+ * @brief Initializes a decoder
+ *
+ * @param dec Decoder to initialize
+ * @param on_frame Called for every valid frame
+ * @param on_text Called with text between frames, may be NULL to drop it
+ * @param ctx Passed to both callbacks
+ */
+void packet_init(packet_decoder *dec, packet_frame_fn on_frame, packet_text_fn on_text, void *ctx);
+
+/**
+ * @brief Forgets a partly received frame and the expected sequence number
+ *
+ * Used when the link is reopened; counters are kept.
+ *
+ * @param dec Initialized decoder
+ */
+void packet_reset(packet_decoder *dec);
+
+/**
+ * @brief Decodes received bytes, calling the callbacks for what they contain
+ *
+ * @param dec Initialized decoder
+ * @param data Received bytes
+ * @param len Number of bytes
+ * @return size_t Number of frames decoded
+ */
+size_t packet_feed(packet_decoder *dec, const char *data, size_t len);
+
+/**
+ * @brief Encodes an events frame
+ *
+ * @param out Where to write the frame, at least PACKET_MAX_SIZE bytes
+ * @param device Device id
+ * @param seq Sequence number of the first event
+ * @param events Events to send; their seq fields are ignored
+ * @param count Number of events, 1 to PACKET_MAX_EVENTS
+ * @return size_t Size of the frame, 0 if count is out of range
+ */
+size_t packet_encode(unsigned char *out, uint8_t device, uint16_t seq, const packet_event *events, size_t count);
+
+/**
+ * @brief Computes the CRC-16/CCITT-FALSE used by the link
+ *
+ * @param data Bytes to check
+ * @param len Number of bytes
+ * @return uint16_t CRC (polynomial 0x1021, initial value 0xFFFF)
+ */
+uint16_t packet_crc16(const unsigned char *data, size_t len);
+
+#endif /* PACKET_H */
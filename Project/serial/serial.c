@@ -5,145 +5,497 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <poll.h>
+#include "serial.h"
+#include "frame.h"
+#include "match.h"
+#include "../metrics/metrics.h"
 
 /**
- * @brief Listens for a specific pattern in serial port data and extracts content between [] brackets
+ * @brief State of an open serial port
  *
- * This function opens and configures a serial port, then continuously reads data from it
- * until it finds a specified pattern. When the pattern is found, it extracts and returns
- * the content between the first set of square brackets that follows the pattern.
+ * The descriptor is opened and configured once by serial_open() and then
+ * reused for every record. Received bytes go straight into the ring of the
+ * frame parser, so bytes after a match are parsed by the next
+ * serial_read_pattern() call instead of being lost.
+ */
+struct serial_session {
+    int fd;
+    int timeout_ms;
+    char port[256];
+    int parser_ready;
+    frame_parser parser;
+    unsigned long long discarded_seen;
+    struct serial_session *next;
+};
+
+// Open sessions, so write_to_serial() can reuse an already open descriptor
+static serial_session *open_sessions = NULL;
+
+/**
+ * @brief Configures a serial port descriptor for the feeder link
  *
- * @param port The serial port device path (e.g., "/dev/ttyUSB0")
- * @param target_pattern The pattern to search for in the incoming serial data
+ * Settings:
+ * - Baud rate: 115200
+ * - 8 data bits, no parity, 1 stop bit
+ * - No hardware flow control
+ * - Raw mode (no canonical processing, 8-bit clean for binary frames)
+ * - VMIN = 0, VTIME = 0 so read() never blocks; waiting is done with poll()
  *
- * @return A dynamically allocated string containing the content between brackets,
- *         or NULL if an error occurs or if no valid pattern is found
- *         The caller is responsible for freeing the returned string.
+ * @param fd Open descriptor of the serial port
+ * @return 0 on success, -1 on error
+ */
+static int configure_port(int fd)
+{
+    struct termios tty;
+    memset(&tty, 0, sizeof(tty));
+    if (tcgetattr(fd, &tty) != 0) {
+        printf("Error from tcgetattr: %s\n", strerror(errno));
+        return -1;
+    }
+
+    cfsetospeed(&tty, B115200);
+    cfsetispeed(&tty, B115200);
+    tty.c_cflag |= CS8 | CLOCAL | CREAD;
+    tty.c_cflag &= ~(PARENB | CSTOPB | CRTSCTS);
+    tty.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG | IEXTEN);
+    // Binary frames must arrive unchanged, see packet.h
+    tty.c_iflag &= ~(IXON | IXOFF | IXANY | IGNBRK | INLCR | ICRNL | IGNCR | ISTRIP | PARMRK | INPCK);
+    tty.c_oflag &= ~OPOST;
+    tty.c_cc[VMIN] = 0;
+    tty.c_cc[VTIME] = 0;
+
+    if (tcsetattr(fd, TCSANOW, &tty) != 0) {
+        printf("Error from tcsetattr: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Opens and configures a serial port for repeated use
  *
- * @note The function configures the serial port with the following settings:
- *       - Baud rate: 115200
- *       - 8 data bits, no parity, 1 stop bit
- *       - No hardware flow control
- *       - Raw mode (no canonical processing)
+ * @param port The serial port device path (e.g., "/dev/ttyUSB0")
  *
- * @warning This function runs in an infinite loop until the pattern is found or an error occurs
+ * @return A session handle, or NULL if the port cannot be opened or configured.
+ *         The caller must release it with serial_close().
  */
-char *listen_for_pattern(const char* port, const char* target_pattern)
+serial_session *serial_open(const char *port)
 {
-    if (!port || !target_pattern) {
+    if (!port) {
         printf("Invalid parameters\n");
         return NULL;
     }
 
-    int serialPort = open(port, O_RDWR);
-    if (serialPort < 0) {
+    int fd = open(port, O_RDWR | O_NOCTTY);
+    if (fd < 0) {
         printf("Error opening port %s: %s\n", port, strerror(errno));
         return NULL;
     }
 
-    struct termios tty;
-    memset(&tty, 0, sizeof(tty));
-    if (tcgetattr(serialPort, &tty) != 0) {
-        printf("Error from tcgetattr: %s\n", strerror(errno));
-        close(serialPort);
+    if (configure_port(fd) != 0) {
+        close(fd);
         return NULL;
     }
 
-    cfsetospeed(&tty, B115200);
-    cfsetispeed(&tty, B115200);
-    tty.c_cflag |= CS8 | CLOCAL | CREAD;
-    tty.c_cflag &= ~(PARENB | CSTOPB | CRTSCTS);
-    tty.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
-    tty.c_iflag &= ~(IXON | IXOFF | IXANY | IGNBRK | INLCR | ICRNL);
-    tty.c_oflag &= ~OPOST;
-
-    if (tcsetattr(serialPort, TCSANOW, &tty) != 0) {
-        printf("Error from tcsetattr: %s\n", strerror(errno));
-        close(serialPort);
+    serial_session *session = calloc(1, sizeof(*session));
+    if (session == NULL) {
+        close(fd);
         return NULL;
     }
 
-    printf("Listening for pattern '%s'...\n", target_pattern);
+    session->fd = fd;
+    session->timeout_ms = -1;
+    strncpy(session->port, port, sizeof(session->port) - 1);
+    session->next = open_sessions;
+    open_sessions = session;
+    return session;
+}
+
+/**
+ * @brief Sets how long serial_read_pattern() waits for data
+ *
+ * @param session Open serial session
+ * @param timeout_ms Milliseconds to wait without receiving any byte,
+ *                   or -1 to wait forever (the default)
+ */
+void serial_set_timeout(serial_session *session, int timeout_ms)
+{
+    if (session) {
+        session->timeout_ms = timeout_ms;
+    }
+}
+
+/**
+ * @brief Waits for data and reads it into the ring of the session parser
+ *
+ * @param session Open serial session with a drained parser ring
+ * @param timeout_ms How long to wait, -1 for ever, 0 to only read what is available
+ * @return 1 if bytes were read, 0 on timeout, -1 on error or hang-up
+ */
+static int fill(serial_session *session, int timeout_ms)
+{
+    frame_parser *parser = &session->parser;
 
-    char buffer[1024];
-    char accum_buffer[4096];
-    size_t accum_size = 0;
-    char* result = NULL;
-    
-    memset(buffer, 0, sizeof(buffer));
-    memset(accum_buffer, 0, sizeof(accum_buffer));
-    
     while (1) {
-        int bytes_read = read(serialPort, buffer, sizeof(buffer) - 1);
-        if (bytes_read > 0) {
-            buffer[bytes_read] = '\0';
-            
-            if (accum_size + bytes_read < sizeof(accum_buffer)) {
-                memcpy(accum_buffer + accum_size, buffer, bytes_read + 1);
-                accum_size += bytes_read;
+        struct pollfd pfd = { .fd = session->fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, timeout_ms);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("Error from poll: %s\n", strerror(errno));
+            return -1;
+        }
+        if (ready == 0) {
+            return 0;
+        }
+        if (pfd.revents & (POLLERR | POLLNVAL)) {
+            printf("Error on port %s\n", session->port);
+            return -1;
+        }
+
+        size_t room;
+        char *dst = frame_write_region(parser, &room);
+        ssize_t bytes_read = read(session->fd, dst, room);
+        if (bytes_read < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
             }
-            
-            char* pattern_start = strstr(accum_buffer, target_pattern);
-            if (pattern_start != NULL) {
-                char* first = strchr(pattern_start, '[');
-                char* end = strchr(pattern_start, ']');
-                
-                if (first && end && (end > first)) {
-                    size_t len = end - first - 1;
-                    if (len > 0) {
-                        result = (char*)malloc(len + 1);
-                        if (result != NULL) {
-                            strncpy(result, first + 1, len);
-                            result[len] = '\0';
-                            printf("Pattern found: %s\n", result);
-                            close(serialPort);
-                            return result;
-                        }
-                    }
-                }
+            printf("Error reading port %s: %s\n", session->port, strerror(errno));
+            return -1;
+        }
+        if (bytes_read == 0) {
+            if (pfd.revents & POLLHUP) {
+                printf("Port %s hung up\n", session->port);
+                return -1;
             }
-            
-            if (accum_size > sizeof(accum_buffer) - 256) {
-                memset(accum_buffer, 0, sizeof(accum_buffer));
-                accum_size = 0;
+            continue;
+        }
+        frame_commit(parser, (size_t)bytes_read);
+        metrics_count(METRIC_BYTES_READ, (uint64_t)bytes_read);
+        return 1;
+    }
+}
+
+/**
+ * @brief Reads from an open session until a pattern is found and extracts content between [] brackets
+ *
+ * The function first parses bytes that are already buffered, then waits for
+ * data with poll() and reads whatever is available directly into the parser
+ * ring. Parsing resumes where the previous call stopped, so records split
+ * across reads are found and several records from one read are returned by
+ * consecutive calls.
+ *
+ * @param session Open serial session
+ * @param target_pattern The pattern to search for in the incoming serial data
+ *
+ * @return A dynamically allocated string containing the content between brackets,
+ *         or NULL on error, timeout or hang-up of the device.
+ *         The caller is responsible for freeing the returned string.
+ */
+char *serial_read_pattern(serial_session *session, const char *target_pattern)
+{
+    if (!session || !target_pattern) {
+        printf("Invalid parameters\n");
+        return NULL;
+    }
+
+    frame_parser *parser = &session->parser;
+    if (!session->parser_ready || strlen(target_pattern) != parser->pattern_len
+            || memcmp(parser->pattern, target_pattern, parser->pattern_len) != 0) {
+        if (frame_set_pattern(parser, target_pattern) != 0) {
+            printf("Invalid pattern '%s'\n", target_pattern);
+            return NULL;
+        }
+        session->parser_ready = 1;
+    }
+
+    char value[FRAME_VALUE_MAX + 1];
+
+    while (1) {
+        int found = frame_next(parser, value, sizeof(value));
+        unsigned long long discarded = frame_discarded(parser);
+        metrics_count(METRIC_BYTES_DISCARDED, discarded - session->discarded_seen);
+        session->discarded_seen = discarded;
+        if (found) {
+            metrics_count(METRIC_EVENTS_MATCHED, 1);
+            char *result = strdup(value);
+            if (result != NULL) {
+                printf("Pattern found: %s\n", result);
             }
+            return result;
+        }
+
+        // frame_next() drained the ring, so there is always room to read into
+        if (fill(session, session->timeout_ms) <= 0) {
+            return NULL;
         }
     }
+}
+
+/**
+ * @brief Feeds every byte buffered in the session ring through a matcher
+ *
+ * @return Number of handlers called
+ */
+static int feed_matcher(serial_session *session, matcher *m)
+{
+    frame_parser *parser = &session->parser;
+    int calls = 0;
+    const char *data;
+    size_t len;
 
-    close(serialPort);
-    return NULL;
+    while ((len = frame_peek(parser, &data)) > 0) {
+        calls += matcher_feed(m, data, len);
+        frame_skip(parser, len);
+    }
+    metrics_count(METRIC_EVENTS_MATCHED, (uint64_t)calls);
+    return calls;
 }
 
-int write_to_serial(const char* port, const char* message) {
-    int serialPort = open(port, O_RDWR);
-    if (serialPort < 0) {
-        printf("Error opening port %s: %s\n", port, strerror(errno));
+/**
+ * @brief Reads from an open session and dispatches every tag found by a matcher
+ *
+ * Waits for data like serial_read_pattern() and feeds everything received
+ * in one read through the matcher, so all registered event types are
+ * extracted in one pass. Bytes left unparsed by an earlier
+ * serial_read_pattern() call are fed first.
+ *
+ * @param session Open serial session
+ * @param m Built matcher whose handlers receive the events
+ *
+ * @return Number of handlers called (may be 0 if the bytes held no complete tag),
+ *         or -1 on error, timeout or hang-up of the device
+ */
+int serial_read_events(serial_session *session, matcher *m)
+{
+    if (!session || !m) {
+        printf("Invalid parameters\n");
         return -1;
     }
 
-    struct termios tty;
-    memset(&tty, 0, sizeof(tty));
-    if (tcgetattr(serialPort, &tty) != 0) {
-        printf("Error from tcgetattr: %s\n", strerror(errno));
-        close(serialPort);
+    int calls = feed_matcher(session, m);
+    if (calls > 0) {
+        return calls;
+    }
+
+    if (fill(session, session->timeout_ms) <= 0) {
         return -1;
     }
+    return feed_matcher(session, m);
+}
 
-    cfsetospeed(&tty, B115200);
-    cfsetispeed(&tty, B115200);
-    tty.c_cflag |= CS8 | CLOCAL | CREAD;
-    tty.c_cflag &= ~(PARENB | CSTOPB | CRTSCTS);
-    tty.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
-    tty.c_iflag &= ~(IXON | IXOFF | IXANY | IGNBRK | INLCR | ICRNL);
-    tty.c_oflag &= ~OPOST;
+/**
+ * @brief Reads whatever is available on a session without waiting
+ *
+ * Meant for callers that wait on many sessions at once with their own
+ * poll() over serial_fd().
+ *
+ * @param session Open serial session
+ * @param m Built matcher whose handlers receive the events
+ *
+ * @return Number of handlers called, 0 if nothing was available,
+ *         or -1 on error or hang-up of the device
+ */
+int serial_pump_events(serial_session *session, matcher *m)
+{
+    if (!session || !m) {
+        return -1;
+    }
 
-    if (tcsetattr(serialPort, TCSANOW, &tty) != 0) {
-        printf("Error from tcsetattr: %s\n", strerror(errno));
-        close(serialPort);
+    int calls = feed_matcher(session, m);
+    int status = fill(session, 0);
+    if (status < 0) {
+        return -1;
+    }
+    if (status > 0) {
+        calls += feed_matcher(session, m);
+    }
+    return calls;
+}
+
+/**
+ * @brief Reads what is available on a session without waiting or parsing
+ *
+ * For callers that parse the bytes elsewhere, e.g. on another thread; the
+ * session's own frame parser is bypassed.
+ *
+ * @param session Open serial session
+ * @param buffer Where to store the bytes
+ * @param size Size of buffer
+ * @return Number of bytes read, 0 if nothing is available, or -1 on error or hang-up
+ */
+int serial_read_raw(serial_session *session, char *buffer, size_t size)
+{
+    if (!session || !buffer) {
         return -1;
     }
 
-    int bytes_written = write(serialPort, message, strlen(message));
-    close(serialPort);
+    struct pollfd pfd = { .fd = session->fd, .events = POLLIN };
+    int ready = poll(&pfd, 1, 0);
+    if (ready <= 0) {
+        return ready < 0 && errno != EINTR ? -1 : 0;
+    }
+    if (pfd.revents & (POLLERR | POLLNVAL)) {
+        printf("Error on port %s\n", session->port);
+        return -1;
+    }
+
+    ssize_t bytes_read = read(session->fd, buffer, size);
+    if (bytes_read < 0) {
+        if (errno == EINTR || errno == EAGAIN) {
+            return 0;
+        }
+        printf("Error reading port %s: %s\n", session->port, strerror(errno));
+        return -1;
+    }
+    if (bytes_read == 0 && (pfd.revents & POLLHUP)) {
+        printf("Port %s hung up\n", session->port);
+        return -1;
+    }
+    metrics_count(METRIC_BYTES_READ, (uint64_t)bytes_read);
+    return (int)bytes_read;
+}
+
+/**
+ * @brief Descriptor of an open session, for use with poll()
+ *
+ * @param session Open serial session
+ * @return The file descriptor, or -1 if session is NULL
+ */
+int serial_fd(const serial_session *session)
+{
+    return session ? session->fd : -1;
+}
+
+/**
+ * @brief Number of received bytes the session had to discard
+ *
+ * @param session Open serial session
+ * @return Bytes dropped by the frame parser, see frame_discarded()
+ */
+unsigned long long serial_discarded(const serial_session *session)
+{
+    return session ? frame_discarded(&session->parser) : 0;
+}
+
+/**
+ * @brief Writes a message through an open session
+ *
+ * @param session Open serial session
+ * @param message The message to write to the serial port
+ * @return Number of bytes written, or -1 if error occurs
+ */
+int serial_write(serial_session *session, const char *message)
+{
+    if (!session || !message) {
+        return -1;
+    }
+
+    size_t total = strlen(message);
+    size_t written = 0;
+    while (written < total) {
+        ssize_t n = write(session->fd, message + written, total - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                struct pollfd pfd = { .fd = session->fd, .events = POLLOUT };
+                poll(&pfd, 1, 100);
+                continue;
+            }
+            printf("Error writing port %s: %s\n", session->port, strerror(errno));
+            return -1;
+        }
+        written += n;
+    }
+    return (int)written;
+}
+
+/**
+ * @brief Closes a session opened with serial_open()
+ *
+ * @param session Session to close, may be NULL
+ */
+void serial_close(serial_session *session)
+{
+    if (!session) {
+        return;
+    }
+
+    serial_session **link = &open_sessions;
+    while (*link && *link != session) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = session->next;
+    }
+
+    close(session->fd);
+    free(session);
+}
+
+/**
+ * @brief Listens for a specific pattern in serial port data and extracts content between [] brackets
+ *
+ * Convenience wrapper that opens the port, waits for a single record and
+ * closes it again. Long-running callers should keep a session from
+ * serial_open() instead, so no bytes are lost between records.
+ *
+ * @param port The serial port device path (e.g., "/dev/ttyUSB0")
+ * @param target_pattern The pattern to search for in the incoming serial data
+ *
+ * @return A dynamically allocated string containing the content between brackets,
+ *         or NULL if an error occurs or if no valid pattern is found
+ *         The caller is responsible for freeing the returned string.
+ */
+char *listen_for_pattern(const char* port, const char* target_pattern)
+{
+    if (!port || !target_pattern) {
+        printf("Invalid parameters\n");
+        return NULL;
+    }
+
+    serial_session *session = serial_open(port);
+    if (session == NULL) {
+        return NULL;
+    }
+
+    printf("Listening for pattern '%s'...\n", target_pattern);
+    char *result = serial_read_pattern(session, target_pattern);
+    serial_close(session);
+    return result;
+}
+
+/**
+ * @brief Writes a message to the specified serial port
+ *
+ * If a session is already open on the port its descriptor is reused,
+ * otherwise the port is opened and configured for this one write.
+ *
+ * @param port The serial port device path (e.g., "/dev/ttyUSB0")
+ * @param message The message to write to the serial port
+ * @return Number of bytes written, or -1 if error occurs
+ */
+int write_to_serial(const char* port, const char* message)
+{
+    if (!port || !message) {
+        return -1;
+    }
+
+    for (serial_session *s = open_sessions; s != NULL; s = s->next) {
+        if (strcmp(s->port, port) == 0) {
+            return serial_write(s, message);
+        }
+    }
+
+    serial_session *session = serial_open(port);
+    if (session == NULL) {
+        return -1;
+    }
+    int bytes_written = serial_write(session, message);
+    serial_close(session);
     return bytes_written;
-}
\ No newline at end of file
+}
@@ -2,6 +2,97 @@
 #define SERIAL_H
 
 #include <stddef.h>
+#include "match.h"
+
+/**
+ * @brief Long-lived handle on an open and configured serial port
+ */
+typedef struct serial_session serial_session;
+
+/**
+ * @brief Opens and configures a serial port once for repeated reads and writes
+ *
+ * @param port The serial port device path (e.g., "/dev/ttyUSB0")
+ * @return serial_session* handle, or NULL if error occurs
+ */
+serial_session *serial_open(const char *port);
+
+/**
+ * @brief Sets the idle timeout used while waiting for data
+ *
+ * @param session Open serial session
+ * @param timeout_ms Timeout in milliseconds, -1 waits forever
+ */
+void serial_set_timeout(serial_session *session, int timeout_ms);
+
+/**
+ * @brief Waits for a pattern on an open session and extracts content between [] brackets
+ *
+ * @param session Open serial session
+ * @param target_pattern The pattern to search for in the incoming serial data
+ * @return char* containing the content between brackets, or NULL on error or timeout
+ */
+char *serial_read_pattern(serial_session *session, const char *target_pattern);
+
+/**
+ * @brief Reads available data and dispatches every tag registered in a matcher
+ *
+ * @param session Open serial session
+ * @param m Built matcher, see match.h
+ * @return int Number of handlers called, or -1 on error or timeout
+ */
+int serial_read_events(serial_session *session, matcher *m);
+
+/**
+ * @brief Reads what is available on a session without waiting and dispatches tags
+ *
+ * @param session Open serial session
+ * @param m Built matcher, see match.h
+ * @return int Number of handlers called, 0 if no data, or -1 on error or hang-up
+ */
+int serial_pump_events(serial_session *session, matcher *m);
+
+/**
+ * @brief Reads what is available on a session without waiting or parsing
+ *
+ * @param session Open serial session
+ * @param buffer Where to store the bytes
+ * @param size Size of buffer
+ * @return int Number of bytes read, 0 if nothing is available, or -1 on error or hang-up
+ */
+int serial_read_raw(serial_session *session, char *buffer, size_t size);
+
+/**
+ * @brief Returns the descriptor of a session so it can be waited on with poll()
+ *
+ * @param session Open serial session
+ * @return int File descriptor, or -1 if session is NULL
+ */
+int serial_fd(const serial_session *session);
+
+/**
+ * @brief Number of received bytes discarded because they could not be parsed
+ *
+ * @param session Open serial session
+ * @return unsigned long long Discarded byte count
+ */
+unsigned long long serial_discarded(const serial_session *session);
+
+/**
+ * @brief Writes a message through an open session
+ *
+ * @param session Open serial session
+ * @param message The message to write
+ * @return int Number of bytes written, or -1 if error occurs
+ */
+int serial_write(serial_session *session, const char *message);
+
+/**
+ * @brief Closes a serial session
+ *
+ * @param session Session returned by serial_open(), may be NULL
+ */
+void serial_close(serial_session *session);
 
 /**
  * @brief Listens for a specific pattern in serial port data and extracts content between [] brackets
@@ -21,4 +112,4 @@ char *listen_for_pattern(const char* port, const char* target_pattern);
  */
 int write_to_serial(const char* port, const char* message);
 
-#endif /* SERIAL_H */
\ No newline at end of file
+#endif /* SERIAL_H */
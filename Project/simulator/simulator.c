@@ -0,0 +1,471 @@
+/**
+ * @file simulator.c
+ * @brief Simulated feeder on a pseudo-terminal, for testing without hardware
+ *
+ * The feeder logic of the firmware (arduino/feeder_core.c) is built into
+ * the host program and run against a HAL made of:
+ *
+ * - a pseudo-terminal standing in for the serial link, so the recorders and
+ *   -config talk to it like to a real device
+ * - TCP sockets on 127.0.0.1 standing in for the WiFi clients
+ * - a file standing in for the flash, written only when a setting changes
+ * - the monotonic clock for millis(); servo positions are only counted
+ *
+ * The simulator keeps the slave side of the terminal open itself, so a
+ * recorder can open and close the port any number of times without the
+ * terminal being torn down. Output that nobody reads is dropped once the
+ * terminal buffer is full instead of blocking the core.
+ *
+ * For every HTTP client the time from accepting the connection to writing
+ * the answer is measured and summed up on exit, which shows how long the
+ * core keeps requests waiting while the servo runs.
+ */
+// posix_openpt() and cfmakeraw() are hidden by glibc otherwise; macOS has them by default
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "simulator.h"
+#include "../arduino/feeder_core.h"
+
+// Delay used when the flash file holds none, as in the firmware
+#define DEFAULT_DELAY_MS 1000
+// Marks a client slot used by a simulated request rather than a socket
+#define VIRTUAL_CLIENT -2
+
+// Set by SIGINT/SIGTERM
+static volatile sig_atomic_t stopping = 0;
+
+/**
+ * @brief State of the simulated hardware
+ */
+struct board
+{
+    const simulator_options *options;
+    int master;
+    int listener;
+    int fds[FEEDER_MAX_CLIENTS];
+    long long accepted_us[FEEDER_MAX_CLIENTS];
+    unsigned long servo_writes;
+    unsigned long answered;
+    long long latency_sum_us;
+    long long latency_max_us;
+    unsigned long long dropped;
+};
+
+/**
+ * Asks the simulator to stop.
+ */
+static void on_stop(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+/**
+ * Microseconds on a clock that does not jump.
+ */
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Reads the delay from the flash file, like readDelayTime() at boot.
+ */
+static long read_flash(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    long delay = DEFAULT_DELAY_MS;
+    if (file != NULL)
+    {
+        if (fscanf(file, "%ld", &delay) != 1 || delay < 0 || delay > FEEDER_MAX_DELAY_MS)
+        {
+            delay = DEFAULT_DELAY_MS;
+        }
+        fclose(file);
+    }
+    return delay;
+}
+
+/**
+ * HAL: millis() of the simulated board.
+ */
+static uint32_t hal_millis(void *ctx)
+{
+    (void)ctx;
+    return (uint32_t)(now_us() / 1000);
+}
+
+/**
+ * HAL: the servo is not simulated, its moves are only counted.
+ */
+static void hal_servo_write(void *ctx, int angle)
+{
+    (void)angle;
+    struct board *b = ctx;
+    b->servo_writes++;
+}
+
+/**
+ * HAL: sends bytes to the host; what does not fit in the terminal buffer is dropped.
+ */
+static void hal_serial_write(void *ctx, const uint8_t *data, size_t len)
+{
+    struct board *b = ctx;
+    while (len > 0)
+    {
+        ssize_t n = write(b->master, data, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            b->dropped += len;
+            return;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+/**
+ * HAL: answers a client and measures how long it waited.
+ */
+static void hal_client_write(void *ctx, int client, const char *data, size_t len)
+{
+    struct board *b = ctx;
+    if (b->fds[client] == VIRTUAL_CLIENT)
+    {
+        return;
+    }
+
+    long long latency = now_us() - b->accepted_us[client];
+    b->answered++;
+    b->latency_sum_us += latency;
+    if (latency > b->latency_max_us)
+    {
+        b->latency_max_us = latency;
+    }
+
+    // The answer is small enough for the socket buffer; a client that does not read loses it
+    while (len > 0)
+    {
+        ssize_t n = send(b->fds[client], data, len, 0);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+/**
+ * HAL: closes a client connection.
+ */
+static void hal_client_close(void *ctx, int client)
+{
+    struct board *b = ctx;
+    if (b->fds[client] >= 0)
+    {
+        close(b->fds[client]);
+    }
+    b->fds[client] = -1;
+}
+
+/**
+ * HAL: writes the delay to the flash file.
+ */
+static int hal_save_delay(void *ctx, long delay_ms)
+{
+    struct board *b = ctx;
+    FILE *file = fopen(b->options->flash_path, "w");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    fprintf(file, "%ld", delay_ms);
+    if (fclose(file) != 0)
+    {
+        return -1;
+    }
+    printf("Delay set to %ld ms and saved to %s.\n", delay_ms, b->options->flash_path);
+    fflush(stdout);
+    return 0;
+}
+
+/**
+ * Creates the terminal and keeps its slave side open in raw mode.
+ * Returns the master descriptor, or -1.
+ */
+static int open_terminal(int *slave)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+    {
+        printf("Error creating terminal: %s\n", strerror(errno));
+        if (master >= 0)
+        {
+            close(master);
+        }
+        return -1;
+    }
+
+    const char *name = ptsname(master);
+    *slave = name ? open(name, O_RDWR | O_NOCTTY) : -1;
+    struct termios tty;
+    if (*slave < 0 || tcgetattr(*slave, &tty) != 0)
+    {
+        printf("Error opening terminal: %s\n", strerror(errno));
+        if (*slave >= 0)
+        {
+            close(*slave);
+        }
+        close(master);
+        return -1;
+    }
+
+    // No echo or line editing, so commands are not sent back and frames pass unchanged
+    cfmakeraw(&tty);
+    tcsetattr(*slave, TCSANOW, &tty);
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    printf("Simulated feeder on %s\n", name);
+    return master;
+}
+
+/**
+ * Listens for HTTP clients on 127.0.0.1. Returns the socket, or -1.
+ */
+static int open_listener(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0)
+    {
+        printf("Error listening on port %d: %s\n", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    printf("Serving the feeder page on http://127.0.0.1:%d/\n", port);
+    return fd;
+}
+
+/**
+ * Accepts waiting HTTP clients; a client beyond the core's slots is closed at once.
+ */
+static void accept_clients(struct board *b, feeder_core *core)
+{
+    int fd;
+    while ((fd = accept(b->listener, NULL, NULL)) >= 0)
+    {
+        int slot = feeder_client_open(core);
+        if (slot < 0)
+        {
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        b->fds[slot] = fd;
+        b->accepted_us[slot] = now_us();
+    }
+}
+
+/**
+ * Requests a feeding as if a client had loaded "/H".
+ */
+static void request_feeding(struct board *b, feeder_core *core)
+{
+    int slot = feeder_client_open(core);
+    if (slot < 0)
+    {
+        return;
+    }
+    static const char request[] = "GET /H HTTP/1.1\r\n\r\n";
+    b->fds[slot] = VIRTUAL_CLIENT;
+    feeder_client_input(core, slot, request, sizeof(request) - 1);
+}
+
+int run_simulator(const simulator_options *options)
+{
+    struct board b;
+    memset(&b, 0, sizeof(b));
+    b.options = options;
+    b.listener = -1;
+    for (int i = 0; i < FEEDER_MAX_CLIENTS; i++)
+    {
+        b.fds[i] = -1;
+    }
+
+    int slave;
+    b.master = open_terminal(&slave);
+    if (b.master < 0)
+    {
+        return 1;
+    }
+    if (options->http_port > 0 && (b.listener = open_listener(options->http_port)) < 0)
+    {
+        close(slave);
+        close(b.master);
+        return 1;
+    }
+
+    feeder_core core;
+    feeder_hal hal = { hal_millis, hal_servo_write, hal_serial_write, hal_client_write, hal_client_close,
+                       hal_save_delay, &b };
+    feeder_init(&core, &hal, read_flash(options->flash_path), (uint8_t)options->device, !options->text);
+    printf("Delay is %ld ms; %s.\n", core.delay_ms,
+           options->every_s > 0 ? "feeding periodically" : "waiting for requests");
+    fflush(stdout);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_handler = on_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    // A client that hangs up before its answer is written must not kill the simulator
+    signal(SIGPIPE, SIG_IGN);
+
+    long long next_feed = now_us() + (long long)options->every_s * 1000000;
+    struct pollfd pfds[2 + FEEDER_MAX_CLIENTS];
+    int owner[2 + FEEDER_MAX_CLIENTS];
+    while (!stopping)
+    {
+        long timeout = feeder_next_due(&core);
+        if (options->every_s > 0)
+        {
+            long long wait = (next_feed - now_us() + 999) / 1000;
+            if (wait < 0)
+            {
+                wait = 0;
+            }
+            if (timeout < 0 || wait < timeout)
+            {
+                timeout = (long)wait;
+            }
+        }
+
+        int nfds = 0;
+        pfds[nfds].fd = b.master;
+        pfds[nfds].events = POLLIN;
+        owner[nfds++] = -1;
+        if (b.listener >= 0)
+        {
+            pfds[nfds].fd = b.listener;
+            pfds[nfds].events = POLLIN;
+            owner[nfds++] = -1;
+        }
+        for (int i = 0; i < FEEDER_MAX_CLIENTS; i++)
+        {
+            if (b.fds[i] >= 0)
+            {
+                pfds[nfds].fd = b.fds[i];
+                pfds[nfds].events = POLLIN;
+                owner[nfds++] = i;
+            }
+        }
+
+        int ready = poll(pfds, nfds, (int)timeout);
+        if (ready < 0 && errno != EINTR)
+        {
+            printf("Error from poll: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; ready > 0 && i < nfds; i++)
+        {
+            if (pfds[i].revents == 0)
+            {
+                continue;
+            }
+            char buffer[256];
+            if (pfds[i].fd == b.master)
+            {
+                ssize_t n = read(b.master, buffer, sizeof(buffer));
+                if (n > 0)
+                {
+                    feeder_serial_input(&core, buffer, (size_t)n);
+                }
+            }
+            else if (pfds[i].fd == b.listener)
+            {
+                accept_clients(&b, &core);
+            }
+            else if (b.fds[owner[i]] == pfds[i].fd)
+            {
+                ssize_t n = recv(pfds[i].fd, buffer, sizeof(buffer), 0);
+                if (n > 0)
+                {
+                    feeder_client_input(&core, owner[i], buffer, (size_t)n);
+                }
+                else if (n == 0 || (errno != EINTR && errno != EAGAIN))
+                {
+                    hal_client_close(&b, owner[i]);
+                    feeder_client_gone(&core, owner[i]);
+                }
+            }
+        }
+
+        if (options->every_s > 0 && now_us() >= next_feed)
+        {
+            request_feeding(&b, &core);
+            next_feed += (long long)options->every_s * 1000000;
+        }
+        feeder_poll(&core);
+    }
+
+    printf("Fed %lu times (%lu servo steps), served %lu requests, answered %lu commands, "
+           "wrote flash %lu times, dropped %llu bytes.\n",
+           (unsigned long)core.stats.feedings, b.servo_writes, (unsigned long)core.stats.requests,
+           (unsigned long)core.stats.commands, (unsigned long)core.stats.flash_writes, b.dropped);
+    if (b.answered > 0)
+    {
+        printf("HTTP latency over %lu clients: mean %.2f ms, max %.2f ms; %lu clients turned away.\n",
+               b.answered, b.latency_sum_us / 1000.0 / b.answered, b.latency_max_us / 1000.0,
+               (unsigned long)core.stats.rejected_clients);
+    }
+    for (int i = 0; i < FEEDER_MAX_CLIENTS; i++)
+    {
+        if (b.fds[i] >= 0)
+        {
+            close(b.fds[i]);
+        }
+    }
+    if (b.listener >= 0)
+    {
+        close(b.listener);
+    }
+    close(slave);
+    close(b.master);
+    return stopping ? 0 : 1;
+}
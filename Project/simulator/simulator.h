@@ -0,0 +1,29 @@
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
+/**
+ * @brief Options of the simulated feeder
+ */
+typedef struct simulator_options {
+    const char *flash_path;    // File standing in for the feeder's flash
+    int every_s;               // Seconds between feedings, 0 for none
+    int text;                  // 1 to print text events like firmware built without LINK_BINARY
+    int device;                // Device id sent in binary frames
+    int http_port;             // TCP port on 127.0.0.1 serving the feeder's HTTP page, 0 for none
+} simulator_options;
+
+/**
+ * @brief Runs the firmware core on a simulated feeder until SIGINT or SIGTERM
+ *
+ * The core of the firmware (arduino/feeder_core.h) runs against a HAL
+ * backed by a pseudo-terminal, sockets and a file. Prints the path of the
+ * terminal, which can be given to -ports, -daemon or -config like a real
+ * serial port. Every every_s seconds a feeding is requested as if a client
+ * had loaded "/H", and real clients can do the same on http_port.
+ *
+ * @param options Simulator options
+ * @return int 0 after SIGINT or SIGTERM, 1 if the terminal cannot be created
+ */
+int run_simulator(const simulator_options *options);
+
+#endif /* SIMULATOR_H */
@@ -0,0 +1,334 @@
+/**
+ * @file range.c
+ * @brief Statistics over an arbitrary time window of the stats log
+ *
+ * The recorder appends records in time order, so the first record of a
+ * window is found by binary search: over record numbers for a binary log,
+ * and over byte offsets for CSV, where each probe skips to the next line
+ * start. Records are then read until the first one past the window.
+ *
+ * Sealed segments are skipped by their time span and searched by the first
+ * timestamp of each block, so only the live file is searched record by record.
+ *
+ * Whether the log really is in time order comes from the sorted flag of the
+ * day index, which is maintained as records are appended. If some record is
+ * older than the one before it, the query falls back to reading the whole
+ * log and filtering every record.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include "range.h"
+#include "../binlog/binlog.h"
+#include "../index/dayindex.h"
+#include "../metrics/metrics.h"
+#include "../segment/segment.h"
+
+#define K 10 // 10 grams per second
+
+// Below this many bytes the binary search hands over to a linear scan
+#define LINEAR_BYTES 4096
+
+/**
+ * @brief Aggregates of the records in the window
+ */
+struct range_totals
+{
+    time_t from;
+    time_t to;
+    int sorted;
+    long count;
+    day_set days;
+    day_bucketer bucketer;
+    double sum;
+    double min;
+    double max;
+};
+
+int parse_time_arg(const char *text, int end, time_t *t)
+{
+    const char *p = text;
+    while (isdigit((unsigned char)*p))
+    {
+        p++;
+    }
+    if (p != text && *p == '\0')
+    {
+        long long value = strtoll(text, NULL, 10);
+        *t = (time_t)(end ? value + 1 : value);
+        return 0;
+    }
+
+    struct tm tm_arg;
+    memset(&tm_arg, 0, sizeof(tm_arg));
+    int hour = 0, min = 0, sec = 0;
+    int n = sscanf(text, "%d-%d-%d %d:%d:%d", &tm_arg.tm_year, &tm_arg.tm_mon, &tm_arg.tm_mday, &hour, &min, &sec);
+    if (n != 3 && n != 5 && n != 6)
+    {
+        return -1;
+    }
+
+    tm_arg.tm_year -= 1900;
+    tm_arg.tm_mon -= 1;
+    tm_arg.tm_hour = hour;
+    tm_arg.tm_min = min;
+    tm_arg.tm_sec = sec;
+    if (end)
+    {
+        // A date covers the whole day, a time is inclusive
+        if (n == 3)
+        {
+            tm_arg.tm_mday += 1;
+        }
+        else
+        {
+            tm_arg.tm_sec += 1;
+        }
+    }
+    tm_arg.tm_isdst = -1;
+
+    *t = mktime(&tm_arg);
+    return *t == (time_t)-1 ? -1 : 0;
+}
+
+int parse_span_arg(const char *text, time_t *seconds)
+{
+    char *unit;
+    long value = strtol(text, &unit, 10);
+    if (unit == text || value <= 0 || unit[0] == '\0' || unit[1] != '\0')
+    {
+        return -1;
+    }
+
+    switch (unit[0])
+    {
+    case 'm':
+        *seconds = value * 60;
+        return 0;
+    case 'h':
+        *seconds = value * 3600;
+        return 0;
+    case 'd':
+        *seconds = value * 86400;
+        return 0;
+    case 'w':
+        *seconds = value * 7 * 86400;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/**
+ * Reads the record starting at the first line start at or after pos.
+ *
+ * Returns 0 and sets start, next and timestamp, or -1 if there is no
+ * complete record before limit.
+ */
+static int csv_record_after(FILE *log, int64_t pos, int64_t limit, int64_t *start, int64_t *next, time_t *timestamp)
+{
+    char line[256];
+    int c = '\n';
+
+    if (fseek(log, pos > 0 ? pos - 1 : 0, SEEK_SET) != 0)
+    {
+        return -1;
+    }
+    if (pos > 0)
+    {
+        // Skip the rest of the line pos points into
+        while ((c = fgetc(log)) != EOF && c != '\n')
+        {
+            pos++;
+        }
+        if (c == EOF)
+        {
+            return -1;
+        }
+    }
+
+    while (pos < limit && fgets(line, sizeof(line), log) != NULL)
+    {
+        size_t len = strlen(line);
+        float duration;
+        if (log_parse_row(line, timestamp, &duration) == 0)
+        {
+            *start = pos;
+            *next = pos + len;
+            return 0;
+        }
+        pos += len;
+    }
+    return -1;
+}
+
+int64_t range_seek(const char *filename, time_t from)
+{
+    segment_list segments;
+    FILE *log = segment_open_live(filename, &segments);
+    if (log == NULL)
+    {
+        return -1;
+    }
+
+    // Sealed segments know their time span, and their blocks are searched by first timestamp
+    int64_t sealed = segment_seek(&segments, from);
+    int64_t base = segments.base;
+    segment_list_free(&segments);
+    struct stat st;
+    if (sealed >= 0 || fstat(fileno(log), &st) != 0)
+    {
+        fclose(log);
+        return sealed;
+    }
+
+    if (binlog_detect(filename))
+    {
+        fclose(log);
+        binlog_map map;
+        if (binlog_map_file(filename, &map) != 0)
+        {
+            return -1;
+        }
+        size_t lo = 0;
+        size_t hi = map.count;
+        while (lo < hi)
+        {
+            size_t mid = lo + (hi - lo) / 2;
+            if (map.records[mid].timestamp < (int64_t)from)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        binlog_unmap(&map);
+        return base + (int64_t)sizeof(binlog_header) + (int64_t)lo * (int64_t)sizeof(binlog_record);
+    }
+
+    // lo is always a line start with only older records before it
+    int64_t lo = 0;
+    int64_t hi = st.st_size;
+    while (hi - lo > LINEAR_BYTES)
+    {
+        int64_t mid = lo + (hi - lo) / 2;
+        int64_t start, next;
+        time_t timestamp;
+
+        if (csv_record_after(log, mid, hi, &start, &next, &timestamp) != 0)
+        {
+            hi = mid;
+        }
+        else if (timestamp < from)
+        {
+            lo = next;
+        }
+        else
+        {
+            hi = start;
+        }
+    }
+
+    fclose(log);
+    return base + lo;
+}
+
+/**
+ * log_scan() callback adding records inside the window to the totals.
+ */
+static int add_in_range(int64_t offset, int64_t end, time_t timestamp, float duration, void *ctx)
+{
+    (void)offset;
+    (void)end;
+    struct range_totals *totals = ctx;
+
+    if (timestamp >= totals->to)
+    {
+        // In a sorted log nothing after this record can be in the window
+        return totals->sorted;
+    }
+    if (timestamp < totals->from)
+    {
+        return 0;
+    }
+
+    // A log that is not in time order comes back to a day, which is still one day
+    day_set_add(&totals->days, day_bucket(&totals->bucketer, timestamp));
+    if (totals->count == 0 || duration < totals->min)
+    {
+        totals->min = duration;
+    }
+    if (totals->count == 0 || duration > totals->max)
+    {
+        totals->max = duration;
+    }
+    totals->count++;
+    totals->sum += duration;
+    return 0;
+}
+
+int print_range(char *filename, time_t from, time_t to)
+{
+    int64_t query_start = metrics_now_us();
+    // The day index records whether every append so far was in time order
+    day_index idx;
+    if (dayindex_load(&idx, filename) != 0)
+    {
+        printf("Error opening stats file.\n");
+        return 1;
+    }
+    int binary = idx.binary;
+    int sorted = (idx.flags & DAYINDEX_SORTED) != 0;
+    dayindex_free(&idx);
+
+    struct range_totals totals;
+    memset(&totals, 0, sizeof(totals));
+    totals.from = from;
+    totals.to = to;
+    totals.sorted = sorted;
+    day_set_init(&totals.days);
+    day_bucketer_init(&totals.bucketer);
+
+    int64_t start = binary ? (int64_t)sizeof(binlog_header) : 0;
+    if (sorted)
+    {
+        start = range_seek(filename, from);
+    }
+    if (start < 0 || log_scan(filename, binary, start, add_in_range, &totals) < 0)
+    {
+        printf("Error opening stats file.\n");
+        day_set_free(&totals.days);
+        return 1;
+    }
+    day_set_free(&totals.days);
+
+    char fromstr[26];
+    char tostr[26];
+    struct tm tm_from, tm_to;
+    time_t last = to - 1;
+    localtime_r(&from, &tm_from);
+    localtime_r(&last, &tm_to);
+    strftime(fromstr, sizeof(fromstr), "%Y-%m-%d %H:%M:%S", &tm_from);
+    strftime(tostr, sizeof(tostr), "%Y-%m-%d %H:%M:%S", &tm_to);
+
+    printf("Logs from %s to %s\n", fromstr, tostr);
+    if (!sorted)
+    {
+        printf("(log is not in time order, all records were read)\n");
+    }
+    printf("-----------------------\n");
+    printf("Records: %ld\n", totals.count);
+    printf("Days: %zu\n", totals.days.count);
+    printf("Total: %.2f g\n", totals.sum * K);
+    if (totals.days.count > 0)
+    {
+        printf("Daily average: %.2f g\n", totals.sum * K / totals.days.count);
+        printf("Min / max: %.2f g / %.2f g\n", totals.min * K, totals.max * K);
+    }
+    metrics_since(METRIC_QUERY_LATENCY, query_start);
+    return 0;
+}
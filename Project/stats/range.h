@@ -0,0 +1,52 @@
+#ifndef RANGE_H
+#define RANGE_H
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @brief Parses a time argument of a range query
+ *
+ * Accepts a Unix timestamp, "YYYY-MM-DD" or "YYYY-MM-DD HH:MM[:SS]" in
+ * local time. With end set, a bare date means the end of that day and a
+ * timestamp is inclusive.
+ *
+ * @param text Argument to parse
+ * @param end 1 if the argument is the end of a range, 0 for the start
+ * @param t Set to the first second of the range, or the first second after it when end is 1
+ * @return int 0 on success, -1 if the argument is not a time
+ */
+int parse_time_arg(const char *text, int end, time_t *t);
+
+/**
+ * @brief Parses a "--last" span such as "7d", "12h", "30m" or "2w"
+ *
+ * @param text Span to parse
+ * @param seconds Set to the length of the span
+ * @return int 0 on success, -1 if the span is invalid
+ */
+int parse_span_arg(const char *text, time_t *seconds);
+
+/**
+ * @brief Finds the byte offset of the first record at or after a timestamp
+ *
+ * Binary-searches the log, so it assumes the records are in time order.
+ *
+ * @param filename Path to the statistics file (CSV or binary log)
+ * @param from Timestamp to look for
+ * @return int64_t Log offset with only older records before it, at or shortly before the
+ *         first record with a timestamp >= from, or -1 on error
+ */
+int64_t range_seek(const char *filename, time_t from);
+
+/**
+ * @brief Prints statistics of the records in [from, to)
+ *
+ * @param filename Path to the statistics file (CSV or binary log)
+ * @param from First second of the range
+ * @param to First second after the range
+ * @return int 0 on success, 1 if the file cannot be opened
+ */
+int print_range(char *filename, time_t from, time_t to);
+
+#endif /* RANGE_H */
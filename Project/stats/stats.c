@@ -13,14 +13,44 @@
  * @param unix_time Unix timestamp to check
  * @return 1 if timestamp is from today, 0 otherwise
  *
+ * @function print_day_stats
+ * @brief Displays one day's entries using the day index of the file
+ * @param filename Path to the statistics file
+ * @param day Local day as YYYYMMDD
+ * @return 0 on success, 1 if file cannot be opened
+ *
+ * @function print_rollup
+ * @brief Displays the latest hourly, daily, weekly or monthly aggregates
+ * @param filename Path to the statistics file
+ * @param granularity Rollup table to show
+ * @param last Number of most recent buckets, 0 for all
+ * @return 0 on success, 1 if file cannot be opened
+ *
+ * @function print_percentiles
+ * @brief Displays p50/p90/p99/max durations of the latest days and of all time
+ * @param filename Path to the statistics file
+ * @param last Number of most recent days, 0 for all
+ * @return 0 on success, 1 if file cannot be opened
+ *
+ * @function follow_stats
+ * @brief Displays the statistics of print_stats and keeps them up to date as records are appended
+ * @param filename Path to the statistics file
+ * @return 1 if the file cannot be opened or watched, otherwise runs until interrupted
+ *
  * @function print_stats
  * @brief Reads and displays water consumption statistics from a file
  * @param filename Path to the statistics file
  * @return 0 on success, 1 if file cannot be opened
  *
  * The statistics file should contain records in the format:
- * unix_timestamp,duration
- * where duration is in seconds
+ * unix_timestamp,duration[,device]
+ * where duration is in seconds and device is the optional device id
+ *
+ * Both functions read through the day index kept next to the file (see
+ * dayindex.h), so only the requested day's records are read and the
+ * all-time average comes from per-day sums. Records that were sealed into
+ * compressed segments (see segment.h) keep their offsets and are decoded
+ * wherever the live file would have been read.
  *
  * Output includes:
  * - List of today's consumption entries with times
@@ -28,8 +58,18 @@
  * - All-time daily average consumption
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
 #include <time.h>
 #include <string.h>
+#include "../binlog/binlog.h"
+#include "../index/dayindex.h"
+#include "../rollup/rollup.h"
+#include "../daybucket/daybucket.h"
+#include "../histogram/histogram.h"
+#include "../segment/segment.h"
+#include "../metrics/metrics.h"
+#include "watch.h"
 
 #define K 10 // 10 grams per second
 
@@ -41,31 +81,303 @@
  * @return Returns 1 if the given timestamp is from today, 0 otherwise
  *         Returns 0 on any error (e.g., time conversion failures)
  * 
- * This function compares year, month and day components of two timestamps:
- * the provided unix_time and the current system time. Time of day is ignored
- * in the comparison.
+ * Today's local-midnight bounds are resolved once per thread and kept until
+ * the clock passes the next midnight, so a call costs a time() call and two
+ * integer comparisons instead of two localtime() conversions.
  */
 int is_today(time_t unix_time) 
 {
-    time_t now;
-    struct tm time_check, time_now;
-    
+    static _Thread_local day_bucketer today = { 0, 0, -1 };
+
     // Get current time
-    now = time(NULL);
+    time_t now = time(NULL);
     if (now == -1) return 0;
-    
-    // Convert times to tm structs safely
-    struct tm *tmp = localtime(&unix_time);
-    if (!tmp) return 0;
-    time_check = *tmp;
-    
-    tmp = localtime(&now);
-    if (!tmp) return 0;
-    time_now = *tmp;
-    
-    return (time_now.tm_year == time_check.tm_year &&
-            time_now.tm_mon == time_check.tm_mon &&
-            time_now.tm_mday == time_check.tm_mday);
+
+    if (!day_contains(&today, now))
+    {
+        day_bucketer_at(&today, now);
+        if (today.key < 0) return 0;
+    }
+
+    return day_contains(&today, unix_time);
+}
+
+/**
+ * @brief Running totals shared by the CSV and binary readers
+ */
+struct stats_totals
+{
+    double sum_all;
+    double sum_today;
+    day_set days;
+    day_bucketer bucketer;
+    day_bucketer today;
+};
+
+/**
+ * Prints the header of a log table.
+ */
+static void print_header(const char *title)
+{
+    printf("%s\n", title);
+    printf("-----------------------\n");
+    printf("%-11s|%11s\n", "Time", "Amount");
+    printf("-----------------------\n");
+}
+
+/**
+ * Prints one row of a log table.
+ */
+static void print_row(time_t time, float dur, void *ctx)
+{
+    (void)ctx;
+    char timestr[26];
+    struct tm tm_info;
+    if (localtime_r(&time, &tm_info))
+    {
+        strftime(timestr, sizeof(timestr), "%H:%M:%S", &tm_info);
+        printf("%-11s|%9.2f g\n", timestr, dur * K);
+    }
+}
+
+/**
+ * Adds one record to the totals and prints it if it is from today.
+ */
+static void add_record(struct stats_totals *totals, time_t time, float dur)
+{
+    totals->sum_all += dur;
+
+    // Check if this is a new day; the bucketer only consults the calendar when the day changes
+    day_set_add(&totals->days, day_bucket(&totals->bucketer, time));
+
+    if (day_contains(&totals->today, time))
+    {
+        totals->sum_today += dur;
+        print_row(time, dur, NULL);
+    }
+}
+
+/**
+ * Prepares empty totals for a query run now.
+ */
+static void init_totals(struct stats_totals *totals)
+{
+    memset(totals, 0, sizeof(*totals));
+    day_set_init(&totals->days);
+    day_bucketer_init(&totals->bucketer);
+    day_bucketer_at(&totals->today, time(NULL));
+}
+
+/**
+ * Releases the days remembered by the totals.
+ */
+static void free_totals(struct stats_totals *totals)
+{
+    day_set_free(&totals->days);
+}
+
+/**
+ * Prints the day's total and the all-time daily average.
+ */
+static void print_footer(const struct stats_totals *totals, const char *label)
+{
+    printf("-----------------------\n");
+    printf("%s: %.2f g\n", label, totals->sum_today * K);
+    if (totals->days.count > 0)
+    {
+        printf("All-time average: %.2f g\n", (totals->sum_all * K) / totals->days.count);
+    }
+}
+
+/**
+ * log_scan() callback adding every record to the totals.
+ */
+static int add_scanned(int64_t offset, int64_t end, time_t timestamp, float duration, void *ctx)
+{
+    (void)offset;
+    (void)end;
+    add_record(ctx, timestamp, duration);
+    return 0;
+}
+
+/**
+ * Prints statistics by reading every record of the log, sealed segments included.
+ */
+static int print_stats_scan(char *filename)
+{
+    int binary = binlog_detect(filename);
+    struct stats_totals totals;
+    init_totals(&totals);
+    print_header("Today's logs");
+    if (log_scan(filename, binary, binary ? (int64_t)sizeof(binlog_header) : 0, add_scanned, &totals) < 0)
+    {
+        printf("Error opening stats file.\n");
+        free_totals(&totals);
+        return 1;
+    }
+    print_footer(&totals, "Today's total");
+    free_totals(&totals);
+    return 0;
+}
+
+/**
+ * Prints the table of one day and the all-time average from the day index.
+ *
+ * Only the records of the requested day are read from the log; the totals
+ * come from the per-day sums kept in the index.
+ */
+static void print_indexed(const day_index *idx, int32_t day, const char *title, const char *label,
+                          struct stats_totals *totals)
+{
+    init_totals(totals);
+
+    print_header(title);
+    for (size_t i = 0; i < idx->count; i++)
+    {
+        const day_entry *entry = &idx->entries[i];
+        totals->sum_all += entry->sum;
+        // Each entry is a run of same-day records; an unsorted log has several runs of one day
+        day_set_add(&totals->days, entry->day);
+        if (entry->day == day)
+        {
+            totals->sum_today += entry->sum;
+            dayindex_rows(idx, entry, print_row, NULL);
+        }
+    }
+    print_footer(totals, label);
+}
+
+/**
+ * Displays the consumption logs of one day and the all-time daily average.
+ *
+ * Uses the day index of the file, so only the records of that day are read.
+ *
+ * @param filename Path to the statistics file (CSV or binary log)
+ * @param day Local day as YYYYMMDD
+ *
+ * @return 0 on successful execution, 1 if file opening fails
+ */
+int print_day_stats(char *filename, int day)
+{
+    int64_t start = metrics_now_us();
+    day_index idx;
+    if (dayindex_load(&idx, filename) != 0)
+    {
+        printf("Error opening stats file.\n");
+        return 1;
+    }
+
+    char title[32];
+    snprintf(title, sizeof(title), "Logs of %04d-%02d-%02d", day / 10000, day / 100 % 100, day % 100);
+    struct stats_totals totals;
+    print_indexed(&idx, day, title, "Day total", &totals);
+    free_totals(&totals);
+    dayindex_free(&idx);
+    metrics_since(METRIC_QUERY_LATENCY, start);
+    return 0;
+}
+
+/**
+ * Displays the most recent buckets of one rollup table.
+ *
+ * Only the requested buckets are read from the rollup sidecar, so the cost
+ * does not depend on the size of the log.
+ *
+ * @param filename Path to the statistics file (CSV or binary log)
+ * @param granularity Hour, day, week or month buckets
+ * @param last Number of most recent buckets to show, 0 for all
+ *
+ * @return 0 on successful execution, 1 if file opening fails
+ */
+int print_rollup(char *filename, rollup_granularity granularity, int last)
+{
+    static const char *titles[ROLLUP_COUNT] = { "Hourly", "Daily", "Weekly", "Monthly" };
+    static const char *formats[ROLLUP_COUNT] = { "%Y-%m-%d %H:00", "%Y-%m-%d", "%Y-%m-%d", "%Y-%m" };
+
+    int64_t query_start = metrics_now_us();
+    rollup_table table;
+    if (rollup_load(&table, filename, granularity, last > 0 ? (size_t)last : 0) != 0)
+    {
+        printf("Error opening stats file.\n");
+        return 1;
+    }
+
+    printf("%s rollup\n", titles[granularity]);
+    printf("-----------------------------------------------------------------\n");
+    printf("%-17s|%6s|%11s|%11s|%8s|%8s\n", "Start", "Count", "Total", "Amount", "Min", "Max");
+    printf("-----------------------------------------------------------------\n");
+
+    for (size_t i = 0; i < table.count; i++)
+    {
+        const rollup_bucket *b = &table.buckets[i];
+        char timestr[26];
+        time_t start = (time_t)b->start;
+        struct tm tm_start;
+        if (!localtime_r(&start, &tm_start))
+        {
+            continue;
+        }
+        strftime(timestr, sizeof(timestr), formats[granularity], &tm_start);
+        printf("%-17s|%6u|%9.2f s|%9.2f g|%6.2f s|%6.2f s\n",
+               timestr, b->count, b->sum, b->sum * K, b->min, b->max);
+    }
+    printf("-----------------------------------------------------------------\n");
+
+    rollup_free(&table);
+    metrics_since(METRIC_QUERY_LATENCY, query_start);
+    return 0;
+}
+
+/**
+ * Prints one row of the percentile table.
+ */
+static void print_percentile_row(const char *label, const duration_histogram *hist)
+{
+    printf("%-11s|%7llu|%7.2f s|%7.2f s|%7.2f s|%7.2f s\n", label, (unsigned long long)hist->count,
+           histogram_percentile(hist, 0.50), histogram_percentile(hist, 0.90),
+           histogram_percentile(hist, 0.99), (double)hist->max);
+}
+
+/**
+ * Displays duration percentiles of the most recent days and of all time.
+ *
+ * The histograms are maintained by the recorder in a sidecar, so only the
+ * records appended since it was last written are read from the log.
+ *
+ * @param filename Path to the statistics file (CSV or binary log)
+ * @param last Number of most recent days to show, 0 for all
+ *
+ * @return 0 on successful execution, 1 if file opening fails
+ */
+int print_percentiles(char *filename, int last)
+{
+    int64_t start = metrics_now_us();
+    histogram_set set;
+    if (histogram_load(&set, filename) != 0)
+    {
+        printf("Error opening stats file.\n");
+        return 1;
+    }
+
+    printf("Duration percentiles\n");
+    printf("---------------------------------------------------------\n");
+    printf("%-11s|%7s|%9s|%9s|%9s|%9s\n", "Day", "Count", "p50", "p90", "p99", "Max");
+    printf("---------------------------------------------------------\n");
+
+    size_t first = last > 0 && set.count > (size_t)last ? set.count - (size_t)last : 0;
+    for (size_t i = first; i < set.count; i++)
+    {
+        int32_t day = set.days[i].day;
+        char label[16];
+        snprintf(label, sizeof(label), "%04d-%02d-%02d", day / 10000, day / 100 % 100, day % 100);
+        print_percentile_row(label, &set.days[i].hist);
+    }
+    printf("---------------------------------------------------------\n");
+    print_percentile_row("All time", &set.all);
+
+    histogram_free(&set);
+    metrics_since(METRIC_QUERY_LATENCY, start);
+    return 0;
 }
 
 /**
@@ -77,7 +389,7 @@ int is_today(time_t unix_time)
  * consumption across all recorded days.
  * 
  * @param filename Path to the statistics file containing timestamp and consumption data
- *                 in the format: "timestamp,amount"
+ *                 in the format: "timestamp,amount", or a binary log (see binlog.h)
  * 
  * @return 0 on successful execution, 1 if file opening fails
  * 
@@ -90,65 +402,225 @@ int is_today(time_t unix_time)
  */
 int print_stats(char *filename)
 {
-    time_t time;
-    float dur;
-    float sum_all = 0;
-    float sum_today = 0;
-    int n = 0;
-    char timestr[26];
-    FILE *stats = fopen(filename, "r");
+    int64_t start = metrics_now_us();
+    int status = 0;
 
-    if (stats == NULL)
+    // The day index lets us read only today's records
+    day_index idx;
+    if (dayindex_load(&idx, filename) == 0)
     {
-        printf("Error opening stats file.\n");
-        return 1;
+        struct stats_totals totals;
+        print_indexed(&idx, day_key(time(NULL)), "Today's logs", "Today's total", &totals);
+        free_totals(&totals);
+        dayindex_free(&idx);
+    }
+    else
+    {
+        status = print_stats_scan(filename);
     }
 
-    printf("Today's logs\n");
-    printf("-----------------------\n");
-    printf("%-11s|%11s\n", "Time", "Amount");
-    printf("-----------------------\n");
+    metrics_since(METRIC_QUERY_LATENCY, start);
+    return status;
+}
+
+/**
+ * @brief Totals kept up to date by follow_stats()
+ */
+struct follow_state
+{
+    struct stats_totals totals;
+    int binary;
+    int64_t covered;   // log offset up to which records were added
+    int64_t limit;     // end of the last complete line when the scan started
+    int stopped;
+    int added;
+};
 
-    time_t last_time = 0;
-    int last_year = -1;
-    int last_yday = -1;
+/**
+ * Offset just after the last newline in [from, size), or from if there is none.
+ */
+static int64_t complete_lines(const char *filename, int64_t from, int64_t size)
+{
+    segment_list segments;
+    FILE *log = segment_open_live(filename, &segments);
+    if (log == NULL)
+    {
+        return from;
+    }
+    // Sealed records are always whole lines; only the live file can end in a partial one
+    int64_t base = segments.base;
+    int64_t start = from > segments.sealed ? from : segments.sealed;
+    segment_list_free(&segments);
 
-    while (fscanf(stats, "%ld,%f", &time, &dur) == 2)
+    char buffer[4096];
+    int64_t pos = size;
+    while (pos > start)
     {
-        sum_all += dur;
-        
-        // Get the time structure
-        struct tm *tm_day = localtime(&time);
-        if (tm_day)
+        size_t n = pos - start < (int64_t)sizeof(buffer) ? (size_t)(pos - start) : sizeof(buffer);
+        if (fseek(log, (long)(pos - (int64_t)n - base), SEEK_SET) != 0 || fread(buffer, 1, n, log) != n)
         {
-            // Check if this is a new day by comparing both year and day of year
-            if (tm_day->tm_year != last_year || tm_day->tm_yday != last_yday) 
-            {
-                n++;
-                last_year = tm_day->tm_year;
-                last_yday = tm_day->tm_yday;
-            }
+            break;
         }
-
-        if (is_today(time))
+        for (size_t i = n; i > 0; i--)
         {
-            sum_today += dur;
-            struct tm *tm_info = localtime(&time);
-            if (tm_info)
+            if (buffer[i - 1] == '\n')
             {
-                strftime(timestr, sizeof(timestr), "%H:%M:%S", tm_info);
-                printf("%-11s|%9.2f g\n", timestr, dur * K);
+                fclose(log);
+                return pos - (int64_t)n + (int64_t)i;
             }
         }
+        pos -= (int64_t)n;
     }
+    fclose(log);
+    return start;
+}
 
-    printf("-----------------------\n");
-    printf("Today's total: %.2f g\n", sum_today * K);
-    if (n > 0)
+/**
+ * log_scan() callback adding appended records to the followed totals.
+ */
+static int add_followed(int64_t offset, int64_t end, time_t timestamp, float duration, void *ctx)
+{
+    struct follow_state *state = ctx;
+
+    // A line the recorder is still writing is read again once it is complete
+    if (end > state->limit)
     {
-        printf("All-time average: %.2f g\n", (sum_all * K) / n);
+        state->covered = offset;
+        state->stopped = 1;
+        return 1;
+    }
+    add_record(&state->totals, timestamp, duration);
+    state->covered = end;
+    state->added++;
+    return 0;
+}
+
+/**
+ * Prints the statistics of the whole file, like print_stats(), and keeps their totals.
+ */
+static int start_follow(char *filename, struct follow_state *state)
+{
+    day_index idx;
+    if (dayindex_load(&idx, filename) != 0)
+    {
+        return -1;
+    }
+    memset(state, 0, sizeof(*state));
+    state->binary = idx.binary;
+    state->covered = idx.covered;
+    print_indexed(&idx, day_key(time(NULL)), "Today's logs", "Today's total", &state->totals);
+    dayindex_free(&idx);
+    fflush(stdout);
+    return 0;
+}
+
+/**
+ * Adds the records appended since the last call. Returns -1 if the log cannot be read.
+ */
+static int read_appended(char *filename, struct follow_state *state, int64_t size)
+{
+    state->limit = state->binary ? size : complete_lines(filename, state->covered, size);
+    state->stopped = 0;
+    state->added = 0;
+    if (state->limit <= state->covered)
+    {
+        return 0;
     }
 
-    fclose(stats);
+    int64_t covered = log_scan(filename, state->binary, state->covered, add_followed, state);
+    if (covered < 0)
+    {
+        return -1;
+    }
+    // Lines that are not records are skipped for good
+    if (!state->stopped)
+    {
+        state->covered = covered < state->limit ? covered : state->limit;
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * Displays today's logs and keeps following the file.
+ *
+ * The totals are computed once from the day index; after that only the
+ * bytes appended to the file are read, whenever inotify (or kqueue) reports
+ * a change. Between changes the process sleeps in the kernel, waking up on
+ * its own only at local midnight to start a new day.
+ *
+ * @param filename Path to the statistics file (CSV or binary log)
+ *
+ * @return 1 if the file cannot be opened or watched, otherwise does not return
+ */
+int follow_stats(char *filename)
+{
+    struct follow_state state;
+    if (start_follow(filename, &state) != 0)
+    {
+        printf("Error opening stats file.\n");
+        return 1;
+    }
+
+    file_watch *watch = watch_open(filename);
+    if (watch == NULL)
+    {
+        printf("Error watching stats file.\n");
+        return 1;
+    }
+
+    for (;;)
+    {
+        time_t now = time(NULL);
+        if (!day_contains(&state.totals.today, now))
+        {
+            // Local midnight passed; the average already counts the new day once a record arrives
+            day_bucketer_at(&state.totals.today, now);
+            state.totals.sum_today = 0;
+            printf("\n");
+            print_header("Today's logs");
+            print_footer(&state.totals, "Today's total");
+            fflush(stdout);
+        }
+
+        int64_t wait_ms = ((int64_t)(state.totals.today.end - now)) * 1000;
+        int changed = watch_wait(watch, wait_ms > INT_MAX ? INT_MAX : (int)wait_ms);
+        if (changed < 0)
+        {
+            printf("Error watching stats file.\n");
+            break;
+        }
+
+        // Sealing moves records into segments without changing the size of the whole log
+        int64_t size = changed == 0 ? -1 : segment_log_size(filename);
+        if (size < 0)
+        {
+            continue;
+        }
+        if (size < state.covered)
+        {
+            printf("\nStats file was truncated, reading it again.\n\n");
+            free_totals(&state.totals);
+            if (start_follow(filename, &state) != 0)
+            {
+                printf("Error opening stats file.\n");
+                break;
+            }
+            continue;
+        }
+
+        if (read_appended(filename, &state, size) != 0)
+        {
+            printf("Error reading stats file.\n");
+            break;
+        }
+        if (state.added > 0)
+        {
+            print_footer(&state.totals, "Today's total");
+            fflush(stdout);
+        }
+    }
+
+    watch_close(watch);
+    free_totals(&state.totals);
+    return 1;
+}
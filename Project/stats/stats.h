@@ -2,6 +2,7 @@
 #define STATS_H
 
 #include <time.h>
+#include "../rollup/rollup.h"
 
 // Constant for consumption rate in grams per second
 #define K 10
@@ -14,6 +15,45 @@
  */
 int is_today(time_t unix_time);
 
+/**
+ * @brief Prints the entries of one day and the all-time average
+ *
+ * @param filename Path to the statistics file
+ * @param day Local day as YYYYMMDD
+ * @return int 0 on success, non-zero on failure
+ */
+int print_day_stats(char *filename, int day);
+
+/**
+ * @brief Prints the most recent buckets of a rollup table
+ *
+ * @param filename Path to the statistics file
+ * @param granularity Hour, day, week or month buckets
+ * @param last Number of most recent buckets to show, 0 for all
+ * @return int 0 on success, non-zero on failure
+ */
+int print_rollup(char *filename, rollup_granularity granularity, int last);
+
+/**
+ * @brief Prints p50, p90, p99 and max durations of the latest days and of all time
+ *
+ * @param filename Path to the statistics file
+ * @param last Number of most recent days to show, 0 for all
+ * @return int 0 on success, non-zero on failure
+ */
+int print_percentiles(char *filename, int last);
+
+/**
+ * @brief Prints the statistics of print_stats() and updates them as records are appended
+ *
+ * Only newly appended bytes are read, when the kernel reports a change to
+ * the file; today's total starts again at local midnight.
+ *
+ * @param filename Path to the statistics file
+ * @return int 1 if the file cannot be opened or watched; otherwise runs until interrupted
+ */
+int follow_stats(char *filename);
+
 /**
  * @brief Prints statistical data from the specified file
  *
@@ -0,0 +1,179 @@
+/**
+ * @file watch.c
+ * @brief Waits for changes to a file without polling it
+ *
+ * Linux uses inotify and macOS (and the BSDs) use a kqueue vnode filter,
+ * so a follower sleeps in the kernel until the recorder writes. Both
+ * watch the file itself; when it is removed or renamed away the watch is
+ * moved to whatever file next appears under the same path.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "watch.h"
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#else
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+// How often a missing file is looked for
+#define MISSING_RETRY_MS 1000
+
+struct file_watch
+{
+    char path[512];
+    int fd;
+    int target;   // inotify watch descriptor or watched file descriptor, -1 while the file is missing
+};
+
+/**
+ * Starts watching whatever file is at the path now. Returns -1 if there is none.
+ */
+static int attach(file_watch *watch)
+{
+#ifdef __linux__
+    watch->target = inotify_add_watch(watch->fd, watch->path,
+                                      IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+    return watch->target < 0 ? -1 : 0;
+#else
+    int fd = open(watch->path, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    struct kevent change;
+    EV_SET(&change, fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+           NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | NOTE_DELETE | NOTE_RENAME, 0, NULL);
+    if (kevent(watch->fd, &change, 1, NULL, 0, NULL) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    watch->target = fd;
+    return 0;
+#endif
+}
+
+/**
+ * Stops watching the current file after it was removed or renamed.
+ */
+static void detach(file_watch *watch)
+{
+#ifdef __linux__
+    // The kernel already dropped a watch on a deleted file; this only covers a rename
+    inotify_rm_watch(watch->fd, watch->target);
+#else
+    close(watch->target);
+#endif
+    watch->target = -1;
+}
+
+file_watch *watch_open(const char *path)
+{
+    file_watch *watch = calloc(1, sizeof(*watch));
+    if (watch == NULL)
+    {
+        return NULL;
+    }
+    watch->target = -1;
+    if (snprintf(watch->path, sizeof(watch->path), "%s", path) >= (int)sizeof(watch->path))
+    {
+        free(watch);
+        return NULL;
+    }
+
+#ifdef __linux__
+    watch->fd = inotify_init1(IN_CLOEXEC);
+#else
+    watch->fd = kqueue();
+#endif
+    if (watch->fd < 0 || attach(watch) != 0)
+    {
+        watch_close(watch);
+        return NULL;
+    }
+    return watch;
+}
+
+int watch_wait(file_watch *watch, int timeout_ms)
+{
+    if (watch->target < 0)
+    {
+        // Nothing to be notified about until the file is back
+        if (attach(watch) == 0)
+        {
+            return 1;
+        }
+        int wait_ms = timeout_ms < 0 || timeout_ms > MISSING_RETRY_MS ? MISSING_RETRY_MS : timeout_ms;
+        usleep((useconds_t)wait_ms * 1000);
+        return attach(watch) == 0 ? 1 : 0;
+    }
+
+#ifdef __linux__
+    struct pollfd pfd = { watch->fd, POLLIN, 0 };
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (ready <= 0)
+    {
+        return ready < 0 && errno != EINTR ? -1 : 0;
+    }
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len = read(watch->fd, events, sizeof(events));
+    if (len < 0)
+    {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (char *p = events; p < events + len; )
+    {
+        const struct inotify_event *event = (const struct inotify_event *)p;
+        if (event->wd == watch->target && (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)))
+        {
+            detach(watch);
+            attach(watch);
+        }
+        p += sizeof(*event) + event->len;
+    }
+    return 1;
+#else
+    struct timespec timeout = { timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000 };
+    struct kevent event;
+    int ready = kevent(watch->fd, NULL, 0, &event, 1, timeout_ms < 0 ? NULL : &timeout);
+    if (ready <= 0)
+    {
+        return ready < 0 && errno != EINTR ? -1 : 0;
+    }
+    if (event.fflags & (NOTE_DELETE | NOTE_RENAME))
+    {
+        detach(watch);
+        attach(watch);
+    }
+    return 1;
+#endif
+}
+
+void watch_close(file_watch *watch)
+{
+    if (watch == NULL)
+    {
+        return;
+    }
+#ifndef __linux__
+    if (watch->target >= 0)
+    {
+        close(watch->target);
+    }
+#endif
+    if (watch->fd >= 0)
+    {
+        close(watch->fd);
+    }
+    free(watch);
+}
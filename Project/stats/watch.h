@@ -0,0 +1,36 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+/**
+ * @brief Kernel notification of changes to one file (inotify or kqueue)
+ */
+typedef struct file_watch file_watch;
+
+/**
+ * @brief Starts watching a file for writes, truncation, replacement and removal
+ *
+ * @param path Path of the file
+ * @return file_watch* Watch, or NULL if the file cannot be watched
+ */
+file_watch *watch_open(const char *path);
+
+/**
+ * @brief Sleeps until the file changes or the timeout expires
+ *
+ * Uses no CPU while waiting. A file that was replaced is watched again
+ * under its path; while it is missing, the path is retried once a second.
+ *
+ * @param watch Watch from watch_open()
+ * @param timeout_ms Longest wait in milliseconds, -1 for no limit
+ * @return int 1 if the file may have changed, 0 on timeout, -1 if error occurs
+ */
+int watch_wait(file_watch *watch, int timeout_ms);
+
+/**
+ * @brief Stops watching and releases a watch
+ *
+ * @param watch Watch to release, may be NULL
+ */
+void watch_close(file_watch *watch);
+
+#endif /* WATCH_H */
@@ -0,0 +1,632 @@
+/**
+ * @file writer.c
+ * @brief Group-commit writer for the stats log
+ *
+ * The recorder used to fflush() after every record: one write() per event,
+ * and still no durability since nothing was synced. Records now go into an
+ * in-memory batch and a background thread writes whole batches with one
+ * write() (and one fsync() under the "fsync" policy), so the thread
+ * reading the serial ports never waits for the disk.
+ *
+ * Two batches are swapped under the lock: the recorder fills one while the
+ * writer thread writes the other. Offsets of the records are assigned when
+ * they reach the file, and the commit callback runs only after that, which
+ * keeps the day index and rollups from ever covering bytes that are not in
+ * the log.
+ *
+ * Under a roll policy the writer thread also seals the live file into a
+ * compressed segment between two writes, when the day changes or the file
+ * reached its size limit. Offsets keep counting across the segments, so the
+ * commit callback never notices.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "writer.h"
+#include "../index/dayindex.h"
+#include "../segment/segment.h"
+#include "../binlog/binlog.h"
+#include "../daybucket/daybucket.h"
+#include "../metrics/metrics.h"
+
+/**
+ * @brief Record waiting in a batch
+ */
+struct pending
+{
+    size_t len;
+    time_t timestamp;
+    double duration;
+    int64_t since_us;
+};
+
+/**
+ * @brief Records queued together and written with one write()
+ */
+struct batch
+{
+    char *data;
+    size_t used;
+    size_t capacity;
+    struct pending *records;
+    size_t count;
+    size_t record_capacity;
+    struct timespec first;
+};
+
+struct log_writer
+{
+    char path[512];
+    int fd;
+    int64_t end;
+    int64_t base;        // offset of the live file in the logical log (see segment.h)
+    int live_records;    // whether the live file holds records
+    int32_t live_day;    // local day of the last record in the live file
+    int roll_failed;
+    int torn;            // a torn record could not be removed; nothing more is appended
+    day_bucketer bucketer;
+    writer_policy policy;
+    writer_commit_fn fn;
+    void *ctx;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t space;
+    struct batch filling;
+    struct batch writing;
+    int stopping;
+};
+
+int writer_parse_policy(const char *text, writer_policy *policy)
+{
+    memset(policy, 0, sizeof(*policy));
+
+    char copy[128];
+    if (snprintf(copy, sizeof(copy), "%s", text) >= (int)sizeof(copy))
+    {
+        return -1;
+    }
+
+    char *save;
+    for (char *item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save))
+    {
+        char *end;
+        if (!strcmp(item, "fsync"))
+        {
+            policy->sync = 1;
+        }
+        else if (!strncmp(item, "records=", 8))
+        {
+            long n = strtol(item + 8, &end, 10);
+            if (end == item + 8 || *end != '\0' || n <= 0 || n > 1000000)
+            {
+                return -1;
+            }
+            policy->records = (int)n;
+        }
+        else if (!strcmp(item, "roll=day"))
+        {
+            policy->roll_daily = 1;
+        }
+        else if (!strncmp(item, "roll=", 5))
+        {
+            long long size = strtoll(item + 5, &end, 10);
+            int shift = 0;
+            if (end != item + 5 && (*end == 'k' || *end == 'm' || *end == 'g'))
+            {
+                shift = *end == 'k' ? 10 : *end == 'm' ? 20 : 30;
+                end++;
+            }
+            if (end == item + 5 || *end != '\0' || size <= 0 || size > (1ll << (40 - shift)))
+            {
+                return -1;
+            }
+            policy->roll_bytes = (int64_t)size << shift;
+        }
+        else if (!strncmp(item, "interval=", 9))
+        {
+            long ms = strtol(item + 9, &end, 10);
+            if (end == item + 9 || *end != '\0' || ms <= 0 || ms > 3600000)
+            {
+                return -1;
+            }
+            policy->interval_ms = (int)ms;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int writer_repair_tail(const char *path)
+{
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+    {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    struct stat st;
+    char last;
+    if (fstat(fd, &st) != 0 || (st.st_size > 0 && pread(fd, &last, 1, st.st_size - 1) != 1))
+    {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0 || last == '\n')
+    {
+        close(fd);
+        return 0;
+    }
+
+    // Even a torn line that still parses may have lost digits, so it is cut off, however long it is
+    off_t line_start = 0;
+    for (off_t at = st.st_size; at > 0;)
+    {
+        char chunk[4096];
+        off_t start = at > (off_t)sizeof(chunk) ? at - (off_t)sizeof(chunk) : 0;
+        if (pread(fd, chunk, (size_t)(at - start), start) != at - start)
+        {
+            close(fd);
+            return -1;
+        }
+        off_t i = at - start;
+        while (i > 0 && chunk[i - 1] != '\n')
+        {
+            i--;
+        }
+        if (i > 0)
+        {
+            line_start = start + i;
+            break;
+        }
+        at = start;
+    }
+    int ok = ftruncate(fd, line_start) == 0;
+    printf("Removed a torn last line from %s.\n", path);
+
+    ok = (close(fd) == 0) && ok;
+    return ok ? 0 : -1;
+}
+
+/**
+ * Adds a record to a batch, growing it as needed.
+ */
+static int batch_add(struct batch *b, const void *data, size_t len, time_t timestamp, double duration, int64_t since_us)
+{
+    if (b->used + len > b->capacity)
+    {
+        size_t capacity = b->capacity ? b->capacity : 4096;
+        while (capacity < b->used + len)
+        {
+            capacity *= 2;
+        }
+        char *grown = realloc(b->data, capacity);
+        if (grown == NULL)
+        {
+            return -1;
+        }
+        b->data = grown;
+        b->capacity = capacity;
+    }
+    if (b->count == b->record_capacity)
+    {
+        size_t capacity = b->record_capacity ? b->record_capacity * 2 : 64;
+        struct pending *grown = realloc(b->records, capacity * sizeof(*grown));
+        if (grown == NULL)
+        {
+            return -1;
+        }
+        b->records = grown;
+        b->record_capacity = capacity;
+    }
+
+    if (b->count == 0)
+    {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        b->first.tv_sec = tv.tv_sec;
+        b->first.tv_nsec = (long)tv.tv_usec * 1000;
+    }
+    memcpy(b->data + b->used, data, len);
+    b->used += len;
+    struct pending record = { len, timestamp, duration, since_us };
+    b->records[b->count++] = record;
+    return 0;
+}
+
+/**
+ * Checks whether the filling batch has to be written now. Called with the lock held.
+ */
+static int due(const log_writer *w, const struct timespec *now)
+{
+    const writer_policy *p = &w->policy;
+    const struct batch *b = &w->filling;
+
+    if (b->count == 0)
+    {
+        return 0;
+    }
+    if (w->stopping || p->sync || (p->records == 0 && p->interval_ms == 0))
+    {
+        return 1;
+    }
+    if (p->records > 0 && b->count >= (size_t)p->records)
+    {
+        return 1;
+    }
+    if (p->interval_ms > 0)
+    {
+        long long age_ms = (long long)(now->tv_sec - b->first.tv_sec) * 1000 +
+                           (now->tv_nsec - b->first.tv_nsec) / 1000000;
+        return age_ms >= p->interval_ms;
+    }
+    return 0;
+}
+
+/**
+ * Makes written data durable; on macOS plain fsync() does not flush the drive cache.
+ */
+static int sync_file(int fd)
+{
+#ifdef F_FULLFSYNC
+    if (fcntl(fd, F_FULLFSYNC) == 0)
+    {
+        return 0;
+    }
+#endif
+    return fsync(fd);
+}
+
+/**
+ * Opens the live file for appending and takes a shared lock on it.
+ *
+ * A seal holds an exclusive lock until the shortened file is in place, so
+ * the file is opened again if it was replaced while waiting.
+ */
+static int open_locked(const char *path)
+{
+    for (;;)
+    {
+        int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (fd < 0)
+        {
+            return -1;
+        }
+        struct stat held, named;
+        if (flock(fd, LOCK_SH) != 0 || fstat(fd, &held) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+        if (stat(path, &named) == 0 && named.st_ino == held.st_ino && named.st_dev == held.st_dev)
+        {
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+/**
+ * Seals the live file into a segment and goes on in the new, empty live file.
+ */
+static void roll(log_writer *w)
+{
+    // Records of another recorder appending to the same file would be lost
+    if (flock(w->fd, LOCK_EX | LOCK_NB) != 0)
+    {
+        printf("Not rolling %s: another process is recording it.\n", w->path);
+        flock(w->fd, LOCK_SH);
+        w->roll_failed = 1;
+        return;
+    }
+    if (segment_seal(w->path, w->end - w->base) != 0)
+    {
+        printf("Error sealing a segment of %s, it is not rolled any more.\n", w->path);
+        w->roll_failed = 1;
+    }
+
+    int fd = open_locked(w->path);
+    off_t size = fd >= 0 ? lseek(fd, 0, SEEK_END) : -1;
+    if (size < 0)
+    {
+        printf("Error reopening stats file: %s\n", strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        flock(w->fd, LOCK_SH);
+        w->roll_failed = 1;
+        return;
+    }
+    close(w->fd);
+    w->fd = fd;
+    w->base = w->end - size;
+    w->live_records = 0;
+}
+
+/**
+ * Writes records [first, last) of a batch, whose data starts at byte at, and reports them.
+ */
+static int write_records(log_writer *w, struct batch *b, size_t first, size_t last, size_t at, size_t len)
+{
+    size_t done = 0;
+    int64_t start = metrics_now_us();
+    while (done < len)
+    {
+        ssize_t n = write(w->fd, b->data + at + done, len - done);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf("Error writing stats file: %s\n", strerror(errno));
+            break;
+        }
+        done += (size_t)n;
+    }
+    metrics_since(METRIC_WRITE_LATENCY, start);
+    if (done == len && w->policy.sync)
+    {
+        start = metrics_now_us();
+        if (sync_file(w->fd) != 0)
+        {
+            printf("Error syncing stats file: %s\n", strerror(errno));
+        }
+        metrics_since(METRIC_SYNC_LATENCY, start);
+    }
+
+    if (done < len)
+    {
+        // Records that did not make it are dropped, and so are their torn bytes, so the next
+        // batch starts on a record boundary and the reported offsets stay valid
+        printf("Lost %zu records.\n", b->count - first);
+        if (done > 0 && ftruncate(w->fd, (off_t)(w->end - w->base)) != 0)
+        {
+            printf("Error removing a torn record from stats file: %s; recording stopped.\n", strerror(errno));
+            w->torn = 1;
+        }
+        return -1;
+    }
+
+    int64_t written = metrics_now_us();
+    for (size_t i = first; i < last; i++)
+    {
+        if (b->records[i].since_us > 0)
+        {
+            metrics_observe(METRIC_RECORD_LATENCY, written - b->records[i].since_us);
+        }
+        int64_t offset = w->end;
+        w->end += (int64_t)b->records[i].len;
+        if (w->fn != NULL)
+        {
+            w->fn(offset, w->end, b->records[i].timestamp, b->records[i].duration, w->ctx);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Writes one batch to the log and reports its records. Called without the lock.
+ *
+ * With a roll policy the batch is cut where the day changes or after the
+ * live file reached its size, and the live file is sealed in between.
+ */
+static void write_batch(log_writer *w, struct batch *b)
+{
+    const writer_policy *p = &w->policy;
+    size_t first = 0;
+    size_t at = 0;
+    if (w->torn)
+    {
+        // Appending after torn bytes would misplace every later record
+        printf("Lost %zu records.\n", b->count);
+        b->used = 0;
+        b->count = 0;
+        return;
+    }
+    while (first < b->count)
+    {
+        int32_t day = p->roll_daily ? day_bucket(&w->bucketer, b->records[first].timestamp) : 0;
+        if (p->roll_daily && !w->roll_failed && w->live_records && day != w->live_day)
+        {
+            roll(w);
+        }
+
+        size_t last = first;
+        size_t len = 0;
+        while (last < b->count && (!p->roll_daily || day_bucket(&w->bucketer, b->records[last].timestamp) == day))
+        {
+            len += b->records[last].len;
+            last++;
+        }
+        if (write_records(w, b, first, last, at, len) != 0)
+        {
+            break;
+        }
+        w->live_records = 1;
+        w->live_day = day;
+        first = last;
+        at += len;
+
+        if (p->roll_bytes > 0 && !w->roll_failed && w->end - w->base >= p->roll_bytes)
+        {
+            roll(w);
+        }
+    }
+
+    metrics_count(METRIC_RECORDS_WRITTEN, first);
+    b->used = 0;
+    b->count = 0;
+}
+
+/**
+ * Writer thread: waits until a batch is due, then writes it outside the lock.
+ */
+static void *run(void *arg)
+{
+    log_writer *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    while (1)
+    {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        struct timespec now = { tv.tv_sec, (long)tv.tv_usec * 1000 };
+
+        if (due(w, &now))
+        {
+            struct batch swap = w->writing;
+            w->writing = w->filling;
+            w->filling = swap;
+            pthread_cond_broadcast(&w->space);
+            pthread_mutex_unlock(&w->lock);
+
+            write_batch(w, &w->writing);
+
+            pthread_mutex_lock(&w->lock);
+            continue;
+        }
+        if (w->stopping)
+        {
+            break;
+        }
+
+        if (w->filling.count > 0 && w->policy.interval_ms > 0)
+        {
+            // Sleep until the oldest record is due
+            struct timespec at = w->filling.first;
+            at.tv_sec += w->policy.interval_ms / 1000;
+            at.tv_nsec += (long)(w->policy.interval_ms % 1000) * 1000000;
+            if (at.tv_nsec >= 1000000000)
+            {
+                at.tv_sec++;
+                at.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&w->wake, &w->lock, &at);
+        }
+        else
+        {
+            pthread_cond_wait(&w->wake, &w->lock);
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+log_writer *writer_open(const char *path, const writer_policy *policy, writer_commit_fn fn, void *ctx)
+{
+    log_writer *w = calloc(1, sizeof(*w));
+    if (w == NULL)
+    {
+        return NULL;
+    }
+
+    if (snprintf(w->path, sizeof(w->path), "%s", path) >= (int)sizeof(w->path))
+    {
+        free(w);
+        return NULL;
+    }
+    w->fd = open_locked(path);
+    if (w->fd < 0)
+    {
+        free(w);
+        return NULL;
+    }
+
+    // Offsets continue after the sealed segments, which cannot change while the lock is held
+    segment_list segments;
+    if (segment_list_load(&segments, path) != 0)
+    {
+        close(w->fd);
+        free(w);
+        return NULL;
+    }
+    segment_list_free(&segments);
+    struct stat st;
+    off_t end = lseek(w->fd, 0, SEEK_END);
+    w->base = segments.base;
+    w->end = w->base + (end > 0 ? end : 0);
+    day_bucketer_init(&w->bucketer);
+    if (fstat(w->fd, &st) == 0 && end > (binlog_detect(path) ? (off_t)sizeof(binlog_header) : 0))
+    {
+        // The last write to the file tells the day of its last record closely enough
+        w->live_records = 1;
+        w->live_day = day_bucket(&w->bucketer, st.st_mtime);
+    }
+    w->policy = *policy;
+    w->fn = fn;
+    w->ctx = ctx;
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->wake, NULL);
+    pthread_cond_init(&w->space, NULL);
+    if (pthread_create(&w->thread, NULL, run, w) != 0)
+    {
+        pthread_cond_destroy(&w->space);
+        pthread_cond_destroy(&w->wake);
+        pthread_mutex_destroy(&w->lock);
+        close(w->fd);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+int writer_append(log_writer *w, const void *data, size_t len, time_t timestamp, double duration, int64_t since_us)
+{
+    pthread_mutex_lock(&w->lock);
+    // Only a disk that stopped keeping up makes the recorder wait
+    while (w->filling.used > 0 && w->filling.used + len > WRITER_MAX_PENDING)
+    {
+        pthread_cond_signal(&w->wake);
+        pthread_cond_wait(&w->space, &w->lock);
+    }
+    int result = batch_add(&w->filling, data, len, timestamp, duration, since_us);
+
+    const writer_policy *p = &w->policy;
+    if (result == 0 && (p->sync || (p->records == 0 && p->interval_ms == 0) ||
+                        (p->records > 0 && w->filling.count >= (size_t)p->records) ||
+                        (p->interval_ms > 0 && w->filling.count == 1)))
+    {
+        pthread_cond_signal(&w->wake);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return result;
+}
+
+void writer_close(log_writer *w)
+{
+    if (w == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    w->stopping = 1;
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+
+    sync_file(w->fd);
+    close(w->fd);
+    pthread_cond_destroy(&w->space);
+    pthread_cond_destroy(&w->wake);
+    pthread_mutex_destroy(&w->lock);
+    free(w->filling.data);
+    free(w->filling.records);
+    free(w->writing.data);
+    free(w->writing.records);
+    free(w);
+}
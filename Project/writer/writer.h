@@ -0,0 +1,97 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+// Most bytes held in memory before writer_append() waits for the disk
+#define WRITER_MAX_PENDING (8 << 20)
+
+/**
+ * @brief When buffered records are written out
+ *
+ * A batch is written as soon as any enabled condition holds. With nothing
+ * enabled every record is written on its own, as before group commits.
+ */
+typedef struct writer_policy {
+    int records;       // write once this many records are waiting, 0 = off
+    int interval_ms;   // write once the oldest waiting record is this old, 0 = off
+    int sync;          // write every record right away and fsync() each batch
+    int roll_daily;    // seal the live file into a segment when the local day changes
+    int64_t roll_bytes; // seal the live file once it holds this many bytes, 0 = off
+} writer_policy;
+
+/**
+ * @brief Called on the writer thread for every record once it is in the file
+ *
+ * @param offset Byte offset of the record in the log
+ * @param end Byte offset just after the record
+ * @param timestamp Timestamp of the record
+ * @param duration Duration of the record in seconds
+ * @param ctx Context given to writer_open()
+ */
+typedef void (*writer_commit_fn)(int64_t offset, int64_t end, time_t timestamp, double duration, void *ctx);
+
+typedef struct log_writer log_writer;
+
+/**
+ * @brief Parses a commit policy such as "fsync", "records=50" or "records=50,interval=1000"
+ *
+ * "roll=day" or "roll=<size>[k|m|g]" also seals the live file into a
+ * compressed segment (see segment.h) every day or whenever it reaches the size.
+ *
+ * @param text Policy to parse
+ * @param policy Set on success
+ * @return int 0 on success, -1 if the policy is invalid
+ */
+int writer_parse_policy(const char *text, writer_policy *policy);
+
+/**
+ * @brief Makes a CSV log end on a whole line
+ *
+ * A last line without a newline was torn by a crash and is cut off, even
+ * if what is left of it still parses, so new records never run into it
+ * and no record is kept with a cut value.
+ *
+ * @param path Path of the CSV log (a missing file is fine)
+ * @return int 0 on success, -1 if error occurs
+ */
+int writer_repair_tail(const char *path);
+
+/**
+ * @brief Opens a log for appending through a background writer thread
+ *
+ * @param path Path of the log, created if missing
+ * @param policy When to write and sync buffered records
+ * @param fn Called on the writer thread for each record after it was written, may be NULL
+ * @param ctx Passed to fn
+ * @return log_writer* Writer, or NULL if the file cannot be opened or the thread cannot start
+ */
+log_writer *writer_open(const char *path, const writer_policy *policy, writer_commit_fn fn, void *ctx);
+
+/**
+ * @brief Queues one record for writing
+ *
+ * Only copies the record; the disk is touched by the writer thread. Waits
+ * only if WRITER_MAX_PENDING bytes are already queued.
+ *
+ * @param writer Writer from writer_open()
+ * @param data Encoded record (a CSV line or a binary record)
+ * @param len Length of data
+ * @param timestamp Timestamp of the record
+ * @param duration Duration of the record in seconds
+ * @param since_us When the first byte of the record was read (metrics_now_us()),
+ *                 counted in the record latency once it is written; 0 if unknown
+ * @return int 0 on success, -1 if error occurs
+ */
+int writer_append(log_writer *writer, const void *data, size_t len, time_t timestamp, double duration, int64_t since_us);
+
+/**
+ * @brief Writes and syncs everything queued, stops the thread and closes the log
+ *
+ * @param writer Writer to close, may be NULL
+ */
+void writer_close(log_writer *writer);
+
+#endif /* WRITER_H */